@@ -1,162 +1,236 @@
-/*! \file activity.cpp
- *  \brief Contains an object to keep activity flags.
- *
- *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
- */
-#include <stdio.h>
-#include <stdlib.h>
-#include "timestamp.h"
-#include "activity.h"
-#include "error.h"
-#include "patchercore.h"
-
-/*! \brief Constructor.
- *
- * Contains a binary tree of activity flags to keep track of at most
- * majorSize * minorSize times.
- *
- * \param[in]   majorSize   Major size, i.e. query granularity.
- * \param[in]   minorSize   Minor size.
- */
-ActivityList::ActivityList(int majorSize, int minorSize):
-    m_majorSize(majorSize), m_minorSize(minorSize), m_dirty(true)
-{
-    m_triggerCount = new int[m_majorSize];
-    m_noteOnCount = new int[m_majorSize];
-    for (int i=0; i<m_majorSize; i++)
-    {
-        m_triggerCount[i] = 0;
-        m_noteOnCount[i] = 0;
-    }
-}
-/*! \brief Destructor.
- */
-ActivityList::~ActivityList()
-{
-    delete[] m_triggerCount;
-    delete[] m_noteOnCount;
-}
-
-/*! \brief Stores the current time at given major/minor location and updates the activity tree.
- *
- * \param[in]   majorIndex   Major location index.
- * \param[in]   minorIndex   Minor location index.
- * \param[in]   noteOn       Set to true if this is a note on trigger.
- * \param[in]   now          Current time.
- */
-void ActivityList::trigger(int majorIndex, int minorIndex, bool noteOn, const TimeSpec &now)
-{
-    m_queue.push(ActivityTrigger(majorIndex, minorIndex, now));
-    m_triggerCount[majorIndex] += 1;
-    if (minorIndex != 0)
-    {
-        if (noteOn)
-        {
-            m_noteOnCount[majorIndex]++;
-            m_dirty = m_dirty || m_noteOnCount[majorIndex] == 1;
-        }
-        else
-        {
-            if (m_noteOnCount[majorIndex] > 0)
-            {
-                m_noteOnCount[majorIndex]--;
-                m_dirty = m_noteOnCount[majorIndex] == 0;
-            }
-        }
-    }
-    m_dirty = m_dirty || m_triggerCount[majorIndex] == 1;
-}
-
-/*! \brief  Returns the next expiry time, if any.
- *
- * \param[out]  expireTime  Next expiry time
- * \return True if there is a next expiry time, false otherwise.
- */
-bool ActivityList::nextExpiry(TimeSpec &expireTime) const
-{
-    if (m_queue.empty())
-        return false;
-    expireTime = m_queue.front().expireTime();
-    return true;
-}
-
-/*! \brief Update activity list with current time.
- *
- * This function clears activity slots that are expired.
- *
- * \param[in]   now      Current time.
- * \return  \sa getDirty().
- */
-bool ActivityList::update(const TimeSpec &now)
-{
-    while(!m_queue.empty())
-    {
-        if (m_queue.front().expired(now))
-        {
-            int major = m_queue.front().major();
-            m_triggerCount[major] -= 1;
-            m_dirty = m_dirty || (m_triggerCount[major] == 0);
-            m_queue.pop();
-        }
-        else
-            break;
-    }
-    return m_dirty;
-}
-
-/*! \brief Get list of activity flags, and clear the dirty flag.
- *
- * \param[out]  b    Bool array, must be at least majorSize entries.
- */
-void ActivityList::get(bool *b)
-{
-    for (int i=0; i<m_majorSize; i++)
-        b[i] = !!m_triggerCount[i];
-    m_dirty = false;
-}
-
-/*! \brief Get activity state, and clear the dirty flag.
- *
- * \param[in]  majorIndex   Major index.
- */
-ActivityList::State ActivityList::get(int majorIndex)
-{
-    m_dirty = false;
-    if (m_triggerCount[majorIndex] != 0)
-        return event;
-    if (m_noteOnCount[majorIndex] > 0)
-        return on;
-    return off;
-}
-
-/*! \brief Clears all activity for majorIndex.
- *
- * \param[in]  majorIndex    Major index.
- */
-void ActivityList::clear(int majorIndex)
-{
-    m_triggerCount[majorIndex] = 0;
-    m_noteOnCount[majorIndex] = 0;
-    // clean queue by copying nonmatching elements, then swapping
-    std::queue<ActivityTrigger> cleanedQueue;
-    while (!m_queue.empty())
-    {
-        if (m_queue.front().major() != majorIndex)
-            cleanedQueue.push(m_queue.front());
-        m_queue.pop();
-    }
-    swap(m_queue, cleanedQueue);
-    m_dirty = true;
-}
-
-/*! \brief Clears all activity.
- *
- */
-void ActivityList::clear()
-{
-    while (!m_queue.empty())
-        m_queue.pop();
-    for (int i=0; i<m_majorSize; i++)
-        m_triggerCount[i] = 0;
-    m_dirty = true;
-}
+/*! \file activity.cpp
+ *  \brief Contains an object to keep activity flags.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "timestamp.h"
+#include "activity.h"
+#include "error.h"
+#include "patchercore.h"
+
+/*! \brief Constructor.
+ *
+ * Allocates the timer wheel for majorSize indexes.
+ *
+ * \param[in]   majorSize   Major size, i.e. query granularity.
+ * \param[in]   minorSize   Minor size.
+ */
+ActivityList::ActivityList(int majorSize, int minorSize):
+    m_tick(0), m_majorSize(majorSize), m_minorSize(minorSize), m_dirty(true)
+{
+    m_wordsPerSlot = (m_majorSize + 31) / 32;
+    m_wheel = new Count[NofSlots * m_majorSize];
+    m_occupied = new uint32_t[NofSlots * m_wordsPerSlot];
+    m_generation = new uint32_t[m_majorSize];
+    m_triggerCount = new int[m_majorSize];
+    m_noteOnCount = new int[m_majorSize];
+    for (int i=0; i<NofSlots * m_majorSize; i++)
+    {
+        m_wheel[i].m_count = 0;
+        m_wheel[i].m_generation = 0;
+    }
+    for (int i=0; i<NofSlots * m_wordsPerSlot; i++)
+        m_occupied[i] = 0;
+    for (int i=0; i<NofSlots; i++)
+        m_slotTotal[i] = 0;
+    for (int i=0; i<m_majorSize; i++)
+    {
+        m_generation[i] = 0;
+        m_triggerCount[i] = 0;
+        m_noteOnCount[i] = 0;
+    }
+}
+/*! \brief Destructor.
+ */
+ActivityList::~ActivityList()
+{
+    delete[] m_wheel;
+    delete[] m_occupied;
+    delete[] m_generation;
+    delete[] m_triggerCount;
+    delete[] m_noteOnCount;
+}
+
+//! \brief Convert a time to ticks, without floating point.
+int64_t ActivityList::toTick(const TimeSpec &ts)
+{
+    return (int64_t)ts.tv_sec * TicksPerSecond + ts.tv_nsec / (1000000000 / TicksPerSecond);
+}
+
+/*! \brief Expire all triggers in a slot.
+ *
+ * \param[in]   slot    Slot index.
+ */
+void ActivityList::expireSlot(int slot)
+{
+    if (m_slotTotal[slot] == 0)
+        return;
+    m_slotTotal[slot] = 0;
+    uint32_t *occupied = m_occupied + slot * m_wordsPerSlot;
+    Count *counts = m_wheel + slot * m_majorSize;
+    for (int w=0; w<m_wordsPerSlot; w++)
+    {
+        while (occupied[w])
+        {
+            int bit = __builtin_ctz(occupied[w]);
+            occupied[w] &= occupied[w] - 1;
+            int major = w * 32 + bit;
+            Count &count = counts[major];
+            if (count.m_generation == m_generation[major])
+            {
+                m_triggerCount[major] -= count.m_count;
+                m_dirty = m_dirty || (m_triggerCount[major] == 0);
+            }
+            count.m_count = 0;
+        }
+    }
+}
+
+/*! \brief Expire the slots of all ticks up to and including \a tick.
+ *
+ * A jump of more than a full turn expires every slot once.
+ */
+void ActivityList::advance(int64_t tick)
+{
+    if (tick <= m_tick)
+        return;
+    if (tick - m_tick >= NofSlots)
+    {
+        for (int slot=0; slot<NofSlots; slot++)
+            expireSlot(slot);
+    }
+    else
+    {
+        for (int64_t t=m_tick+1; t<=tick; t++)
+            expireSlot((int)(t & (NofSlots-1)));
+    }
+    m_tick = tick;
+}
+
+/*! \brief Stores the current time at given major/minor location and updates the activity tree.
+ *
+ * \param[in]   majorIndex   Major location index.
+ * \param[in]   minorIndex   Minor location index.
+ * \param[in]   noteOn       Set to true if this is a note on trigger.
+ * \param[in]   now          Current time.
+ */
+void ActivityList::trigger(int majorIndex, int minorIndex, bool noteOn, const TimeSpec &now)
+{
+    // the wheel must be current, or the slot may be expired a turn early
+    advance(toTick(now));
+    int slot = (int)((m_tick + ExpireTicks) & (NofSlots-1));
+    Count &count = m_wheel[slot * m_majorSize + majorIndex];
+    uint32_t &occupied = m_occupied[slot * m_wordsPerSlot + majorIndex / 32];
+    uint32_t bit = 1u << (majorIndex % 32);
+    if (!(occupied & bit) || count.m_generation != m_generation[majorIndex])
+    {
+        count.m_count = 0;
+        count.m_generation = m_generation[majorIndex];
+        occupied |= bit;
+    }
+    count.m_count++;
+    m_slotTotal[slot]++;
+    m_triggerCount[majorIndex] += 1;
+    if (minorIndex != 0)
+    {
+        if (noteOn)
+        {
+            m_noteOnCount[majorIndex]++;
+            m_dirty = m_dirty || m_noteOnCount[majorIndex] == 1;
+        }
+        else
+        {
+            if (m_noteOnCount[majorIndex] > 0)
+            {
+                m_noteOnCount[majorIndex]--;
+                m_dirty = m_noteOnCount[majorIndex] == 0;
+            }
+        }
+    }
+    m_dirty = m_dirty || m_triggerCount[majorIndex] == 1;
+}
+
+/*! \brief  Returns the next expiry time, if any.
+ *
+ * This is the start of the first tick with triggers in it, so it may
+ * be up to a tick early, and it may belong to cleared triggers only.
+ *
+ * \param[out]  expireTime  Next expiry time
+ * \return True if there is a next expiry time, false otherwise.
+ */
+bool ActivityList::nextExpiry(TimeSpec &expireTime) const
+{
+    for (int64_t t=m_tick+1; t<=m_tick+NofSlots; t++)
+    {
+        if (m_slotTotal[t & (NofSlots-1)] != 0)
+        {
+            expireTime = TimeSpec((time_t)(t / TicksPerSecond),
+                (long int)(t % TicksPerSecond) * (1000000000 / TicksPerSecond));
+            return true;
+        }
+    }
+    return false;
+}
+
+/*! \brief Update activity list with current time.
+ *
+ * This function clears activity slots that are expired.
+ *
+ * \param[in]   now      Current time.
+ * \return  \sa getDirty().
+ */
+bool ActivityList::update(const TimeSpec &now)
+{
+    advance(toTick(now));
+    return m_dirty;
+}
+
+/*! \brief Get list of activity flags, and clear the dirty flag.
+ *
+ * \param[out]  b    Bool array, must be at least majorSize entries.
+ */
+void ActivityList::get(bool *b)
+{
+    for (int i=0; i<m_majorSize; i++)
+        b[i] = !!m_triggerCount[i];
+    m_dirty = false;
+}
+
+/*! \brief Get activity state, and clear the dirty flag.
+ *
+ * \param[in]  majorIndex   Major index.
+ */
+ActivityList::State ActivityList::get(int majorIndex)
+{
+    m_dirty = false;
+    if (m_triggerCount[majorIndex] != 0)
+        return event;
+    if (m_noteOnCount[majorIndex] > 0)
+        return on;
+    return off;
+}
+
+/*! \brief Clears all activity for majorIndex.
+ *
+ * Its triggers stay in the wheel, but they are ignored from now on.
+ *
+ * \param[in]  majorIndex    Major index.
+ */
+void ActivityList::clear(int majorIndex)
+{
+    m_triggerCount[majorIndex] = 0;
+    m_noteOnCount[majorIndex] = 0;
+    m_generation[majorIndex]++;
+    m_dirty = true;
+}
+
+/*! \brief Clears all activity.
+ *
+ */
+void ActivityList::clear()
+{
+    for (int i=0; i<m_majorSize; i++)
+        clear(i);
+}
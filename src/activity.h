@@ -5,59 +5,47 @@
  */
 #ifndef ACTIVITY_H
 #define ACTIVITY_H
-#include <queue>
+#include <stdint.h>
 #include "timestamp.h"
 
-#ifdef FAKE_STL // set in PREDEFINED in doxygen config
-namespace std { /*! \brief STL queue */ template <class T> class queue {
-        public T entry[2]; /*!< Entry. */ }; }
-#endif
-
-/*! \brief This object knows wether or not is has expired.
+/*! \brief  Manage activity flags that expire 0.15 seconds after a trigger.
+ *
+ * Triggers are counted in a hashed timer wheel with integer ticks.
+ * Every trigger expires the same time after it was made, so a slot only
+ * holds the triggers of a single tick, counted per major index.
+ * Triggering and expiring are constant time, and nothing is allocated
+ * after construction.
  *
- * Expiration time is set to 0.15 seconds after its construction.
+ * A major index is cleared by bumping its generation, counts in the
+ * wheel with an older generation are dropped when their slot expires.
  */
-class ActivityTrigger
-{
-    TimeSpec m_expireTime;      //!<    Absolute expiration time.
-    int m_major;                //!<    Major index of the trigger.
-    int m_minor;                //!<    Minor index of the tigger, not used.
-public:
-    //! \brief Absolute expiration time.
-    const TimeSpec &expireTime() const { return m_expireTime; }
-    //! \brief Major index of the trigger.
-    int major() const { return m_major; }
-    /*! \brief Construct a new trigger.
-     *
-     * \param[in] major     Major index of the trigger.
-     * \param[in] minor     Minor index of the trigger, not used.
-     * \param[in] now       The current time.
-     */
-    ActivityTrigger(int major, int minor, const TimeSpec &now):
-        m_major(major), m_minor(minor)
-    {
-        timeSum(m_expireTime, now, TimeSpec((Real)0.15));
-    }
-    /*! \brief Expiration query
-     *
-     * \param[in]   now     The current time.
-     * \return  True if expired.
-     */
-    bool expired(const TimeSpec &now)
-    {
-        return timeGreaterThanOrEqual(now, m_expireTime);
-    }
-};
-
-//! \brief  Manage a list of ActivityTriggers.
 class ActivityList
 {
-    std::queue<ActivityTrigger> m_queue;    //!<    Queue of triggers.
+    static const int TicksPerSecond = 100;  //!<    Timer resolution.
+    static const int ExpireTicks = 15;      //!<    Time from trigger to expiry.
+    static const int NofSlots = 32;         //!<    Wheel size, a power of 2 larger than \a ExpireTicks.
+    //! \brief Triggers of one major index in one slot.
+    struct Count
+    {
+        uint32_t m_count;                   //!<    Number of triggers.
+        uint32_t m_generation;              //!<    Generation of the major index they were made in.
+    };
+    Count *m_wheel;                         //!<    NofSlots by majorSize trigger counts.
+    uint32_t *m_occupied;                   //!<    Per slot, a bit for every major index with a count.
+    int m_wordsPerSlot;                     //!<    Size of a slot in \a m_occupied.
+    int m_slotTotal[NofSlots];              //!<    Number of triggers per slot, including stale ones.
+    int64_t m_tick;                         //!<    Last tick the wheel was advanced to.
+    uint32_t *m_generation;                 //!<    Current generation per major index.
     int *m_triggerCount;                    //!<    List of trigger counters.
     int m_majorSize;                        //!<    Major size of the list.
     int m_minorSize;                        //!<    Minor size of the list, not used.
     int *m_noteOnCount;                     //!<    List of note on counters.
     bool m_dirty;                           //!<    True if any change since last \a get().
+    ActivityList(const ActivityList &);             //!< Not copyable.
+    ActivityList &operator=(const ActivityList &);  //!< Not assignable.
+    static int64_t toTick(const TimeSpec &ts);
+    void advance(int64_t tick);
+    void expireSlot(int slot);
 public:
     //! \brief Activity state.
     enum State { off, event, on };
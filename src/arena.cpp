@@ -0,0 +1,114 @@
+/*! \file arena.cpp
+ *  \brief Contains a region allocator for the track definitions.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+namespace
+{
+//! \brief FNV-1a hash of a string.
+uint32_t hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    return h;
+}
+}
+
+//! \brief Start a new chunk with room for at least \a size bytes.
+void Arena::addChunk(size_t size)
+{
+    if (size < ChunkSize)
+        size = ChunkSize;
+    Chunk *chunk = (Chunk *)malloc(headerSize() + size);
+    if (!chunk)
+        throw(Error("out of memory"));
+    chunk->m_next = m_chunk;
+    chunk->m_size = size;
+    chunk->m_used = 0;
+    m_chunk = chunk;
+}
+
+/*! \brief Make sure the next \a size bytes come from a single chunk.
+ *
+ * Callers that know how much they will allocate use this to get all
+ * of it in one contiguous block.
+ */
+void Arena::reserve(size_t size)
+{
+    if (!m_chunk || m_chunk->m_size - m_chunk->m_used < size)
+        addChunk(size);
+}
+
+/*! \brief Allocate memory, aligned for any of the track definition objects.
+ *
+ * \param[in] size  Size in bytes.
+ * \return    The memory, never 0.
+ */
+void *Arena::allocate(size_t size)
+{
+    size = (size + Alignment-1) & ~(Alignment-1);
+    reserve(size);
+    void *p = (char *)m_chunk + headerSize() + m_chunk->m_used;
+    m_chunk->m_used += size;
+    m_size += size;
+    return p;
+}
+
+//! \brief Rebuild the string hash table with \a nofBuckets buckets, a power of 2.
+void Arena::rehash(size_t nofBuckets)
+{
+    std::vector<const char *> strings(nofBuckets, (const char *)0);
+    for (size_t i=0; i<m_strings.size(); i++)
+    {
+        if (!m_strings[i])
+            continue;
+        size_t b = hash(m_strings[i]) & (nofBuckets-1);
+        while (strings[b])
+            b = (b+1) & (nofBuckets-1);
+        strings[b] = m_strings[i];
+    }
+    m_strings.swap(strings);
+}
+
+/*! \brief Store a string, or find the copy that is already stored.
+ *
+ * \param[in] s     The string.
+ * \return    The stored copy, valid until \a release().
+ */
+const char *Arena::intern(const char *s)
+{
+    if ((m_nofStrings+1)*3 > m_strings.size()*2)
+        rehash(m_strings.empty() ? 64 : 2*m_strings.size());
+    size_t mask = m_strings.size()-1;
+    size_t b = hash(s) & mask;
+    for (; m_strings[b]; b = (b+1) & mask)
+    {
+        if (strcmp(m_strings[b], s) == 0)
+            return m_strings[b];
+    }
+    size_t length = strlen(s)+1;
+    char *copy = (char *)allocate(length);
+    memcpy(copy, s, length);
+    m_strings[b] = copy;
+    m_nofStrings++;
+    return copy;
+}
+
+//! \brief Free all chunks at once, every pointer into the Arena becomes invalid.
+void Arena::release()
+{
+    while (m_chunk)
+    {
+        Chunk *next = m_chunk->m_next;
+        free(m_chunk);
+        m_chunk = next;
+    }
+    m_size = 0;
+    std::vector<const char *>().swap(m_strings);
+    m_nofStrings = 0;
+}
@@ -0,0 +1,119 @@
+/*! \file arena.h
+ *  \brief Contains a region allocator for the track definitions.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include "error.h"
+
+/*! \brief A region allocator.
+ *
+ * Memory is handed out from large chunks in allocation order, so objects
+ * that are created one after the other end up next to each other.
+ * There is no way to free a single allocation, everything is released
+ * at once by \a release() or the destructor, and no destructors are run.
+ * Objects placed in an \a Arena must not own any memory outside of it.
+ *
+ * Strings can be interned, every distinct string is stored only once.
+ */
+class Arena
+{
+    //! \brief Header of a chunk, the memory handed out follows it.
+    struct Chunk
+    {
+        Chunk *m_next;      //!< Previous chunk, the list starts at the current one.
+        size_t m_size;      //!< Usable size in bytes.
+        size_t m_used;      //!< Bytes handed out.
+    };
+    static const size_t Alignment = 8;      //!< Alignment of every allocation.
+    static const size_t ChunkSize = 16384;  //!< Minimum usable size of a chunk.
+    Chunk *m_chunk;                         //!< Current chunk, 0 if none.
+    size_t m_size;                          //!< Bytes handed out from all chunks.
+    std::vector<const char *> m_strings;    //!< Open addressing hash table of interned strings.
+    size_t m_nofStrings;                    //!< Number of interned strings.
+    Arena(const Arena &);                   //!< Not copyable.
+    Arena &operator=(const Arena &);        //!< Not assignable.
+    static size_t headerSize() { return (sizeof(Chunk) + Alignment-1) & ~(Alignment-1); }
+    void addChunk(size_t size);
+    void rehash(size_t nofBuckets);
+public:
+    void reserve(size_t size);
+    void *allocate(size_t size);
+    const char *intern(const char *s);
+    void release();
+    //! \brief Bytes handed out since the last \a release().
+    size_t size() const { return m_size; }
+    //! \brief Construct an empty Arena, the first chunk is allocated on demand.
+    Arena(): m_chunk(0), m_size(0), m_nofStrings(0) { }
+    //! \brief Destructor, releases all memory.
+    ~Arena() { release(); }
+};
+
+//! \brief Placement new in an \a Arena.
+inline void *operator new(size_t size, Arena &arena) { return arena.allocate(size); }
+//! \brief Only called if a constructor throws, the memory is reclaimed with the rest of the \a Arena.
+inline void operator delete(void *, Arena &) { }
+
+/*! \brief A list of plain values, e.g. pointers, stored in an \a Arena.
+ *
+ * It has the part of the std::vector interface the track definitions
+ * use. Growing the list leaves the old storage behind in the \a Arena,
+ * so the exact length should be reserved up front where it is known.
+ */
+template <class T>
+class ArenaList
+{
+    Arena *m_arena;         //!< Arena the elements are stored in.
+    T *m_data;              //!< Elements.
+    uint32_t m_size;        //!< Number of elements.
+    uint32_t m_capacity;    //!< Number of elements that fit in \a m_data.
+public:
+    typedef T *iterator;                //!< Iterator.
+    typedef const T *const_iterator;    //!< Const iterator.
+    //! \brief Construct an empty list, \a setArena() must be called before it can grow.
+    ArenaList(): m_arena(0), m_data(0), m_size(0), m_capacity(0) { }
+    //! \brief Construct an empty list.
+    explicit ArenaList(Arena &arena): m_arena(&arena), m_data(0), m_size(0), m_capacity(0) { }
+    //! \brief Set the \a Arena of an empty list.
+    void setArena(Arena &arena) { m_arena = &arena; }
+    //! \brief Number of elements.
+    size_t size() const { return m_size; }
+    //! \brief True if there are no elements.
+    bool empty() const { return m_size == 0; }
+    //! \brief Element access, unchecked.
+    T &operator[](size_t i) { return m_data[i]; }
+    //! \brief Element access, unchecked.
+    const T &operator[](size_t i) const { return m_data[i]; }
+    iterator begin() { return m_data; }                 //!< Start of the list.
+    iterator end() { return m_data + m_size; }          //!< End of the list.
+    const_iterator begin() const { return m_data; }     //!< Start of the list.
+    const_iterator end() const { return m_data + m_size; }  //!< End of the list.
+    //! \brief Remove all elements, the storage is kept for reuse.
+    void clear() { m_size = 0; }
+    //! \brief Make room for \a n elements.
+    void reserve(size_t n)
+    {
+        if (n <= m_capacity)
+            return;
+        ASSERT(m_arena);
+        T *data = (T *)m_arena->allocate(n * sizeof(T));
+        for (uint32_t i=0; i<m_size; i++)
+            data[i] = m_data[i];
+        m_data = data;
+        m_capacity = (uint32_t)n;
+    }
+    //! \brief Append an element.
+    void push_back(const T &value)
+    {
+        if (m_size == m_capacity)
+            reserve(m_capacity ? 2*m_capacity : 4);
+        m_data[m_size++] = value;
+    }
+};
+
+#endif // ARENA_H
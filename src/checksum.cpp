@@ -0,0 +1,65 @@
+/*! \file checksum.cpp
+ *  \brief Contains a checksum function for binary files and memory images.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include "checksum.h"
+
+namespace
+{
+const uint32_t mod = 65521;     //!< Largest prime below 65536.
+}
+
+/*! \brief Calculate an Adler-32 checksum.
+ *
+ * The checksum can be calculated in pieces by passing the result of the
+ * previous call as \a adler.
+ *
+ * \param[in]   data    Start of the data.
+ * \param[in]   n       Size of the data in bytes.
+ * \param[in]   adler   Running checksum, 1 for a new checksum.
+ * \return      The checksum.
+ */
+uint32_t adler32(const void *data, size_t n, uint32_t adler)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (n > 0)
+    {
+        // 5552 is the largest block that cannot overflow b
+        size_t block = n < 5552 ? n : 5552;
+        n -= block;
+        while (block--)
+        {
+            a += *p++;
+            b += a;
+        }
+        a %= mod;
+        b %= mod;
+    }
+    return (b << 16) | a;
+}
+
+/*! \brief Update an Adler-32 checksum for a single byte that has changed.
+ *
+ * A byte at offset \a i adds its value once to the first sum, and
+ * \a n - \a i times to the second, so the change is applied in constant
+ * time instead of summing the data again.
+ *
+ * \param[in]   adler   Checksum of the data before the change.
+ * \param[in]   n       Size of the data in bytes.
+ * \param[in]   i       Offset of the byte that has changed.
+ * \param[in]   from    The old value of the byte.
+ * \param[in]   to      The new value of the byte.
+ * \return      The checksum of the data after the change.
+ */
+uint32_t adler32Replace(uint32_t adler, size_t n, size_t i, uint8_t from, uint8_t to)
+{
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    uint32_t weight = (uint32_t)((n - i) % mod);
+    a = (a + to + mod - from) % mod;
+    b = (b + weight * to % mod + mod - weight * from % mod) % mod;
+    return (b << 16) | a;
+}
@@ -0,0 +1,14 @@
+/*! \file checksum.h
+ *  \brief Contains a checksum function for binary files and memory images.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t adler32(const void *data, size_t n, uint32_t adler = 1);
+uint32_t adler32Replace(uint32_t adler, size_t n, size_t i, uint8_t from, uint8_t to);
+
+#endif // CHECKSUM_H
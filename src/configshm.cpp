@@ -0,0 +1,363 @@
+/*! \file configshm.cpp
+ *  \brief Contains the configuration the core publishes in shared memory.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "configshm.h"
+#include "trackimage.h"
+#include "checksum.h"
+#include "error.h"
+#include "ipcname.h"
+
+using namespace ConfigShm;
+
+namespace
+{
+const char controlName[] = "/patcher_config";   //!< Name of the control object of a live patcher.
+const char controlMagic[8] = { 'P', 'A', 'T', 'C', 'H', 'S', 'H', 'M' }; //!< Control object magic.
+const char segmentMagic[8] = { 'P', 'A', 'T', 'C', 'H', 'C', 'F', 'G' }; //!< Segment magic.
+const int nofLoadAttempts = 3;  //!< A segment may be superseded while a client opens it.
+
+//! \brief Name of the segment of a generation.
+std::string segmentName(uint32_t generation)
+{
+    char suffix[12];
+    snprintf(suffix, sizeof(suffix), ".%u", (unsigned)generation);
+    return Ipc::name(controlName) + suffix;
+}
+
+//! \brief Round up to a multiple of 8, so the track image records are aligned.
+uint32_t align(size_t offset)
+{
+    return (uint32_t)((offset + 7) & ~(size_t)7);
+}
+
+/*! \brief Check the header and the checksum of a mapped segment.
+ *
+ * \param[in]   map         Start of the segment.
+ * \param[in]   mapSize     Size of the segment.
+ * \param[in]   generation  The generation it should have.
+ * \return      True if the segment is complete and intact.
+ */
+bool valid(const void *map, size_t mapSize, uint32_t generation)
+{
+    const Header *header = (const Header *)map;
+    return memcmp(header->m_magic, segmentMagic, sizeof(segmentMagic)) == 0
+        && header->m_version == Control::Version
+        && header->m_generation == generation
+        && header->m_size == mapSize
+        && header->m_recordSize == sizeof(Fantom::Performance)
+        && header->m_imageOffset >= sizeof(Header)
+        && header->m_imageOffset + (uint64_t)header->m_imageSize <= header->m_performanceOffset
+        && header->m_performanceOffset
+            + (uint64_t)header->m_nofPerformances*sizeof(Fantom::Performance) == mapSize
+        && header->m_checksum == adler32((const char *)map + sizeof(Header), mapSize - sizeof(Header));
+}
+}
+
+//! \brief Construct a detached object.
+SharedConfig::SharedConfig():
+    m_control(0), m_owner(false), m_map(0), m_mapSize(0), m_generation(0)
+{
+}
+
+//! \brief Destructor, unmaps the segments but leaves them for the other processes.
+SharedConfig::~SharedConfig()
+{
+    release();
+    if (m_control)
+        munmap(m_control, sizeof(Control));
+}
+
+/*! \brief Create or reuse the control object, in the core.
+ *
+ * A control object left by a previous core is reused, so clients that
+ * are still running see the next generation.
+ */
+void SharedConfig::create()
+{
+    int fd = shm_open(Ipc::name(controlName).c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd == -1)
+        throw(Error("shm_open", errno));
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1
+        || (statBuf.st_size < (off_t)sizeof(Control) && ftruncate(fd, sizeof(Control)) == -1))
+    {
+        int errNo = errno;
+        close(fd);
+        throw(Error("cannot size shared configuration", errNo));
+    }
+    void *map = mmap(0, sizeof(Control), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw(Error("mmap", errno));
+    m_control = (Control *)map;
+    m_owner = true;
+    if (memcmp(m_control->m_magic, controlMagic, sizeof(controlMagic)) != 0
+        || m_control->m_version != Control::Version)
+    {
+        memcpy(m_control->m_magic, controlMagic, sizeof(controlMagic));
+        m_control->m_version = Control::Version;
+        m_control->m_generation = 0;
+    }
+    m_generation = m_control->m_generation;
+}
+
+/*! \brief Take over a configuration a previous core has published, in the core.
+ *
+ * A restarted core uses this instead of reading the track definitions and
+ * the performance cache. The segment stays published, so clients that
+ * have loaded it keep it. It must be called after \a create().
+ *
+ * \param[in]   generation          The generation to resume, it must still be the published one.
+ * \param[out]  trackList           Tracks, merged with the performances.
+ * \param[out]  setList             Setlist.
+ * \param[out]  performanceStore    Copy of the performance data.
+ * \return      False if that generation is gone or damaged, nothing is changed then.
+ */
+bool SharedConfig::resume(uint32_t generation, TrackList &trackList, SetList &setList,
+    std::vector<Fantom::Performance> &performanceStore)
+{
+    if (!m_owner || generation == 0 || m_control->m_generation != generation)
+        return false;
+    int fd = shm_open(segmentName(generation).c_str(), O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1 || statBuf.st_size < (off_t)sizeof(Header))
+    {
+        close(fd);
+        return false;
+    }
+    size_t mapSize = (size_t)statBuf.st_size;
+    void *map = mmap(0, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const char *base = (const char *)map;
+    const Header *header = (const Header *)map;
+    TrackList tracks;
+    SetList set;
+    if (!valid(map, mapSize, generation)
+        || !TrackImage::read(base + header->m_imageOffset, header->m_imageSize, tracks, set)
+        || tracks.size() != header->m_nofPerformances)
+    {
+        munmap(map, mapSize);
+        return false;
+    }
+    m_image.assign(base + header->m_imageOffset, header->m_imageSize);
+    const Fantom::Performance *record = (const Fantom::Performance *)(base + header->m_performanceOffset);
+    std::vector<Fantom::Performance> store(record, record + header->m_nofPerformances);
+    munmap(map, mapSize);
+    trackList.swap(tracks);
+    setList = set;
+    performanceStore.swap(store);
+    for (size_t i=0; i<trackList.size(); i++)
+        trackList[i]->merge(performanceStore[i].m_loaded ? &performanceStore[i] : 0);
+    m_generation = generation;
+    return true;
+}
+
+/*! \brief Set the tracks and setlist for the next \a publish(), in the core.
+ *
+ * The chain placeholders must already be resolved by \a fixChain().
+ *
+ * \param[in]   trackList   Tracks.
+ * \param[in]   setList     Setlist.
+ */
+void SharedConfig::setTracks(const TrackList &trackList, const SetList &setList)
+{
+    // the source file checks of the image are not used here
+    SourceStamp none;
+    none.clear();
+    TrackImage::build(m_image, none, trackList, setList);
+}
+
+/*! \brief Publish a new generation of the configuration, in the core.
+ *
+ * The segment is complete before its generation is stored, and the
+ * segment of the previous generation is removed. Clients that have it
+ * mapped keep their mapping until they load the new one.
+ *
+ * \param[in]   performanceList   Performance data, as many as there are tracks.
+ */
+void SharedConfig::publish(const Fantom::PerformanceList &performanceList)
+{
+    if (!m_owner)
+        throw(Error("shared configuration not created"));
+    uint32_t generation = m_generation + 1 != 0 ? m_generation + 1 : 1;
+    Header header;
+    memcpy(header.m_magic, segmentMagic, sizeof(segmentMagic));
+    header.m_version = Control::Version;
+    header.m_generation = generation;
+    header.m_imageOffset = align(sizeof(Header));
+    header.m_imageSize = (uint32_t)m_image.size();
+    header.m_performanceOffset = header.m_imageOffset + header.m_imageSize;
+    header.m_nofPerformances = (uint32_t)performanceList.size();
+    header.m_recordSize = sizeof(Fantom::Performance);
+    header.m_size = header.m_performanceOffset + header.m_nofPerformances * header.m_recordSize;
+
+    std::string name = segmentName(generation);
+    // a core that died halfway may have left this one
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd == -1)
+        throw(Error("shm_open", errno));
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, header.m_size) == 0)
+        map = mmap(0, header.m_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    int errNo = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        Error e;
+        e.stream() << "cannot write " << name << ": " << strerror(errNo);
+        throw(e);
+    }
+    char *base = (char *)map;
+    memcpy(base + header.m_imageOffset, m_image.data(), m_image.size());
+    Fantom::Performance *record = (Fantom::Performance *)(base + header.m_performanceOffset);
+    for (size_t i=0; i<performanceList.size(); i++)
+        record[i] = *performanceList[i];
+    header.m_checksum = adler32(base + sizeof(Header), header.m_size - sizeof(Header));
+    memcpy(base, &header, sizeof(header));
+    munmap(map, header.m_size);
+
+    // the segment must be complete before a client can find it
+    __sync_synchronize();
+    uint32_t previous = m_control->m_generation;
+    m_control->m_generation = generation;
+    m_generation = generation;
+    if (previous != 0 && previous != generation)
+        shm_unlink(segmentName(previous).c_str());
+}
+
+//! \brief Map the control object, if the core has created it.
+bool SharedConfig::attach()
+{
+    if (m_control)
+        return true;
+    int fd = shm_open(Ipc::name(controlName).c_str(), O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1 || statBuf.st_size < (off_t)sizeof(Control))
+    {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(0, sizeof(Control), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const Control *control = (const Control *)map;
+    if (memcmp(control->m_magic, controlMagic, sizeof(controlMagic)) != 0
+        || control->m_version != Control::Version)
+    {
+        munmap(map, sizeof(Control));
+        return false;
+    }
+    m_control = (Control *)map;
+    return true;
+}
+
+//! \brief Read the published generation, with a barrier so its segment is visible.
+uint32_t SharedConfig::generation() const
+{
+    uint32_t generation = m_control->m_generation;
+    __sync_synchronize();
+    return generation;
+}
+
+/*! \brief Check if the core has published a configuration that is not loaded yet.
+ *
+ * This is cheap enough to be called for every event.
+ */
+bool SharedConfig::changed()
+{
+    if (!attach())
+        return false;
+    uint32_t published = generation();
+    return published != 0 && published != m_generation;
+}
+
+/*! \brief Load the latest configuration the core has published, in a client.
+ *
+ * The tracks are rebuilt from the track image and merged with the
+ * performances, which point into the mapped segment. The previous tracks
+ * and performances are released, the lists are left alone if nothing
+ * has been published.
+ *
+ * \param[in,out]  trackList         Tracks.
+ * \param[in,out]  setList           Setlist.
+ * \param[in,out]  performanceList   Performance data.
+ * \return         True if a configuration was loaded.
+ */
+bool SharedConfig::load(TrackList &trackList, SetList &setList,
+    Fantom::PerformanceList &performanceList)
+{
+    if (!attach())
+        return false;
+    for (int attempt=0; attempt<nofLoadAttempts; attempt++)
+    {
+        uint32_t published = generation();
+        if (published == 0)
+            return false;
+        int fd = shm_open(segmentName(published).c_str(), O_RDONLY, 0);
+        if (fd == -1)
+            continue;   // superseded, look again
+        struct stat statBuf;
+        if (fstat(fd, &statBuf) == -1 || statBuf.st_size < (off_t)sizeof(Header))
+        {
+            close(fd);
+            return false;
+        }
+        size_t mapSize = (size_t)statBuf.st_size;
+        // private, clients may change the performances locally
+        void *map = mmap(0, mapSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return false;
+        const char *base = (const char *)map;
+        const Header *header = (const Header *)map;
+        TrackList tracks;
+        SetList set;
+        if (!valid(map, mapSize, published)
+            || !TrackImage::read(base + header->m_imageOffset, header->m_imageSize, tracks, set))
+        {
+            munmap(map, mapSize);
+            return false;
+        }
+        trackList.swap(tracks);
+        setList = set;
+        release();
+        m_map = map;
+        m_mapSize = mapSize;
+        m_generation = published;
+        Fantom::Performance *record = (Fantom::Performance *)(base + header->m_performanceOffset);
+        performanceList.clear();
+        for (uint32_t i=0; i<header->m_nofPerformances; i++)
+            performanceList.push_back(record+i);
+        for (size_t i=0; i<trackList.size() && i<performanceList.size(); i++)
+            trackList[i]->merge(performanceList[i]->m_loaded ? performanceList[i] : 0);
+        return true;
+    }
+    return false;
+}
+
+//! \brief Unmap the loaded segment, if any.
+void SharedConfig::release()
+{
+    if (m_map)
+        munmap(m_map, m_mapSize);
+    m_map = 0;
+    m_mapSize = 0;
+}
@@ -0,0 +1,97 @@
+/*! \file configshm.h
+ *  \brief Contains the configuration the core publishes in shared memory.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef CONFIG_SHM_H
+#define CONFIG_SHM_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "trackdef.h"
+#include "fantomdef.h"
+
+//! \brief Namespace for the records of the shared configuration.
+namespace ConfigShm
+{
+
+/*! \brief The control object, it is created once and never removed.
+ *
+ * It only holds the generation of the current configuration segment,
+ * so clients keep a valid mapping of it across restarts of the core.
+ */
+struct Control
+{
+    static const uint32_t Version = 2;  //!< Must be changed if the layout of any record changes.
+    char m_magic[8];                    //!< Magic string, "PATCHSHM".
+    uint32_t m_version;                 //!< Layout version.
+    volatile uint32_t m_generation;     //!< Generation of the current segment, 0 if none.
+};
+
+/*! \brief Header of a configuration segment.
+ *
+ * The header is followed by a track image, see \a TrackImage, and an
+ * array of \a Fantom::Performance records. A segment is never changed
+ * once its generation has been published, and it outlives the core, so
+ * a restarted core can resume with it.
+ */
+struct Header
+{
+    char m_magic[8];            //!< Magic string, "PATCHCFG".
+    uint32_t m_version;         //!< Layout version, same as \a Control::Version.
+    uint32_t m_generation;      //!< Generation of this segment.
+    uint32_t m_size;            //!< Size of the whole segment in bytes.
+    uint32_t m_checksum;        //!< Adler-32 checksum of everything after the header.
+    uint32_t m_imageOffset;     //!< Offset of the track image.
+    uint32_t m_imageSize;       //!< Size of the track image.
+    uint32_t m_performanceOffset;   //!< Offset of the \a Fantom::Performance records.
+    uint32_t m_nofPerformances; //!< Number of \a Fantom::Performance records.
+    uint32_t m_recordSize;      //!< sizeof(Fantom::Performance) of the writer.
+};
+
+} // namespace ConfigShm
+
+/*! \brief The configuration the core has loaded, shared with its clients.
+ *
+ * The core publishes its tracks, setlist and performance data in a new
+ * POSIX shared memory segment every time any of them change, and then
+ * bumps the generation in the control object. A client compares that
+ * generation with the one it has loaded, and maps the new segment when
+ * they differ. The tracks are rebuilt from the track image in the
+ * segment, the performances are used in place, so a client never parses
+ * XML and always shows what the core actually plays.
+ *
+ * Client mappings are private, so local changes, e.g. volumes, do not
+ * reach the core or other clients.
+ */
+class SharedConfig
+{
+    ConfigShm::Control *m_control;  //!< The mapped control object, 0 if not attached.
+    bool m_owner;                   //!< True in the core, which writes the segments.
+    void *m_map;                    //!< Start of the mapped segment, 0 if nothing is mapped.
+    size_t m_mapSize;               //!< Size of the mapped segment.
+    uint32_t m_generation;          //!< Generation that was published or loaded last.
+    std::string m_image;            //!< Track image of the core, rebuilt by \a setTracks().
+    SharedConfig(const SharedConfig &);             //!< Not copyable.
+    SharedConfig &operator=(const SharedConfig &);  //!< Not assignable.
+    bool attach();
+    uint32_t generation() const;
+    void release();
+public:
+    // core
+    void create();
+    bool resume(uint32_t generation, TrackList &trackList, SetList &setList,
+        std::vector<Fantom::Performance> &performanceStore);
+    void setTracks(const TrackList &trackList, const SetList &setList);
+    void publish(const Fantom::PerformanceList &performanceList);
+    //! \brief The generation that was published or loaded last, 0 if none.
+    uint32_t published() const { return m_generation; }
+    // clients
+    bool changed();
+    bool load(TrackList &trackList, SetList &setList, Fantom::PerformanceList &performanceList);
+    SharedConfig();
+    ~SharedConfig();
+};
+
+#endif // CONFIG_SHM_H
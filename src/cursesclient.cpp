@@ -1,5 +1,7 @@
 #include <iostream>
 #include <unistd.h> // getopt
+#include <stdlib.h>
+#include <algorithm>
 #include "queue.h"
 #include "screen.h"
 #include "trackdef.h"
@@ -10,6 +12,10 @@
 #include "timestamp.h"
 #include "now.h"
 #include "activity.h"
+#include "fantomcache.h"
+#include "trackimage.h"
+#include "configshm.h"
+#include "liveshm.h"
 #define VERSION "1.4.0"     //!< global version number
 
 //! \brief A curses client for the patcher-core.
@@ -23,6 +29,10 @@ class CursesClient
     Queue m_eventRxQueue;               //!< Event RX queue.
     TrackList m_trackList;              //!< Global \a Track list.
     Fantom::PerformanceList m_performanceList; //!< Performance list.
+    Fantom::Cache m_fantomCache;        //!< Memory mapped performance data, if the core has not published any.
+    SharedConfig m_sharedConfig;        //!< The configuration published by the core.
+    SharedLiveState m_liveState;        //!< The live state published by the core.
+    uint32_t m_liveSequence;            //!< Update counter of the live state that was read last.
     SetList m_setList;                  //!< Global \a SetList object.
     int m_trackIdx;                     //!< Current track index
     int m_trackIdxWithinSet;            //!< Current track index within \a SetList.
@@ -30,6 +40,55 @@ class CursesClient
     bool m_metaMode;                    //!< Meta mode switch.
     TimeSpec m_eventRxTime;             //!< Arrival time of the current Midi event.
     int m_nofScreenUpdates;             //!< Screen update counter.
+    int m_nofSynced;                    //!< Number of performances downloaded by the core so far.
+    int m_nofToSync;                    //!< Number of performances the core is downloading, 0 if none.
+    int m_nofSyncErrors;                //!< Number of failed Fantom requests during the download.
+    int m_nofSyncFailed;                //!< Number of performances the core has given up on.
+    uint32_t m_nofRoundTrips;           //!< Round trip probes to the Fantom answered.
+    uint32_t m_nofLostProbes;           //!< Round trip probes lost.
+    uint32_t m_roundTrip[3];            //!< Latest, shortest and longest of the latest round trips in usec.
+    int m_nofCoreRestarts;              //!< Restarts of the core by the administrator process.
+    int m_coreSignal;                   //!< Signal that stopped the previous core, 0 if it exited.
+    int m_coreExitCode;                 //!< Exit code of the previous core.
+    //! \brief A part on the screen, coloured by its activity.
+    struct PartCell
+    {
+        int m_y;                        //!< Row.
+        int m_x;                        //!< Column.
+        int m_labelWidth;               //!< Width of the part number.
+        int m_width;                    //!< Width of the whole part.
+        int m_index;                    //!< Channel or \a SwPart index in its \a ActivityList.
+        int m_hwPart;                   //!< Fantom part index.
+        ActivityList::State m_shown;    //!< Activity state shown.
+    };
+    std::vector<PartCell> m_hwCells;    //!< Fantom parts on the screen.
+    std::vector<PartCell> m_swCells;    //!< \a SwPart rows on the screen.
+    bool m_layoutDirty;                 //!< The whole screen must be drawn on the next update.
+    int m_shownTrackIdx;                //!< Track index on the screen.
+    int m_shownSectionIdx;              //!< Section index on the screen.
+    int m_shownTrackIdxWithinSet;       //!< Setlist index on the screen.
+    bool m_shownMetaMode;               //!< Meta mode on the screen.
+    TimeSpec m_frameInterval;           //!< Minimum time between screen updates.
+    bool m_renderPending;               //!< The screen is out of date.
+    //! \brief True if the whole screen must be drawn on the next update.
+    bool layoutChanged() const {
+        return m_layoutDirty
+            || m_shownTrackIdx != m_trackIdx
+            || m_shownSectionIdx != m_sectionIdx
+            || m_shownTrackIdxWithinSet != m_trackIdxWithinSet
+            || m_shownMetaMode != m_metaMode; }
+    void drawLayout();
+    void drawActivity();
+    void drawHwCell(PartCell &cell);
+    void drawSwCell(PartCell &cell);
+    void drawSwPart(int swPartIdx);
+    void paintCell(PartCell &cell, ActivityList::State s);
+    void render();
+    void handleEvent(Event &event);
+    void readLiveState();
+    void reloadConfig();
+    void loadTracks();
+    void loadPerformances();
 public:
     size_t nofTracks() const { return m_trackList.size(); } //!< The number of \a Tracks.
     Track *currentTrack() const {
@@ -54,14 +113,21 @@ public:
     //! \brief Event loop, never returns.
     void eventLoop();
     //! \brief Constructs a curses client.
-    CursesClient(bool enableLogging, Screen *s):
+    CursesClient(bool enableLogging, int frameRate, Screen *s):
         m_fpLog(0),
         m_xml(0),
         m_channelActivity(Midi::NofChannels, Midi::Note::max),
         m_softPartActivity(64 /*see tracks.xsd*/, Midi::Note::max),
         m_screen(s),
+        m_liveSequence(0),
         m_trackIdx(0), m_trackIdxWithinSet(0), m_sectionIdx(0),
-        m_metaMode(false), m_nofScreenUpdates(0)
+        m_metaMode(false), m_nofScreenUpdates(0),
+        m_nofSynced(0), m_nofToSync(0), m_nofSyncErrors(0), m_nofSyncFailed(0),
+        m_nofRoundTrips(0), m_nofLostProbes(0),
+        m_nofCoreRestarts(0), m_coreSignal(0), m_coreExitCode(0),
+        m_layoutDirty(true), m_shownTrackIdx(0), m_shownSectionIdx(0),
+        m_shownTrackIdxWithinSet(0), m_shownMetaMode(false),
+        m_frameInterval((Real)1/frameRate), m_renderPending(true)
     {
         if (enableLogging)
             m_fpLog = fopen("clientlog.txt", "wb");
@@ -70,12 +136,17 @@ public:
     }
 };
 
+/*! \brief Bring the screen up to date.
+ *
+ * The whole screen is only drawn when something other than the activity
+ * or a volume has changed, e.g. the track or section. Otherwise only the
+ * parts whose activity state differs from what is shown are recoloured,
+ * so a busy performance costs a few attribute changes instead of a full
+ * repaint of the window.
+ */
 void CursesClient::updateScreen()
 {
     m_nofScreenUpdates++;
-    werase(m_screen->main());
-    wprintw(m_screen->main(),
-        "*** Ray's MIDI patcher " VERSION ", rev " SVN ", " NOW " ***\n\n");
     if (m_fpLog)
     {
         fprintf(m_fpLog, "screen update %08d\n", m_nofScreenUpdates);
@@ -84,6 +155,43 @@ void CursesClient::updateScreen()
             fprintf(m_fpLog, "%02d ", m_channelActivity.triggerCount(i));
         fprintf(m_fpLog, "\n");
     }
+    if (layoutChanged())
+        drawLayout();
+    else
+        drawActivity();
+}
+
+//! \brief Draw the whole screen, and remember where the parts are.
+void CursesClient::drawLayout()
+{
+    m_layoutDirty = false;
+    m_shownTrackIdx = m_trackIdx;
+    m_shownSectionIdx = m_sectionIdx;
+    m_shownTrackIdxWithinSet = m_trackIdxWithinSet;
+    m_shownMetaMode = m_metaMode;
+    m_hwCells.clear();
+    m_swCells.clear();
+    werase(m_screen->main());
+    wprintw(m_screen->main(),
+        "*** Ray's MIDI patcher " VERSION ", rev " SVN ", " NOW " ***\n\n");
+    if (m_nofSynced + m_nofSyncFailed < m_nofToSync)
+        mvwprintw(m_screen->main(), 1, 0,
+            "downloading Fantom performance data %d/%d, %d errors",
+            m_nofSynced, m_nofToSync, m_nofSyncErrors);
+    else if (m_nofSyncFailed)
+        mvwprintw(m_screen->main(), 1, 0,
+            "Fantom performance data %d/%d, %d failed",
+            m_nofSynced, m_nofToSync, m_nofSyncFailed);
+    else if (m_nofRoundTrips || m_nofLostProbes)
+        mvwprintw(m_screen->main(), 1, 0,
+            "Fantom round trip %.1f ms, %.1f-%.1f ms, %u lost",
+            m_roundTrip[0]*1e-3, m_roundTrip[1]*1e-3, m_roundTrip[2]*1e-3, m_nofLostProbes);
+    if (m_nofCoreRestarts && m_coreSignal)
+        mvwprintw(m_screen->main(), 1, 50, "core restarts %d: signal %d",
+            m_nofCoreRestarts, m_coreSignal);
+    else if (m_nofCoreRestarts)
+        mvwprintw(m_screen->main(), 1, 50, "core restarts %d: exit %d",
+            m_nofCoreRestarts, m_coreExitCode);
     mvwprintw(m_screen->main(), 2, 0,
         "track   %03d \"%s\"\nsection %03d/%03d \"%s\"\n",
         1+m_trackIdx, currentTrack()->m_name,
@@ -93,7 +201,7 @@ void CursesClient::updateScreen()
         "%03d/%03d within setlist", 1+m_trackIdxWithinSet, m_setList.size());
     mvwprintw(m_screen->main(), 5, 0,
         "performance \"%s\"\n",
-        currentTrack()->m_performance->m_name);
+        currentTrack()->m_performance ? currentTrack()->m_performance->m_name : "<pending>");
     mvwprintw(m_screen->main(), 3, 44,
         "next \"%s\"\n", nextTrackName());
     mvwprintw(m_screen->main(), 5, 30, "chain mode %s\n",
@@ -104,32 +212,25 @@ void CursesClient::updateScreen()
         m_metaMode?"on":"off");
     if (m_metaMode)
         wattroff(m_screen->main(), COLOR_PAIR(1));
-    int partsShown = 0;
+    if (!currentTrack()->m_performance)
+    {
+        mvwprintw(m_screen->main(), 7, 0, "waiting for Fantom performance data");
+        return;
+    }
     for (int partIdx=0; partIdx<Fantom::Performance::NofParts;partIdx++)
     {
-        int x = (partsShown / 4) * 19;
-        int y = 7 + partsShown % 4;
         const Fantom::Part *part = currentTrack()->m_performance->m_partList+partIdx;
         ASSERT(part->m_channel != 255);
-        if (1 || part->m_channel == m_sectionIdx)
-        {
-            ActivityList::State s = m_channelActivity.get(part->m_channel);
-            if (s == ActivityList::event)
-                wattron(m_screen->main(), COLOR_PAIR(2));
-            else if (s == ActivityList::on)
-                wattron(m_screen->main(), COLOR_PAIR(1));
-            mvwprintw(m_screen->main(), y, x, "%2d", partIdx+1);
-            if (s == ActivityList::event)
-                wattroff(m_screen->main(), COLOR_PAIR(2));
-            if (s == ActivityList::event || s == ActivityList::on)
-                wattron(m_screen->main(), COLOR_PAIR(1));
-            wprintw(m_screen->main(), " %2d %s ", 1+part->m_channel, part->m_preset);
-            if (s == ActivityList::event || s == ActivityList::on)
-                wattroff(m_screen->main(), COLOR_PAIR(1));
-            partsShown++;
-        }
+        PartCell cell;
+        cell.m_y = 7 + partIdx % 4;
+        cell.m_x = (partIdx / 4) * 19;
+        cell.m_labelWidth = 2;
+        cell.m_index = part->m_channel;
+        cell.m_hwPart = partIdx;
+        drawHwCell(cell);
+        m_hwCells.push_back(cell);
     }
-    partsShown = 0;
+    int partsShown = 0;
     const int colLength = 3;
     for (size_t i=0; i<currentSection()->m_partList.size(); i++)
     {
@@ -142,44 +243,120 @@ void CursesClient::updateScreen()
                 int x = 0;
                 if (partsShown >= colLength)
                     x += 40;
-                int y = 6 + 5 + 2 + partsShown % colLength;
                 if (partsShown % colLength == 0)
                     mvwprintw(m_screen->main(), 6+5+1, x,
                         "prt range         patch        vol tps");
-                char keyL[20];
-                keyL[0] = 0;
-                Midi::noteName(
-                    std::max(hwPart->m_keyRangeLower,
-                    swPart->m_rangeLower), keyL);
-                char keyU[20];
-                keyU[0] = 0;
-                Midi::noteName(
-                    std::min(hwPart->m_keyRangeUpper,
-                    swPart->m_rangeUpper), keyU);
-                int transpose = swPart->m_transpose +
-                        (int)hwPart->m_transpose +
-                        (int)hwPart->m_octave*12;
-                ActivityList::State s = m_softPartActivity.get(i);
-                ASSERT(hwPart->m_patch.m_name[1] != '[');
-                if (s == ActivityList::event)
-                    wattron(m_screen->main(), COLOR_PAIR(2));
-                else if (s == ActivityList::on)
-                    wattron(m_screen->main(), COLOR_PAIR(1));
-                mvwprintw(m_screen->main(), y, x, "%3d", j+1);
-                if (s == ActivityList::event)
-                    wattroff(m_screen->main(), COLOR_PAIR(2));
-                if (s == ActivityList::event || s == ActivityList::on)
-                    wattron(m_screen->main(), COLOR_PAIR(1));
-                wprintw(m_screen->main(), " [%3s - %4s]  %12s %3d %3d",
-                    keyL, keyU, hwPart->m_patch.m_name, hwPart->m_volume,transpose);
-                if (s == ActivityList::event || s == ActivityList::on)
-                    wattroff(m_screen->main(), COLOR_PAIR(1));
+                PartCell cell;
+                cell.m_y = 6 + 5 + 2 + partsShown % colLength;
+                cell.m_x = x;
+                cell.m_labelWidth = 3;
+                cell.m_index = (int)i;
+                cell.m_hwPart = j;
+                drawSwCell(cell);
+                m_swCells.push_back(cell);
                 partsShown++;
             }
         }
     }
 }
 
+//! \brief Recolour the parts whose activity has changed since they were drawn.
+void CursesClient::drawActivity()
+{
+    for (size_t i=0; i<m_hwCells.size(); i++)
+    {
+        ActivityList::State s = m_channelActivity.get(m_hwCells[i].m_index);
+        if (s != m_hwCells[i].m_shown)
+            paintCell(m_hwCells[i], s);
+    }
+    for (size_t i=0; i<m_swCells.size(); i++)
+    {
+        ActivityList::State s = m_softPartActivity.get(m_swCells[i].m_index);
+        if (s != m_swCells[i].m_shown)
+            paintCell(m_swCells[i], s);
+    }
+}
+
+//! \brief Draw a Fantom part of the current performance.
+void CursesClient::drawHwCell(PartCell &cell)
+{
+    const Fantom::Part *part = currentTrack()->m_performance->m_partList+cell.m_hwPart;
+    mvwprintw(m_screen->main(), cell.m_y, cell.m_x, "%2d", cell.m_hwPart+1);
+    wprintw(m_screen->main(), " %2d %s ", 1+part->m_channel, part->m_preset);
+    cell.m_width = getcurx(m_screen->main()) - cell.m_x;
+    paintCell(cell, m_channelActivity.get(cell.m_index));
+}
+
+//! \brief Draw a \a SwPart of the current section, on one of its Fantom parts.
+void CursesClient::drawSwCell(PartCell &cell)
+{
+    const SwPart *swPart = currentSection()->m_partList[cell.m_index];
+    const Fantom::Part *hwPart = currentTrack()->m_performance->m_partList+cell.m_hwPart;
+    char keyL[20];
+    keyL[0] = 0;
+    Midi::noteName(
+        std::max(hwPart->m_keyRangeLower,
+        swPart->m_rangeLower), keyL);
+    char keyU[20];
+    keyU[0] = 0;
+    Midi::noteName(
+        std::min(hwPart->m_keyRangeUpper,
+        swPart->m_rangeUpper), keyU);
+    int transpose = swPart->m_transpose +
+            (int)hwPart->m_transpose +
+            (int)hwPart->m_octave*12;
+    ASSERT(hwPart->m_patch.m_name[1] != '[');
+    mvwprintw(m_screen->main(), cell.m_y, cell.m_x, "%3d", cell.m_hwPart+1);
+    wprintw(m_screen->main(), " [%3s - %4s]  %12s %3d %3d",
+        keyL, keyU, hwPart->m_patch.m_name, hwPart->m_volume,transpose);
+    cell.m_width = getcurx(m_screen->main()) - cell.m_x;
+    paintCell(cell, m_softPartActivity.get(cell.m_index));
+}
+
+/*! \brief Set the colours of a part for an activity state, the text is left alone.
+ *
+ * The part number is highlighted on an event, the rest while notes are on.
+ */
+void CursesClient::paintCell(PartCell &cell, ActivityList::State s)
+{
+    short labelPair = s == ActivityList::event ? 2 : s == ActivityList::on ? 1 : 0;
+    short restPair = s == ActivityList::off ? 0 : 1;
+    mvwchgat(m_screen->main(), cell.m_y, cell.m_x,
+        cell.m_labelWidth, A_NORMAL, labelPair, 0);
+    mvwchgat(m_screen->main(), cell.m_y, cell.m_x + cell.m_labelWidth,
+        cell.m_width - cell.m_labelWidth, A_NORMAL, restPair, 0);
+    cell.m_shown = s;
+}
+
+//! \brief Redraw the rows of a \a SwPart of the current section, after its volume has changed.
+void CursesClient::drawSwPart(int swPartIdx)
+{
+    for (size_t i=0; i<m_swCells.size(); i++)
+    {
+        if (m_swCells[i].m_index == swPartIdx)
+            drawSwCell(m_swCells[i]);
+    }
+}
+
+/*! \brief Update the screen and send it to the terminal.
+ *
+ * With logging enabled, the time this takes is logged.
+ */
+void CursesClient::render()
+{
+    TimeSpec start;
+    if (m_fpLog)
+        getTime(start);
+    updateScreen();
+    wrefresh(m_screen->main());
+    if (m_fpLog)
+    {
+        TimeSpec stop;
+        getTime(stop);
+        fprintf(m_fpLog, "render %d us\n", (int)(timeDiffSeconds(start, stop)*1e6));
+    }
+}
+
 void CursesClient::allNotesOff(uint8_t channel)
 {
     m_channelActivity.clear(channel);
@@ -197,124 +374,234 @@ void CursesClient::allNotesOff()
     m_softPartActivity.clear();
 }
 
+/*! \brief Take the track, section, meta mode and download status from the core.
+ *
+ * The live state is only copied if the core has changed it, so this is
+ * cheap enough to be called for every event.
+ */
+void CursesClient::readLiveState()
+{
+    uint32_t sequence = m_liveState.sequence();
+    if (sequence == m_liveSequence && sequence != 0)
+        return;
+    LiveShm::State state;
+    if (!m_liveState.read(state))
+        return;
+    m_liveSequence = sequence;
+    if (nofTracks() == 0)
+        return;
+    if (m_metaMode != !!state.m_metaMode)
+    {
+        m_metaMode = !!state.m_metaMode;
+        m_renderPending = true;
+    }
+    bool doAllNotesOff = false;
+    if (m_trackIdx != state.m_currentTrack && (size_t)state.m_currentTrack < nofTracks())
+    {
+        m_trackIdx = state.m_currentTrack;
+        m_sectionIdx = std::min(m_sectionIdx, (int)currentTrack()->m_sectionList.size()-1);
+        doAllNotesOff = true;
+    }
+    if (m_sectionIdx != state.m_currentSection
+            && (size_t)state.m_currentSection < currentTrack()->m_sectionList.size())
+    {
+        m_sectionIdx = state.m_currentSection;
+        doAllNotesOff = true;
+    }
+    if (doAllNotesOff)
+    {
+        allNotesOff();
+    }
+    m_trackIdxWithinSet = state.m_trackIdxWithinSet;
+    if (m_nofSynced != state.m_nofSynced || m_nofToSync != state.m_nofToSync
+        || m_nofSyncErrors != state.m_nofSyncErrors || m_nofSyncFailed != state.m_nofSyncFailed)
+    {
+        m_nofSynced = state.m_nofSynced;
+        m_nofToSync = state.m_nofToSync;
+        m_nofSyncErrors = state.m_nofSyncErrors;
+        m_nofSyncFailed = state.m_nofSyncFailed;
+        m_renderPending = true;
+    }
+    if (m_nofRoundTrips != state.m_nofRoundTrips || m_nofLostProbes != state.m_nofLostProbes)
+    {
+        // only probed while idle, so the whole screen can be drawn
+        m_nofRoundTrips = state.m_nofRoundTrips;
+        m_nofLostProbes = state.m_nofLostProbes;
+        m_roundTrip[0] = state.m_roundTripLast;
+        m_roundTrip[1] = state.m_roundTripMin;
+        m_roundTrip[2] = state.m_roundTripMax;
+        m_layoutDirty = true;
+        m_renderPending = true;
+    }
+    if (m_nofCoreRestarts != state.m_nofCoreRestarts)
+    {
+        m_nofCoreRestarts = state.m_nofCoreRestarts;
+        m_coreSignal = state.m_coreSignal;
+        m_coreExitCode = state.m_coreExitCode;
+        m_layoutDirty = true;
+        m_renderPending = true;
+    }
+    if (layoutChanged())
+        m_renderPending = true;
+}
+
+/*! \brief Apply an event to the client state.
+ *
+ * Nothing is drawn here, \a m_renderPending is set if the screen must be updated.
+ *
+ * \param[in]  event   The event.
+ */
+void CursesClient::handleEvent(Event &event)
+{
+    if (m_fpLog)
+    {
+        fprintf(m_fpLog, "%s\n", event.toString().c_str());
+    }
+    // the core publishes before it sends the event that refers to it
+    bool reloaded = m_sharedConfig.changed();
+    if (reloaded)
+        reloadConfig();
+    readLiveState();
+    if ((event.m_type == Event::MidiOut3Bytes ||
+         event.m_type == Event::MidiOut2Bytes ||
+         event.m_type == Event::MidiOut1Byte) &&
+        event.m_deviceId == Midi::Device::FantomOut)
+    {
+        if(event.m_part == Event::Unspecified ||
+                event.m_part < currentSection()->m_partList.size())
+        {
+            // parse MIDI out event
+            uint8_t channel = Midi::channel(event.m_midi[0]);
+            bool volumeChange = false;
+            if (Midi::isNote(event.m_midi[0]))
+            {
+                bool on = Midi::isNoteOn(event.m_midi[0], event.m_midi[1], event.m_midi[2]);
+                m_channelActivity.trigger(channel, event.m_midi[1], on, m_eventRxTime);
+                if (event.m_part != Event::Unspecified)
+                    m_softPartActivity.trigger(event.m_part, event.m_midi[1], on, m_eventRxTime);
+            }
+            else if (Midi::isController(event.m_midi[0]) || (Midi::status(event.m_midi[0]) == Midi::pitchBend))
+            {
+                if (event.m_midi[1] == Midi::allNotesOff)
+                {
+                    allNotesOff(channel);
+                }
+                else
+                {
+                    // Abuse note C0 to store regular controller activity.
+                    m_channelActivity.trigger(channel, Midi::Note::C0, false, m_eventRxTime);
+                    if (event.m_part != Event::Unspecified)
+                        m_softPartActivity.trigger(event.m_part, Midi::Note::C0, false, m_eventRxTime);
+                    if ((event.m_midi[0] & 0xf0) == Midi::controller &&
+                         event.m_midi[1] == Midi::mainVolume)
+                    {
+                        volumeChange = true;
+                        SwPart *swPart = currentSection()->m_partList[event.m_part];
+                        for (size_t hwPart = 0; hwPart < swPart->m_hwPartList.size(); hwPart++)
+                        {
+                            Fantom::Part *hp = swPart->m_hwPartList[hwPart];
+                            hp->m_volume = event.m_midi[2];
+                        }
+                        // \todo These volume changes are lost in the Fantom when
+                        // switching to another performance, but we keep them.
+                        // This leads to inconsistencies when switching back to this performance.
+                    }
+                }
+            }
+            if (volumeChange)
+            {
+                // the rows on the screen belong to another section if the layout has changed
+                if (!layoutChanged())
+                    drawSwPart(event.m_part);
+                m_renderPending = true;
+            }
+        }
+        else
+        {
+            if (m_fpLog)
+                fprintf(m_fpLog, "ignored invalid part in %s\n", event.toString().c_str());
+        }
+    }
+    else if (event.m_type == Event::TracksReloaded)
+    {
+        if (!reloaded)
+            reloadConfig();
+        m_renderPending = true;
+    }
+    else if (event.m_type == Event::FantomSync)
+    {
+        // the core has written a new cache file
+        if (!reloaded)
+            reloadConfig();
+        m_renderPending = true;
+    }
+    else
+    {
+        if (m_fpLog)
+            fprintf(m_fpLog, "ignored %s\n", event.toString().c_str());
+        m_renderPending = true;
+    }
+}
+
+/*! \brief Event loop, never returns.
+ *
+ * All pending events are applied before the screen is drawn, and the
+ * screen is drawn at most once per frame interval, so a burst of notes
+ * costs one update instead of one per event. Activity that expires
+ * between frames is shown on the next frame.
+ */
 void CursesClient::eventLoop()
 {
     Event event;
     wprintw(m_screen->main(), "q.getattr: %s\n", m_eventRxQueue.getAttr().c_str());
     wprintw(m_screen->main(), "sizeof event: %d\n", (int)sizeof(event));
     wrefresh(m_screen->main());
+    TimeSpec frameTime;     // time of the last frame
     for (;;)
     {
-        TimeSpec nextTime;
-        bool timedOut = false;
-        if (m_channelActivity.nextExpiry(nextTime))
+        TimeSpec nextFrameTime;
+        timeSum(nextFrameTime, frameTime, m_frameInterval);
+        TimeSpec deadline;
+        bool received;
+        if (m_renderPending)
         {
-            timedOut = !m_eventRxQueue.receive(event, nextTime);
+            received = m_eventRxQueue.receive(event, nextFrameTime);
+        }
+        else if (m_channelActivity.nextExpiry(deadline))
+        {
+            if (!timeGreaterThanOrEqual(deadline, nextFrameTime))
+                deadline = nextFrameTime;
+            received = m_eventRxQueue.receive(event, deadline);
         }
         else
         {
             m_eventRxQueue.receive(event);
+            received = true;
         }
         getTime(m_eventRxTime);
-        m_channelActivity.update(m_eventRxTime);
-        m_softPartActivity.update(m_eventRxTime);
-        if (timedOut)
+        int nofEvents = 0;
+        if (received)
         {
-            if (m_channelActivity.isDirty() || m_softPartActivity.isDirty())
+            // drain the queue without blocking, a time in the past does not wait
+            do
             {
-                updateScreen();
-                wrefresh(m_screen->main());
-            }
+                handleEvent(event);
+                nofEvents++;
+            } while (m_eventRxQueue.receive(event, TimeSpec()));
         }
-        else
+        // the events that announced a change may have been dropped
+        readLiveState();
+        m_channelActivity.update(m_eventRxTime);
+        m_softPartActivity.update(m_eventRxTime);
+        if (m_channelActivity.isDirty() || m_softPartActivity.isDirty())
+            m_renderPending = true;
+        if (m_renderPending && timeGreaterThanOrEqual(m_eventRxTime, nextFrameTime))
         {
             if (m_fpLog)
-            {
-                fprintf(m_fpLog, "%s\n", event.toString().c_str());
-            }
-            m_metaMode = !!event.m_metaMode;
-            bool doAllNotesOff = false;
-            if (event.m_currentTrack != Event::Unspecified && m_trackIdx != event.m_currentTrack)
-            {
-                m_trackIdx = event.m_currentTrack;
-                doAllNotesOff = true;
-            }
-            if (event.m_currentSection != Event::Unspecified && m_sectionIdx != event.m_currentSection)
-            {
-                m_sectionIdx = event.m_currentSection;
-                doAllNotesOff = true;
-            }
-            if (doAllNotesOff)
-            {
-                allNotesOff();
-            }
-            if (event.m_trackIdxWithinSet != Event::Unspecified)
-                m_trackIdxWithinSet = event.m_trackIdxWithinSet;
-            if ((event.m_type == Event::MidiOut3Bytes ||
-                 event.m_type == Event::MidiOut2Bytes ||
-                 event.m_type == Event::MidiOut1Byte) &&
-                event.m_deviceId == Midi::Device::FantomOut)
-            {
-                if(event.m_part == Event::Unspecified ||
-                        event.m_part < currentSection()->m_partList.size())
-                {
-                    // parse MIDI out event
-                    uint8_t channel = Midi::channel(event.m_midi[0]);
-                    bool volumeChange = false;
-                    if (Midi::isNote(event.m_midi[0]))
-                    {
-                        bool on = Midi::isNoteOn(event.m_midi[0], event.m_midi[1], event.m_midi[2]);
-                        m_channelActivity.trigger(channel, event.m_midi[1], on, m_eventRxTime);
-                        if (event.m_part != Event::Unspecified)
-                            m_softPartActivity.trigger(event.m_part, event.m_midi[1], on, m_eventRxTime);
-                    }
-                    else if (Midi::isController(event.m_midi[0]) || (Midi::status(event.m_midi[0]) == Midi::pitchBend))
-                    {
-                        if (event.m_midi[1] == Midi::allNotesOff)
-                        {
-                            allNotesOff(channel);
-                        }
-                        else
-                        {
-                            // Abuse note C0 to store regular controller activity.
-                            m_channelActivity.trigger(channel, Midi::Note::C0, false, m_eventRxTime);
-                            if (event.m_part != Event::Unspecified)
-                                m_softPartActivity.trigger(event.m_part, Midi::Note::C0, false, m_eventRxTime);
-                            if ((event.m_midi[0] & 0xf0) == Midi::controller &&
-                                 event.m_midi[1] == Midi::mainVolume)
-                            {
-                                volumeChange = true;
-                                SwPart *swPart = currentSection()->m_partList[event.m_part];
-                                for (size_t hwPart = 0; hwPart < swPart->m_hwPartList.size(); hwPart++)
-                                {
-                                    Fantom::Part *hp = swPart->m_hwPartList[hwPart];
-                                    hp->m_volume = event.m_midi[2];
-                                }
-                                // \todo These volume changes are lost in the Fantom when
-                                // switching to another performance, but we keep them.
-                                // This leads to inconsistencies when switching back to this performance.
-                            }
-                        }
-                    }
-                    if (m_channelActivity.isDirty() || m_softPartActivity.isDirty() || volumeChange)
-                    {
-                        updateScreen();
-                        wrefresh(m_screen->main());
-                    }
-                }
-                else
-                {
-                    if (m_fpLog)
-                        fprintf(m_fpLog, "ignored invalid part in %s\n", event.toString().c_str());
-                }
-            }
-            else
-            {
-                if (m_fpLog)
-                    fprintf(m_fpLog, "ignored %s\n", event.toString().c_str());
-                updateScreen();
-                wrefresh(m_screen->main());
-            }
+                fprintf(m_fpLog, "frame after %d events\n", nofEvents);
+            render();
+            frameTime = m_eventRxTime;
+            m_renderPending = false;
         }
         if (m_fpLog)
             fflush(m_fpLog);
@@ -323,31 +610,76 @@ void CursesClient::eventLoop()
 
 void CursesClient::loadConfig()
 {
-    m_xml->importTracks(TRACK_DEF, m_trackList, m_setList);
-    // Wait for core process to start its event loop.
+    // Wait for core process to start its event loop, by then it has published its configuration.
     Event event;
     m_eventRxQueue.receive(event);
+    reloadConfig();
+}
+
+/*! \brief Load the configuration published by the core.
+ *
+ * This is called again whenever the core has published a new generation.
+ * If no core has published yet, the image and cache files are read instead,
+ * and they are read again on every reload or download event.
+ */
+void CursesClient::reloadConfig()
+{
+    allNotesOff();
+    m_layoutDirty = true;
+    if (m_sharedConfig.load(m_trackList, m_setList, m_performanceList))
+    {
+        m_fantomCache.release();
+    }
+    else
+    {
+        loadTracks();
+        loadPerformances();
+    }
+    // the core may have removed the tracks we were at
+    if (m_trackIdx >= (int)nofTracks())
+        m_trackIdx = 0;
+    if (m_sectionIdx >= (int)currentTrack()->m_sectionList.size())
+        m_sectionIdx = 0;
+    // and take the position again
+    m_liveSequence = 0;
+}
+
+//! \brief Load the track list and setlist from the image or XML file.
+void CursesClient::loadTracks()
+{
+    m_trackList.release();
+    m_setList = SetList();
+    if (!TrackImage::load(TRACK_IMAGE, TRACK_DEF, m_trackList, m_setList))
+        m_xml->importTracks(TRACK_DEF, m_trackList, m_setList);
+}
+
+//! \brief Load the performance list from the cache files, and merge performance data.
+void CursesClient::loadPerformances()
+{
     // By now the cache file should be available.
-    m_xml->importPerformances("fantom_cache.xml", m_performanceList);
+    if (!m_fantomCache.load(FANTOM_CACHE, m_performanceList))
+        m_xml->importPerformances(FANTOM_CACHE_XML, m_performanceList);
 
     TrackList::iterator track = m_trackList.begin();
     Fantom::PerformanceList::iterator performance =
                 m_performanceList.begin();
-    for (; performance != m_performanceList.end(); ++performance, ++track)
+    for (; performance != m_performanceList.end() && track != m_trackList.end();
+            ++performance, ++track)
     {
         if (m_fpLog)
             fprintf(m_fpLog, "merging performance %s\n",
                 (*performance)->m_name);
-        (*track)->merge(*performance);
+        (*track)->merge((*performance)->m_loaded ? *performance : 0);
     }
 }
 
 int main(int argc, char**argv)
 {
     bool enableLogging = false;
+    int frameRate = 30;
     for (;;)
     {
-        int opt = getopt(argc, argv, "lh");
+        int opt = getopt(argc, argv, "lr:h");
         if (opt == -1)
             break;
         switch (opt)
@@ -355,10 +687,19 @@ int main(int argc, char**argv)
             case 'l':
                 enableLogging = true;
                 break;
+            case 'r':
+                frameRate = atoi(optarg);
+                if (frameRate < 1 || frameRate > 1000)
+                {
+                    std::cerr << "frame rate must be 1..1000 Hz\n";
+                    return 1;
+                }
+                break;
             default:
-                std::cerr << "\ncurses_client [-h|?] [-l]\n\n"
+                std::cerr << "\ncurses_client [-h|?] [-l] [-r <rate>]\n\n"
                     "  -h|?     This message\n"
-                    "  -l       Enable logging\n\n";
+                    "  -l       Enable logging\n"
+                    "  -r       Maximum screen updates per second, default 30\n\n";
                 return 1;
                 break;
         }
@@ -370,7 +711,7 @@ int main(int argc, char**argv)
     try
     {
         Screen screen;
-        CursesClient cursesClient(enableLogging, &screen);
+        CursesClient cursesClient(enableLogging, frameRate, &screen);
         cursesClient.loadConfig();
         cursesClient.eventLoop();
     }
@@ -0,0 +1,125 @@
+/*! \file fantomcache.cpp
+ *  \brief Contains a binary cache for Fantom performance data.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include "fantomcache.h"
+#include "checksum.h"
+#include "error.h"
+
+namespace Fantom
+{
+
+namespace
+{
+const char magic[8] = { 'F', 'A', 'N', 'T', 'O', 'M', 'X', 'R' }; //!< Cache file magic.
+//! \brief Compile time check: a \a Performance must be a packed byte record.
+typedef char performanceIsPacked[
+    sizeof(Performance) == NameLength+1 + Performance::NofParts*sizeof(Part) + 1 ? 1 : -1];
+}
+
+/*! \brief Map a cache file and use it as backing store for a \a PerformanceList.
+ *
+ * Any previous mapping is released, so pointers obtained from an
+ * earlier \a load() become invalid.
+ *
+ * \param[in]   fileName          Cache file name.
+ * \param[out]  performanceList   Pointers into the mapped file.
+ * \return      True if the cache file exists and is valid.
+ */
+bool Cache::load(const char *fileName, PerformanceList &performanceList)
+{
+    release();
+    performanceList.clear();
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1 || statBuf.st_size < (off_t)sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+    m_mapSize = (size_t)statBuf.st_size;
+    m_map = mmap(0, m_mapSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED)
+    {
+        m_map = 0;
+        return false;
+    }
+    const CacheHeader *header = (const CacheHeader *)m_map;
+    Performance *record = (Performance *)((char *)m_map + sizeof(CacheHeader));
+    size_t recordBytes = m_mapSize - sizeof(CacheHeader);
+    if (memcmp(header->m_magic, magic, sizeof(magic)) != 0
+        || header->m_version != CacheHeader::Version
+        || header->m_recordSize != sizeof(Performance)
+        || recordBytes != header->m_nofPerformances * sizeof(Performance)
+        || header->m_checksum != adler32(record, recordBytes))
+    {
+        release();
+        return false;
+    }
+    performanceList.reserve(header->m_nofPerformances);
+    for (uint32_t i=0; i<header->m_nofPerformances; i++)
+        performanceList.push_back(record+i);
+    return true;
+}
+
+/*! \brief Write a \a PerformanceList to a cache file.
+ *
+ * The file is written under a temporary name first and then renamed,
+ * so a reader never sees a half written cache.
+ *
+ * \param[in]   fileName          Cache file name.
+ * \param[in]   performanceList   Performances to store.
+ */
+void Cache::save(const char *fileName, const PerformanceList &performanceList)
+{
+    CacheHeader header;
+    memcpy(header.m_magic, magic, sizeof(magic));
+    header.m_version = CacheHeader::Version;
+    header.m_recordSize = sizeof(Performance);
+    header.m_nofPerformances = (uint32_t)performanceList.size();
+    header.m_checksum = 1;
+    for (PerformanceList::const_iterator p = performanceList.begin(); p != performanceList.end(); ++p)
+        header.m_checksum = adler32(*p, sizeof(Performance), header.m_checksum);
+    std::string tmpName = std::string(fileName) + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if (!fp)
+    {
+        Error e;
+        e.stream() << "cannot create " << tmpName << ": " << strerror(errno);
+        throw(e);
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (PerformanceList::const_iterator p = performanceList.begin(); ok && p != performanceList.end(); ++p)
+        ok = fwrite(*p, sizeof(Performance), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmpName.c_str(), fileName) == -1)
+    {
+        unlink(tmpName.c_str());
+        Error e;
+        e.stream() << "cannot write " << fileName;
+        throw(e);
+    }
+}
+
+//! \brief Unmap the cache file, if any.
+void Cache::release()
+{
+    if (m_map)
+        munmap(m_map, m_mapSize);
+    m_map = 0;
+    m_mapSize = 0;
+}
+
+} // namespace Fantom
@@ -0,0 +1,57 @@
+/*! \file fantomcache.h
+ *  \brief Contains a binary cache for Fantom performance data.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef FANTOM_CACHE_H
+#define FANTOM_CACHE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "fantomdef.h"
+
+//! \brief Namespace for Fantom driver objects.
+namespace Fantom
+{
+
+/*! \brief Header of a binary cache file.
+ *
+ * The header is followed by an array of \a Performance records.
+ * Header fields are stored in host byte order, a byte-swapped file
+ * fails the version check and is ignored.
+ */
+struct CacheHeader
+{
+    static const uint32_t Version = 2;  //!< Must be changed if the layout of \a Performance changes.
+    char m_magic[8];                    //!< Magic string, "FANTOMXR".
+    uint32_t m_version;                 //!< File format version.
+    uint32_t m_recordSize;              //!< sizeof(Performance) of the writer.
+    uint32_t m_nofPerformances;         //!< Number of \a Performance records.
+    uint32_t m_checksum;                //!< Adler-32 checksum of all records.
+};
+
+/*! \brief Binary cache of Fantom performance data.
+ *
+ * Parsing the XML cache takes seconds on the Pi. This cache is mapped into
+ * memory and used in place as the backing store of a \a PerformanceList,
+ * so loading is just a validity check.
+ * The mapping is private, so changes to the performances are not written
+ * back to the file.
+ */
+class Cache
+{
+    void *m_map;        //!< Start of the memory map, 0 if nothing is mapped.
+    size_t m_mapSize;   //!< Size of the memory map.
+    Cache(const Cache &);               //!< Not copyable.
+    Cache &operator=(const Cache &);    //!< Not assignable.
+public:
+    bool load(const char *fileName, PerformanceList &performanceList);
+    static void save(const char *fileName, const PerformanceList &performanceList);
+    void release();
+    //! \brief Construct an empty Cache.
+    Cache(): m_map(0), m_mapSize(0) { }
+    //! \brief Destructor, unmaps the file.
+    ~Cache() { release(); }
+};
+
+} // Fantom namespace
+#endif // FANTOM_CACHE_H
@@ -79,7 +79,7 @@ void Part::constructPreset(bool &patchReadAllowed)
 }
 
 //! \brief Default constructor.
-Performance::Performance()
+Performance::Performance(): m_loaded(0)
 {
     memset(m_name, ' ', sizeof(m_name));
     m_name[sizeof(m_name)-1] = 0;
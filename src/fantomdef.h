@@ -12,7 +12,6 @@
 #include "mididriver.h"
 
 class XML;
-class SwPart;
 
 //! \brief Namespace for Fantom driver objects.
 namespace Fantom
@@ -36,6 +35,9 @@ public:
 /*! \brief A Fantom 'part', i.e. a patch with some additional mix parameters.
  *
  *  All integer widths are specified so the binary dumps are portable.
+ *  This is also a plain data record without pointers, so a \a Performance
+ *  can be used in place from a memory mapped \a Cache file.
+ *  Links to \a SwPart objects are kept in the \a Track instead.
  */
 class Part
 {
@@ -53,7 +55,6 @@ public:
     uint8_t m_fadeWidthLower;   //!<    Lower fade width.
     uint8_t m_fadeWidthUpper;   //!<    Upper fade width.
     Patch m_patch;              //!<    \a Patch object.
-    std::vector <const SwPart *> m_swPartList;  //!< List of \a SwPart pointerx which point here.
     void constructPreset(bool &patchReadAllowed);
     /*! \brief Constructor */
     Part();
@@ -72,6 +73,7 @@ public:
     static const int NofParts = 16; //!< Number of Parts in a Fantom performance.
     char m_name[NameLength+1];    //!< Performance name.
     Part m_partList[NofParts];    //!< Parts within this \a FantomPerformance.
+    uint8_t m_loaded;             //!< Zero while the data is still pending download.
     Performance();
 };
 
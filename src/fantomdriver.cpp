@@ -27,11 +27,11 @@ void Driver::setParam(const uint32_t addr, const uint32_t length, const uint8_t
     uint32_t i=0;
     txBuf[i++] = Midi::sysEx;
     txBuf[i++] = 0x41; // ID: Roland
-    uint32_t checkSumStart = i;
-    txBuf[i++] = 0x10; // dev ID, start of checksum
+    txBuf[i++] = 0x10; // dev ID
     txBuf[i++] = 0x00; // model fantom XR
     txBuf[i++] = 0x6b; // model fantom XR
     txBuf[i++] = 0x12; // command ID
+    uint32_t checkSumStart = i; // the checksum covers the address and the data
     txBuf[i++] = (uint8_t)(0xff & addr >> 24);
     txBuf[i++] = (uint8_t)(0xff & addr >> 16);
     txBuf[i++] = (uint8_t)(0xff & addr >> 8);
@@ -42,9 +42,9 @@ void Driver::setParam(const uint32_t addr, const uint32_t length, const uint8_t
         txBuf[i++] = data[j];
     uint32_t checkSumEnd = i;
     checkSum = 0;
-    for (uint32_t j=checkSumStart; j<=checkSumEnd; j++)
+    for (uint32_t j=checkSumStart; j<checkSumEnd; j++)
         checkSum += txBuf[j];
-    txBuf[i++] = 0x80 - (checkSum & 0x7f);
+    txBuf[i++] = (0x80 - (checkSum & 0x7f)) & 0x7f;
     txBuf[i++] = Midi::EOX;
     m_midi->putBytes(Midi::Device::FantomOut, txBuf, i);
 #if 0
@@ -53,28 +53,88 @@ void Driver::setParam(const uint32_t addr, const uint32_t length, const uint8_t
 #endif
 }
 
-/*! \brief Retrieve a parameter fom Fantom memory.
+/*! \brief Add a received byte to the reply.
+ *
+ * Bytes before the start of a SysEx message are ignored, and a new SysEx
+ * start discards a partial message.
+ *
+ * \param[in] byteRx    Received byte.
+ * \return True if the reply is complete.
+ */
+bool Reply::add(uint8_t byteRx)
+{
+    if (byteRx >= Midi::timingClock)
+        return false; // realtime bytes may show up anywhere, even within SysEx
+    if (byteRx == Midi::sysEx)
+        m_length = 0;
+    else if (m_length == 0)
+        return false;
+    m_buf[m_length++] = byteRx;
+    return byteRx == Midi::EOX || m_length >= MaxLength;
+}
+
+/*! \brief Check a complete reply against the request.
+ *
+ * The reply must be a DT1 message from a Fantom XR with the requested
+ * address and length, and a correct Roland checksum.
+ *
+ * \param[in] addr      Requested parameter address.
+ * \param[in] length    Requested number of bytes.
+ * \return True if the reply is valid.
+ */
+bool Reply::valid(uint32_t addr, uint32_t length) const
+{
+    if (m_length != HeaderLength + length + 2
+            || m_buf[0] != Midi::sysEx
+            || m_buf[1] != 0x41 // ID: Roland
+            || m_buf[2] != 0x10 // dev ID
+            || m_buf[3] != 0x00 // model fantom XR
+            || m_buf[4] != 0x6b // model fantom XR
+            || m_buf[5] != 0x12 // command ID = DT1
+            || m_buf[m_length-1] != Midi::EOX)
+        return false;
+    uint32_t addrRx = (uint32_t)m_buf[6] << 24 | (uint32_t)m_buf[7] << 16
+        | (uint32_t)m_buf[8] << 8 | (uint32_t)m_buf[9];
+    if (addrRx != addr)
+        return false;
+    // address, data and checksum add up to zero
+    uint32_t checkSum = 0;
+    for (uint32_t i=6; i<m_length-1; i++)
+        checkSum += m_buf[i];
+    return (checkSum & 0x7f) == 0;
+}
+
+/*! \brief Copy the payload of a complete reply.
+ *
+ * \param[in] length    Number of bytes to copy.
+ * \param[out] data     Byte string.
+ */
+void Reply::data(uint32_t length, uint8_t *data) const
+{
+    for (uint32_t i=0; i<length && HeaderLength+i+1 < m_length; i++)
+        data[i] = m_buf[HeaderLength+i];
+}
+
+/*! \brief Request a parameter from Fantom memory.
+ *
+ * The Fantom answers with a SysEx message, which should be collected
+ * in a \a Reply.
  *
  * \param[in] addr      Parameter address.
  * \param[in] length    Number of bytes to get.
- * \param[out] data     Byte string.
  */
-void Driver::getParam(const uint32_t addr, const uint32_t length, uint8_t *data)
+void Driver::requestParam(const uint32_t addr, const uint32_t length)
 {
-    const uint32_t rxHeaderLength = 10;
-    //wprintw(m_window, "Driver::getParam %08x %08x\n", addr, length);
     uint8_t txBuf[128];
-    uint8_t rxBuf[128]; // debug only
-    memset(rxBuf, 0, sizeof(rxBuf));
     uint32_t checkSum = 0;
     uint32_t i=0;
     txBuf[i++] = Midi::sysEx;
     txBuf[i++] = 0x41; // ID: Roland
-    uint32_t checkSumStart = i;
-    txBuf[i++] = 0x10; // dev ID, start of checksum
+    txBuf[i++] = 0x10; // dev ID
     txBuf[i++] = 0x00; // model fantom XR
     txBuf[i++] = 0x6b; // model fantom XR
     txBuf[i++] = 0x11; // command ID = RQ1
+    uint32_t checkSumStart = i; // the checksum covers the address and the size
     txBuf[i++] = (uint8_t)(0xff & addr >> 24);
     txBuf[i++] = (uint8_t)(0xff & addr >> 16);
     txBuf[i++] = (uint8_t)(0xff & addr >> 8);
@@ -82,38 +142,121 @@ void Driver::getParam(const uint32_t addr, const uint32_t length, uint8_t *data)
     txBuf[i++] = (uint8_t)(0xff & length >> 24);
     txBuf[i++] = (uint8_t)(0xff & length >> 16);
     txBuf[i++] = (uint8_t)(0xff & length >> 8);
-    uint32_t checkSumEnd = i;
     txBuf[i++] = (uint8_t)(0xff & length);
+    uint32_t checkSumEnd = i;
     checkSum = 0;
     if (i + length + 2 > sizeof(txBuf))
-        throw(Error("Driver::getParam: txBuf overflow"));
-    for (uint32_t j=checkSumStart; j<=checkSumEnd; j++)
+        throw(Error("Driver::requestParam: txBuf overflow"));
+    for (uint32_t j=checkSumStart; j<checkSumEnd; j++)
         checkSum += txBuf[j];
-    txBuf[i++] = 0x80 - (checkSum & 0x7f);
+    txBuf[i++] = (0x80 - (checkSum & 0x7f)) & 0x7f;
     txBuf[i++] = Midi::EOX;
     m_midi->putBytes(Midi::Device::FantomOut, txBuf, i);
-    uint8_t byteRx;
+    m_statistics.m_requests++;
+}
+
+/*! \brief Delay before retrying a failed read.
+ *
+ * The delay doubles with every retry, up to a limit.
+ *
+ * \param[in] retry     Retry number, starting at 1.
+ * \return    Delay in seconds.
+ */
+Real Driver::retryBackoff(int retry)
+{
+    Real delay = (Real)0.02;
+    for (int i=1; i<retry && delay < (Real)0.3; i++)
+        delay *= 2;
+    return delay;
+}
+
+/*! \brief Collect a reply from the Fantom, with a timeout.
+ *
+ * \param[out] reply    The reply.
+ * \return True if a complete reply was received in time.
+ */
+bool Driver::receiveReply(Reply &reply)
+{
+    reply.clear();
+    TimeSpec now, deadline;
+    getTime(now);
+    timeSum(deadline, now, TimeSpec(replyTimeout()));
     for (;;)
     {
-        byteRx = m_midi->getByte(Midi::Device::FantomIn);
-        if (byteRx == Midi::sysEx)
-            break;
-        throw(Error("Driver::getParam: unexpected response"));
+        Real remaining = timeDiffSeconds(now, deadline);
+        if (remaining <= 0)
+            return false;
+        if (m_midi->wait((int)(remaining*(Real)1e+6)+1, Midi::Device::FantomIn) == Midi::Device::none)
+            return false;
+        if (reply.add(m_midi->getByte(Midi::Device::FantomIn)))
+            return true;
+        getTime(now);
     }
-    rxBuf[0] = byteRx;
-    for (i=1;;i++)
+}
+
+/*! \brief Retrieve a parameter fom Fantom memory.
+ *
+ * A read that times out or gets an invalid reply is retried, with an
+ * increasing delay, for this address only.
+ *
+ * \param[in] addr      Parameter address.
+ * \param[in] length    Number of bytes to get.
+ * \param[out] data     Byte string.
+ */
+void Driver::getParam(const uint32_t addr, const uint32_t length, uint8_t *data)
+{
+    //wprintw(m_window, "Driver::getParam %08x %08x\n", addr, length);
+    Reply reply;
+    for (int retry=0;; retry++)
     {
-        byteRx = m_midi->getByte(Midi::Device::FantomIn);
-        rxBuf[i] = byteRx;
-        if (byteRx == Midi::EOX || i+1 >= (uint32_t)sizeof(rxBuf))
-            break;
-        if (i >= rxHeaderLength && i-rxHeaderLength < length)
+        if (retry > 0)
+        {
+            m_statistics.m_retries++;
+            TimeSpec backoff(retryBackoff(retry));
+            nanosleep(&backoff, NULL);
+        }
+        requestParam(addr, length);
+        if (!receiveReply(reply))
+        {
+            m_statistics.m_timeouts++;
+        }
+        else if (!reply.valid(addr, length))
         {
-            data[i-rxHeaderLength] = byteRx;
+            m_statistics.m_badReplies++;
+        }
+        else
+        {
+            reply.data(length, data);
+            return;
+        }
+        if (retry == MaxRetries)
+        {
+            m_statistics.m_failures++;
+            Error e;
+            e.stream() << "Driver::getParam: no valid reply for address 0x" << std::hex << addr;
+            throw(e);
         }
-        // \todo check Rx header check and checksum
     }
-    //wprintw(m_window, "received, length = %d\n", i);
+}
+
+/*! \brief Fill in a Part from its parameter block.
+ *
+ * \param[out] p        Pointer to a Part.
+ * \param[in] buf       Parameter block of \a PartParamsSize bytes.
+ */
+void Driver::decodePartParams(Part *p, const uint8_t *buf)
+{
+    p->m_channel = buf[0];
+    p->m_bankSelectMsb = buf[4];
+    p->m_bankSelectLsb = buf[5];
+    p->m_programChange = buf[6];
+    p->m_volume = buf[0x07];
+    p->m_transpose = buf[0x09] - 64;
+    p->m_octave = buf[0x15] - 64;
+    p->m_keyRangeLower = buf[0x17];
+    p->m_keyRangeUpper = buf[0x18];
+    p->m_fadeWidthLower = buf[0x19];
+    p->m_fadeWidthUpper = buf[0x1a];
 }
 
 /*! \brief Set the volume of a part.
@@ -123,7 +266,7 @@ void Driver::getParam(const uint32_t addr, const uint32_t length, uint8_t *data)
  */
 void Driver::setVolume(uint8_t part, uint8_t val)
 {
-    uint32_t addr = 0x10000000 + ((0x20+part)<<8) + 7;
+    uint32_t addr = partParamsAddress(part) + 7;
     setParam(addr, 1, &val);
 }
 
@@ -134,21 +277,9 @@ void Driver::setVolume(uint8_t part, uint8_t val)
  */
 void Driver::getPartParams(Part *p, int idx)
 {
-    const int partSize = 0x31;
-    uint8_t buf[partSize];
-    getParam(0x10000000 + ((0x20+idx)<<8), partSize, buf);
-    p->m_channel = buf[0];
-    p->m_bankSelectMsb = buf[4];
-    p->m_bankSelectLsb = buf[5];
-    p->m_programChange = buf[6];
-    p->m_volume = buf[0x07];
-    p->m_transpose = buf[0x09] - 64;
-//    wprintw(m_window, "transpose = %d\n", p->m_transpose);
-    p->m_octave = buf[0x15] - 64;
-    p->m_keyRangeLower = buf[0x17];
-    p->m_keyRangeUpper = buf[0x18];
-    p->m_fadeWidthLower = buf[0x19];
-    p->m_fadeWidthUpper = buf[0x1a];
+    uint8_t buf[PartParamsSize];
+    getParam(partParamsAddress(idx), PartParamsSize, buf);
+    decodePartParams(p, buf);
 }
 
 /*! \brief Retrieve a patch name from a Fantom Performance.
@@ -158,13 +289,9 @@ void Driver::getPartParams(Part *p, int idx)
  */
 void Driver::getPatchName(char *s, int idx)
 {
-    uint32_t offset = 0x20 * idx;
-    uint32_t offsetLo = offset & 0x7f;
-    uint32_t offsetHi = offset >> 7;
-    uint32_t addr = 0x11000000 + (offsetHi << 24) + (offsetLo << 16);
     uint8_t buf[NameLength+1];
     memset(buf, '*', sizeof(buf));
-    getParam(addr, NameLength, buf);
+    getParam(patchNameAddress(idx), NameLength, buf);
     memcpy(s, buf, NameLength);
     s[NameLength] = 0;
 }
@@ -177,7 +304,7 @@ void Driver::getPerformanceName(char *s)
 {
     uint8_t buf[NameLength+1];
     memset(buf, '*', sizeof(buf));
-    getParam(0x10000000, NameLength, buf);
+    getParam(PerformanceNameAddress, NameLength, buf);
     memcpy(s, buf, NameLength);
     s[NameLength] = 0;
 }
@@ -194,7 +321,7 @@ void Driver::setPerformanceName(const char *s)
     {
         buf[i] = s[i];
     }
-    setParam(0x10000000, NameLength, buf);
+    setParam(PerformanceNameAddress, NameLength, buf);
 }
 
 /*! \brief Set a Part name in the Fantom.
@@ -263,10 +390,13 @@ void Driver::download(WINDOW *win, Fantom::PerformanceList &performanceList, siz
         if (win)
         {
             mvwprintw(win, 4, 3, "Performance: '%s'", nameBuf);
+            mvwprintw(win, 6, 3, "Errors:      %d, retries %d",
+                (int)m_statistics.errors(), (int)m_statistics.m_retries);
             Screen::showProgressBar(win, 4, 32, ((Real)i)/nofPerformances);
             wrefresh(win);
         }
         strcpy(performance->m_name, nameBuf);
+        performance->m_loaded = 1;
         for (int j=0; j<Fantom::Performance::NofParts; j++)
         {
             Fantom::Part *hwPart = performance->m_partList+j;
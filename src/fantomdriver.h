@@ -15,14 +15,60 @@
 namespace Fantom
 {
 
+/*! \brief Collects a SysEx reply from the Fantom, one byte at a time.
+ */
+class Reply
+{
+    static const uint32_t HeaderLength = 10;    //!< Bytes before the payload: sysEx, IDs, command, address.
+    static const uint32_t MaxLength = 128;      //!< Size of the receive buffer.
+    uint8_t m_buf[MaxLength];                   //!< Receive buffer.
+    uint32_t m_length;                          //!< Number of bytes received.
+public:
+    //! \brief Discard anything received so far.
+    void clear() { m_length = 0; }
+    bool add(uint8_t byteRx);
+    bool valid(uint32_t addr, uint32_t length) const;
+    void data(uint32_t length, uint8_t *data) const;
+    //! \brief Construct an empty Reply.
+    Reply(): m_length(0) { }
+};
+
+/*! \brief Error counters of the SysEx traffic with the Fantom, for the current session.
+ */
+struct Statistics
+{
+    uint32_t m_requests;    //!< Parameter requests sent, including retries.
+    uint32_t m_retries;     //!< Requests sent again after a failure.
+    uint32_t m_timeouts;    //!< Requests without a reply in time.
+    uint32_t m_badReplies;  //!< Replies with a bad header, address echo or checksum.
+    uint32_t m_failures;    //!< Reads that still failed after all retries.
+    //! \brief Total number of failed requests.
+    uint32_t errors() const { return m_timeouts + m_badReplies; }
+    //! \brief Construct zeroed counters.
+    Statistics(): m_requests(0), m_retries(0), m_timeouts(0), m_badReplies(0), m_failures(0) { }
+};
+
 /*! \brief Upload and download parameters from and to the Fantom.
  */
 class Driver
 {
     Midi::Driver *m_midi;       //!< A MIDI driver object.
+    Statistics m_statistics;    //!< Error counters.
     void setParam(const uint32_t addr, const uint32_t length, const uint8_t *data);
     void getParam(const uint32_t addr, const uint32_t length, uint8_t *data);
+    bool receiveReply(Reply &reply);
 public:
+    static const uint32_t PerformanceNameAddress = 0x10000000;  //!< Address of the name of the current performance.
+    static const uint32_t PartParamsSize = 0x31;                //!< Size of the parameter block of a part.
+    static const int MaxRetries = 4;                            //!< Number of times a failed read is retried.
+    static Real replyTimeout() { return (Real)0.5; }            //!< Time to wait for a reply in seconds.
+    static Real retryBackoff(int retry);
+    static uint32_t partParamsAddress(int idx);
+    static uint32_t patchNameAddress(int idx);
+    static void decodePartParams(Part *p, const uint8_t *buf);
+    void requestParam(const uint32_t addr, const uint32_t length);
+    //! \brief Error counters of this session.
+    Statistics &statistics() { return m_statistics; }
     /* \brief Constructor
      *
      * Constructs an empty Driver object.
@@ -40,6 +86,26 @@ public:
     void download(WINDOW *win, Fantom::PerformanceList &performanceList, size_t nofPerformances);
 };
 
+/*! \brief Address of the parameter block of a part.
+ *
+ * \param[in] idx       Part index within Performance.
+ */
+inline uint32_t Driver::partParamsAddress(int idx)
+{
+    return PerformanceNameAddress + ((0x20+idx)<<8);
+}
+
+/*! \brief Address of the patch name of a part.
+ *
+ * \param[in] idx       Part index within Performance.
+ */
+inline uint32_t Driver::patchNameAddress(int idx)
+{
+    uint32_t offset = 0x20 * idx;
+    uint32_t offsetLo = offset & 0x7f;
+    uint32_t offsetHi = offset >> 7;
+    return 0x11000000 + (offsetHi << 24) + (offsetLo << 16);
+}
 
 } // Fantom namespace
 #endif // FANTOM_DRIVER_H
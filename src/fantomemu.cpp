@@ -0,0 +1,632 @@
+/*! \file fantomemu.cpp
+ *  \brief Stands in for the Fantom XR on named pipes, for tests without the synth.
+ *
+ *  The emulator holds the temporary performance of the Fantom: the
+ *  common block with the performance name, the parameter blocks of the
+ *  16 parts and the names of their patches, at the addresses that
+ *  \a Fantom::Driver uses. Other addresses are not modelled, a request
+ *  for those goes unanswered, like on the synth.
+ *
+ *  It answers RQ1 with checksummed DT1 replies, applies DT1 writes, and
+ *  loads a stored performance on a program change on the control channel,
+ *  which takes a while, during which input waits. The stored performances
+ *  come from an XML performance cache, the rest are initial performances.
+ *  Both directions run at the speed of a MIDI link.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include "fantomdef.h"
+#include "fantomdriver.h"
+#include "mididef.h"
+#include "xml.h"
+#include "error.h"
+
+namespace
+{
+
+const uint8_t rolandId = 0x41;          //!< Manufacturer ID.
+const uint8_t deviceId = 0x10;          //!< Device ID of the Fantom.
+const uint8_t modelId[2] = { 0x00, 0x6b };  //!< Model ID of the Fantom XR.
+const uint8_t rq1 = 0x11;               //!< Command ID of a data request.
+const uint8_t dt1 = 0x12;               //!< Command ID of data.
+const uint32_t commonSize = 0x40;       //!< Size of the common block of a performance.
+const uint32_t patchCommonSize = 0x40;  //!< Size of the common block of a patch.
+const uint32_t maxPacket = 128;         //!< Data bytes per DT1 reply, longer replies are split.
+const int nofPerformances = 128;        //!< Performances that can be selected.
+
+volatile sig_atomic_t g_stop = 0;       //!< Set by a signal, ends the emulator.
+
+//! \brief Signal handler, ends the emulator.
+void stop(int)
+{
+    g_stop = 1;
+}
+
+//! \brief CLOCK_MONOTONIC in nanoseconds.
+uint64_t now()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+//! \brief Map a Roland address, 4 bytes of 7 bits, to a linear address.
+uint32_t linear(uint32_t addr)
+{
+    return (addr >> 24 & 0x7f) << 21 | (addr >> 16 & 0x7f) << 14 | (addr >> 8 & 0x7f) << 7 | (addr & 0x7f);
+}
+
+//! \brief Map a linear address to a Roland address.
+uint32_t roland(uint32_t addr)
+{
+    return (addr >> 21 & 0x7f) << 24 | (addr >> 14 & 0x7f) << 16 | (addr >> 7 & 0x7f) << 8 | (addr & 0x7f);
+}
+
+//! \brief Counters of the emulator.
+struct Statistics
+{
+    uint32_t m_requests;        //!< RQ1 messages received.
+    uint32_t m_unanswered;      //!< RQ1 messages for addresses that are not modelled.
+    uint32_t m_replyBytes;      //!< Bytes of DT1 replies sent.
+    uint32_t m_writes;          //!< DT1 messages applied.
+    uint32_t m_ignoredWrites;   //!< DT1 messages for addresses that are not modelled.
+    uint32_t m_loads;           //!< Performances loaded.
+    uint32_t m_badMessages;     //!< SysEx messages with a bad header, length or checksum.
+    uint64_t m_firstRequest;    //!< Time of the first request, 0 if none.
+    uint64_t m_lastReply;       //!< Time the last reply byte left the link.
+    //! \brief Construct zeroed counters.
+    Statistics(): m_requests(0), m_unanswered(0), m_replyBytes(0), m_writes(0), m_ignoredWrites(0),
+        m_loads(0), m_badMessages(0), m_firstRequest(0), m_lastReply(0) { }
+};
+
+/*! \brief Emulates the SysEx address space and performance switching of the Fantom XR.
+ */
+class Emulator
+{
+    //! \brief A modelled range of the address space.
+    struct Block
+    {
+        uint32_t m_start;               //!< Linear start address.
+        std::vector<uint8_t> m_data;    //!< Contents.
+    };
+    std::vector<Block> m_memory;                //!< The temporary performance.
+    Fantom::PerformanceList m_performances;     //!< Stored performances, by program number.
+    int m_inFd;                 //!< Pipe the core writes to the Fantom.
+    int m_outFd;                //!< Pipe the core reads from the Fantom.
+    uint64_t m_byteNs;          //!< Time a byte takes on the link, 0 for no throttling.
+    uint64_t m_loadNs;          //!< Time it takes to load a performance.
+    bool m_verbose;             //!< Log every message.
+    std::deque<uint8_t> m_input;        //!< Bytes received, not processed yet.
+    std::deque<uint64_t> m_inputTime;   //!< When every byte in \a m_input has arrived over the link.
+    uint64_t m_inputLink;       //!< When the last byte read has arrived over the link.
+    std::deque<uint8_t> m_output;       //!< Bytes to send.
+    uint64_t m_outputLink;      //!< When the last byte written has left the link.
+    uint64_t m_loadEnd;         //!< End of the current performance load, 0 if not loading.
+    uint8_t m_status;           //!< Running status of the input.
+    std::vector<uint8_t> m_message;     //!< Message being received, without the status byte.
+    uint8_t m_bank[2];          //!< Bank select MSB and LSB of the control channel.
+    Statistics m_statistics;    //!< Counters.
+    Emulator(const Emulator &);             //!< Not copyable.
+    Emulator &operator=(const Emulator &);  //!< Not assignable.
+    void addBlock(uint32_t addr, uint32_t size);
+    uint8_t *find(uint32_t addr, uint32_t length);
+    void write(uint32_t addr, const uint8_t *data, uint32_t length);
+    void load(int idx);
+    void receive(uint8_t byteRx);
+    void message();
+    void sysEx();
+    void reply(uint32_t addr, uint32_t length);
+    void readInput(uint64_t t);
+    void writeOutput(uint64_t t);
+public:
+    Emulator(const Fantom::PerformanceList &stored, int inFd, int outFd,
+        uint64_t byteNs, uint64_t loadNs, bool verbose);
+    ~Emulator();
+    void run();
+    //! \brief The counters.
+    const Statistics &statistics() const { return m_statistics; }
+};
+
+/*! \brief Construct an emulator with the first performance loaded.
+ *
+ * \param[in] stored    Stored performances, copied, missing ones are initial performances.
+ * \param[in] inFd      Pipe the core writes to the Fantom.
+ * \param[in] outFd     Pipe the core reads from the Fantom.
+ * \param[in] byteNs    Time a byte takes on the link, 0 for no throttling.
+ * \param[in] loadNs    Time it takes to load a performance.
+ * \param[in] verbose   Log every message.
+ */
+Emulator::Emulator(const Fantom::PerformanceList &stored, int inFd, int outFd,
+        uint64_t byteNs, uint64_t loadNs, bool verbose):
+    m_inFd(inFd), m_outFd(outFd), m_byteNs(byteNs), m_loadNs(loadNs), m_verbose(verbose),
+    m_inputLink(0), m_outputLink(0), m_loadEnd(0), m_status(0)
+{
+    m_bank[0] = 0;
+    m_bank[1] = 0;
+    addBlock(Fantom::Driver::PerformanceNameAddress, commonSize);
+    for (int i=0; i<Fantom::Performance::NofParts; i++)
+    {
+        addBlock(Fantom::Driver::partParamsAddress(i), Fantom::Driver::PartParamsSize);
+        addBlock(Fantom::Driver::patchNameAddress(i), patchCommonSize);
+    }
+    for (int i=0; i<nofPerformances; i++)
+    {
+        Fantom::Performance *performance = new Fantom::Performance;
+        if ((size_t)i < stored.size() && stored[i]->m_loaded)
+        {
+            *performance = *stored[i];
+        }
+        else
+        {
+            memcpy(performance->m_name, "INIT PERFORM", Fantom::NameLength);
+            for (int j=0; j<Fantom::Performance::NofParts; j++)
+            {
+                Fantom::Part &part = performance->m_partList[j];
+                part.m_channel = j;
+                part.m_bankSelectMsb = 87;
+                part.m_bankSelectLsb = 64;
+                part.m_programChange = 0;
+                part.m_volume = 100;
+                part.m_transpose = 0;
+                part.m_octave = 0;
+                part.m_keyRangeLower = 0;
+                part.m_keyRangeUpper = 127;
+                part.m_fadeWidthLower = 0;
+                part.m_fadeWidthUpper = 0;
+                memcpy(part.m_patch.m_name, "INIT PATCH  ", Fantom::NameLength);
+            }
+        }
+        m_performances.push_back(performance);
+    }
+    load(0);
+}
+
+//! \brief Destructor.
+Emulator::~Emulator()
+{
+    for (size_t i=0; i<m_performances.size(); i++)
+        delete m_performances[i];
+}
+
+/*! \brief Model a range of the address space.
+ *
+ * \param[in] addr      Roland start address.
+ * \param[in] size      Number of bytes.
+ */
+void Emulator::addBlock(uint32_t addr, uint32_t size)
+{
+    Block block;
+    block.m_start = linear(addr);
+    block.m_data.resize(size, 0);
+    m_memory.push_back(block);
+}
+
+/*! \brief Find the memory of an address range.
+ *
+ * \param[in] addr      Roland start address.
+ * \param[in] length    Number of bytes.
+ * \return    The memory, 0 if the range is not within a single block.
+ */
+uint8_t *Emulator::find(uint32_t addr, uint32_t length)
+{
+    uint32_t start = linear(addr);
+    for (size_t i=0; i<m_memory.size(); i++)
+    {
+        Block &block = m_memory[i];
+        if (start >= block.m_start && start + length <= block.m_start + block.m_data.size())
+            return &block.m_data[start - block.m_start];
+    }
+    return 0;
+}
+
+/*! \brief Write to the address space, as a DT1 message would.
+ *
+ * \param[in] addr      Roland start address.
+ * \param[in] data      Bytes.
+ * \param[in] length    Number of bytes.
+ */
+void Emulator::write(uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    uint8_t *p = find(addr, length);
+    if (!p)
+    {
+        m_statistics.m_ignoredWrites++;
+        if (m_verbose)
+            printf("DT1 %08x %u bytes, not modelled\n", addr, length);
+        return;
+    }
+    memcpy(p, data, length);
+    m_statistics.m_writes++;
+    if (m_verbose)
+        printf("DT1 %08x %u bytes\n", addr, length);
+}
+
+/*! \brief Copy a stored performance into the temporary performance.
+ *
+ * The parameter block is the inverse of \a Fantom::Driver::decodePartParams().
+ *
+ * \param[in] idx       Program number.
+ */
+void Emulator::load(int idx)
+{
+    const Fantom::Performance *performance = m_performances[idx];
+    uint8_t *name = find(Fantom::Driver::PerformanceNameAddress, Fantom::NameLength);
+    memcpy(name, performance->m_name, Fantom::NameLength);
+    for (int i=0; i<Fantom::Performance::NofParts; i++)
+    {
+        const Fantom::Part &part = performance->m_partList[i];
+        uint8_t *buf = find(Fantom::Driver::partParamsAddress(i), Fantom::Driver::PartParamsSize);
+        memset(buf, 0, Fantom::Driver::PartParamsSize);
+        buf[0] = part.m_channel & 0x0f;
+        buf[4] = part.m_bankSelectMsb & 0x7f;
+        buf[5] = part.m_bankSelectLsb & 0x7f;
+        buf[6] = part.m_programChange & 0x7f;
+        buf[0x07] = part.m_volume & 0x7f;
+        buf[0x09] = (part.m_transpose + 64) & 0x7f;
+        buf[0x15] = (part.m_octave + 64) & 0x7f;
+        buf[0x17] = part.m_keyRangeLower & 0x7f;
+        buf[0x18] = part.m_keyRangeUpper & 0x7f;
+        buf[0x19] = part.m_fadeWidthLower & 0x7f;
+        buf[0x1a] = part.m_fadeWidthUpper & 0x7f;
+        memcpy(find(Fantom::Driver::patchNameAddress(i), Fantom::NameLength),
+            part.m_patch.m_name, Fantom::NameLength);
+    }
+}
+
+/*! \brief Send the contents of an address range, in DT1 packets.
+ *
+ * \param[in] addr      Roland start address.
+ * \param[in] length    Number of bytes.
+ */
+void Emulator::reply(uint32_t addr, uint32_t length)
+{
+    const uint8_t *data = find(addr, length);
+    if (!data || length == 0)
+    {
+        m_statistics.m_unanswered++;
+        if (m_verbose)
+            printf("RQ1 %08x %u bytes, not modelled\n", addr, length);
+        return;
+    }
+    if (m_verbose)
+        printf("RQ1 %08x %u bytes\n", addr, length);
+    for (uint32_t offset=0; offset<length; offset+=maxPacket)
+    {
+        uint32_t packetAddr = roland(linear(addr) + offset);
+        uint32_t packetLength = std::min(maxPacket, length - offset);
+        uint8_t header[] = { Midi::sysEx, rolandId, deviceId, modelId[0], modelId[1], dt1,
+            (uint8_t)(packetAddr >> 24), (uint8_t)(packetAddr >> 16),
+            (uint8_t)(packetAddr >> 8), (uint8_t)packetAddr };
+        m_output.insert(m_output.end(), header, header + sizeof(header));
+        m_output.insert(m_output.end(), data + offset, data + offset + packetLength);
+        // address, data and checksum add up to zero
+        uint32_t checkSum = 0;
+        for (int i=6; i<10; i++)
+            checkSum += header[i];
+        for (uint32_t i=0; i<packetLength; i++)
+            checkSum += data[offset + i];
+        m_output.push_back((0x80 - (checkSum & 0x7f)) & 0x7f);
+        m_output.push_back(Midi::EOX);
+        m_statistics.m_replyBytes += sizeof(header) + packetLength + 2;
+    }
+}
+
+//! \brief Handle a complete SysEx message in \a m_message, without its start and end.
+void Emulator::sysEx()
+{
+    const std::vector<uint8_t> &m = m_message;
+    if (m.size() < 10 || m[0] != rolandId || m[1] != deviceId || m[2] != modelId[0] || m[3] != modelId[1]
+        || (m[4] != rq1 && m[4] != dt1) || (m[4] == rq1 && m.size() != 14))
+    {
+        m_statistics.m_badMessages++;
+        if (m_verbose)
+            printf("SysEx of %u bytes ignored\n", (unsigned)m.size());
+        return;
+    }
+    uint32_t checkSum = 0;
+    for (size_t i=5; i<m.size(); i++)
+        checkSum += m[i];
+    if ((checkSum & 0x7f) != 0)
+    {
+        m_statistics.m_badMessages++;
+        if (m_verbose)
+            printf("SysEx with a bad checksum ignored\n");
+        return;
+    }
+    uint32_t addr = (uint32_t)m[5] << 24 | (uint32_t)m[6] << 16 | (uint32_t)m[7] << 8 | m[8];
+    if (m[4] == dt1)
+    {
+        write(addr, &m[9], m.size() - 10);
+        return;
+    }
+    if (m_statistics.m_firstRequest == 0)
+        m_statistics.m_firstRequest = now();
+    m_statistics.m_requests++;
+    // the size has 7 bits per byte, like the address
+    uint32_t size = linear((uint32_t)m[9] << 24 | (uint32_t)m[10] << 16 | (uint32_t)m[11] << 8 | m[12]);
+    reply(addr, size);
+}
+
+//! \brief Handle a complete channel message in \a m_status and \a m_message.
+void Emulator::message()
+{
+    if ((m_status & 0x0f) != Fantom::programChangeChannel)
+        return;
+    if (Midi::status(m_status) == Midi::controller && (m_message[0] == 0x00 || m_message[0] == 0x20))
+    {
+        m_bank[m_message[0] == 0x00 ? 0 : 1] = m_message[1];
+    }
+    else if (Midi::status(m_status) == Midi::programChange)
+    {
+        // edits of the temporary performance are lost
+        load(m_message[0]);
+        m_statistics.m_loads++;
+        m_loadEnd = now() + m_loadNs;
+        if (m_verbose)
+            printf("loading performance %d of bank %d-%d '%s'\n", m_message[0] + 1, m_bank[0], m_bank[1],
+                m_performances[m_message[0]]->m_name);
+    }
+}
+
+/*! \brief Add a received byte to the current message.
+ *
+ * \param[in] byteRx    The byte.
+ */
+void Emulator::receive(uint8_t byteRx)
+{
+    if (byteRx >= Midi::timingClock)
+        return;
+    if (byteRx == Midi::EOX)
+    {
+        if (m_status == Midi::sysEx)
+            sysEx();
+        m_status = 0;
+        return;
+    }
+    if (byteRx & 0x80)
+    {
+        if (m_status == Midi::sysEx)
+            m_statistics.m_badMessages++; // an unterminated SysEx
+        m_status = byteRx >= Midi::sysEx ? (byteRx == Midi::sysEx ? byteRx : 0) : byteRx;
+        m_message.clear();
+        return;
+    }
+    if (m_status == 0)
+        return;
+    m_message.push_back(byteRx);
+    if (m_status == Midi::sysEx)
+        return;
+    uint8_t status = Midi::status(m_status);
+    size_t length = status == Midi::programChange || status == Midi::channelAftertouch ? 1 : 2;
+    if (m_message.size() == length)
+    {
+        message();
+        m_message.clear(); // running status
+    }
+}
+
+/*! \brief Read what the core has written, and time its arrival over the link.
+ *
+ * \param[in] t     Now.
+ */
+void Emulator::readInput(uint64_t t)
+{
+    uint8_t buf[256];
+    ssize_t len = ::read(m_inFd, buf, sizeof(buf));
+    if (len == -1 && errno != EAGAIN && errno != EINTR)
+        throw(Error("read", errno));
+    for (ssize_t i=0; i<len; i++)
+    {
+        // an idle link starts on the first byte now
+        m_inputLink = std::max(m_inputLink, t) + m_byteNs;
+        m_input.push_back(buf[i]);
+        m_inputTime.push_back(m_inputLink);
+    }
+}
+
+/*! \brief Write what the link can take by now.
+ *
+ * \param[in] t     Now.
+ */
+void Emulator::writeOutput(uint64_t t)
+{
+    if (m_output.empty())
+        return;
+    if (m_outputLink + m_byteNs < t)
+        m_outputLink = t - m_byteNs;
+    size_t n = m_byteNs ? std::min(m_output.size(), (size_t)((t - m_outputLink) / m_byteNs)) : m_output.size();
+    if (n == 0)
+        return;
+    uint8_t buf[256];
+    n = std::min(n, sizeof(buf));
+    std::copy(m_output.begin(), m_output.begin() + n, buf);
+    ssize_t len = ::write(m_outFd, buf, n);
+    if (len == -1)
+    {
+        // the core does not read, the link stalls
+        if (errno != EAGAIN && errno != EINTR)
+            throw(Error("write", errno));
+        return;
+    }
+    m_output.erase(m_output.begin(), m_output.begin() + len);
+    m_outputLink += len * m_byteNs;
+    m_statistics.m_lastReply = std::max(m_outputLink, t);
+}
+
+//! \brief Serve the core until a signal arrives.
+void Emulator::run()
+{
+    while (!g_stop)
+    {
+        uint64_t t = now();
+        if (m_loadEnd && t >= m_loadEnd)
+            m_loadEnd = 0;
+        // a performance load holds up the input
+        while (!m_loadEnd && !m_input.empty() && m_inputTime.front() <= t)
+        {
+            uint8_t byteRx = m_input.front();
+            m_input.pop_front();
+            m_inputTime.pop_front();
+            receive(byteRx);
+        }
+        writeOutput(t);
+        uint64_t due = t + 100000000u;
+        if (m_loadEnd)
+            due = std::min(due, m_loadEnd);
+        else if (!m_input.empty())
+            due = std::min(due, m_inputTime.front());
+        if (!m_output.empty())
+            due = std::min(due, m_outputLink + m_byteNs);
+        pollfd fds[2];
+        fds[0].fd = m_inFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = m_outFd;
+        fds[1].events = m_output.empty() ? 0 : POLLOUT;
+        timespec timeout = { 0, 0 };
+        if (due > t)
+        {
+            timeout.tv_sec = (due - t) / 1000000000u;
+            timeout.tv_nsec = (due - t) % 1000000000u;
+        }
+        if (ppoll(fds, 2, &timeout, 0) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw(Error("ppoll", errno));
+        }
+        if (fds[0].revents & POLLIN)
+            readInput(now());
+        if (m_verbose)
+            fflush(stdout);
+    }
+}
+
+/*! \brief Open a named pipe, create it if it does not exist.
+ *
+ * It is opened for reading and writing, so the open does not block, and
+ * there is no end of file when the core exits.
+ *
+ * \param[in] path      The pipe.
+ * \return    File descriptor.
+ */
+int openFifo(const std::string &path)
+{
+    if (mkfifo(path.c_str(), S_IRUSR|S_IWUSR) == -1 && errno != EEXIST)
+    {
+        Error e;
+        e.stream() << "cannot create " << path << ": " << strerror(errno);
+        throw(e);
+    }
+    int fd = open(path.c_str(), O_RDWR|O_NONBLOCK);
+    if (fd == -1)
+    {
+        Error e;
+        e.stream() << "cannot open " << path << ": " << strerror(errno);
+        throw(e);
+    }
+    return fd;
+}
+
+}
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    const char *fifoDir = 0;
+    const char *cacheFile = FANTOM_CACHE_XML;
+    int baud = 31250;
+    double loadSeconds = 0.05;
+    bool verbose = false;
+    for (;;)
+    {
+        int opt = getopt(argc, argv, "f:c:b:l:vh");
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'f':
+                fifoDir = optarg;
+                break;
+            case 'c':
+                cacheFile = optarg;
+                break;
+            case 'b':
+                baud = atoi(optarg);
+                break;
+            case 'l':
+                loadSeconds = atof(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "\npatcher_fantom [-h|?] -f <dir> [-c <cache>] [-b <baud>] [-l <seconds>] [-v]\n\n"
+                    "  -h|?     This message\n"
+                    "  -f dir   Directory with the named pipes of the core, see its -f option\n"
+                    "  -c       XML performance cache to load the performances from, default " FANTOM_CACHE_XML "\n"
+                    "           without a cache, all performances are initial performances\n"
+                    "  -b       Speed of the MIDI link, default 31250, 0 for as fast as possible\n"
+                    "  -l       Time it takes to load a performance, default 0.05\n"
+                    "  -v       Log every message\n\n"
+                    "It runs until interrupted, and then prints its counters.\n\n");
+                return 1;
+                break;
+        }
+    }
+    if (!fifoDir || argc > optind || baud < 0 || loadSeconds < 0)
+    {
+        fprintf(stderr, "bad arguments, try -h\n");
+        return 1;
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    try
+    {
+        Fantom::PerformanceList stored;
+        if (access(cacheFile, R_OK) == 0)
+        {
+            XML xml;
+            xml.importPerformances(cacheFile, stored);
+            printf("%u performances from %s\n", (unsigned)stored.size(), cacheFile);
+        }
+        int inFd = openFifo(std::string(fifoDir) + "/" + Midi::fifoName(Midi::Device::FantomOut));
+        int outFd = openFifo(std::string(fifoDir) + "/" + Midi::fifoName(Midi::Device::FantomIn));
+        Emulator emulator(stored, inFd, outFd, baud ? (uint64_t)10 * 1000000000u / baud : 0,
+            (uint64_t)(loadSeconds * 1e9), verbose);
+        for (size_t i=0; i<stored.size(); i++)
+            delete stored[i];
+        fflush(stdout);
+        emulator.run();
+        const Statistics &s = emulator.statistics();
+        double seconds = s.m_firstRequest && s.m_lastReply > s.m_firstRequest
+            ? (s.m_lastReply - s.m_firstRequest) * 1e-9 : 0;
+        printf("\nrequests      %u, %u not modelled\n", s.m_requests, s.m_unanswered);
+        printf("replies       %u bytes", s.m_replyBytes);
+        if (seconds > 0)
+            printf(", %.0f requests/s over %.2f s", (s.m_requests - s.m_unanswered) / seconds, seconds);
+        printf("\nwrites        %u, %u not modelled\n", s.m_writes, s.m_ignoredWrites);
+        printf("loads         %u\n", s.m_loads);
+        printf("bad messages  %u\n", s.m_badMessages);
+        close(inFd);
+        close(outFd);
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        return e.exitCode();
+    }
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*! \file fantomprobe.cpp
+ *  \brief Contains an object that measures the round trip to the Fantom while the player is idle.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <algorithm>
+#include "fantomprobe.h"
+
+namespace Fantom
+{
+
+namespace
+{
+const Real idleGap = (Real)1.0;     //!< Time without live input before a probe is sent.
+}
+
+/*! \brief Constructor, probing is off.
+ *
+ * \param[in] fantom    Fantom driver used to send requests.
+ */
+Prober::Prober(Driver *fantom):
+    m_fantom(fantom),
+    m_period(0),
+    m_waiting(false),
+    m_nofRoundTrips(0),
+    m_nofLost(0)
+{
+}
+
+/*! \brief Start probing.
+ *
+ * \param[in] period    Minimum time between probes in seconds.
+ * \param[in] now       Current time, counts as live input.
+ */
+void Prober::start(Real period, const TimeSpec &now)
+{
+    m_period = period;
+    m_sent = now;
+    m_lastLiveInput = now;
+}
+
+//! \brief When the next probe may be sent, if no live input arrives meanwhile.
+TimeSpec Prober::nextProbe() const
+{
+    TimeSpec period, idle;
+    timeSum(period, m_sent, TimeSpec(m_period));
+    timeSum(idle, m_lastLiveInput, TimeSpec(idleGap));
+    return timeGreaterThanOrEqual(period, idle) ? period : idle;
+}
+
+/*! \brief Add a byte received from the Fantom to the reply.
+ *
+ * \param[in] byteRx    Received byte.
+ * \param[in] now       Arrival time of the byte.
+ * \return    True if a probe was completed, answered or not.
+ */
+bool Prober::receive(uint8_t byteRx, const TimeSpec &now)
+{
+    if (!m_waiting || !m_reply.add(byteRx))
+        return false;
+    m_waiting = false;
+    if (!m_reply.valid(Driver::PerformanceNameAddress, NameLength))
+    {
+        m_nofLost++;
+        return true;
+    }
+    Real dt = timeDiffSeconds(m_sent, now);
+    m_roundTrip[m_nofRoundTrips % Window] = dt > 0 ? (uint32_t)(dt*(Real)1e+6) : 0;
+    m_nofRoundTrips++;
+    return true;
+}
+
+/*! \brief Send a probe when it is due, and give up on a late reply.
+ *
+ * This must be called from the event loop after every wakeup.
+ *
+ * \param[in] now       Current time.
+ * \param[in] busy      True if the replies of the Fantom are used by others.
+ * \return    True if a probe was lost.
+ */
+bool Prober::poll(const TimeSpec &now, bool busy)
+{
+    if (!enabled())
+        return false;
+    if (m_waiting)
+    {
+        TimeSpec deadline;
+        timeSum(deadline, m_sent, TimeSpec(Driver::replyTimeout()));
+        if (!timeGreaterThanOrEqual(now, deadline))
+            return false;
+        m_waiting = false;
+        m_nofLost++;
+        return true;
+    }
+    if (busy || !timeGreaterThanOrEqual(now, nextProbe()))
+        return false;
+    m_reply.clear();
+    getTime(m_sent);
+    m_fantom->requestParam(Driver::PerformanceNameAddress, NameLength);
+    m_waiting = true;
+    return false;
+}
+
+/*! \brief Time until \a poll() must be called again.
+ *
+ * \param[in] now       Current time.
+ * \param[in] busy      True if the replies of the Fantom are used by others.
+ * \return    Timeout in usec for Midi::Driver::wait(), 0 to wait for input only.
+ */
+int Prober::usecTimeout(const TimeSpec &now, bool busy) const
+{
+    TimeSpec then;
+    if (m_waiting)
+        timeSum(then, m_sent, TimeSpec(Driver::replyTimeout()));
+    else if (enabled() && !busy)
+        then = nextProbe();
+    else
+        return 0;
+    Real dt = timeDiffSeconds(now, then);
+    return dt > (Real)0.001 ? (int)(dt*(Real)1e+6) : 1000;
+}
+
+/*! \brief Statistics of the latest \a Window round trips.
+ *
+ * \param[out] min      Shortest round trip in usec, 0 if none.
+ * \param[out] mean     Mean round trip in usec, 0 if none.
+ * \param[out] max      Longest round trip in usec, 0 if none.
+ */
+void Prober::summary(uint32_t &min, uint32_t &mean, uint32_t &max) const
+{
+    uint32_t n = std::min(m_nofRoundTrips, (uint32_t)Window);
+    uint64_t sum = 0;
+    min = n ? m_roundTrip[0] : 0;
+    max = 0;
+    for (uint32_t i=0; i<n; i++)
+    {
+        min = std::min(min, m_roundTrip[i]);
+        max = std::max(max, m_roundTrip[i]);
+        sum += m_roundTrip[i];
+    }
+    mean = n ? (uint32_t)(sum / n) : 0;
+}
+
+} // namespace Fantom
@@ -0,0 +1,63 @@
+/*! \file fantomprobe.h
+ *  \brief Contains an object that measures the round trip to the Fantom while the player is idle.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef FANTOM_PROBE_H
+#define FANTOM_PROBE_H
+#include <stdint.h>
+#include "fantomdriver.h"
+#include "timestamp.h"
+
+//! \brief Namespace for Fantom driver objects.
+namespace Fantom
+{
+
+/*! \brief Measures the round trip to the Fantom while the player is idle.
+ *
+ * A probe is a request for the name of the current performance, which
+ * changes nothing in the Fantom. It is only sent after a period without
+ * live input, and never while \a Synchroniser is downloading, since that
+ * reads the same replies. The round trip runs from the request to the
+ * arrival of the last byte of the reply, so it covers the interface, the
+ * kernel, both MIDI links and the Fantom itself. The requests and the
+ * replies alone take about 13 ms on the links.
+ */
+class Prober
+{
+public:
+    static const int Window = 32;   //!< Number of round trips in the rolling statistics.
+private:
+    Driver *m_fantom;               //!< Fantom driver.
+    Real m_period;                  //!< Minimum time between probes, 0 if probing is off.
+    bool m_waiting;                 //!< True if a reply is outstanding.
+    TimeSpec m_sent;                //!< When the latest probe was sent.
+    TimeSpec m_lastLiveInput;       //!< Arrival time of the latest live input.
+    Reply m_reply;                  //!< Reply being received.
+    uint32_t m_roundTrip[Window];   //!< Latest round trips in usec, a ring buffer.
+    uint32_t m_nofRoundTrips;       //!< Probes answered.
+    uint32_t m_nofLost;             //!< Probes without a valid reply in time.
+    TimeSpec nextProbe() const;
+public:
+    Prober(Driver *fantom);
+    void start(Real period, const TimeSpec &now);
+    //! \brief True if probing is on.
+    bool enabled() const { return m_period > 0; }
+    //! \brief True if a reply is outstanding.
+    bool waiting() const { return m_waiting; }
+    bool receive(uint8_t byteRx, const TimeSpec &now);
+    bool poll(const TimeSpec &now, bool busy);
+    int usecTimeout(const TimeSpec &now, bool busy) const;
+    //! \brief Report live input from the player.
+    void liveInput(const TimeSpec &now) { m_lastLiveInput = now; }
+    //! \brief Probes answered.
+    uint32_t nofRoundTrips() const { return m_nofRoundTrips; }
+    //! \brief Probes without a valid reply in time.
+    uint32_t nofLost() const { return m_nofLost; }
+    //! \brief The latest round trip in usec, 0 if none.
+    uint32_t last() const { return m_nofRoundTrips ? m_roundTrip[(m_nofRoundTrips - 1) % Window] : 0; }
+    void summary(uint32_t &min, uint32_t &mean, uint32_t &max) const;
+};
+
+} // Fantom namespace
+#endif // FANTOM_PROBE_H
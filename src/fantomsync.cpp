@@ -0,0 +1,328 @@
+/*! \file fantomsync.cpp
+ *  \brief Contains an object that downloads Fantom performance data in the background.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <string.h>
+#include <algorithm>
+#include "fantomsync.h"
+
+namespace Fantom
+{
+
+namespace
+{
+const Real idlePeriod = (Real)5.0;      //!< Time without live input before another performance is selected.
+}
+
+/*! \brief Constructor.
+ *
+ * \param[in] fantom    Fantom driver used to send requests.
+ */
+Synchroniser::Synchroniser(Driver *fantom):
+    m_fantom(fantom),
+    m_target(-1),
+    m_foreign(false),
+    m_step(Done),
+    m_part(0),
+    m_waiting(false),
+    m_failed(false),
+    m_backoff(false),
+    m_retry(0),
+    m_nofSynced(0),
+    m_total(0),
+    m_nofFailed(0)
+{
+}
+
+/*! \brief Start downloading a list of performances.
+ *
+ * \param[in] order     Performance indexes in the order they should be read.
+ * \param[in] now       Current time, counts as live input.
+ */
+void Synchroniser::start(const std::vector<int> &order, const TimeSpec &now)
+{
+    m_queue = order;
+    m_requeued.clear();
+    m_target = -1;
+    m_waiting = false;
+    m_failed = false;
+    m_backoff = false;
+    m_nofSynced = 0;
+    m_total = (int)order.size();
+    m_nofFailed = 0;
+    m_lastLiveInput = now;
+}
+
+//! \brief Parameter address of the current step.
+uint32_t Synchroniser::requestAddress() const
+{
+    switch (m_step)
+    {
+        case Name:
+            return Driver::PerformanceNameAddress;
+        case PartParams:
+            return Driver::partParamsAddress(m_part);
+        case PatchName:
+            return Driver::patchNameAddress(m_part);
+        default:
+            return 0;
+    }
+}
+
+//! \brief Parameter length of the current step.
+uint32_t Synchroniser::requestLength() const
+{
+    return m_step == PartParams ? Driver::PartParamsSize : NameLength;
+}
+
+/*! \brief Send the request for the current step.
+ *
+ * \param[in] now       Current time.
+ */
+void Synchroniser::request(const TimeSpec &now)
+{
+    if (m_step != Name && m_step != PartParams && m_step != PatchName)
+        return;
+    m_fantom->requestParam(requestAddress(), requestLength());
+    m_reply.clear();
+    m_waiting = true;
+    timeSum(m_deadline, now, TimeSpec(Driver::replyTimeout()));
+}
+
+/*! \brief Handle a request that timed out or got an invalid reply.
+ *
+ * The request is sent again after a delay. If all retries are used up,
+ * the performance is tried again after the rest of the queue, and given
+ * up on if that fails as well.
+ *
+ * \param[in] now       Current time.
+ * \param[in] liveTrack Index of the live track.
+ */
+void Synchroniser::retry(const TimeSpec &now, int liveTrack)
+{
+    Statistics &statistics = m_fantom->statistics();
+    if (m_waiting)
+        statistics.m_timeouts++;
+    m_waiting = false;
+    m_failed = false;
+    if (m_retry < Driver::MaxRetries)
+    {
+        m_retry++;
+        statistics.m_retries++;
+        m_backoff = true;
+        timeSum(m_deadline, now, TimeSpec(Driver::retryBackoff(m_retry)));
+        return;
+    }
+    statistics.m_failures++;
+    int target = m_target;
+    abort(false);
+    if (m_foreign)
+        m_fantom->selectPerformance(liveTrack);
+    if (std::find(m_requeued.begin(), m_requeued.end(), target) == m_requeued.end())
+    {
+        m_requeued.push_back(target);
+        m_queue.push_back(target);
+    }
+    else
+    {
+        m_nofFailed++;
+    }
+}
+
+/*! \brief Stop reading the current performance.
+ *
+ * A reply that is still underway is ignored.
+ *
+ * \param[in] requeue   Put the performance in front of the queue, so it is read again first.
+ */
+void Synchroniser::abort(bool requeue)
+{
+    if (m_target == -1)
+        return;
+    if (requeue)
+        m_queue.insert(m_queue.begin(), m_target);
+    m_target = -1;
+    m_waiting = false;
+    m_failed = false;
+    m_backoff = false;
+}
+
+//! \brief Advance to the next part, or finish the performance.
+void Synchroniser::nextPart()
+{
+    m_part++;
+    m_step = m_part < Performance::NofParts ? PartParams : Done;
+}
+
+/*! \brief Feed a byte received from the Fantom.
+ *
+ * \param[in] byteRx    Received byte.
+ */
+void Synchroniser::receive(uint8_t byteRx)
+{
+    if (!m_waiting || !m_reply.add(byteRx))
+        return;
+    m_waiting = false;
+    if (!m_reply.valid(requestAddress(), requestLength()))
+    {
+        m_fantom->statistics().m_badReplies++;
+        m_failed = true;
+        return;
+    }
+    m_retry = 0;
+    switch (m_step)
+    {
+        case Name:
+            m_reply.data(NameLength, (uint8_t *)m_performance.m_name);
+            m_performance.m_name[NameLength] = 0;
+            m_step = PartParams;
+            m_part = 0;
+            break;
+        case PartParams:
+        {
+            uint8_t buf[Driver::PartParamsSize];
+            memset(buf, 0, sizeof(buf));
+            m_reply.data(Driver::PartParamsSize, buf);
+            Part *hwPart = m_performance.m_partList+m_part;
+            Driver::decodePartParams(hwPart, buf);
+            bool readPatchParams;
+            hwPart->constructPreset(readPatchParams);
+            if (readPatchParams)
+            {
+                m_step = PatchName;
+            }
+            else
+            {
+                strcpy(hwPart->m_patch.m_name, "secret GM   ");
+                nextPart();
+            }
+            break;
+        }
+        case PatchName:
+        {
+            char *name = m_performance.m_partList[m_part].m_patch.m_name;
+            m_reply.data(NameLength, (uint8_t *)name);
+            name[NameLength] = 0;
+            nextPart();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/*! \brief Advance the download.
+ *
+ * This must be called from the event loop after every wakeup.
+ *
+ * \param[in] now       Current time.
+ * \param[in] liveTrack Index of the live track, which is also the index of the selected performance.
+ * \param[in] quiet     True if no note is sounding and the sustain pedal is up.
+ * \return    Index of a performance that was completed, -1 if none.
+ */
+int Synchroniser::poll(const TimeSpec &now, int liveTrack, bool quiet)
+{
+    if (m_target != -1 && m_step == Done)
+    {
+        int done = m_target;
+        m_target = -1;
+        m_nofSynced++;
+        m_performance.m_loaded = 1;
+        if (m_foreign)
+            m_fantom->selectPerformance(liveTrack);
+        return done;
+    }
+    if (m_target != -1 && (m_failed || (m_waiting && timeGreaterThanOrEqual(now, m_deadline))))
+        retry(now, liveTrack);
+    if (m_target == -1 && !m_queue.empty())
+    {
+        int next = m_queue.front();
+        m_foreign = next != liveTrack;
+        TimeSpec idleEnd;
+        timeSum(idleEnd, m_lastLiveInput, TimeSpec(idlePeriod));
+        if (m_foreign && (!quiet || !timeGreaterThanOrEqual(now, idleEnd)))
+            return -1;
+        m_queue.erase(m_queue.begin());
+        m_target = next;
+        m_performance = Performance();
+        m_part = 0;
+        m_retry = 0;
+        if (m_foreign)
+        {
+            m_fantom->selectPerformance(next);
+            m_step = SelectDelay;
+            timeSum(m_deadline, now, TimeSpec(selectDelay()));
+        }
+        else
+        {
+            m_step = Name;
+        }
+    }
+    if (m_target != -1 && m_step == SelectDelay && timeGreaterThanOrEqual(now, m_deadline))
+        m_step = Name;
+    if (m_target != -1 && m_backoff && timeGreaterThanOrEqual(now, m_deadline))
+        m_backoff = false;
+    if (m_target != -1 && !m_waiting && !m_backoff && m_step != SelectDelay)
+        request(now);
+    return -1;
+}
+
+/*! \brief Time until \a poll() must be called again.
+ *
+ * \param[in] now       Current time.
+ * \param[in] quiet     True if no note is sounding and the sustain pedal is up.
+ * \return    Timeout in usec for Midi::Driver::wait(), 0 to wait for input only.
+ */
+int Synchroniser::usecTimeout(const TimeSpec &now, bool quiet) const
+{
+    TimeSpec then;
+    if (m_target != -1)
+        then = m_deadline;
+    else if (!m_queue.empty() && quiet)
+        timeSum(then, m_lastLiveInput, TimeSpec(idlePeriod));
+    else
+        return 0;
+    Real dt = timeDiffSeconds(now, then);
+    return dt > (Real)0.001 ? (int)(dt*(Real)1e+6) : 1000;
+}
+
+/*! \brief Report live input from the player.
+ *
+ * If another performance is being read, it is abandoned and the live
+ * performance is selected again. The input must then be held for
+ * \a selectDelay(), or its notes play on the other performance.
+ *
+ * \param[in] now       Arrival time of the input.
+ * \param[in] liveTrack Index of the live track.
+ * \return    True if the live performance was selected again.
+ */
+bool Synchroniser::liveInput(const TimeSpec &now, int liveTrack)
+{
+    m_lastLiveInput = now;
+    if (m_target == -1 || !m_foreign)
+        return false;
+    abort(true);
+    m_fantom->selectPerformance(liveTrack);
+    return true;
+}
+
+/*! \brief Report a track change.
+ *
+ * The new performance has been selected, so whatever was being read
+ * is abandoned and the new performance is read first.
+ *
+ * \param[in] track     Index of the new live track.
+ */
+void Synchroniser::trackChanged(int track)
+{
+    abort(true);
+    std::vector<int>::iterator it = std::find(m_queue.begin(), m_queue.end(), track);
+    if (it != m_queue.end())
+    {
+        m_queue.erase(it);
+        m_queue.insert(m_queue.begin(), track);
+    }
+}
+
+} // namespace Fantom
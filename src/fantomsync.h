@@ -0,0 +1,88 @@
+/*! \file fantomsync.h
+ *  \brief Contains an object that downloads Fantom performance data in the background.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef FANTOM_SYNC_H
+#define FANTOM_SYNC_H
+#include <vector>
+#include "fantomdef.h"
+#include "fantomdriver.h"
+#include "timestamp.h"
+
+//! \brief Namespace for Fantom driver objects.
+namespace Fantom
+{
+
+/*! \brief Downloads performance data in the background.
+ *
+ * The download is split into single parameter requests, which are sent
+ * from the event loop of the core whenever it is waiting for input.
+ * Replies are fed back one byte at a time, so live MIDI traffic never
+ * waits for more than a single byte.
+ *
+ * A performance can only be read while it is selected in the Fantom.
+ * The performance of the live track is read right away. Other performances
+ * are only selected after a period without live input, and only while
+ * nothing sounds, since the Fantom cuts off held notes when it switches.
+ * Live input aborts such a read, so the live performance is selected
+ * again before any notes are sent.
+ *
+ * A request without a valid reply is retried after a growing delay. Only
+ * when all retries fail, the performance is put at the end of the queue,
+ * once. If it fails again it is given up on and stays pending, so a Fantom
+ * that is off or unplugged does not keep the download going forever.
+ */
+class Synchroniser
+{
+    //! \brief Download step within a single performance.
+    enum Step { SelectDelay, Name, PartParams, PatchName, Done };
+    Driver *m_fantom;               //!< Fantom driver.
+    std::vector<int> m_queue;       //!< Performance indexes still to be read, in order.
+    std::vector<int> m_requeued;    //!< Performance indexes that were put at the end of the queue after a failure.
+    int m_target;                   //!< Performance being read, -1 if none.
+    bool m_foreign;                 //!< True if \a m_target was selected by us rather than by the live track.
+    Step m_step;                    //!< Current download step.
+    int m_part;                     //!< Current part index within \a m_target.
+    bool m_waiting;                 //!< True if a reply is outstanding.
+    bool m_failed;                  //!< True if the latest reply was invalid.
+    bool m_backoff;                 //!< True while waiting to retry a failed request.
+    int m_retry;                    //!< Retry number of the current request.
+    TimeSpec m_deadline;            //!< End of the select delay, reply timeout or retry backoff.
+    TimeSpec m_lastLiveInput;       //!< Arrival time of the latest live input.
+    Reply m_reply;                  //!< Reply being received.
+    Performance m_performance;      //!< Performance being read.
+    int m_nofSynced;                //!< Number of performances read so far.
+    int m_total;                    //!< Number of performances to read.
+    int m_nofFailed;                //!< Number of performances given up on.
+    uint32_t requestAddress() const;
+    uint32_t requestLength() const;
+    void request(const TimeSpec &now);
+    void retry(const TimeSpec &now, int liveTrack);
+    void abort(bool requeue);
+    void nextPart();
+public:
+    Synchroniser(Driver *fantom);
+    void start(const std::vector<int> &order, const TimeSpec &now);
+    //! \brief True if there is anything left to download.
+    bool active() const { return m_target != -1 || !m_queue.empty(); }
+    //! \brief True if a performance other than the live one is selected for reading.
+    bool foreign() const { return m_target != -1 && m_foreign; }
+    //! \brief Number of performances read so far.
+    int nofSynced() const { return m_nofSynced; }
+    //! \brief Number of performances to read.
+    int total() const { return m_total; }
+    //! \brief Number of performances given up on, they stay pending.
+    int nofFailed() const { return m_nofFailed; }
+    //! \brief The performance that was completed by the latest \a poll().
+    const Performance &performance() const { return m_performance; }
+    void receive(uint8_t byteRx);
+    int poll(const TimeSpec &now, int liveTrack, bool quiet);
+    int usecTimeout(const TimeSpec &now, bool quiet) const;
+    bool liveInput(const TimeSpec &now, int liveTrack);
+    static Real selectDelay() { return (Real)0.10; }    //!< Time the Fantom needs to switch performances.
+    void trackChanged(int track);
+};
+
+} // Fantom namespace
+#endif // FANTOM_SYNC_H
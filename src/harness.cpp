@@ -0,0 +1,370 @@
+/*! \file harness.cpp
+ *  \brief Runs patcher_core on named pipes, for replay and stress tests.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <algorithm>
+#include "harness.h"
+#include "error.h"
+#include "ipcname.h"
+#include "mididef.h"
+
+namespace
+{
+
+const uint64_t startupTimeoutNs = (uint64_t)30 * 1000000000u;   //!< Time for the core to load its configuration.
+const uint64_t quietNs = 500000000u;                 //!< Output silence that ends the run.
+
+}
+
+//! \brief The number of bytes captured from all devices.
+size_t Capture::size() const
+{
+    size_t n = 0;
+    for (int i=0; i<Midi::Device::max; i++)
+        n += m_bytes[i].size();
+    return n;
+}
+
+//! \brief CLOCK_MONOTONIC in nanoseconds.
+uint64_t now()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+//! \brief True if the core writes to the device.
+bool isOutput(int device)
+{
+    return device == Midi::Device::FantomOut || device == Midi::Device::BcfOut;
+}
+
+//! \brief Map a pipe name to a device ID, \a Midi::Device::none if unknown.
+int deviceByName(const std::string &name)
+{
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        if (name == Midi::fifoName(i))
+            return i;
+    }
+    return Midi::Device::none;
+}
+
+//! \brief The percentile of sorted values.
+uint64_t percentile(const std::vector<uint64_t> &sorted, double fraction)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t)(fraction * sorted.size());
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+/*! \brief Create the named pipes, and select an IPC instance for the core.
+ *
+ * \param[in] byteNs    Time a byte takes on an output link, \a dinByteNs for DIN MIDI, 0 to read output as fast as possible.
+ */
+Harness::Harness(uint64_t byteNs):
+    m_core(0), m_lastOutput(0), m_inputTime(0), m_answered(true), m_byteNs(byteNs), m_sensingDue(0)
+{
+    char dir[] = "/tmp/patcher_harness.XXXXXX";
+    if (!mkdtemp(dir))
+        throw(Error("mkdtemp", errno));
+    m_fifoDir = dir;
+    char instance[32];
+    snprintf(instance, sizeof(instance), "harness-%d", (int)getpid());
+    m_instance = instance;
+    Ipc::setInstance(m_instance);
+    for (int i=0; i<Midi::Device::max; i++)
+    {
+        m_fd[i] = -1;
+        m_linkTime[i] = 0;
+        m_backlog[i] = false;
+    }
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        std::string path = m_fifoDir + "/" + Midi::fifoName(i);
+        if (mkfifo(path.c_str(), S_IRUSR|S_IWUSR) == -1)
+            throw(Error("mkfifo", errno));
+        m_fd[i] = open(path.c_str(), O_RDWR|O_NONBLOCK);
+        if (m_fd[i] == -1)
+            throw(Error("open fifo", errno));
+        // the kernel rounds up to a page, which is the rawmidi default anyway
+        if (m_byteNs && isOutput(i) && fcntl(m_fd[i], F_SETPIPE_SZ, dinBufferSize) == -1)
+            throw(Error("F_SETPIPE_SZ", errno));
+    }
+}
+
+//! \brief Stop the core and remove the named pipes and its IPC objects.
+Harness::~Harness()
+{
+    if (m_core)
+    {
+        kill(m_core, SIGTERM);
+        waitpid(m_core, 0, 0);
+    }
+    removeObjects();
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        if (m_fd[i] != -1)
+            close(m_fd[i]);
+        unlink((m_fifoDir + "/" + Midi::fifoName(i)).c_str());
+    }
+    rmdir(m_fifoDir.c_str());
+}
+
+/*! \brief Start the core and wait until its event loop runs.
+ *
+ * \param[in] core      The patcher_core executable.
+ * \param[in] workDir   Directory with the track definitions.
+ */
+void Harness::start(const char *core, const char *workDir)
+{
+    removeObjects();
+    m_queue.create();
+    m_events.openRead();
+    m_core = fork();
+    if (m_core == -1)
+    {
+        m_core = 0;
+        throw(Error("fork", errno));
+    }
+    if (m_core == 0)
+    {
+        execl(core, core, "-d", workDir, "-f", m_fifoDir.c_str(), "-i", m_instance.c_str(), (char *)0);
+        fprintf(stderr, "** execl %s: %s\n", core, strerror(errno));
+        _exit(1);
+    }
+    uint64_t deadline = now() + startupTimeoutNs;
+    Event event;
+    for (;;)
+    {
+        checkCore();
+        keepAlive();
+        readOutput(10000000);
+        bool ready = false;
+        while (m_events.tryReceive(event))
+            ready = ready || event.m_type == Event::Ready;
+        if (ready)
+            break;
+        if (now() > deadline)
+            throw(Error("patcher_core did not start"));
+    }
+    settle();
+}
+
+/*! \brief Remove the event queue and the shared memory of the instance.
+ *
+ * The configuration segments are named after their generation, so
+ * everything of the instance is looked up where Linux keeps them.
+ */
+void Harness::removeObjects()
+{
+    m_queue.unlink();
+    std::string prefix = Ipc::name("/").substr(1);
+    DIR *dir = opendir("/dev/shm");
+    if (!dir)
+        return;
+    while (struct dirent *entry = readdir(dir))
+    {
+        if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) == 0)
+            shm_unlink(("/" + std::string(entry->d_name)).c_str());
+    }
+    closedir(dir);
+}
+
+/*! \brief Send active sensing to the A30 input, if it is due.
+ *
+ * This is only called between messages, so the byte never splits one.
+ */
+void Harness::keepAlive()
+{
+    uint64_t t = now();
+    if (t < m_sensingDue)
+        return;
+    uint8_t byte = Midi::activeSensing;
+    if (write(m_fd[Midi::Device::A30], &byte, 1) == -1 && errno != EAGAIN)
+        throw(Error("write", errno));
+    m_sensingDue = t + sensingNs;
+}
+
+//! \brief Throw if the core has died.
+void Harness::checkCore()
+{
+    int status;
+    if (waitpid(m_core, &status, WNOHANG) == m_core)
+    {
+        m_core = 0;
+        Error e;
+        e.stream() << "patcher_core stopped, ";
+        if (WIFSIGNALED(status))
+            e.stream() << "signal " << WTERMSIG(status);
+        else
+            e.stream() << "exit code " << WEXITSTATUS(status);
+        throw(e);
+    }
+}
+
+/*! \brief The number of bytes waiting in the pipe of a device.
+ *
+ * For an output, this is what the core has written that has not left
+ * the link yet. For an input, this is what the core has not read yet.
+ */
+size_t Harness::queued(int device) const
+{
+    int n = 0;
+    if (ioctl(m_fd[device], FIONREAD, &n) == -1)
+        throw(Error("FIONREAD", errno));
+    return n;
+}
+
+/*! \brief Wait for output, and capture it.
+ *
+ * When the output is throttled, a pipe with a backlog is not polled,
+ * the wait ends when its link can take the next byte.
+ *
+ * \param[in] timeoutNs     Time to wait.
+ * \return    False if the core wrote nothing.
+ */
+bool Harness::readOutput(uint64_t timeoutNs)
+{
+    pollfd fds[Midi::Device::max];
+    int devices[Midi::Device::max];
+    int n = 0;
+    uint64_t t = now();
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        if (!isOutput(i))
+            continue;
+        if (m_backlog[i])
+        {
+            uint64_t due = m_linkTime[i] + m_byteNs;
+            timeoutNs = std::min(timeoutNs, due > t ? due - t : 0);
+            continue;
+        }
+        fds[n].fd = m_fd[i];
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        devices[n++] = i;
+    }
+    timespec timeout = { (time_t)(timeoutNs / 1000000000u), (long)(timeoutNs % 1000000000u) };
+    int rv = ppoll(fds, n, &timeout, 0);
+    if (rv == -1 && errno != EINTR)
+        throw(Error("ppoll", errno));
+    t = now();
+    bool any = false;
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        if (!isOutput(i))
+            continue;
+        bool readable = m_backlog[i];
+        for (int j=0; j<n && !readable; j++)
+            readable = devices[j] == i && (fds[j].revents & POLLIN);
+        if (!readable)
+            continue;
+        uint8_t buf[4096];
+        size_t budget = sizeof(buf);
+        if (m_byteNs)
+        {
+            // an idle link starts on the first byte now
+            if (m_linkTime[i] + m_byteNs < t)
+                m_linkTime[i] = t - m_byteNs;
+            budget = std::min(budget, (size_t)((t - m_linkTime[i]) / m_byteNs));
+        }
+        ssize_t len;
+        while (budget > 0 && (len = read(m_fd[i], buf, budget)) > 0)
+        {
+            m_capture.m_bytes[i].insert(m_capture.m_bytes[i].end(), buf, buf + len);
+            for (ssize_t j=0; j<len; j++)
+            {
+                if (m_byteNs)
+                    m_linkTime[i] += m_byteNs;
+                m_capture.m_times[i].push_back(m_byteNs ? m_linkTime[i] : t);
+            }
+            budget -= m_byteNs ? len : 0;
+            any = true;
+        }
+        if (m_byteNs)
+            m_backlog[i] = queued(i) > 0;
+    }
+    if (!any)
+        return false;
+    m_lastOutput = t;
+    if (!m_answered)
+    {
+        m_latency.push_back(t - m_inputTime);
+        m_answered = true;
+    }
+    return true;
+}
+
+/*! \brief Write a message to its input pipe.
+ *
+ * The output is read while the pipe is full, so the core never blocks.
+ */
+void Harness::send(const Message &message)
+{
+    const uint8_t *p = message.m_bytes;
+    int left = message.m_length;
+    while (left > 0)
+    {
+        ssize_t n = write(m_fd[message.m_device], p, left);
+        if (n == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                throw(Error("write", errno));
+            checkCore();
+            readOutput(1000000);
+            continue;
+        }
+        p += n;
+        left -= n;
+    }
+    m_inputTime = now();
+    m_answered = false;
+}
+
+/*! \brief Capture output until a moment, at least what is there now.
+ *
+ * \param[in] until     CLOCK_MONOTONIC in nanoseconds.
+ */
+void Harness::pump(uint64_t until)
+{
+    uint64_t t = now();
+    do
+    {
+        keepAlive();
+        readOutput(std::min(until > t ? until - t : 0, m_sensingDue - std::min(m_sensingDue, t)));
+        t = now();
+    } while (t < until);
+}
+
+//! \brief Capture output until the links are empty and the core has been quiet for a while.
+void Harness::settle()
+{
+    for (;;)
+    {
+        bool backlog = false;
+        for (int i=0; i<Midi::Device::max; i++)
+            backlog = backlog || m_backlog[i];
+        keepAlive();
+        if (!readOutput(quietNs) && !backlog)
+            break;
+    }
+    checkCore();
+    m_answered = true;
+}
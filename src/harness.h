@@ -0,0 +1,95 @@
+/*! \file harness.h
+ *  \brief Runs patcher_core on named pipes, for replay and stress tests.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef HARNESS_H
+#define HARNESS_H
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "queue.h"
+#include "mididriver.h"
+
+//! \brief A MIDI message to send to the core.
+struct Message
+{
+    uint64_t m_time;        //!< Time relative to the start of the stream, in nanoseconds.
+    int m_device;           //!< Input device ID.
+    uint8_t m_bytes[3];     //!< MIDI bytes.
+    int m_length;           //!< Number of MIDI bytes.
+};
+
+//! \brief Output of the core, by device.
+struct Capture
+{
+    std::vector<uint8_t> m_bytes[Midi::Device::max];   //!< Bytes written, by device ID.
+    std::vector<uint64_t> m_times[Midi::Device::max];  //!< When every byte arrived, CLOCK_MONOTONIC in nanoseconds.
+    size_t size() const;
+};
+
+uint64_t now();
+bool isOutput(int device);
+int deviceByName(const std::string &name);
+uint64_t percentile(const std::vector<uint64_t> &sorted, double fraction);
+
+/*! \brief Runs patcher_core on named pipes, feeds it the input and captures the output.
+ *
+ * The core runs in an IPC instance of its own, see \a Ipc, so it has its
+ * own event queue and shared memory, and can run next to a live patcher.
+ * It starts without a warm start snapshot, in the first track of the setlist.
+ *
+ * Like the A30, the harness sends active sensing to the core while it
+ * waits, so the watchdog of the core does not stop it in a pause of the
+ * stream.
+ *
+ * The outputs can be throttled to the speed of a DIN MIDI link. The
+ * pipes are then shrunk to the size of the buffer of a rawmidi device,
+ * and drained a byte at a time, so the core blocks on a full link like
+ * it does on the hardware, and \a Capture::m_times holds the moment
+ * every byte has left the link.
+ */
+class Harness
+{
+    std::string m_fifoDir;                  //!< Directory with the named pipes.
+    std::string m_instance;                 //!< IPC instance of the core.
+    int m_fd[Midi::Device::max];            //!< Pipe per device.
+    pid_t m_core;                           //!< The core process, 0 if not running.
+    Queue m_queue;                          //!< The event queue, created for the core.
+    Queue m_events;                         //!< The event queue, to see the core start.
+    Capture m_capture;                      //!< Output of the core.
+    uint64_t m_lastOutput;                  //!< Time of the last output.
+    uint64_t m_inputTime;                   //!< Time the last input was written.
+    bool m_answered;                        //!< The core has written something since the last input.
+    std::vector<uint64_t> m_latency;        //!< Time from an input to the first output after it.
+    uint64_t m_byteNs;                      //!< Time a byte takes on an output link, 0 if not throttled.
+    uint64_t m_linkTime[Midi::Device::max]; //!< When the last byte read from the pipe has left the link.
+    bool m_backlog[Midi::Device::max];      //!< The pipe held more than the link could take.
+    uint64_t m_sensingDue;                  //!< When the next active sensing byte is due.
+    Harness(const Harness &);               //!< Not copyable.
+    Harness &operator=(const Harness &);    //!< Not assignable.
+    void checkCore();
+    void removeObjects();
+    bool readOutput(uint64_t timeoutNs);
+    void keepAlive();
+public:
+    static const uint64_t dinByteNs = 320000;   //!< 10 bits at 31250 baud.
+    static const uint64_t sensingNs = 300000000u;   //!< Active sensing period of the A30.
+    static const int dinBufferSize = 4096;      //!< Output buffer of a rawmidi device.
+    explicit Harness(uint64_t byteNs = 0);
+    ~Harness();
+    void start(const char *core, const char *workDir);
+    void send(const Message &message);
+    void pump(uint64_t until);
+    void settle();
+    size_t queued(int device) const;
+    //! \brief What the core has written.
+    Capture &capture() { return m_capture; }
+    //! \brief Time of the last output.
+    uint64_t lastOutput() const { return m_lastOutput; }
+    //! \brief Latencies in nanoseconds, of the inputs that were answered.
+    std::vector<uint64_t> &latency() { return m_latency; }
+};
+
+#endif // HARNESS_H
@@ -0,0 +1,50 @@
+/*! \file ipcname.h
+ *  \brief Contains the names of the POSIX IPC objects shared by the processes.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef IPC_NAME_H
+#define IPC_NAME_H
+#include <string>
+
+/*! \brief Names of the event queue and the shared memory objects.
+ *
+ * A live patcher uses the plain names. Test rigs like patcher_replay run
+ * their core in an instance of its own, with its own objects, so they can
+ * run next to a live patcher without touching its queue, live state,
+ * configuration or warm start snapshot.
+ */
+namespace Ipc
+{
+
+//! \brief The instance of this process, empty for a live patcher.
+inline std::string &instance()
+{
+    static std::string name;
+    return name;
+}
+
+/*! \brief Select the instance, before any IPC object is opened.
+ *
+ * \param[in] name  Instance name, without slashes, empty for a live patcher.
+ */
+inline void setInstance(const std::string &name)
+{
+    instance() = name;
+}
+
+/*! \brief Name of an IPC object in the current instance.
+ *
+ * \param[in] name  Name of the object of a live patcher, e.g. "/patcher_queue".
+ * \return    The name, e.g. "/harness-1234_patcher_queue" in instance "harness-1234".
+ */
+inline std::string name(const char *name)
+{
+    if (instance().empty())
+        return name;
+    return "/" + instance() + "_" + (name + 1);
+}
+
+} // namespace Ipc
+
+#endif // IPC_NAME_H
@@ -0,0 +1,224 @@
+/*! \file liveshm.cpp
+ *  \brief Contains the live state the core publishes in shared memory.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include "liveshm.h"
+#include "queue.h"
+#include "error.h"
+#include "ipcname.h"
+
+using namespace LiveShm;
+
+namespace
+{
+const char pageName[] = "/patcher_live";    //!< Name of the shared memory object of a live patcher.
+const char pageMagic[8] = { 'P', 'A', 'T', 'C', 'H', 'L', 'I', 'V' };  //!< Page magic.
+const int nofSpins = 100;   //!< Read attempts before yielding to a core that is halfway an update.
+}
+
+//! \brief Set the state of a core that has not played anything yet.
+void State::clear()
+{
+    memset(this, 0, sizeof(*this));
+    memset(m_volume, Unknown, sizeof(m_volume));
+    memset(m_controller, Unknown, sizeof(m_controller));
+}
+
+/*! \brief Apply a MIDI message sent to the Fantom.
+ *
+ * \param[in]   status  MIDI status byte, with the channel.
+ * \param[in]   data1   MIDI data byte 1.
+ * \param[in]   data2   MIDI data byte 2.
+ */
+void State::apply(uint8_t status, uint8_t data1, uint8_t data2)
+{
+    uint8_t channel = Midi::channel(status);
+    if (Midi::isNote(status) && data1 < 128)
+    {
+        uint32_t bit = 1u << (data1 & 31);
+        if (Midi::isNoteOn(status, data1, data2))
+            m_noteOn[channel][data1 >> 5] |= bit;
+        else
+            m_noteOn[channel][data1 >> 5] &= ~bit;
+    }
+    else if (Midi::isController(status) && data1 < 128)
+    {
+        if (data1 == Midi::allNotesOff)
+            memset(m_noteOn[channel], 0, sizeof(m_noteOn[channel]));
+        else if (data1 == Midi::resetAllControllers)
+            memset(m_controller[channel], Unknown, sizeof(m_controller[channel]));
+        else
+            m_controller[channel][data1] = data2;
+    }
+}
+
+//! \brief The number of notes sounding on a channel.
+int State::nofNotesOn(int channel) const
+{
+    int n = 0;
+    for (int i=0; i<4; i++)
+        n += __builtin_popcount(m_noteOn[channel][i]);
+    return n;
+}
+
+/*! \brief True if no note is sounding and no sustain pedal is down.
+ *
+ * The Fantom cuts everything off when another performance is selected.
+ */
+bool State::quiet() const
+{
+    for (int channel=0; channel<Midi::NofChannels; channel++)
+    {
+        uint8_t sustain = m_controller[channel][Midi::sustain];
+        if (sustain != Unknown && sustain >= 64)
+            return false;
+        for (int i=0; i<4; i++)
+        {
+            if (m_noteOn[channel][i])
+                return false;
+        }
+    }
+    return true;
+}
+
+//! \brief Construct a detached object.
+SharedLiveState::SharedLiveState(): m_page(0), m_owner(false)
+{
+}
+
+//! \brief Destructor, unmaps the page but leaves it for the other processes.
+SharedLiveState::~SharedLiveState()
+{
+    if (m_page)
+        munmap(m_page, sizeof(Page));
+}
+
+/*! \brief Create or reuse the page, in the core.
+ *
+ * A page left by a previous core is reused, so clients that are still
+ * running keep a valid mapping. The state is cleared.
+ */
+void SharedLiveState::create()
+{
+    int fd = shm_open(Ipc::name(pageName).c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd == -1)
+        throw(Error("shm_open", errno));
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1
+        || (statBuf.st_size < (off_t)sizeof(Page) && ftruncate(fd, sizeof(Page)) == -1))
+    {
+        int errNo = errno;
+        close(fd);
+        throw(Error("cannot size shared live state", errNo));
+    }
+    void *map = mmap(0, sizeof(Page), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw(Error("mmap", errno));
+    m_page = (Page *)map;
+    m_owner = true;
+    if (memcmp(m_page->m_magic, pageMagic, sizeof(pageMagic)) != 0
+        || m_page->m_version != Page::Version)
+    {
+        m_page->m_sequence = 0;
+        memcpy(m_page->m_magic, pageMagic, sizeof(pageMagic));
+        m_page->m_version = Page::Version;
+    }
+    // a core that died halfway an update left it odd
+    if (m_page->m_sequence & 1)
+        m_page->m_sequence++;
+    beginUpdate().clear();
+    endUpdate();
+}
+
+/*! \brief Start changing the state, in the core.
+ *
+ * Clients retry their reads until \a endUpdate() is called, so keep it short.
+ *
+ * \return  The state, to be changed in place.
+ */
+State &SharedLiveState::beginUpdate()
+{
+    m_page->m_sequence++;
+    __sync_synchronize();
+    return m_page->m_state;
+}
+
+//! \brief Finish changing the state, in the core.
+void SharedLiveState::endUpdate()
+{
+    m_page->m_state.m_nextPacket = Event::m_sequenceNumber;
+    __sync_synchronize();
+    m_page->m_sequence++;
+}
+
+//! \brief Map the page, if the core has created it.
+bool SharedLiveState::attach()
+{
+    if (m_page)
+        return true;
+    int fd = shm_open(Ipc::name(pageName).c_str(), O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1 || statBuf.st_size < (off_t)sizeof(Page))
+    {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(0, sizeof(Page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const Page *page = (const Page *)map;
+    if (memcmp(page->m_magic, pageMagic, sizeof(pageMagic)) != 0
+        || page->m_version != Page::Version)
+    {
+        munmap(map, sizeof(Page));
+        return false;
+    }
+    m_page = (Page *)map;
+    return true;
+}
+
+/*! \brief The update counter, to check cheaply if the state has changed.
+ *
+ * \return  0 if not attached.
+ */
+uint32_t SharedLiveState::sequence() const
+{
+    return m_page ? m_page->m_sequence : 0;
+}
+
+/*! \brief Copy a consistent state, in a client.
+ *
+ * \param[out]  state   The state.
+ * \return      False if the core has not created the page yet.
+ */
+bool SharedLiveState::read(State &state)
+{
+    if (!attach())
+        return false;
+    for (int attempt=1;; attempt++)
+    {
+        uint32_t before = m_page->m_sequence;
+        __sync_synchronize();
+        if ((before & 1) == 0)
+        {
+            memcpy(&state, &m_page->m_state, sizeof(state));
+            __sync_synchronize();
+            if (m_page->m_sequence == before)
+                return true;
+        }
+        if (attempt % nofSpins == 0)
+            sched_yield();
+    }
+}
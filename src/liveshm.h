@@ -0,0 +1,101 @@
+/*! \file liveshm.h
+ *  \brief Contains the live state the core publishes in shared memory.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef LIVE_SHM_H
+#define LIVE_SHM_H
+#include <stdint.h>
+#include "mididef.h"
+#include "fantomdef.h"
+
+//! \brief Namespace for the records of the shared live state.
+namespace LiveShm
+{
+
+static const uint8_t Unknown = 255;     //!< Volume or controller value that has not been sent yet.
+
+/*! \brief What the core is doing right now.
+ *
+ * The notes and controllers are those sent to the Fantom, by MIDI
+ * channel. The volumes are those of the Fantom parts.
+ */
+struct State
+{
+    uint32_t m_nextPacket;          //!< Packet counter of the next event, this state includes all before it.
+    uint16_t m_currentTrack;        //!< Current track.
+    uint16_t m_currentSection;      //!< Current section.
+    uint16_t m_trackIdxWithinSet;   //!< Setlist index.
+    uint8_t m_metaMode;             //!< Meta mode switch.
+    uint8_t m_reserved;             //!< Padding, 0.
+    uint16_t m_nofSynced;           //!< Performances downloaded so far.
+    uint16_t m_nofToSync;           //!< Performances to download, 0 if none.
+    uint16_t m_nofSyncErrors;       //!< Failed Fantom requests during the download.
+    uint16_t m_nofSyncFailed;       //!< Performances the download has given up on.
+    uint32_t m_nofRoundTrips;       //!< Round trip probes to the Fantom answered, see \a Fantom::Prober.
+    uint32_t m_nofLostProbes;       //!< Round trip probes without a valid reply in time.
+    uint32_t m_roundTripLast;       //!< Latest round trip in usec, 0 if none.
+    uint32_t m_roundTripMin;        //!< Shortest of the latest round trips in usec.
+    uint32_t m_roundTripMean;       //!< Mean of the latest round trips in usec.
+    uint32_t m_roundTripMax;        //!< Longest of the latest round trips in usec.
+    uint16_t m_nofCoreRestarts;     //!< Restarts of the core by the administrator process.
+    uint8_t m_coreSignal;           //!< Signal that stopped the previous core, 0 if it exited.
+    uint8_t m_coreExitCode;         //!< Exit code of the previous core, if it exited.
+    uint32_t m_noteOn[Midi::NofChannels][4];                //!< Sounding notes, a bit per note.
+    uint8_t m_volume[Fantom::Performance::NofParts];        //!< Volume per Fantom part.
+    uint8_t m_controller[Midi::NofChannels][128];           //!< Last controller values.
+    void clear();
+    void apply(uint8_t status, uint8_t data1, uint8_t data2);
+    //! \brief True if a note is sounding.
+    bool noteOn(int channel, int note) const {
+        return (m_noteOn[channel][note >> 5] >> (note & 31)) & 1; }
+    int nofNotesOn(int channel) const;
+    bool quiet() const;
+};
+
+/*! \brief The shared memory object.
+ *
+ * \a m_sequence is odd while the core updates \a m_state.
+ */
+struct Page
+{
+    static const uint32_t Version = 4;  //!< Must be changed if the layout of \a State changes.
+    char m_magic[8];                    //!< Magic string, "PATCHLIV".
+    uint32_t m_version;                 //!< Layout version.
+    volatile uint32_t m_sequence;       //!< Update counter.
+    State m_state;                      //!< The live state.
+};
+
+} // namespace LiveShm
+
+/*! \brief The live state of the core, shared with its clients.
+ *
+ * The core updates the state in place in a POSIX shared memory object,
+ * protected by a sequence lock: it makes the sequence number odd, changes
+ * the state and makes it even again. A client copies the state and
+ * retries if the sequence number was odd or has changed meanwhile, so it
+ * always gets a consistent state in one read, however late it started or
+ * however many events it has dropped. The core never waits for a client.
+ */
+class SharedLiveState
+{
+    LiveShm::Page *m_page;          //!< The mapped page, 0 if not attached.
+    bool m_owner;                   //!< True in the core, which writes the state.
+    SharedLiveState(const SharedLiveState &);               //!< Not copyable.
+    SharedLiveState &operator=(const SharedLiveState &);    //!< Not assignable.
+public:
+    // core
+    void create();
+    LiveShm::State &beginUpdate();
+    void endUpdate();
+    //! \brief The state as the core has written it, in the core.
+    const LiveShm::State &current() const { return m_page->m_state; }
+    // clients
+    bool attach();
+    bool read(LiveShm::State &state);
+    uint32_t sequence() const;
+    SharedLiveState();
+    ~SharedLiveState();
+};
+
+#endif // LIVE_SHM_H
@@ -12,7 +12,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <alsa/asoundlib.h>
+#include <map>
+#include <string>
 #include "error.h"
 #include "mididriver.h"
 #include "timer.h"
@@ -20,156 +21,218 @@
 
 namespace Midi {
 
-/*! \brief My setup.
- */
-Device deviceList[] =
+namespace
+{
+
+//! \brief Descriptions of the devices for the log, by \a Device::DeviceId.
+const char *longDescription[Device::max] =
 {
-    { "Anniv",   0, 0, 0, in,  Device::A30,       "A30", "Roland A30",        0 },
-    { "Anniv",   0, 0, 0, out, Device::FantomOut, "Fan", "Roland Fantom XR",  0 },
-    { "Anniv",   0, 0, 1, in,  Device::Fcb1010,   "FCB", "Behringer FCB1010", 0 },
-    { "Anniv",   0, 0, 1, out, Device::none,      "---", "-",                 0 },
-    { "Anniv",   0, 0, 2, in,  Device::FantomIn,  "Fan", "Roland Fantom XR",  0 },
-    { "Anniv",   0, 0, 2, out, Device::none,      "---", "-",                 0 },
-    { "Anniv",   0, 0, 3, in,  Device::none,      "---", "-",                 0 },
-    { "Anniv",   0, 0, 3, out, Device::none,      "---", "-",                 0 },
-    { "BCF2000", 0, 0, 0, in,  Device::BcfIn,     "BCF", "Behringer BCF2000", 0 },
-    { "BCF2000", 0, 0, 0, out, Device::BcfOut,    "BCF", "Behringer BCF2000", 0 },
-    { 0,         0, 0, 0, none,Device::none,      0,     0,                   0 },
+    "-", "Roland A30", "Behringer FCB1010", "Roland Fantom XR", "Roland Fantom XR",
+    "Behringer BCF2000", "Behringer BCF2000"
 };
 
+}
 
-/*! \brief Map from DevId to file descriptor.
+/*! \brief Map from DevId to port.
  *
- *  \param[in]  deviceId    A valid \a DevId.
+ *  \param[in]  deviceId    A \a DevId.
+ *  \return     The port, 0 if the device is not configured or could not be opened.
  */
-int Driver::fd(int deviceId) const
+Port *Driver::port(int deviceId) const
 {
     if (deviceId > Device::none && deviceId < Device::max)
-        return m_deviceList[m_deviceIdToDeviceTabIdx[deviceId]].m_fd;
-    return -1;
+        return m_ports[deviceId];
+    return 0;
 }
 
-/*! \brief Obtain file descriptors for all devices.
+/*! \brief Read the devices and their transports from a config file.
+ *
+ * Every line is "<device> <backend> <address>", where the device is
+ * named by \a fifoName(), and the backend is "rawmidi", "seq" or "fifo".
+ * Empty lines and lines that start with '#' are skipped.
+ *
+ * \param[in] fileName  Config file name.
+ */
+void Driver::readConfig(const char *fileName)
+{
+    FILE *fp = fopen(fileName, "r");
+    if (!fp)
+    {
+        Error e;
+        e.stream() << "cannot open " << fileName << ", " << strerror(errno);
+        throw(e);
+    }
+    char line[256];
+    for (int lineNr = 1; fgets(line, sizeof(line), fp); lineNr++)
+    {
+        char name[32], backend[32], address[200];
+        if (line[0] == '#' || sscanf(line, "%31s", name) != 1)
+            continue;
+        Device d;
+        d.m_id = Device::none;
+        for (int i=Device::none+1; i<Device::max; i++)
+        {
+            if (strcmp(name, fifoName(i)) == 0)
+                d.m_id = (Device::DeviceId)i;
+        }
+        if (d.m_id == Device::none || sscanf(line, "%31s %31s %199s", name, backend, address) != 3
+            || (strcmp(backend, "rawmidi") && strcmp(backend, "seq") && strcmp(backend, "fifo")))
+        {
+            fclose(fp);
+            Error e;
+            e.stream() << fileName << ":" << lineNr << ": expected <device> rawmidi|seq|fifo <address>";
+            throw(e);
+        }
+        d.m_direction = (d.m_id == Device::FantomOut || d.m_id == Device::BcfOut) ? out : in;
+        d.m_backend = backend;
+        d.m_address = address;
+        m_deviceList.push_back(d);
+    }
+    fclose(fp);
+}
+
+/*! \brief Use named pipes instead of the configured devices.
+ *
+ * A replay or test harness writes the input of every device into its
+ * pipe, and reads the output from it.
+ *
+ * \param[in] fifoDir   Directory with a pipe per device, named by \a fifoName().
+ */
+void Driver::fifoConfig(const char *fifoDir)
+{
+    for (int i=Device::none+1; i<Device::max; i++)
+    {
+        Device d;
+        d.m_id = (Device::DeviceId)i;
+        d.m_direction = (d.m_id == Device::FantomOut || d.m_id == Device::BcfOut) ? out : in;
+        d.m_backend = "fifo";
+        d.m_address = std::string(fifoDir) + "/" + fifoName(i);
+        m_deviceList.push_back(d);
+    }
+}
+
+/*! \brief Open a port for every configured device.
+ *
+ * A rawmidi device can be opened only once, so an input and an output
+ * on the same address share the file descriptor. Named pipes are opened
+ * for reading and writing, so the open never blocks, and the core never
+ * sees an end of file when the harness closes them.
+ * Devices that cannot be opened are logged and left out.
  */
 void Driver::openDevices()
 {
-    Device *dIn = m_deviceList;
-    char devStr[100];
-    int deviceIdx = 0;
-    while (dIn->m_longDescription != 0)
+    std::map<std::string, int> rawMidiFds;
+    for (size_t i=0; i<m_deviceList.size(); i++)
     {
-        Device *dOut = dIn+1;
-        dOut->m_card = dIn->m_card = cardNameToNum(dIn->m_cardName);
-        sprintf(devStr, "hw:%d,%d,%d", dIn->m_card, dIn->m_sub1, dIn->m_sub2);
-        if (dIn->m_id != Device::none && dOut->m_id != Device::none)
+        const Device &d = m_deviceList[i];
+        if (m_ports[d.m_id])
         {
-            if (m_window)
-            {
-                wprintw(m_window, "opening %s\n%s\n", dIn->m_longDescription, devStr);
-                wprintw(m_window, "opening %s\n%s\n", dOut->m_longDescription, devStr);
-                wrefresh(m_window);
-            }
-            dIn->m_fd = dOut->m_fd = openRaw(devStr, O_RDWR);
+            Error e;
+            e.stream() << "device " << fifoName(d.m_id) << " is configured twice";
+            throw(e);
         }
-        else if (dIn->m_id == Device::none && dOut->m_id != Device::none)
+        if (m_window)
         {
-            if (m_window)
-            {
-                wprintw(m_window, "opening %s\n%s\n", dOut->m_longDescription, devStr);
-                wrefresh(m_window);
-            }
-            dOut->m_fd = openRaw(devStr, O_WRONLY);
+            wprintw(m_window, "opening %s\n%s %s\n", longDescription[d.m_id],
+                d.m_backend.c_str(), d.m_address.c_str());
+            wrefresh(m_window);
+        }
+        if (d.m_backend == "seq")
+        {
+            m_ports[d.m_id] = openSeqPort(d.m_address, d.m_direction == in);
+            continue;
         }
-        else if (dIn->m_id != Device::none && dOut->m_id == Device::none)
+        int fd = -1;
+        if (d.m_backend == "fifo")
         {
-            if (m_window)
+            fd = open(d.m_address.c_str(), O_RDWR);
+            if (fd == -1)
             {
-                wprintw(m_window, "opening %s\n%s\n", dIn->m_longDescription, devStr);
-                wrefresh(m_window);
+                Error e;
+                e.stream() << "cannot open " << d.m_address << ", " << strerror(errno);
+                throw(e);
             }
-            dIn->m_fd = openRaw(devStr, O_RDONLY);
+        }
+        else if (rawMidiFds.count(d.m_address))
+        {
+            fd = rawMidiFds[d.m_address];
         }
         else
         {
-            // nothing
+            int mode = d.m_direction == in ? O_RDONLY : O_WRONLY;
+            for (size_t j=0; j<m_deviceList.size(); j++)
+            {
+                if (m_deviceList[j].m_backend == d.m_backend && m_deviceList[j].m_address == d.m_address
+                    && m_deviceList[j].m_direction != d.m_direction)
+                    mode = O_RDWR;
+            }
+            fd = rawMidiFds[d.m_address] = openRawMidi(d.m_address, mode);
         }
-        m_deviceIdToDeviceTabIdx[dIn->m_id] = deviceIdx;
-        m_deviceIdToDeviceTabIdx[dOut->m_id] = deviceIdx+1;
-        dIn += 2;
-        deviceIdx += 2;
+        if (fd >= 0)
+            m_ports[d.m_id] = new FdPort(fd);
+        else if (m_window)
+            wprintw(m_window, "cannot open MIDI port %s\n", d.m_address.c_str());
     }
     if (m_window)
     {
         for (int i=Device::none+1; i<Device::max; i++)
         {
-            wprintw(m_window, "dev = %d, devIdx = %d, fd = %d\n",
-                i, m_deviceIdToDeviceTabIdx[i], fd(i));
+            wprintw(m_window, "dev = %d, fd = %d\n", i, m_ports[i] ? m_ports[i]->descriptor() : -1);
         }
         wrefresh(m_window);
     }
 }
 
-/*! \brief Open a raw midi device.
- *
- * \param[in] portName  ALSA port name.
- * \param[in] mode      open(2) flag.
- * \return file descriptor, or -1 on error.
- */
-int Driver::openRaw(const char *portName, int mode) const
-{
-   // abandoned once we have the file descriptor
-   snd_rawmidi_t *rawMidi1, *rawMidi2;
-   int status;
-   if ((status =
-        snd_rawmidi_open(&rawMidi1, &rawMidi2, portName, 0)) < 0) {
-        if (m_window)
-            wprintw(m_window, "cannot open MIDI port %s: %s",
-                portName, snd_strerror(status));
-    return -1;
-   }
-    struct pollfd pfds;
-    if (mode & O_WRONLY)
-        snd_rawmidi_poll_descriptors(rawMidi2, &pfds, 1);
-    else
-        snd_rawmidi_poll_descriptors(rawMidi1, &pfds, 1);
-    return pfds.fd;
-}
-
 /*! \brief wait for activity on one or all devices.
  *
- * If there is any activity on the suicide-fd then this function throws an exception
- * which will presumably kill this process.
+ * When waiting for all devices, changes to the directory with the track
+ * definitions are reported as \a Device::config. Use \a configChanged()
+ * to find out if the track definitions themselves have changed.
  *
  * \param[in] usecTimeout    timeout in usec, if specified.
  * \param[in] device         specified device ID to wait for, if specified, otherwise any activity.
+ * \return    The ID of the device that has input, or Device::none on timeout.
  */
 int Driver::wait(int usecTimeout, int device) const
 {
+    // input that a port has buffered itself is invisible to select
+    for (int i=Device::none+1; i<Device::max; i++)
+    {
+        if (device != Device::all && device != i)
+            continue;
+        if (m_heldByte[i] != -1)
+        {
+            if (!m_holding)
+                return i;
+        }
+        else if (m_ports[i] && m_ports[i]->pending())
+        {
+            return i;
+        }
+    }
     fd_set fdSet;
     FD_ZERO(&fdSet);
     int maxFd = 0;
-    if (device == Device::all)
+    for (size_t i=0; i<m_deviceList.size(); i++)
     {
-        for (int i=0; m_deviceList[i].m_longDescription;i++)
+        const Port *p = m_ports[m_deviceList[i].m_id];
+        if (p && m_deviceList[i].m_direction == in && (device == Device::all || device == m_deviceList[i].m_id)
+            && (!m_holding || m_heldByte[m_deviceList[i].m_id] == -1))
         {
-            if (m_deviceList[i].m_direction == in && m_deviceList[i].m_id != Device::none)
-            {
-                FD_SET(m_deviceList[i].m_fd, &fdSet);
-                if (m_deviceList[i].m_fd > maxFd)
-                    maxFd = m_deviceList[i].m_fd;
-            }
+            FD_SET(p->descriptor(), &fdSet);
+            if (p->descriptor() > maxFd)
+                maxFd = p->descriptor();
         }
-        //FD_SET(0, &fdSet); // add stdin
     }
-    else
+    if (device == Device::all)
     {
-        maxFd = fd(device);
-        FD_SET(maxFd, &fdSet);
+        FD_SET(m_configFd, &fdSet);
+        if (m_configFd > maxFd)
+            maxFd = m_configFd;
     }
-    FD_SET(m_suicideFd, &fdSet);
     struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = usecTimeout;
+    tv.tv_sec = usecTimeout / 1000000;
+    tv.tv_usec = usecTimeout % 1000000;
     if (m_window)
         wrefresh(m_window);
     int e;
@@ -183,72 +246,81 @@ int Driver::wait(int usecTimeout, int device) const
     {
         throw(Error("select", errno));
     }
-    for (int i=0; m_deviceList[i].m_longDescription;i++)
+    if (e == 0)
+        return Device::none;
+    if (device == Device::all && FD_ISSET(m_configFd, &fdSet))
+        return Device::config;
+    for (size_t i=0; i<m_deviceList.size(); i++)
     {
-        if (m_deviceList[i].m_id != Device::none &&
-            m_deviceList[i].m_direction == in &&
-            FD_ISSET(m_deviceList[i].m_fd, &fdSet))
-        {
-#if 0
-            wprintw(m_window,
-                    "fd %d is ready, idx = %d, dev = %d\n",
-                    m_deviceList[i].m_fd, i, m_deviceList[i].m_id);
-#endif
+        const Port *p = m_ports[m_deviceList[i].m_id];
+        if (p && m_deviceList[i].m_direction == in && FD_ISSET(p->descriptor(), &fdSet))
             return m_deviceList[i].m_id;
-        }
     }
     throw(Error("non-midi activity", errno));
     return -1;
 }
 
-/*! \brief Map an ALSA card name to a card number.
+/*! \brief Construct a MIDI \a Driver object
  *
- * \param[in] target        Card name to look for.
- * \return                  The card number.
+ * \param[in] win     A curses WINDOW object to log to.
+ * \param[in] fifoDir Directory with named pipes to use instead of the devices in \a DEVICE_CONF, 0 for the devices.
  */
-int Driver::cardNameToNum(const char *target) const
+Driver::Driver(WINDOW *win, const char *fifoDir): m_window(win), m_holding(false)
 {
-    const char *proc = "/proc/asound/cards";
-    int hwNum = -1;
-    FILE *fp = fopen(proc, "r");
-    if (g_timer.timedout() || !fp)
+    for (int i=0; i<Device::max; i++)
     {
-        throw(Error("open", errno));
+        m_ports[i] = 0;
+        m_heldByte[i] = -1;
     }
-    char procLineBuf[100];
-    for (;;)
+    if (fifoDir)
+        fifoConfig(fifoDir);
+    else
+        readConfig(DEVICE_CONF);
+    openDevices();
+    m_configFd = inotify_init1(IN_NONBLOCK);
+    if (m_configFd < 0)
     {
-        if (!fgets(procLineBuf, sizeof(procLineBuf), fp))
-            break;
-        if (sscanf(procLineBuf, "%d", &hwNum) == 1)
-        {
-            if (strstr(procLineBuf, target) != 0)
-                break;
-        }
-        hwNum = -1;
+        throw(Error("inotify_init1", errno));
     }
-    fclose(fp);
-    if (hwNum == -1 && m_window)
+    // Watch the directory rather than the file, editors that save by
+    // renaming a new file over the old one would end a watch on the file.
+    int wd = inotify_add_watch(m_configFd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0)
     {
-        wprintw(m_window, "cannot find %s\n", target);
+        throw(Error("inotify_add_watch", errno));
     }
-    return hwNum;
 }
 
-/*! \brief Construct a MIDI \a Driver object
+//! \brief Destructor, closes the ports.
+Driver::~Driver()
+{
+    for (int i=0; i<Device::max; i++)
+        delete m_ports[i];
+    close(m_configFd);
+}
+
+/*! \brief Consume pending directory change notifications.
  *
- * \param[in] win     A curses WINDOW object to log to.
+ * \return True if the track definitions were written or replaced.
  */
-Driver::Driver(WINDOW *win): m_window(win)
+bool Driver::configChanged() const
 {
-    m_deviceList = &deviceList[0];
-    openDevices();
-    m_suicideFd = inotify_init();
-    int wd = inotify_add_watch(m_suicideFd, TRACK_DEF, IN_MODIFY);
-    if (wd < 0)
+    bool changed = false;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;)
     {
-        throw(Error("inotify_add_watch", errno));
+        ssize_t len = read(m_configFd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (char *p = buf; p < buf + len; )
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->len && strcmp(event->name, TRACK_DEF) == 0)
+                changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
     }
+    return changed;
 }
 
 /*! \brief Get a byte from a MIDI device.
@@ -260,11 +332,48 @@ Driver::Driver(WINDOW *win): m_window(win)
  */
 uint8_t Driver::getByte(int device) const
 {
-    if (device < 0)
-        return 0;
-    uint8_t buf;
-    g_timer.read(fd(device), &buf, 1);
-    return buf;
+    if (device > Device::none && device < Device::max && m_heldByte[device] != -1)
+    {
+        uint8_t b = (uint8_t)m_heldByte[device];
+        m_heldByte[device] = -1;
+        return b;
+    }
+    Port *p = port(device);
+    return p ? p->getByte() : 0;
+}
+
+/*! \brief Put back the byte just read from a device, and hold its input.
+ *
+ * The device is left out of \a wait() until \a release(), then the byte
+ * is the first one \a getByte() returns.
+ *
+ * \param[in] device    Device ID.
+ * \param[in] byte      The byte that was read last.
+ */
+void Driver::hold(int device, uint8_t byte)
+{
+    if (device <= Device::none || device >= Device::max)
+        return;
+    m_heldByte[device] = byte;
+    m_holding = true;
+}
+
+//! \brief Serve the held devices again, starting with the bytes that were put back.
+void Driver::release()
+{
+    m_holding = false;
+}
+
+/*! \brief The time the last byte from a MIDI device was received, if its transport knows it.
+ *
+ * \param[in]   device  Device ID.
+ * \param[out]  time    CLOCK_REALTIME, unchanged if unknown.
+ * \return      False if unknown.
+ */
+bool Driver::timestamp(int device, TimeSpec &time) const
+{
+    Port *p = port(device);
+    return p && p->timestamp(time);
 }
 
 /*! \brief Write a byte to a MIDI device.
@@ -274,9 +383,7 @@ uint8_t Driver::getByte(int device) const
  */
 void Driver::putByte(int device, uint8_t b1) const
 {
-    int fDescr = fd(device);
-    if (fDescr >= 0)
-        g_timer.write(fDescr, &b1, 1);
+    putBytes(device, &b1, 1);
 }
 
 /*! \brief Write a byte string to a MIDI device.
@@ -287,9 +394,9 @@ void Driver::putByte(int device, uint8_t b1) const
  */
 void Driver::putBytes(int device, const uint8_t *b, int n) const
 {
-    int fDescr = fd(device);
-    if (fDescr >= 0)
-        g_timer.write(fDescr, b, n);
+    Port *p = port(device);
+    if (p)
+        p->putBytes(b, n);
 }
 
 /*! \brief Write 2 bytes to a MIDI device.
@@ -300,14 +407,10 @@ void Driver::putBytes(int device, const uint8_t *b, int n) const
  */
 void Driver::putBytes(int device, uint8_t b1, uint8_t b2) const
 {
-    int fDescr = fd(device);
-    if (fDescr >= 0)
-    {
-        uint8_t buf[2];
-        buf[0] = b1;
-        buf[1] = b2;
-        g_timer.write(fDescr, buf, 2);
-    }
+    uint8_t buf[2];
+    buf[0] = b1;
+    buf[1] = b2;
+    putBytes(device, buf, 2);
 }
 
 /*! \brief Write 3 bytes to a MIDI device.
@@ -319,15 +422,11 @@ void Driver::putBytes(int device, uint8_t b1, uint8_t b2) const
  */
 void Driver::putBytes(int device, uint8_t b1, uint8_t b2, uint8_t b3) const
 {
-    int fDescr = fd(device);
-    if (fDescr >= 0)
-    {
-        uint8_t buf[3];
-        buf[0] = b1;
-        buf[1] = b2;
-        buf[2] = b3;
-        g_timer.write(fDescr, buf, 3);
-    }
+    uint8_t buf[3];
+    buf[0] = b1;
+    buf[1] = b2;
+    buf[2] = b3;
+    putBytes(device, buf, 3);
 }
 
 } // namespace Midi
@@ -6,7 +6,10 @@
 #ifndef MIDI_DRIVER_H
 #define MIDI_DRIVER_H
 #include <stdint.h>
+#include <string>
+#include <vector>
 #include "screen.h"
+#include "midiport.h"
 
 //! \brief Namespace for all MIDI driver objects.
 namespace Midi
@@ -15,42 +18,69 @@ namespace Midi
 //! \brief Direction of MIDI data, as seen from Pi.
 enum InOut { none, in = 100, out };
 
-//! \brief State of a single MIDI device.
+//! \brief A MIDI device, as configured in \a DEVICE_CONF.
 struct Device
 {
-    //! \brief My hardware.
-    enum DeviceId { none = 0, A30, Fcb1010, FantomOut, FantomIn, BcfOut, BcfIn, max, all };
-    const char *m_cardName;     //!< ALSA driver name.
-    int m_card;                 //!< ALSA card number.
-    int m_sub1;                 //!< ALSA sub ID 1.
-    int m_sub2;                 //!< ALSA sub ID 2.
-    InOut m_direction;          //!< In or out.
+    /*! \brief My hardware.
+     *
+     * \a all selects every input in \a Driver::wait(), \a config is returned
+     * by it when the directory with the track definitions has changed.
+     */
+    enum DeviceId { none = 0, A30, Fcb1010, FantomOut, FantomIn, BcfOut, BcfIn, max, all, config };
     DeviceId m_id;              //!< Device ID.
-    const char *m_shortDescription;   //!< Short description.
-    const char *m_longDescription;    //!< Long description.
-    int m_fd;                   //!< ALSA File descriptor.
+    InOut m_direction;          //!< In or out.
+    std::string m_backend;      //!< Transport: "rawmidi", "seq" or "fifo".
+    std::string m_address;      //!< Address of the port, in the syntax of the transport.
 };
 
+/*! \brief Name of a device in \a DEVICE_CONF, and of the named pipe that stands in for it.
+ *
+ * \param[in] deviceId  Device ID.
+ * \return    The name, without the directory.
+ */
+inline const char *fifoName(int deviceId)
+{
+    static const char *const names[Device::max] =
+        { "none", "a30", "fcb1010", "fantom-out", "fantom-in", "bcf-out", "bcf-in" };
+    return deviceId > Device::none && deviceId < Device::max ? names[deviceId] : "none";
+}
+
 /*! \brief Handles all MIDI traffic, including logging.
  *
- * It uses ALSA drivers to obtain a file descriptor for each MIDI
- * device. After initialisation ALSA is no longer used, as the
- * standard POSIX interface for file descriptors is rich enough.
+ * The devices and their transports are read from \a DEVICE_CONF. A
+ * device is a rawmidi device or a port of the ALSA sequencer, or a named
+ * pipe that a test harness uses to stand in for the hardware. Every
+ * transport has a file descriptor, so the driver waits for all of them
+ * with select(2).
+ * The core can hold the input of a device: the byte it has just read is
+ * put back, and the device is left out of \a wait() until \a release(),
+ * while the other devices are served as usual.
  * This object logs to a curses WINDOW object.
  */
 class Driver {
     WINDOW *m_window;                               //!< a curses WINDOW object to log to.
-    struct Device *m_deviceList;                    //!< List of all MIDI devices.
-    int m_deviceIdToDeviceTabIdx[Device::max];      //!< Map from DeviceId to m_deviceList index.
-    int m_suicideFd;                                //!< Activity on this file descriptor kills the process.
-    int fd(int deviceId) const;
-    int cardNameToNum(const char *target) const;
-    int openRaw(const char *portName, int mode) const;
+    std::vector<Device> m_deviceList;               //!< List of all configured MIDI devices.
+    Port *m_ports[Device::max];                     //!< Map from DeviceId to its port, 0 if none.
+    int m_configFd;                                 //!< inotify watch on the directory with the track definitions.
+    mutable int m_heldByte[Device::max];            //!< Byte put back by \a hold(), -1 if none.
+    bool m_holding;                                 //!< Devices with a held byte are left out of \a wait().
+    Driver(const Driver &);                         //!< Not copyable.
+    Driver &operator=(const Driver &);              //!< Not assignable.
+    Port *port(int deviceId) const;
+    void readConfig(const char *fileName);
+    void fifoConfig(const char *fifoDir);
     void openDevices();
 public:
-    Driver(WINDOW *window);
+    Driver(WINDOW *window, const char *fifoDir = 0);
+    ~Driver();
     int wait(int usecTimeout = 0, int device = Device::all) const;
+    bool configChanged() const;
     uint8_t getByte(int device) const;
+    void hold(int device, uint8_t byte);
+    void release();
+    //! \brief True while input is held.
+    bool holding() const { return m_holding; }
+    bool timestamp(int device, TimeSpec &time) const;
     void putByte(int device, uint8_t b1) const;
     void putBytes(int device, const uint8_t *b, int n) const;
     void putBytes(int device, uint8_t b1, uint8_t b2) const;
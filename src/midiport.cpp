@@ -0,0 +1,302 @@
+/*! \file midiport.cpp
+ *  \brief Contains the transports that carry the MIDI data of a device.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <alsa/asoundlib.h>
+#include "midiport.h"
+#include "timer.h"
+#include "error.h"
+
+namespace Midi {
+
+//! \brief Read a byte from the descriptor.
+uint8_t FdPort::getByte()
+{
+    uint8_t buf;
+    g_timer.read(m_fd, &buf, 1);
+    return buf;
+}
+
+//! \brief Write bytes to the descriptor.
+void FdPort::putBytes(const uint8_t *b, int n)
+{
+    g_timer.write(m_fd, b, n);
+}
+
+namespace
+{
+
+/*! \brief Map an ALSA card name to a card number.
+ *
+ * \param[in] target        Card name to look for.
+ * \return                  The card number, -1 if not found.
+ */
+int cardNameToNum(const char *target)
+{
+    const char *proc = "/proc/asound/cards";
+    int hwNum = -1;
+    FILE *fp = fopen(proc, "r");
+    if (g_timer.timedout() || !fp)
+    {
+        throw(Error("open", errno));
+    }
+    char procLineBuf[100];
+    for (;;)
+    {
+        if (!fgets(procLineBuf, sizeof(procLineBuf), fp))
+            break;
+        if (sscanf(procLineBuf, "%d", &hwNum) == 1)
+        {
+            if (strstr(procLineBuf, target) != 0)
+                break;
+        }
+        hwNum = -1;
+    }
+    fclose(fp);
+    return hwNum;
+}
+
+}
+
+/*! \brief Open a raw midi device.
+ *
+ * \param[in] address   "<card name>,<device>,<subdevice>", or an ALSA name such as "hw:1,0,0".
+ * \param[in] mode      open(2) flag.
+ * \return file descriptor, or -1 on error.
+ */
+int openRawMidi(const std::string &address, int mode)
+{
+    std::string portName = address;
+    size_t comma = address.find(',');
+    if (address.find(':') == std::string::npos && comma != std::string::npos)
+    {
+        int card = cardNameToNum(address.substr(0, comma).c_str());
+        if (card == -1)
+            return -1;
+        char hw[32];
+        sprintf(hw, "hw:%d", card);
+        portName = hw + address.substr(comma);
+    }
+    // abandoned once we have the file descriptor
+    snd_rawmidi_t *rawMidi1, *rawMidi2;
+    if (snd_rawmidi_open(&rawMidi1, &rawMidi2, portName.c_str(), 0) < 0)
+        return -1;
+    struct pollfd pfds;
+    if (mode & O_WRONLY)
+        snd_rawmidi_poll_descriptors(rawMidi2, &pfds, 1);
+    else
+        snd_rawmidi_poll_descriptors(rawMidi1, &pfds, 1);
+    return pfds.fd;
+}
+
+namespace
+{
+
+/*! \brief A port of the ALSA sequencer.
+ *
+ * Every port has a sequencer client of its own, so it has a descriptor
+ * of its own. Input is stamped in real time by a sequencer queue.
+ */
+class SeqPort: public Port
+{
+    snd_seq_t *m_seq;               //!< Sequencer client.
+    int m_port;                     //!< Our port.
+    int m_queue;                    //!< Queue that stamps the input, -1 for output.
+    TimeSpec m_queueStart;          //!< CLOCK_REALTIME when the queue started.
+    snd_midi_event_t *m_codec;      //!< Converts between events and bytes.
+    std::vector<uint8_t> m_buf;     //!< Bytes of the last input event.
+    size_t m_bufIdx;                //!< Next byte to read from \a m_buf.
+    TimeSpec m_time;                //!< Time stamp of the last input event.
+    bool m_stamped;                 //!< True if \a m_time is valid.
+    SeqPort(const SeqPort &);               //!< Not copyable.
+    SeqPort &operator=(const SeqPort &);    //!< Not assignable.
+    void receive();
+public:
+    SeqPort(const std::string &address, bool input);
+    virtual ~SeqPort();
+    virtual int descriptor() const;
+    virtual bool pending() const;
+    virtual uint8_t getByte();
+    virtual void putBytes(const uint8_t *b, int n);
+    virtual bool timestamp(TimeSpec &time) const;
+};
+
+/*! \brief Create a port and connect it.
+ *
+ * \param[in] address   Sequencer address to connect to, "<client>:<port>" or "<client name>:<port>".
+ * \param[in] input     True to receive from \a address, false to send to it.
+ */
+SeqPort::SeqPort(const std::string &address, bool input):
+    m_seq(0), m_port(-1), m_queue(-1), m_codec(0), m_bufIdx(0), m_stamped(false)
+{
+    // an input port sends the start of its queue
+    int rv = snd_seq_open(&m_seq, "default", input ? SND_SEQ_OPEN_DUPLEX : SND_SEQ_OPEN_OUTPUT, 0);
+    if (rv < 0)
+    {
+        Error e;
+        e.stream() << "snd_seq_open: " << snd_strerror(rv);
+        throw(e);
+    }
+    snd_seq_set_client_name(m_seq, "patcher");
+    snd_seq_addr_t peer;
+    if ((rv = snd_seq_parse_address(m_seq, &peer, address.c_str())) < 0
+        || (rv = snd_midi_event_new(256, &m_codec)) < 0)
+    {
+        snd_seq_close(m_seq);
+        Error e;
+        e.stream() << "sequencer port " << address << ": " << snd_strerror(rv);
+        throw(e);
+    }
+    // the event loop needs a status byte in every message
+    snd_midi_event_no_status(m_codec, 1);
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca(&info);
+    snd_seq_port_info_set_name(info, address.c_str());
+    snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION);
+    if (input)
+    {
+        snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE);
+        m_queue = snd_seq_alloc_named_queue(m_seq, "patcher");
+        snd_seq_port_info_set_timestamping(info, 1);
+        snd_seq_port_info_set_timestamp_real(info, 1);
+        snd_seq_port_info_set_timestamp_queue(info, m_queue);
+    }
+    else
+    {
+        snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ);
+    }
+    if ((rv = snd_seq_create_port(m_seq, info)) < 0
+        || (rv = input ? snd_seq_connect_from(m_seq, snd_seq_port_info_get_port(info), peer.client, peer.port)
+                       : snd_seq_connect_to(m_seq, snd_seq_port_info_get_port(info), peer.client, peer.port)) < 0)
+    {
+        snd_midi_event_free(m_codec);
+        snd_seq_close(m_seq);
+        Error e;
+        e.stream() << "sequencer port " << address << ": " << snd_strerror(rv);
+        throw(e);
+    }
+    m_port = snd_seq_port_info_get_port(info);
+    if (input)
+    {
+        snd_seq_start_queue(m_seq, m_queue, 0);
+        snd_seq_drain_output(m_seq);
+        getTime(m_queueStart);
+    }
+}
+
+//! \brief Destructor.
+SeqPort::~SeqPort()
+{
+    snd_midi_event_free(m_codec);
+    snd_seq_close(m_seq);
+}
+
+//! \brief The descriptor of the sequencer client.
+int SeqPort::descriptor() const
+{
+    struct pollfd pfds;
+    snd_seq_poll_descriptors(m_seq, &pfds, 1, POLLIN);
+    return pfds.fd;
+}
+
+//! \brief True if bytes of an event, or events, are waiting in user space.
+bool SeqPort::pending() const
+{
+    return m_bufIdx < m_buf.size() || (m_queue >= 0 && snd_seq_event_input_pending(m_seq, 0) > 0);
+}
+
+//! \brief Read the next event into \a m_buf.
+void SeqPort::receive()
+{
+    snd_seq_event_t *ev = 0;
+    for (;;)
+    {
+        int rv = snd_seq_event_input(m_seq, &ev);
+        if (g_timer.timedout())
+            throw(TimeoutError("read timeout"));
+        if (rv >= 0 && ev)
+            break;
+        if (rv < 0 && rv != -EAGAIN && rv != -EINTR && rv != -ENOSPC)
+        {
+            Error e;
+            e.stream() << "snd_seq_event_input: " << snd_strerror(rv);
+            throw(e);
+        }
+    }
+    size_t size = snd_seq_ev_is_variable(ev) ? ev->data.ext.len + 16 : 16;
+    m_buf.resize(size);
+    long n = snd_midi_event_decode(m_codec, &m_buf[0], size, ev);
+    m_buf.resize(n > 0 ? n : 0);
+    m_bufIdx = 0;
+    m_stamped = (ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_REAL;
+    if (m_stamped)
+        timeSum(m_time, m_queueStart, TimeSpec(ev->time.time.tv_sec, ev->time.time.tv_nsec));
+}
+
+//! \brief Read a byte, events that carry no MIDI bytes are skipped.
+uint8_t SeqPort::getByte()
+{
+    while (m_bufIdx >= m_buf.size())
+        receive();
+    return m_buf[m_bufIdx++];
+}
+
+//! \brief Encode bytes into events and send them, a SysEx message may span calls.
+void SeqPort::putBytes(const uint8_t *b, int n)
+{
+    while (n > 0)
+    {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        long used = snd_midi_event_encode(m_codec, b, n, &ev);
+        if (used <= 0)
+        {
+            snd_midi_event_reset_encode(m_codec);
+            break;
+        }
+        b += used;
+        n -= used;
+        if (ev.type == SND_SEQ_EVENT_NONE)
+            continue;
+        snd_seq_ev_set_source(&ev, m_port);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+        int rv = snd_seq_event_output_direct(m_seq, &ev);
+        if (g_timer.timedout())
+            throw(TimeoutError("write timeout"));
+        if (rv < 0)
+        {
+            Error e;
+            e.stream() << "snd_seq_event_output_direct: " << snd_strerror(rv);
+            throw(e);
+        }
+    }
+}
+
+//! \brief The time the last input event arrived, stamped by the kernel.
+bool SeqPort::timestamp(TimeSpec &time) const
+{
+    if (m_stamped)
+        time = m_time;
+    return m_stamped;
+}
+
+}
+
+/*! \brief Open a port of the ALSA sequencer.
+ *
+ * \param[in] address   Sequencer address to connect to, as shown by aconnect -l.
+ * \param[in] input     True to receive from \a address, false to send to it.
+ * \return    The port, owned by the caller.
+ */
+Port *openSeqPort(const std::string &address, bool input)
+{
+    return new SeqPort(address, input);
+}
+
+} // namespace Midi
@@ -0,0 +1,61 @@
+/*! \file midiport.h
+ *  \brief Contains the transports that carry the MIDI data of a device.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef MIDI_PORT_H
+#define MIDI_PORT_H
+#include <stdint.h>
+#include <string>
+#include "timestamp.h"
+
+namespace Midi
+{
+
+/*! \brief The transport of a MIDI device, in one or both directions.
+ *
+ * \a Driver waits on the descriptors of all ports with select(2), so
+ * every port must have one, and report data it has buffered itself
+ * with \a pending().
+ */
+class Port
+{
+public:
+    virtual ~Port() { }
+    //! \brief File descriptor that becomes readable on input.
+    virtual int descriptor() const = 0;
+    //! \brief True if input is buffered in the port, so select(2) would not see it.
+    virtual bool pending() const { return false; }
+    //! \brief Read a byte, this blocks, and an \a Alarm may cause an exception.
+    virtual uint8_t getByte() = 0;
+    //! \brief Write bytes.
+    virtual void putBytes(const uint8_t *b, int n) = 0;
+    /*! \brief The time the device sent the last byte read, if the transport knows it.
+     *
+     * \param[out] time     CLOCK_REALTIME.
+     * \return     False if unknown.
+     */
+    virtual bool timestamp(TimeSpec &) const { return false; }
+};
+
+/*! \brief A port that is a plain file descriptor.
+ *
+ * Used for ALSA rawmidi devices and for named pipes.
+ */
+class FdPort: public Port
+{
+    int m_fd;       //!< The file descriptor.
+public:
+    //! \brief Construct from an open file descriptor.
+    explicit FdPort(int fd): m_fd(fd) { }
+    virtual int descriptor() const { return m_fd; }
+    virtual uint8_t getByte();
+    virtual void putBytes(const uint8_t *b, int n);
+};
+
+int openRawMidi(const std::string &address, int mode);
+Port *openSeqPort(const std::string &address, bool input);
+
+} // namespace Midi
+
+#endif // MIDI_PORT_H
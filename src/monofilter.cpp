@@ -68,3 +68,36 @@ bool MonoFilter::passNoteOff(uint8_t note, uint8_t velo)
     (void)velo;
     return passNoteOn(note,0);
 }
+
+//! \brief Forget all keys and the sustain pedal.
+void MonoFilter::reset()
+{
+    for (int i=0; i<Midi::Note::max; i++)
+    {
+        m_noteOnCount[i] = 0;
+        m_ringing[i] = false;
+    }
+    m_sustain = false;
+}
+
+//! \brief Copy the filter state.
+void MonoFilter::getState(State &state) const
+{
+    for (int i=0; i<Midi::Note::max; i++)
+    {
+        state.m_noteOnCount[i] = m_noteOnCount[i];
+        state.m_ringing[i] = m_ringing[i] ? 1 : 0;
+    }
+    state.m_sustain = m_sustain ? 1 : 0;
+}
+
+//! \brief Restore the filter state.
+void MonoFilter::setState(const State &state)
+{
+    for (int i=0; i<Midi::Note::max; i++)
+    {
+        m_noteOnCount[i] = state.m_noteOnCount[i];
+        m_ringing[i] = state.m_ringing[i] != 0;
+    }
+    m_sustain = state.m_sustain != 0;
+}
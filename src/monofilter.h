@@ -16,9 +16,19 @@ class MonoFilter
     bool m_ringing[Midi::Note::max];            //!< 'ringing' flag for each note.
     bool m_sustain;                             //!< Last known state of the sustain pedal.
 public:
+    //! \brief A copy of the filter state, to survive a restart of the core.
+    struct State
+    {
+        uint8_t m_noteOnCount[Midi::Note::max]; //!< Number of note on events seen for each note.
+        uint8_t m_ringing[Midi::Note::max];     //!< 'ringing' flag for each note.
+        uint8_t m_sustain;                      //!< Last known state of the sustain pedal.
+    };
     MonoFilter();
     void sustain(bool b);
     bool passNoteOn(uint8_t note, uint8_t velo);
     bool passNoteOff(uint8_t note, uint8_t velo);
+    void reset();
+    void getState(State &state) const;
+    void setState(const State &state);
 };
 #endif
@@ -0,0 +1,139 @@
+/*! \file netclient.cpp
+ *  \brief Serves the patcher state to displays on other machines.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include "queue.h"
+#include "remote.h"
+#include "liveshm.h"
+#include "error.h"
+
+/*! \brief Pass the events from the event queue and the live state to the viewers.
+ *
+ * Waits on both the queue and the socket, so the viewers are answered
+ * while the core is quiet. The live state is checked on every wakeup,
+ * so a position change is passed on even if its event was dropped.
+ */
+void serveEvents(Remote::Server &server)
+{
+    Queue eventRxQueue;
+    eventRxQueue.openRead();
+    SharedLiveState liveState;
+    uint32_t liveSequence = 0;
+    LiveShm::State live;
+    pollfd fds[2];
+    fds[0].fd = eventRxQueue.descriptor();
+    fds[0].events = POLLIN;
+    fds[1].fd = server.descriptor();
+    fds[1].events = POLLIN;
+    Event event;
+    for (;;)
+    {
+        if (poll(fds, 2, 1000) == -1 && errno != EINTR)
+            throw(Error("poll", errno));
+        while (eventRxQueue.tryReceive(event))
+            server.publish(event);
+        uint32_t sequence = liveState.sequence();
+        if ((sequence != liveSequence || sequence == 0) && liveState.read(live))
+        {
+            liveSequence = sequence;
+            server.publish(live);
+        }
+        server.poll();
+        server.heartbeat();
+    }
+}
+
+/*! \brief Show the state of a remote patcher, a line per change.
+ *
+ * This is the simplest display, others can use \a Remote::Viewer the
+ * same way.
+ */
+void showState(const char *host, uint16_t port)
+{
+    Remote::Viewer viewer;
+    viewer.open(host, port);
+    Remote::State shown;
+    shown.clear();
+    bool shownSynced = false;
+    for (;;)
+    {
+        viewer.receive(1000);
+        const Remote::State &state = viewer.state();
+        if (viewer.synced() == shownSynced && (!viewer.synced() || state == shown))
+            continue;
+        shown = state;
+        shownSynced = viewer.synced();
+        if (!shownSynced)
+        {
+            printf("%08x resync\n", viewer.sequence());
+            continue;
+        }
+        const Remote::Position &position = state.m_position;
+        printf("%08x meta %u track %u section %u set %u sync %u/%u/%u notes",
+            viewer.sequence(), position.m_metaMode, position.m_currentTrack,
+            position.m_currentSection, position.m_trackIdxWithinSet,
+            position.m_nofSynced, position.m_nofToSync, position.m_nofSyncErrors);
+        for (int i=0; i<Midi::NofChannels; i++)
+            printf(" %u", state.m_noteOn[i]);
+        printf("\n");
+        fflush(stdout);
+    }
+}
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    int port = Remote::DefaultPort;
+    const char *host = 0;
+    for (;;)
+    {
+        int opt = getopt(argc, argv, "p:c:h");
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                host = optarg;
+                break;
+            default:
+                fprintf(stderr, "\nnet_client [-h|?] [-p <port>] [-c <host>]\n\n"
+                    "  -h|?     This message\n"
+                    "  -p       UDP port of the server, default %d\n"
+                    "  -c       Show the state served by net_client on this host,\n"
+                    "           instead of serving the local events\n\n",
+                    Remote::DefaultPort);
+                return 1;
+                break;
+        }
+    }
+    if (argc > optind)
+    {
+        fprintf(stderr, "unrecognised trailing arguments, try -h\n");
+    }
+    try
+    {
+        if (host)
+        {
+            showState(host, port);
+            return 0;
+        }
+        Remote::Server server;
+        server.open(port);
+        serveEvents(server);
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        return e.exitCode();
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*! \file netloopback.cpp
+ *  \brief Checks that a remote view stays consistent when frames are lost.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "remote.h"
+#include "mididriver.h"
+#include "error.h"
+
+namespace
+{
+
+//! \brief Change the live state now and then, the way the core does.
+void randomLiveState(LiveShm::State &live)
+{
+    if (rand() % 50 == 0)
+        live.m_metaMode = !live.m_metaMode;
+    if (rand() % 100 == 0)
+        live.m_currentTrack = rand() % 300;
+    if (rand() % 50 == 0)
+        live.m_currentSection = rand() % 4;
+    if (rand() % 200 == 0)
+        live.m_trackIdxWithinSet = rand() % 300;
+    if (rand() % 50 == 0)
+    {
+        live.m_nofSynced = rand() % 300;
+        live.m_nofToSync = 300;
+        live.m_nofSyncErrors = rand() % 3;
+    }
+}
+
+//! \brief A random event of the kinds the remote state is built from.
+void randomEvent(Event &event, int i)
+{
+    event.m_packetCounter = i;
+    event.m_deviceId = Midi::Device::FantomOut;
+    event.m_part = rand() % Midi::NofChannels;
+    int kind = rand() % 100;
+    event.m_type = Event::MidiOut3Bytes;
+    uint8_t channel = rand() % Midi::NofChannels;
+    if (kind < 10)
+    {
+        event.m_midi[0] = Midi::controller | channel;
+        event.m_midi[1] = kind < 4 ? Midi::allNotesOff : Midi::mainVolume;
+        event.m_midi[2] = rand() % 128;
+    }
+    else
+    {
+        event.m_midi[0] = (kind < 55 ? Midi::noteOn : Midi::noteOff) | channel;
+        event.m_midi[1] = rand() % 128;
+        event.m_midi[2] = kind < 55 ? 1 + rand() % 127 : 0;
+    }
+}
+
+//! \brief Let the viewer and the server handle what is pending.
+void exchange(Remote::Server &server, Remote::Viewer &viewer, int timeoutMs)
+{
+    server.poll();
+    while (viewer.receive(timeoutMs))
+    {
+        server.poll();
+        timeoutMs = 0;
+    }
+}
+
+}
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    int nofEvents = 20000;
+    int lossPercentage = 10;
+    int paceUs = 200;
+    for (;;)
+    {
+        int opt = getopt(argc, argv, "n:l:p:h");
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'n':
+                nofEvents = atoi(optarg);
+                break;
+            case 'l':
+                lossPercentage = atoi(optarg);
+                break;
+            case 'p':
+                paceUs = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "\nnet_loopback [-h|?] [-n <events>] [-l <percentage>] [-p <us>]\n\n"
+                    "  -h|?     This message\n"
+                    "  -n       Number of events to send, default 20000\n"
+                    "  -l       Percentage of frames lost in both directions, default 10\n"
+                    "  -p       Microseconds between events, default 200\n\n");
+                return 1;
+                break;
+        }
+    }
+    try
+    {
+        Remote::Server server;
+        server.open(0, INADDR_LOOPBACK);
+        server.setLossPercentage(lossPercentage);
+        Remote::Viewer viewer;
+        viewer.open("127.0.0.1", server.port());
+        viewer.setLossPercentage(lossPercentage);
+        srand(1);
+
+        int nofChecks = 0;
+        int nofMismatches = 0;
+        Event event;
+        LiveShm::State live;
+        live.clear();
+        for (int i=0; i<nofEvents; i++)
+        {
+            randomLiveState(live);
+            server.publish(live);
+            randomEvent(event, i);
+            server.publish(event);
+            exchange(server, viewer, 0);
+            if (paceUs > 0)
+                usleep(paceUs);
+            // a synced view must match the server at the same sequence number
+            if (viewer.synced() && viewer.sequence() == server.sequence())
+            {
+                nofChecks++;
+                if (viewer.state() != server.state())
+                    nofMismatches++;
+            }
+        }
+        // the heartbeats must bring the view back in sync after the last delta
+        TimeSpec start, now;
+        getTime(start);
+        getTime(now);
+        while (timeDiffSeconds(start, now) < 10
+            && !(viewer.synced() && viewer.sequence() == server.sequence()))
+        {
+            server.heartbeat();
+            exchange(server, viewer, 100);
+            getTime(now);
+        }
+        bool converged = viewer.synced() && viewer.sequence() == server.sequence()
+            && viewer.state() == server.state();
+        printf("events %d, loss %d%%, checks %d, mismatches %d, resyncs %d, converged %s\n",
+            nofEvents, lossPercentage, nofChecks, nofMismatches, viewer.nofResyncs(),
+            converged ? "yes" : "no");
+        return nofMismatches == 0 && converged ? 0 : 1;
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        return e.exitCode();
+    }
+}
@@ -7,82 +7,220 @@
 #define _POSIX_SOURCE
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <iostream>
+#include <sstream>
 #include <stdio.h>
 #include <errno.h>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include "queue.h"
 
 namespace
 {
 
 const int maxSubProcesses = 2; //!< Max sub processes managed by this process.
+const uint64_t quickDeathNs = (uint64_t)5 * 1000000000u;   //!< A process that dies sooner after its start is crash looping.
+const uint64_t firstBackoffNs = 250000000u;                 //!< Delay of the second restart in a row of quick deaths.
+const uint64_t maxBackoffNs = (uint64_t)8 * 1000000000u;   //!< Longest delay of a restart.
+const int coldStartAfter = 3;   //!< Quick deaths in a row after which the core ignores its warm start snapshot.
 
-//! \brief A process name and a PID.
+//! \brief CLOCK_MONOTONIC in nanoseconds.
+uint64_t now()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+//! \brief A supervised process.
 class Process
 {
 public:
     std::string m_name; //!<    Process name.
-    pid_t   m_pid;      //!<    PID.
+    pid_t   m_pid;      //!<    PID, -1 if it is not running.
+    int m_renice;       //!<    Nice increment.
+    bool m_core;        //!<    True for the core, which is told about its restarts.
+    int m_nofRestarts;  //!<    Restarts so far.
+    int m_nofQuickDeaths;   //!< Deaths in a row shortly after the start.
+    int m_signal;       //!<    Signal that stopped it last, 0 if it exited.
+    int m_exitCode;     //!<    Exit code of its last exit.
+    uint64_t m_started; //!<    When it was started.
+    uint64_t m_restart; //!<    When it is restarted, if it is not running.
+    //! \brief Why it stopped last.
+    std::string reason() const
+    {
+        std::stringstream ss;
+        if (m_signal)
+            ss << "signal " << m_signal << " (" << strsignal(m_signal) << ")";
+        else
+            ss << "exit code " << m_exitCode;
+        return ss.str();
+    }
 };
 
-//! \brief Handler for all signals.
-void signalHandler(int sigNum, siginfo_t *sigInfo, void *unused);
-
-//! \brief Admin process for the core and the curses tasks.
+/*! \brief Admin process for the core and the curses tasks.
+ *
+ * Every process is supervised on its own: a process that stops is
+ * started again right away, the others keep running. The event queue
+ * stays, so the clients stay attached while the core restarts, and
+ * resync from the shared memory the new core publishes. A process that
+ * keeps dying shortly after its start is restarted with a backoff, and
+ * a crash looping core is told to ignore its warm start snapshot.
+ *
+ * SIGCHLD, SIGTERM and SIGINT are blocked and taken by \a supervise(),
+ * so no signal is lost between two waits.
+ */
 class Admin
 {
-friend
-    void signalHandler(int sigNum, siginfo_t *sigInfo, void *unused);
     Process m_process[maxSubProcesses]; //!<    Process table.
-    bool m_terminate;                   //!<    Raised on SIGTERM and SIGINT.
-public:
-    //! \brief Check termination flag.
-    bool terminate() const { return m_terminate; }
-    //! \brief Start a process in slot i.
-    void startProcess(int i, const char *name, int renice = 0)
+    int m_nofProcesses;                 //!<    Processes in the table.
+    sigset_t m_signals;                 //!<    Signals taken by \a supervise().
+    sigset_t m_childMask;               //!<    Signal mask of the children.
+    //! \brief Start a process.
+    void start(Process &process)
     {
+        std::vector<std::string> args(1, process.m_name);
+        if (process.m_core && process.m_nofRestarts > 0)
+        {
+            std::stringstream ss;
+            ss << process.m_nofRestarts << "," << process.m_signal << "," << process.m_exitCode;
+            args.push_back("-R");
+            args.push_back(ss.str());
+        }
+        if (process.m_core && process.m_nofQuickDeaths >= coldStartAfter)
+            args.push_back("-C");
+        std::vector<char *> argv;
+        for (size_t i=0; i<args.size(); i++)
+            argv.push_back(const_cast<char *>(args[i].c_str()));
+        argv.push_back(0);
+        process.m_started = now();
         pid_t pid = fork();
         if (pid == 0)
         {
-            if (renice != 0)
-                nice(renice);
-            //std::cout << "launching " << name << " " << getpid() << std::endl;
-            execl(name, name, 0);
-            std::cerr << "execl " << name << ": "
+            sigprocmask(SIG_SETMASK, &m_childMask, 0);
+            if (process.m_renice != 0)
+                nice(process.m_renice);
+            execv(argv[0], &argv[0]);
+            std::cerr << "execv " << argv[0] << ": "
                 << strerror(errno) << "\n";
-            exit(1);
+            _exit(1);
+        }
+        if (pid == -1)
+        {
+            perror("fork");
+            process.m_restart = process.m_started + maxBackoffNs;
         }
-        m_process[i].m_name = std::string(name);
-        m_process[i].m_pid = pid;
+        process.m_pid = pid;
     }
-    //! \brief The number of managed processes.
-    size_t nofProcesses() const
+    //! \brief Schedule the restart of a process that has stopped.
+    void stopped(Process &process, int status)
     {
-        size_t n = 0;
-        for (int i=0; i<maxSubProcesses; i++)
-            if (m_process[i].m_pid != -1)
-                n++;
-        return n;
+        uint64_t t = now();
+        process.m_pid = -1;
+        process.m_signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        process.m_exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+        if (t - process.m_started < quickDeathNs)
+            process.m_nofQuickDeaths++;
+        else
+            process.m_nofQuickDeaths = 0;
+        // the first restart is immediate, then the delay doubles
+        uint64_t delay = 0;
+        if (process.m_nofQuickDeaths > 1)
+        {
+            delay = maxBackoffNs;
+            if (process.m_nofQuickDeaths - 2 < 6)
+                delay = std::min(delay, firstBackoffNs << (process.m_nofQuickDeaths - 2));
+        }
+        process.m_restart = t + delay;
+        process.m_nofRestarts++;
+        std::cerr << process.m_name << " stopped: " << process.reason()
+            << ", restart " << process.m_nofRestarts
+            << " in " << delay / 1000000 << " ms\n";
     }
-    //! \brief Drop a process from the process table.
-    void dropProcess(pid_t pid)
+    //! \brief Reap every child that has stopped.
+    void reap()
     {
-        for (int i=0; i<maxSubProcesses; i++)
-            if (m_process[i].m_pid == pid)
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (int i=0; i<m_nofProcesses; i++)
             {
-                m_process[i].m_pid = -1;
-                break;
+                if (m_process[i].m_pid == pid)
+                    stopped(m_process[i], status);
+            }
+        }
+    }
+public:
+    //! \brief Default constructor.
+    Admin(): m_nofProcesses(0)
+    {
+        sigemptyset(&m_signals);
+        sigaddset(&m_signals, SIGCHLD);
+        sigaddset(&m_signals, SIGTERM);
+        sigaddset(&m_signals, SIGINT);
+        if (sigprocmask(SIG_BLOCK, &m_signals, &m_childMask) < 0)
+            perror("sigprocmask");
+    }
+    //! \brief Add a process to the table and start it.
+    void startProcess(const char *name, bool core, int renice = 0)
+    {
+        Process &process = m_process[m_nofProcesses++];
+        process.m_name = std::string(name);
+        process.m_renice = renice;
+        process.m_core = core;
+        process.m_nofRestarts = 0;
+        process.m_nofQuickDeaths = 0;
+        process.m_signal = 0;
+        process.m_exitCode = 0;
+        start(process);
+    }
+    /*! \brief Restart the processes that are due, and wait for a signal.
+     *
+     * \return False on SIGTERM or SIGINT.
+     */
+    bool supervise()
+    {
+        uint64_t t = now();
+        uint64_t wake = 0;
+        for (int i=0; i<m_nofProcesses; i++)
+        {
+            Process &process = m_process[i];
+            if (process.m_pid != -1)
+                continue;
+            if (process.m_restart <= t)
+            {
+                start(process);
+                t = now();
             }
+            if (process.m_pid == -1 && (wake == 0 || process.m_restart < wake))
+                wake = process.m_restart;
+        }
+        int sigNum;
+        if (wake == 0)
+        {
+            sigNum = sigwaitinfo(&m_signals, 0);
+        }
+        else
+        {
+            uint64_t dt = wake > t ? wake - t : 0;
+            timespec timeout = { (time_t)(dt / 1000000000u), (long)(dt % 1000000000u) };
+            sigNum = sigtimedwait(&m_signals, 0, &timeout);
+        }
+        reap();
+        return sigNum != SIGTERM && sigNum != SIGINT;
     }
     //! \brief Kill every process in the table.
     void killAll()
     {
-        for (int i=0; i<maxSubProcesses; i++)
+        for (int i=0; i<m_nofProcesses; i++)
         {
             pid_t pid = m_process[i].m_pid;
             if (pid != -1)
@@ -94,46 +232,8 @@ public:
             }
         }
     }
-    //! \brief Default constructor.
-    Admin(): m_terminate(false)
-    {
-        for (int i=0; i<maxSubProcesses; i++)
-            m_process[i].m_pid = -1;
-
-        struct sigaction act;
-        act.sa_sigaction = signalHandler;
-        sigemptyset(&act.sa_mask);
-        act.sa_flags = SA_SIGINFO;
-        if (sigaction(SIGCHLD, &act, 0) < 0)
-            perror("sigaction SIGCHLD");
-        if (sigaction(SIGTERM, &act, 0) < 0)
-            perror("sigaction SIGTERM");
-        if (sigaction(SIGINT, &act, 0) < 0)
-            perror("sigaction SIGINT");
-    }
 };
 
-Admin admin;    //!<    Global Admin object.
-
-//! \brief Handler for all SIGCHLD, SIGTERM and SIGINT.
-void signalHandler(int sigNum, siginfo_t *sigInfo, void *unused)
-{
-    (void)unused;
-    switch (sigNum)
-    {
-        case SIGCHLD:
-            admin.dropProcess(sigInfo->si_pid);
-            waitpid(-1, 0, WNOHANG);
-            break;
-        case SIGTERM:
-        case SIGINT:
-            admin.m_terminate = true;
-            break;
-        default:
-            ;
-    }
-}
-
 } // anonymous namespace
 
 //! \brief Patcher task main entry.
@@ -168,33 +268,23 @@ int main(int argc, char **argv)
         std::cerr << "unrecognised trailing arguments, try -h\n";
         return 1;
     }
+    Admin admin;
     Queue q;
     q.create();
-    int nofSubProcesses = 1;
-    admin.startProcess(0, "./patcher_core");
+    admin.startProcess("./patcher_core", true);
     switch (client)
     {
         case Curses:
-            nofSubProcesses++;
-            admin.startProcess(1, "./curses_client", 10);
+            admin.startProcess("./curses_client", false, 10);
             break;
         case Stdout:
-            nofSubProcesses++;
-            admin.startProcess(1, "./stdout_client", 10);
+            admin.startProcess("./stdout_client", false, 10);
             break;
         default:
             ;
     }
-    for (;;)
-    {
-        if (admin.nofProcesses() != (size_t)nofSubProcesses)
-            // failed launch or unexpected death
-            break;
-        if (admin.terminate())
-            break;
-        pause();
-        std::cerr << "caught signal\n";
-    }
+    while (admin.supervise())
+        ;
     admin.killAll();
     q.unlink();
     return 0;
@@ -0,0 +1,826 @@
+/*! \file patcherbench.cpp
+ *  \brief Measures the routing and filter primitives of the core in isolation.
+ *
+ *  Every benchmark is calibrated to run for a fixed time per sample, and
+ *  the median of a number of samples is reported, as JSON on stdout, so
+ *  results can be kept and compared between builds. Build with
+ *  SINGLE_PRECISION and with DOUBLE_PRECISION to compare the Pi and the PC.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trackdef.h"
+#include "router.h"
+#include "controller.h"
+#include "toggler.h"
+#include "monofilter.h"
+#include "transposer.h"
+#include "mididef.h"
+#include "activity.h"
+#include "queue.h"
+#include "timestamp.h"
+#include "xml.h"
+#include "persistent.h"
+#include "checksum.h"
+#include "ipcname.h"
+#include "error.h"
+
+namespace
+{
+
+//! \brief Results are accumulated here, so the compiler cannot drop the work.
+volatile uint32_t g_sink;
+
+//! \brief A MIDI message of an input stream.
+struct Message
+{
+    uint8_t m_status;   //!< Status byte.
+    uint8_t m_data1;    //!< Data byte 1.
+    uint8_t m_data2;    //!< Data byte 2.
+};
+
+/*! \brief Chords of three notes over the keyboard, note on and note off.
+ *
+ * \param[in] channel   MIDI channel.
+ * \return    384 messages, every note on has its note off.
+ */
+std::vector<Message> noteStream(uint8_t channel)
+{
+    std::vector<Message> stream;
+    for (int k=0; k<64; k++)
+    {
+        uint8_t root = Midi::Note::C0 + 36 + (k*7) % 48;
+        uint8_t chord[3] = { root, (uint8_t)(root+4), (uint8_t)(root+7) };
+        for (int on=1; on>=0; on--)
+        {
+            for (int i=0; i<3; i++)
+            {
+                Message m;
+                m.m_status = (on ? Midi::noteOn : Midi::noteOff) | channel;
+                m.m_data1 = chord[i];
+                m.m_data2 = on ? 100 : 64;
+                stream.push_back(m);
+            }
+        }
+    }
+    return stream;
+}
+
+/*! \brief Expression pedal sweeps on controller 16, with the sustain pedal.
+ *
+ * \param[in] channel   MIDI channel.
+ * \return    The messages.
+ */
+std::vector<Message> controllerStream(uint8_t channel)
+{
+    std::vector<Message> stream;
+    for (int v=0; v<256; v++)
+    {
+        Message m;
+        m.m_status = Midi::controller | channel;
+        m.m_data1 = Midi::continuousController16;
+        m.m_data2 = v < 128 ? v : 255-v;
+        stream.push_back(m);
+        if (v % 32 == 0)
+        {
+            m.m_data1 = Midi::sustain;
+            m.m_data2 = v % 64 ? 0 : 127;
+            stream.push_back(m);
+        }
+    }
+    return stream;
+}
+
+//! \brief A benchmark, \a run() does \a iterations operations.
+class Benchmark
+{
+    std::string m_name;     //!< Name in the report.
+public:
+    //! \brief Construct with a name.
+    explicit Benchmark(const std::string &name): m_name(name) { }
+    virtual ~Benchmark() { }
+    //! \brief The name.
+    const std::string &name() const { return m_name; }
+    //! \brief Do an operation \a iterations times.
+    virtual void run(long iterations) = 0;
+};
+
+//! \brief Route a message stream through a section.
+class RouteBenchmark: public Benchmark
+{
+    Section *m_section;             //!< The section.
+    std::vector<Message> m_stream;  //!< Messages, routed in a loop.
+    RoutedMessageList m_out;        //!< Output of \a route().
+    size_t m_idx;                   //!< Next message.
+public:
+    //! \brief Construct for a section and a stream.
+    RouteBenchmark(const std::string &name, Section *section, const std::vector<Message> &stream):
+        Benchmark(name), m_section(section), m_stream(stream), m_idx(0) { }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[m_idx];
+            m_idx = m_idx+1 < m_stream.size() ? m_idx+1 : 0;
+            route(m_section, m.m_status, m.m_data1, m.m_data2, m_out);
+            n += m_out.size();
+        }
+        g_sink += n;
+    }
+};
+
+/*! \brief Route a message stream and keep the warm start snapshot, like \a Patcher::sendEventToFantom().
+ *
+ * Every routed message goes to \a Persist::apply(), and the parts that
+ * \a route() reports go to \a Persist::storePart(). With \a everyPart, all
+ * parts of the section are stored after every note and sustain message,
+ * which is what the core did before \a route() reported them.
+ */
+class SnapshotBenchmark: public Benchmark
+{
+    Persist *m_persist;             //!< The snapshot.
+    Section *m_section;             //!< The section.
+    std::vector<Message> m_stream;  //!< Messages, routed in a loop.
+    RoutedMessageList m_out;        //!< Output of \a route().
+    size_t m_idx;                   //!< Next message.
+    bool m_everyPart;               //!< Store all parts, not just the changed ones.
+public:
+    //! \brief Construct for a snapshot, a section and a stream.
+    SnapshotBenchmark(const std::string &name, Persist *persist, Section *section,
+        const std::vector<Message> &stream, bool everyPart):
+        Benchmark(name), m_persist(persist), m_section(section), m_stream(stream),
+        m_idx(0), m_everyPart(everyPart) { }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        const SwPartList &partList = m_section->m_partList;
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[m_idx];
+            m_idx = m_idx+1 < m_stream.size() ? m_idx+1 : 0;
+            uint64_t changed = route(m_section, m.m_status, m.m_data1, m.m_data2, m_out);
+            for (size_t j=0; j<m_out.size(); j++)
+                m_persist->apply(m_out[j].m_status, m_out[j].m_data1, m_out[j].m_data2, m_out[j].m_part);
+            if (m_everyPart && (Midi::isNote(m.m_status)
+                || (Midi::isController(m.m_status) && m.m_data1 == Midi::sustain)))
+                changed = ~(uint64_t)0;
+            for (size_t j=0; j<partList.size() && j<64; j++)
+            {
+                if (changed & ((uint64_t)1 << j))
+                    m_persist->storePart((int)j, *partList[j]);
+            }
+            n += m_out.size();
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a Persist::apply() on note messages, from 4 parts.
+class PersistApplyBenchmark: public Benchmark
+{
+    Persist *m_persist;             //!< The snapshot.
+    std::vector<Message> m_stream;  //!< Note messages.
+public:
+    //! \brief Construct for a snapshot.
+    explicit PersistApplyBenchmark(Persist *persist):
+        Benchmark("Persist::apply"), m_persist(persist), m_stream(noteStream(0)) { }
+    virtual void run(long iterations)
+    {
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[i % m_stream.size()];
+            m_persist->apply(m.m_status, m.m_data1, m.m_data2, (int)(i & 3));
+        }
+        g_sink += (uint32_t)iterations;
+    }
+};
+
+//! \brief \a Persist::storePart() of a part with a transposer.
+class PersistStorePartBenchmark: public Benchmark
+{
+    Persist *m_persist;             //!< The snapshot.
+    Arena m_arena;                  //!< Arena of the part.
+    SwPart *m_part;                 //!< The part.
+public:
+    //! \brief Construct for a snapshot.
+    explicit PersistStorePartBenchmark(Persist *persist):
+        Benchmark("Persist::storePart"), m_persist(persist)
+    {
+        m_part = new (m_arena) SwPart(m_arena, 0, "part");
+        m_part->m_transposer = new (m_arena) Transposer(12);
+    }
+    virtual void run(long iterations)
+    {
+        for (long i=0; i<iterations; i++)
+            m_persist->storePart((int)(i & 15), *m_part);
+        g_sink += (uint32_t)iterations;
+    }
+};
+
+//! \brief \a adler32() of a note owner record, what \a Persist::apply() used to do for every note.
+class OwnerChecksumBenchmark: public Benchmark
+{
+    uint8_t m_owner[Midi::Note::max];   //!< A note owner record.
+public:
+    //! \brief Construct.
+    OwnerChecksumBenchmark(): Benchmark("adler32/ownerRecord")
+    {
+        memset(m_owner, Persist::NoOwner, sizeof(m_owner));
+    }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        for (long i=0; i<iterations; i++)
+        {
+            m_owner[i & 127] = (uint8_t)i;
+            n += adler32(m_owner, sizeof(m_owner));
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a ControllerRemap::Default::value() on controller sweeps.
+class RemapBenchmark: public Benchmark
+{
+    const ControllerRemap::Default *m_remap;    //!< The remap.
+    std::vector<Message> m_stream;              //!< Controller messages.
+public:
+    //! \brief Construct for a remap, which is owned by the caller.
+    explicit RemapBenchmark(const ControllerRemap::Default *remap):
+        Benchmark(std::string("ControllerRemap::") + remap->name() + "::value"),
+        m_remap(remap), m_stream(controllerStream(0)) { }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        size_t idx = 0;
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[idx];
+            idx = idx+1 < m_stream.size() ? idx+1 : 0;
+            uint8_t controller = m.m_data1, val = m.m_data2;
+            if (m_remap->value(m.m_data1, m.m_data2, &controller, &val))
+                n += val;
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a Toggler::pass() on a note stream.
+class TogglerBenchmark: public Benchmark
+{
+    Toggler m_toggler;              //!< The toggler.
+    std::vector<Message> m_stream;  //!< Note messages.
+public:
+    TogglerBenchmark(): Benchmark("Toggler::pass"), m_stream(noteStream(0)) { m_toggler.enable(); }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        size_t idx = 0;
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[idx];
+            idx = idx+1 < m_stream.size() ? idx+1 : 0;
+            n += m_toggler.pass(m.m_status, m.m_data1, m.m_data2);
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a MonoFilter::passNoteOn() on a note stream, note off goes through it too.
+class MonoFilterBenchmark: public Benchmark
+{
+    MonoFilter m_filter;            //!< The filter.
+    std::vector<Message> m_stream;  //!< Note messages.
+public:
+    MonoFilterBenchmark(): Benchmark("MonoFilter::passNoteOn"), m_stream(noteStream(0)) { }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        size_t idx = 0;
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[idx];
+            idx = idx+1 < m_stream.size() ? idx+1 : 0;
+            n += m_filter.passNoteOn(m.m_data1, Midi::isNoteOn(m.m_status, m.m_data1, m.m_data2) ? m.m_data2 : 0);
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a Transposer::transpose() on a note stream, with the sustain pedal down half the time.
+class TransposerBenchmark: public Benchmark
+{
+    Transposer m_transposer;        //!< The transposer.
+    std::vector<Message> m_stream;  //!< Note messages.
+public:
+    TransposerBenchmark(): Benchmark("Transposer::transpose"), m_stream(noteStream(0)) { }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        size_t idx = 0;
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[idx];
+            idx = idx+1 < m_stream.size() ? idx+1 : 0;
+            if (idx % 96 == 0)
+                m_transposer.setSustain(idx % 192 == 0);
+            uint8_t data1 = m.m_data1, data2 = m.m_data2;
+            m_transposer.transpose(Midi::status(m.m_status), data1, data2);
+            n += data1;
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a Event::toString() on MIDI events.
+class EventBenchmark: public Benchmark
+{
+    std::vector<Event> m_events;    //!< The events.
+public:
+    EventBenchmark(): Benchmark("Event::toString")
+    {
+        std::vector<Message> stream = noteStream(3);
+        for (size_t i=0; i<stream.size(); i++)
+        {
+            Event e;
+            e.m_type = Event::MidiOut3Bytes;
+            e.m_deviceId = Midi::Device::FantomOut;
+            e.m_part = i % 16;
+            e.m_midi[0] = stream[i].m_status;
+            e.m_midi[1] = stream[i].m_data1;
+            e.m_midi[2] = stream[i].m_data2;
+            m_events.push_back(e);
+        }
+    }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        for (long i=0; i<iterations; i++)
+            n += m_events[i % m_events.size()].toString().size();
+        g_sink += n;
+    }
+};
+
+//! \brief \a Midi::noteName() for every note.
+class NoteNameBenchmark: public Benchmark
+{
+public:
+    NoteNameBenchmark(): Benchmark("Midi::noteName") { }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        char name[8];
+        for (long i=0; i<iterations; i++)
+        {
+            Midi::noteName(i & 127, name);
+            n += name[0];
+        }
+        g_sink += n;
+    }
+};
+
+//! \brief \a Midi::noteValue() for every note name.
+class NoteValueBenchmark: public Benchmark
+{
+    std::vector<std::string> m_names;   //!< Names of all notes.
+public:
+    NoteValueBenchmark(): Benchmark("Midi::noteValue")
+    {
+        char name[8];
+        for (int i=0; i<Midi::Note::max; i++)
+        {
+            Midi::noteName(i, name);
+            m_names.push_back(name);
+        }
+    }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        for (long i=0; i<iterations; i++)
+            n += Midi::noteValue(m_names[i & 127].c_str());
+        g_sink += n;
+    }
+};
+
+/*! \brief \a ActivityList::trigger(), or trigger and \a ActivityList::update().
+ *
+ * The clock advances 1 ms per operation, like a fast player on 16 channels.
+ */
+class ActivityBenchmark: public Benchmark
+{
+    ActivityList m_list;            //!< The list.
+    std::vector<Message> m_stream;  //!< Note messages.
+    bool m_update;                  //!< Also update after every trigger.
+    TimeSpec m_now;                 //!< Fake clock.
+public:
+    //! \brief Construct, \a update selects trigger and update.
+    explicit ActivityBenchmark(bool update):
+        Benchmark(update ? "ActivityList::trigger+update" : "ActivityList::trigger"),
+        m_list(16, Midi::Note::max), m_stream(noteStream(0)), m_update(update)
+    {
+        getTime(m_now);
+    }
+    virtual void run(long iterations)
+    {
+        uint32_t n = 0;
+        const TimeSpec tick(0, 1000000);
+        for (long i=0; i<iterations; i++)
+        {
+            const Message &m = m_stream[i % m_stream.size()];
+            timeSum(m_now, m_now, tick);
+            m_list.trigger(i & 15, m.m_data1, Midi::isNoteOn(m.m_status, m.m_data1, m.m_data2), m_now);
+            if (m_update)
+                n += m_list.update(m_now);
+        }
+        g_sink += n;
+    }
+};
+
+/*! \brief \a fixChain() on a set of 64 tracks of 8 sections.
+ *
+ * The placeholders are put back before every call, which is included in
+ * the measurement.
+ */
+class FixChainBenchmark: public Benchmark
+{
+    TrackList m_trackList;          //!< The tracks.
+    std::vector<int> m_chain;       //!< Placeholders, 4 per section.
+public:
+    FixChainBenchmark(): Benchmark("fixChain")
+    {
+        Arena &arena = m_trackList.arena();
+        const int placeholder[] = { TrackDef::Unspecified, TrackDef::NextTrack,
+            TrackDef::PreviousTrack, TrackDef::CurrentTrack };
+        for (int t=0; t<64; t++)
+        {
+            Track *track = new (arena) Track(arena, "track");
+            for (int s=0; s<8; s++)
+            {
+                Section *section = new (arena) Section(arena, "section");
+                section->m_nextTrack = placeholder[(t+s) % 4];
+                section->m_previousTrack = placeholder[(t+s+1) % 4];
+                section->m_nextSection = s == 7 ? (int)TrackDef::LastSection : (int)TrackDef::Unspecified;
+                section->m_previousSection = s == 0 ? 0 : (int)TrackDef::Unspecified;
+                track->addSection(section);
+                m_chain.push_back(section->m_nextTrack);
+                m_chain.push_back(section->m_previousTrack);
+                m_chain.push_back(section->m_nextSection);
+                m_chain.push_back(section->m_previousSection);
+            }
+            m_trackList.push_back(track);
+        }
+    }
+    virtual void run(long iterations)
+    {
+        for (long i=0; i<iterations; i++)
+        {
+            std::vector<int>::const_iterator c = m_chain.begin();
+            for (size_t t=0; t<m_trackList.size(); t++)
+            {
+                for (int s=0; s<m_trackList[t]->nofSections(); s++)
+                {
+                    Section *section = m_trackList[t]->m_sectionList[s];
+                    section->m_nextTrack = *c++;
+                    section->m_previousTrack = *c++;
+                    section->m_nextSection = *c++;
+                    section->m_previousSection = *c++;
+                }
+            }
+            fixChain(m_trackList);
+        }
+        g_sink += m_trackList[0]->m_sectionList[0]->m_nextSection;
+    }
+};
+
+//! \brief SAX import of a track definition file, including \a fixChain().
+class ImportBenchmark: public Benchmark
+{
+    std::string m_fileName;     //!< The file.
+    XML m_xml;                  //!< The parser.
+public:
+    //! \brief Construct for a file.
+    explicit ImportBenchmark(const char *fileName): Benchmark("XML::importTracks"), m_fileName(fileName) { }
+    virtual void run(long iterations)
+    {
+        for (long i=0; i<iterations; i++)
+        {
+            TrackList trackList;
+            SetList setList;
+            m_xml.importTracks(m_fileName.c_str(), trackList, setList);
+            g_sink += trackList.size();
+        }
+    }
+};
+
+//! \brief Result of a benchmark.
+struct Result
+{
+    std::string m_name;     //!< Name of the benchmark.
+    long m_iterations;      //!< Operations per sample.
+    double m_median;        //!< Median time per operation in ns.
+    double m_min;           //!< Fastest sample, ns per operation.
+    double m_max;           //!< Slowest sample, ns per operation.
+};
+
+/*! \brief Time \a iterations operations.
+ *
+ * \return    Seconds.
+ */
+double timeRun(Benchmark &benchmark, long iterations)
+{
+    TimeSpec start, stop;
+    getTime(start);
+    benchmark.run(iterations);
+    getTime(stop);
+    return timeDiffSeconds(start, stop);
+}
+
+/*! \brief Calibrate and run a benchmark.
+ *
+ * The number of operations per sample is doubled until a sample takes
+ * a tenth of the sample time, then scaled up to the sample time. That
+ * also warms up the caches and the branch predictors.
+ *
+ * \param[in] benchmark     The benchmark.
+ * \param[in] sampleTime    Time per sample in seconds.
+ * \param[in] nofSamples    Number of samples.
+ * \return    The result.
+ */
+Result measure(Benchmark &benchmark, double sampleTime, int nofSamples)
+{
+    long iterations = 1;
+    double seconds;
+    while ((seconds = timeRun(benchmark, iterations)) < sampleTime / 10 && iterations < (1L << 30))
+        iterations *= 2;
+    iterations = std::max(1L, (long)(iterations * sampleTime / std::max(seconds, 1e-9)));
+    std::vector<double> ns;
+    for (int i=0; i<nofSamples; i++)
+        ns.push_back(timeRun(benchmark, iterations) * 1e9 / iterations);
+    std::sort(ns.begin(), ns.end());
+    Result result;
+    result.m_name = benchmark.name();
+    result.m_iterations = iterations;
+    result.m_median = ns[ns.size()/2];
+    result.m_min = ns.front();
+    result.m_max = ns.back();
+    return result;
+}
+
+//! \brief Quote a string for JSON.
+std::string quote(const std::string &s)
+{
+    std::string q = "\"";
+    for (size_t i=0; i<s.size(); i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+            q += '\\';
+        if ((unsigned char)s[i] >= ' ')
+            q += s[i];
+    }
+    return q + "\"";
+}
+
+//! \brief Write the results as JSON.
+void report(std::ostream &out, const std::vector<Result> &results, double sampleTime, int nofSamples)
+{
+    char date[32];
+    time_t now = time(0);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    char host[64] = "";
+    gethostname(host, sizeof(host)-1);
+    out << "{\n"
+        << "  \"benchmark\": \"patcher_bench\",\n"
+        << "  \"date\": " << quote(date) << ",\n"
+        << "  \"host\": " << quote(host) << ",\n"
+#ifdef __VERSION__
+        << "  \"compiler\": " << quote(__VERSION__) << ",\n"
+#endif
+        << "  \"real\": " << quote(sizeof(Real) == sizeof(float) ? "float" : "double") << ",\n"
+        << "  \"sampleTime\": " << sampleTime << ",\n"
+        << "  \"samples\": " << nofSamples << ",\n"
+        << "  \"results\": [\n";
+    for (size_t i=0; i<results.size(); i++)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "\"iterations\": %ld, \"nsPerOp\": %.3f, \"nsPerOpMin\": %.3f, \"nsPerOpMax\": %.3f",
+            results[i].m_iterations, results[i].m_median, results[i].m_min, results[i].m_max);
+        out << "    { \"name\": " << quote(results[i].m_name) << ", " << line << " }"
+            << (i+1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+/*! \brief Add a part to a section.
+ *
+ * \param[in] arena     Arena of the section.
+ * \param[in] section   The section.
+ * \param[in] channel   Channel of the new part.
+ * \param[in] lower     Lowest note.
+ * \param[in] upper     Highest note.
+ * \return    The part.
+ */
+SwPart *addPart(Arena &arena, Section *section, uint8_t channel, uint8_t lower = 0, uint8_t upper = 127)
+{
+    SwPart *part = new (arena) SwPart(arena, (int)section->m_partList.size(), "part");
+    part->m_channel = channel;
+    part->m_rangeLower = lower;
+    part->m_rangeUpper = upper;
+    section->m_partList.push_back(part);
+    return part;
+}
+
+/*! \brief Add a route benchmark for every section shape.
+ *
+ * \param[in] arena         Arena for the sections.
+ * \param[out] benchmarks   The list to add to.
+ */
+void addRouteBenchmarks(Arena &arena, std::vector<Benchmark *> &benchmarks)
+{
+    std::vector<Message> notes = noteStream(0);
+    std::vector<Message> controllers = controllerStream(0);
+    Section *section = new (arena) Section(arena, "single");
+    addPart(arena, section, 0);
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/single", section, notes));
+
+    section = new (arena) Section(arena, "split");
+    addPart(arena, section, 0, 0, Midi::Note::C4 - 1);
+    addPart(arena, section, 1, Midi::Note::C4, 127)->m_transpose = -12;
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/split2", section, notes));
+
+    section = new (arena) Section(arena, "layer");
+    for (int i=0; i<4; i++)
+        addPart(arena, section, i);
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/layer4", section, notes));
+
+    section = new (arena) Section(arena, "zones16");
+    for (int i=0; i<16; i++)
+        addPart(arena, section, i, i*8, i*8+23);
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/zones16", section, notes));
+
+    section = new (arena) Section(arena, "custom");
+    SwPart *part = addPart(arena, section, 0);
+    part->m_customTransposeEnabled = true;
+    for (int i=0; i<12; i++)
+        part->m_customTranspose[i] = i % 2;
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/customTranspose", section, notes));
+
+    section = new (arena) Section(arena, "mono");
+    addPart(arena, section, 0)->m_mono = true;
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/mono", section, notes));
+
+    section = new (arena) Section(arena, "toggler");
+    addPart(arena, section, 0)->m_toggler.enable();
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/toggler", section, notes));
+
+    section = new (arena) Section(arena, "transposer");
+    addPart(arena, section, 0)->m_transposer = new (arena) Transposer(12);
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/transposer", section, notes));
+
+    section = new (arena) Section(arena, "remap");
+    addPart(arena, section, 0)->m_controllerRemap = new (arena) ControllerRemap::VolQuadratic;
+    addPart(arena, section, 1)->m_controllerRemap = new (arena) ControllerRemap::Drop16;
+    benchmarks.push_back(new RouteBenchmark("sendEventToFantom/controllerRemap", section, controllers));
+}
+
+/*! \brief Add a snapshot benchmark for sections of plain and stateful parts.
+ *
+ * \param[in] arena         Arena for the sections.
+ * \param[in] persist       The snapshot.
+ * \param[out] benchmarks   The list to add to.
+ */
+void addSnapshotBenchmarks(Arena &arena, Persist *persist, std::vector<Benchmark *> &benchmarks)
+{
+    std::vector<Message> notes = noteStream(0);
+    for (int everyPart=0; everyPart<2; everyPart++)
+    {
+        const char *suffix = everyPart ? "/everyPart" : "";
+        Section *section = new (arena) Section(arena, "zones16");
+        for (int i=0; i<16; i++)
+            addPart(arena, section, i, i*8, i*8+23);
+        benchmarks.push_back(new SnapshotBenchmark(std::string("snapshot/zones16") + suffix,
+            persist, section, notes, everyPart != 0));
+
+        section = new (arena) Section(arena, "zones16mono");
+        for (int i=0; i<16; i++)
+            addPart(arena, section, i, i*8, i*8+23)->m_mono = i % 4 == 0;
+        benchmarks.push_back(new SnapshotBenchmark(std::string("snapshot/zones16mono") + suffix,
+            persist, section, notes, everyPart != 0));
+    }
+}
+
+} // anonymous namespace
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    const char *inFile = TRACK_DEF;
+    double sampleTime = 0.05;
+    int nofSamples = 9;
+    const char *filter = 0;
+    std::vector<Benchmark *> benchmarks;
+    int rv = 0;
+    try
+    {
+        for (;;)
+        {
+            int opt = getopt(argc, argv, "ht:n:f:d:");
+            if (opt == -1)
+                break;
+            switch (opt)
+            {
+                case 't':
+                    sampleTime = atof(optarg);
+                    if (sampleTime <= 0)
+                        throw(Error("sample time must be positive"));
+                    break;
+                case 'n':
+                    nofSamples = atoi(optarg);
+                    if (nofSamples < 1)
+                        throw(Error("at least one sample is needed"));
+                    break;
+                case 'f':
+                    filter = optarg;
+                    break;
+                case 'd':
+                {
+                    const char *dir = optarg;
+                    if (-1 == chdir(dir))
+                    {
+                        Error e;
+                        e.stream() << "cannot change dir to " << dir;
+                        throw(e);
+                    }
+                    break;
+                }
+                default:
+                    std::cerr << "\npatcher_bench [-h|?] [-d <dir>] [-t <seconds>] [-n <samples>] [-f <name>] [<tracks.xml>]\n\n"
+                        "  -h|?       This message\n"
+                        "  -d dir     Change dir\n"
+                        "  -t seconds Time per sample, default 0.05\n"
+                        "  -n samples Number of samples, the median is reported, default 9\n"
+                        "  -f name    Only run benchmarks whose name contains this\n\n";
+                    return 1;
+                    break;
+            }
+        }
+        if (argc > optind)
+            inFile = argv[optind++];
+        if (argc > optind)
+            throw(Error("unrecognised trailing arguments, try -h"));
+        // a snapshot of its own, the one of a live core is left alone
+        char instance[32];
+        snprintf(instance, sizeof(instance), "bench-%d", (int)getpid());
+        Ipc::setInstance(instance);
+        Persist persist;
+        Arena arena;
+        addRouteBenchmarks(arena, benchmarks);
+        addSnapshotBenchmarks(arena, &persist, benchmarks);
+        benchmarks.push_back(new PersistApplyBenchmark(&persist));
+        benchmarks.push_back(new PersistStorePartBenchmark(&persist));
+        benchmarks.push_back(new OwnerChecksumBenchmark);
+        ControllerRemap::VolQuadratic volQuadratic;
+        ControllerRemap::VolReverse volReverse;
+        ControllerRemap::Drop16 drop16;
+        benchmarks.push_back(new RemapBenchmark(&volQuadratic));
+        benchmarks.push_back(new RemapBenchmark(&volReverse));
+        benchmarks.push_back(new RemapBenchmark(&drop16));
+        benchmarks.push_back(new TogglerBenchmark);
+        benchmarks.push_back(new MonoFilterBenchmark);
+        benchmarks.push_back(new TransposerBenchmark);
+        benchmarks.push_back(new EventBenchmark);
+        benchmarks.push_back(new NoteNameBenchmark);
+        benchmarks.push_back(new NoteValueBenchmark);
+        benchmarks.push_back(new ActivityBenchmark(false));
+        benchmarks.push_back(new ActivityBenchmark(true));
+        benchmarks.push_back(new FixChainBenchmark);
+        benchmarks.push_back(new ImportBenchmark(inFile));
+        std::vector<Result> results;
+        for (size_t i=0; i<benchmarks.size(); i++)
+        {
+            if (filter && benchmarks[i]->name().find(filter) == std::string::npos)
+                continue;
+            std::cerr << benchmarks[i]->name() << std::endl;
+            results.push_back(measure(*benchmarks[i], sampleTime, nofSamples));
+        }
+        report(std::cout, results, sampleTime, nofSamples);
+    }
+    catch (Error &e)
+    {
+        std::cerr << "** " << e.what() << std::endl;
+        rv = e.exitCode();
+    }
+    for (size_t i=0; i<benchmarks.size(); i++)
+        delete benchmarks[i];
+    Persist::remove();
+    return rv;
+}
@@ -0,0 +1,116 @@
+/*! \file patchercompile.cpp
+ *  \brief Compiles the XML track definitions into a binary track image.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <iostream>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "trackdef.h"
+#include "trackimage.h"
+#include "xml.h"
+#include "error.h"
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    const char *inFile = TRACK_DEF;
+    const char *outFile = TRACK_IMAGE;
+    const char *schemaFile = TRACK_SCHEMA;
+    char schemaPath[PATH_MAX];
+    try
+    {
+        for (;;)
+        {
+            int opt = getopt(argc, argv, "ho:d:s:");
+            if (opt == -1)
+                break;
+            switch (opt)
+            {
+                case 'o':
+                    outFile = optarg;
+                    break;
+                case 's':
+                    // relative to the working directory, not to the XML file
+                    if (!realpath(optarg, schemaPath))
+                    {
+                        Error e;
+                        e.stream() << "cannot find schema " << optarg;
+                        throw(e);
+                    }
+                    schemaFile = schemaPath;
+                    break;
+                case 'd':
+                {
+                    const char *dir = optarg;
+                    if (-1 == chdir(dir))
+                    {
+                        Error e;
+                        e.stream() << "cannot change dir to " << dir;
+                        throw(e);
+                    }
+                    break;
+                }
+                default:
+                    std::cerr << "\npatcher_compile [-h|?] [-d <dir>] [-o <image>] [-s <schema>] [<tracks.xml>]\n\n"
+                        "  -h|?     This message\n"
+                        "  -d dir   Change dir\n"
+                        "  -o image Output file, default " TRACK_IMAGE "\n"
+                        "  -s xsd   Schema to validate against, default " TRACK_SCHEMA " next to the XML file\n\n";
+                    return 1;
+                    break;
+            }
+        }
+        if (argc > optind)
+            inFile = argv[optind++];
+        if (argc > optind)
+            throw(Error("unrecognised trailing arguments, try -h"));
+        // validate against the schema, and resolve the chain placeholders and setlist names
+        TrackList trackList;
+        SetList setList;
+        SourceStamp source;
+        if (!source.read(inFile))
+        {
+            Error e;
+            e.stream() << "cannot stat " << inFile;
+            throw(e);
+        }
+        {
+            XML xml;
+            xml.importTracks(inFile, trackList, setList, schemaFile);
+        }
+        if (!TrackImage::save(outFile, inFile, source, trackList, setList))
+        {
+            Error e;
+            e.stream() << inFile << " has changed while it was compiled, try again";
+            throw(e);
+        }
+        // read it back as a check
+        TrackList checkList;
+        SetList checkSetList;
+        if (!TrackImage::load(outFile, inFile, checkList, checkSetList)
+                || checkList.size() != trackList.size()
+                || checkSetList.size() != setList.size())
+        {
+            throw(Error("image verification failed"));
+        }
+        size_t nofSections = 0;
+        size_t nofParts = 0;
+        for (TrackList::const_iterator t = trackList.begin(); t != trackList.end(); ++t)
+        {
+            nofSections += (*t)->m_sectionList.size();
+            for (SectionList::const_iterator s = (*t)->m_sectionList.begin(); s != (*t)->m_sectionList.end(); ++s)
+                nofParts += (*s)->m_partList.size();
+        }
+        std::cout << outFile << ": " << trackList.size() << " tracks, "
+            << nofSections << " sections, " << nofParts << " parts, "
+            << setList.size() << " setlist entries\n";
+    }
+    catch (Error &e)
+    {
+        std::cerr << "** " << e.what() << std::endl;
+        return e.exitCode();
+    }
+    return 0;
+}
@@ -11,6 +11,10 @@
 #include <string.h>
 #include <ctype.h>
 #include <ctype.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
 #include "trackdef.h"
 #include "mididef.h"
 #include "mididriver.h"
@@ -29,6 +33,15 @@
 #include "fantomscroller.h"
 #include "fcb1010.h"
 #include "queue.h"
+#include "fantomcache.h"
+#include "fantomprobe.h"
+#include "fantomsync.h"
+#include "trackimage.h"
+#include "trackloader.h"
+#include "configshm.h"
+#include "liveshm.h"
+#include "router.h"
+#include "ipcname.h"
 
 //#define LOG_ENABLE          //!< Enable logging.
 #define LOG_NOTE            //!< Log note data if defined.
@@ -61,7 +74,8 @@ private:
     int m_trackIdxWithinSet;            //!< Current track index within \a SetList.
     SetList m_setList;                  //!< Global \a SetList object.
     int m_sectionIdx;                   //!< Current section index.
-    Sequencer m_sequencer;              //!< Global \a Sequencer object.
+    Sequencer m_sequencer;              //!< Recorder of all MIDI traffic.
+    int m_recordingError;               //!< Write error of the recording that has been reported, 0 if none.
     Persist m_persist;                  //!< Global \a Persist object.
     bool m_metaMode;                    //!< Meta mode switch.
     FantomScreenScroller m_fantomScroller;              //!< Fantom screen scroller.
@@ -69,6 +83,27 @@ private:
     TimeSpec m_debouncePreviousTriggerTime;             //!< Absolute time of last debounce test.
     TimeSpec m_eventRxTime;                             //!< Arrival time of the current Midi event.
     Queue m_eventTxQueue;                      //!< Event queue to write to.
+    Fantom::Cache m_fantomCache;               //!< Memory mapped performance data.
+    bool m_xmlExport;                          //!< Also write the human readable XML cache after a download.
+    Fantom::Synchroniser m_fantomSync;         //!< Background download of performance data.
+    Fantom::Prober m_fantomProbe;              //!< Round trip measurement to the Fantom.
+    std::vector<Fantom::Performance> m_performanceStore;   //!< Performance data while the cache is incomplete, or after a warm start.
+    Fantom::PerformanceList m_performanceList; //!< Performance data, either mapped or in \a m_performanceStore.
+    bool m_xmlExportPending;                   //!< The XML cache must be written.
+    bool m_cacheDirty;                         //!< The binary cache must be written.
+    bool m_configDirty;                        //!< Downloaded performance data has not been published yet.
+    TimeSpec m_configPublishDue;               //!< When downloaded performance data may be published again.
+    TimeSpec m_cacheWriteDue;                  //!< When the caches may be written again.
+    pid_t m_cacheWriter;                       //!< Child process writing the caches, -1 if none.
+    TrackLoader m_trackLoader;                 //!< Reads changed track definitions in the background.
+    bool m_reloadPending;                      //!< The track definitions have changed.
+    TimeSpec m_reloadTime;                     //!< When to start reading the changed track definitions.
+    TimeSpec m_liveHoldEnd;                    //!< When held live input may go to the Fantom again.
+    SharedConfig m_sharedConfig;               //!< The loaded configuration, published for the clients.
+    SharedLiveState m_liveState;               //!< The live state, published for the clients.
+    RoutedMessageList m_routed;                //!< Output of \a route(), reused for every event.
+    bool m_warmStart;                          //!< The configuration was resumed from the snapshot of a previous core.
+    bool m_coldStart;                          //!< Ignore the warm start snapshot.
     Track *currentTrack() const {
         return m_trackList[m_trackIdx]; } //!< The current \a Track.
     Section *currentSection() const {
@@ -82,15 +117,41 @@ private:
     void sendEventToFantom(uint8_t midiStatus,
                 uint8_t data1, uint8_t data2 = Midi::noData);
     void sendMidi(int deviceId, uint8_t part, uint8_t status, uint8_t data1, uint8_t data2 = Midi::noData);
+    //! \brief Record a received MIDI message.
+    void recordInput(int deviceId, uint8_t status, uint8_t data1 = Midi::noData, uint8_t data2 = Midi::noData) {
+        m_sequencer.record(deviceId, m_trackIdx, m_sectionIdx, status, data1, data2); }
     void setVolume(uint8_t part, uint8_t value);
+    void publishVolumes();
     void allNotesOff();
-    void changeSection(uint8_t sectionIdx);
+    void changeSection(int sectionIdx);
     void nextSection();
     void prevSection();
-    void changeTrack(uint8_t track);
+    void changeTrack(int track);
     void changeTrackByNote(uint8_t note);
     bool debounced(Real delaySeconds);
     void consumeSysEx(int device);
+    void pollFantomSync();
+    void finishFantomSync();
+    void publishDownloads(int performance);
+    void pollConfigPublish();
+    void sendFantomSyncEvent(int performance);
+    void publishSyncState();
+    void pollFantomProbe();
+    void publishRoundTrip();
+    void pollCacheWriter();
+    void pollReload();
+    void pollRecording();
+    void pollLiveHold();
+    void swapTracks(TrackList &trackList, SetList &setList, const SourceStamp &source);
+    bool resizePerformances();
+    void releaseNotes();
+    void publishConfig();
+    int partIndex(int part) const;
+    void storeParts(uint64_t parts = ~(uint64_t)0);
+    void restoreParts();
+    void releaseHangingNotes();
+    void sendTracksReloadedEvent();
+    int usecTimeout() const;
 public:
     void updateBcfFaders();
     void updateFantomDisplay();
@@ -98,7 +159,16 @@ public:
     void loadConfig();
     void eventLoop();
     void sendReadyEvent();
+    //! \brief Record all MIDI traffic.
+    void enableRecording() { m_sequencer.enable(); }
     void restoreState();
+    void startFantomSync();
+    void startFantomProbe(Real period);
+    //! \brief Enable the XML side output of the performance cache.
+    void enableXmlExport() { m_xmlExport = true; }
+    //! \brief Ignore the warm start snapshot, in case it is what makes the core crash.
+    void forceColdStart() { m_coldStart = true; }
+    void restarted(int nofRestarts, int exitSignal, int exitCode);
     /*! \brief constructor for Patcher
      *
      *  This will set up an empty Patcher object.
@@ -112,13 +182,20 @@ public:
         debounceTime(Real(0.4)),
         m_midi(m), m_fantom(f),
         m_trackIdx(0), m_trackIdxWithinSet(0), m_sectionIdx(0),
-        m_metaMode(false), m_fantomScroller(f), m_partOffsetBcf(0)
+        m_recordingError(0),
+        m_metaMode(false), m_fantomScroller(f), m_partOffsetBcf(0),
+        m_xmlExport(false), m_fantomSync(f), m_fantomProbe(f), m_xmlExportPending(false),
+        m_cacheDirty(false), m_configDirty(false), m_cacheWriter(-1),
+        m_trackLoader(TRACK_DEF, TRACK_IMAGE), m_reloadPending(false), m_warmStart(false),
+        m_coldStart(false)
     {
 #ifdef LOG_ENABLE
         m_fpLog = fopen("corelog.txt", "wb");
 #endif
+        // on the main thread, it initialises xerces-c for the track loader as well
         m_xml = new XML;
         m_eventTxQueue.openWrite();
+        m_liveState.create();
         m_trackIdx = m_setList[0];
         getTime(m_debouncePreviousTriggerTime);
         m_fantom->selectPerformanceFromMemCard();
@@ -126,71 +203,733 @@ public:
 };
 
 /*! \brief Add links from software parts to hardware parts, based on matching channels.
+ *
+ * After a crash, the configuration the previous core has published is
+ * resumed, unless the track definitions have changed since. That takes
+ * no file access at all, and includes the performances it downloaded.
+ * Otherwise, performance data comes from the binary cache if it is valid,
+ * then from the XML cache. Performances that are missing from the cache
+ * are left pending, they are downloaded in the background by
+ * \a startFantomSync(), so the patcher is playable right away.
  */
 void Patcher::loadConfig()
 {
     // increase timeout, parsing XML takes a lot of time on the Pi.
     g_timer.setTimeout((Real)2.5, 3);
-    const char *cacheFilename = "fantom_cache.xml";
-    // try to read cache to avoid download
-    Fantom::PerformanceList performanceList;
-    try
+    m_sharedConfig.create();
+    // before anything is parsed, so an edit meanwhile is never taken for what was loaded
+    uint32_t generation;
+    SourceStamp source, published;
+    source.clear();
+    bool haveSource = source.read(TRACK_DEF);
+    if (!m_coldStart && haveSource && m_persist.restoreConfig(&generation, &published)
+        && published == source
+        && m_sharedConfig.resume(generation, m_trackList, m_setList, m_performanceStore))
     {
-        m_xml->importPerformances(cacheFilename, performanceList);
+        m_performanceList.clear();
+        for (size_t i=0; i<m_performanceStore.size(); i++)
+            m_performanceList.push_back(&m_performanceStore[i]);
+        m_warmStart = true;
+        g_timer.setTimeout((Real)0.4, 3);
+        return;
     }
-    catch(...)
+    m_persist.storeConfig(0);
+    if (!TrackImage::load(TRACK_IMAGE, TRACK_DEF, m_trackList, m_setList))
     {
-    }
-    if (performanceList.empty())
-    {
-        // no (valid) cache, import tracks and download the right number of performances
+        // no image or stale image, parse and recompile
         m_xml->importTracks(TRACK_DEF, m_trackList, m_setList);
-        m_fantom->download(0, performanceList, m_trackList.size());
-        // create cache
-        m_xml->exportPerformances(cacheFilename, performanceList);
+        TrackImage::save(TRACK_IMAGE, TRACK_DEF, source, m_trackList, m_setList);
     }
-    else
+    // try to map the binary cache to avoid parsing and download
+    Fantom::PerformanceList performanceList;
+    if (!m_fantomCache.load(FANTOM_CACHE, performanceList))
     {
-        m_xml->importTracks(TRACK_DEF, m_trackList, m_setList);
-        if (m_trackList.size() != performanceList.size())
+        try
+        {
+            m_xml->importPerformances(FANTOM_CACHE_XML, performanceList);
+        }
+        catch(...)
+        {
+            performanceList.clear();
+        }
+        if (!performanceList.empty())
         {
-            // cache was outdated
-            m_fantom->download(0, performanceList, m_trackList.size());
-            // refresh cache
-            m_xml->exportPerformances(cacheFilename, performanceList);
+            // convert, and use the binary cache from now on
+            Fantom::Cache::save(FANTOM_CACHE, performanceList);
+            for (size_t i=0; i<performanceList.size(); i++)
+                delete performanceList[i];
+            m_fantomCache.load(FANTOM_CACHE, performanceList);
         }
     }
+    if (m_trackList.size() != performanceList.size())
+    {
+        // no (valid) cache, or cache was outdated
+        performanceList.clear();
+    }
+    bool complete = !performanceList.empty();
+    for (size_t i=0; i<performanceList.size(); i++)
+        complete = complete && performanceList[i]->m_loaded;
+    if (!complete)
+    {
+        // keep what we have, the rest is pending until startFantomSync()
+        m_performanceStore.resize(m_trackList.size());
+        for (size_t i=0; i<performanceList.size(); i++)
+            m_performanceStore[i] = *performanceList[i];
+        performanceList.clear();
+        m_fantomCache.release();
+        for (size_t i=0; i<m_performanceStore.size(); i++)
+            performanceList.push_back(&m_performanceStore[i]);
+        // refresh cache, so clients can find one
+        Fantom::Cache::save(FANTOM_CACHE, performanceList);
+    }
+    m_performanceList = performanceList;
     // merge performance data into track data
     g_timer.setTimeout((Real)0.4, 3);
     TrackList::iterator track = m_trackList.begin();
-    Fantom::PerformanceList::iterator performance = performanceList.begin();
-    for (; performance != performanceList.end(); ++performance, ++track)
+    Fantom::PerformanceList::iterator performance = m_performanceList.begin();
+    for (; performance != m_performanceList.end(); ++performance, ++track)
     {
-        (*track)->merge(*performance);
+        (*track)->merge((*performance)->m_loaded ? *performance : 0);
+    }
+    m_persist.storeSource(source);
+    m_sharedConfig.setTracks(m_trackList, m_setList);
+    publishConfig();
+}
+
+/*! \brief Publish the configuration for the clients, and for a restarted core.
+ */
+void Patcher::publishConfig()
+{
+    m_configDirty = false;
+    m_sharedConfig.publish(m_performanceList);
+    m_persist.storeConfig(m_sharedConfig.published());
+}
+
+/*! \brief Start downloading pending performances in the background.
+ *
+ * The live track comes first, then the rest of the setlist from the current
+ * position onwards, wrapping around, and finally the tracks that are not
+ * in the setlist.
+ */
+void Patcher::startFantomSync()
+{
+    std::vector<int> order;
+    std::vector<bool> queued(m_trackList.size(), false);
+    for (int i=0; i<=m_setList.size(); i++)
+    {
+        int t = i == 0 ? m_trackIdx : m_setList[(m_trackIdxWithinSet + i - 1) % m_setList.size()];
+        if (t >= 0 && (size_t)t < queued.size() && !queued[t])
+        {
+            queued[t] = true;
+            order.push_back(t);
+        }
+    }
+    for (size_t t=0; t<queued.size(); t++)
+    {
+        if (!queued[t])
+            order.push_back((int)t);
+    }
+    std::vector<int> pending;
+    for (size_t i=0; i<order.size(); i++)
+    {
+        if (!m_performanceList[order[i]]->m_loaded)
+            pending.push_back(order[i]);
+    }
+    if (pending.empty())
+        return;
+    getTime(m_eventRxTime);
+    m_fantomSync.start(pending, m_eventRxTime);
+    publishSyncState();
+}
+
+/*! \brief Start measuring the round trip to the Fantom while the player is idle.
+ *
+ * \param[in] period    Minimum time between probes in seconds.
+ */
+void Patcher::startFantomProbe(Real period)
+{
+    getTime(m_eventRxTime);
+    m_fantomProbe.start(period, m_eventRxTime);
+}
+
+/*! \brief Publish why the previous core stopped, for the clients.
+ *
+ * \param[in] nofRestarts   Restarts of the core by the administrator process so far.
+ * \param[in] exitSignal    Signal that stopped the previous core, 0 if it exited.
+ * \param[in] exitCode      Exit code of the previous core, if it exited.
+ */
+void Patcher::restarted(int nofRestarts, int exitSignal, int exitCode)
+{
+    if (m_fpLog)
+        fprintf(m_fpLog, "restart %d, previous core stopped by signal %d, exit code %d\n",
+            nofRestarts, exitSignal, exitCode);
+    LiveShm::State &state = m_liveState.beginUpdate();
+    state.m_nofCoreRestarts = (uint16_t)std::min(nofRestarts, 0xffff);
+    state.m_coreSignal = (uint8_t)exitSignal;
+    state.m_coreExitCode = (uint8_t)exitCode;
+    m_liveState.endUpdate();
+}
+
+/*! \brief Send a round trip probe when it is due, and publish a lost one.
+ */
+void Patcher::pollFantomProbe()
+{
+    if (m_fantomProbe.poll(m_eventRxTime, m_fantomSync.active()))
+        publishRoundTrip();
+}
+
+/*! \brief Publish the round trip statistics, and inform clients.
+ */
+void Patcher::publishRoundTrip()
+{
+    if (m_fpLog)
+        fprintf(m_fpLog, "fantom round trip %u us, %u answered, %u lost\n", m_fantomProbe.last(),
+            m_fantomProbe.nofRoundTrips(), m_fantomProbe.nofLost());
+    LiveShm::State &state = m_liveState.beginUpdate();
+    state.m_nofRoundTrips = m_fantomProbe.nofRoundTrips();
+    state.m_nofLostProbes = m_fantomProbe.nofLost();
+    state.m_roundTripLast = m_fantomProbe.last();
+    m_fantomProbe.summary(state.m_roundTripMin, state.m_roundTripMean, state.m_roundTripMax);
+    m_liveState.endUpdate();
+    sendReadyEvent();
+}
+
+/*! \brief Advance the background download of performance data.
+ *
+ * A completed performance is merged into its track. The performance of
+ * the live track is published right away, and clients are informed. The
+ * others are published in batches by \a pollConfigPublish(), since every
+ * publication rebuilds the whole configuration segment. A performance the
+ * download gives up on is only counted. The cache files are written by
+ * \a pollCacheWriter().
+ */
+void Patcher::pollFantomSync()
+{
+    int idx = m_fantomSync.poll(m_eventRxTime, m_trackIdx, m_liveState.current().quiet());
+    if (idx >= 0)
+    {
+        if (m_fpLog)
+        {
+            const Fantom::Statistics &statistics = m_fantom->statistics();
+            fprintf(m_fpLog, "fantom sync %d: %u requests, %u retries, %u timeouts, %u bad replies, %u failures\n",
+                idx, statistics.m_requests, statistics.m_retries, statistics.m_timeouts,
+                statistics.m_badReplies, statistics.m_failures);
+        }
+        *m_performanceList[idx] = m_fantomSync.performance();
+        m_trackList[idx]->merge(m_performanceList[idx]);
+        m_cacheDirty = true;
+        m_configDirty = true;
+        if (idx == m_trackIdx)
+        {
+            publishDownloads(idx);
+            updateBcfFaders();
+            sendReadyEvent();
+        }
+        else
+        {
+            publishSyncState();
+        }
+    }
+    else if (m_fantomSync.nofFailed() != m_liveState.current().m_nofSyncFailed)
+    {
+        if (m_fpLog)
+            fprintf(m_fpLog, "fantom sync gave up on %d performances\n", m_fantomSync.nofFailed());
+        publishSyncState();
+    }
+    else
+    {
+        return;
+    }
+    if (!m_fantomSync.active())
+        finishFantomSync();
+}
+
+//! \brief The download is over, publish the rest and write the caches right away.
+void Patcher::finishFantomSync()
+{
+    m_configPublishDue = m_eventRxTime;
+    m_xmlExportPending = m_xmlExport;
+    m_cacheWriteDue = m_eventRxTime;
+}
+
+namespace
+{
+const Real configPublishPeriod = (Real)10.0;    //!< Minimum time between two publications of downloaded performances.
+const Real cacheWritePeriod = (Real)10.0;   //!< Minimum time between two writes of the caches during a download.
+const int cacheWriterPollPeriod = 50000;    //!< Poll period in usec while the cache writer is running.
+}
+
+/*! \brief Publish the configuration with the downloaded performances, and inform clients.
+ *
+ * \param[in]  performance     Index of the downloaded performance, \a Event::Unspecified for a batch.
+ */
+void Patcher::publishDownloads(int performance)
+{
+    publishConfig();
+    sendFantomSyncEvent(performance);
+    timeSum(m_configPublishDue, m_eventRxTime, TimeSpec(configPublishPeriod));
+}
+
+/*! \brief Publish downloaded performances in a batch.
+ *
+ * During a download they are published at most every \a configPublishPeriod,
+ * and once more when it is done, but only while nothing sounds.
+ */
+void Patcher::pollConfigPublish()
+{
+    if (m_configDirty && m_liveState.current().quiet()
+            && timeGreaterThanOrEqual(m_eventRxTime, m_configPublishDue))
+        publishDownloads(Event::Unspecified);
+}
+
+/*! \brief Write the performance caches in a child process, and reap it.
+ *
+ * Rewriting the caches is too slow for the event loop, so a child writes
+ * a copy of the performance data. During a download, the caches are
+ * written at most every \a cacheWritePeriod, and once more when it is
+ * done. A child is only forked while the track loader thread is idle,
+ * since a forked child only gets a copy of the calling thread and the
+ * parser state of the other one could be torn.
+ */
+void Patcher::pollCacheWriter()
+{
+    if (m_cacheWriter != -1)
+    {
+        int status;
+        pid_t pid = waitpid(m_cacheWriter, &status, WNOHANG);
+        if (pid == 0)
+            return;
+        m_cacheWriter = -1;
+        if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            // try again later
+            m_cacheDirty = true;
+            if (m_fpLog)
+                fprintf(m_fpLog, "writing the performance caches failed\n");
+        }
+    }
+    if ((!m_cacheDirty && !m_xmlExportPending) || m_trackLoader.busy()
+            || !timeGreaterThanOrEqual(m_eventRxTime, m_cacheWriteDue))
+        return;
+    bool binary = m_cacheDirty;
+    bool xml = m_xmlExportPending;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        try
+        {
+            if (binary)
+                Fantom::Cache::save(FANTOM_CACHE, m_performanceList);
+            if (xml)
+                m_xml->exportPerformances(FANTOM_CACHE_XML, m_performanceList);
+        }
+        catch (...)
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if (pid == -1)
+    {
+        if (m_fpLog)
+            fprintf(m_fpLog, "cannot fork the cache writer\n");
+    }
+    else
+    {
+        m_cacheWriter = pid;
+        m_cacheDirty = false;
+        m_xmlExportPending = false;
+    }
+    timeSum(m_cacheWriteDue, m_eventRxTime, TimeSpec(cacheWritePeriod));
+}
+
+namespace
+{
+const Real reloadDelay = (Real)0.2;         //!< Time for an editor to finish saving the track definitions.
+const int reloadPollPeriod = 50000;         //!< Poll period in usec while the track loader thread is running.
+}
+
+/*! \brief Start reading changed track definitions, and swap them in once they are read.
+ *
+ * The swap happens here, between two events, so the event loop never
+ * sees a half built track list.
+ */
+void Patcher::pollReload()
+{
+    if (m_trackLoader.done())
+    {
+        TrackList trackList;
+        SetList setList;
+        SourceStamp source;
+        std::string error;
+        if (!m_trackLoader.take(trackList, setList, source, error))
+        {
+            // keep playing with what we have
+            if (m_fpLog)
+                fprintf(m_fpLog, "reload of " TRACK_DEF " failed: %s\n", error.c_str());
+        }
+        else if (trackList.empty())
+        {
+            if (m_fpLog)
+                fprintf(m_fpLog, "reload of " TRACK_DEF " ignored: no tracks\n");
+        }
+        else
+        {
+            swapTracks(trackList, setList, source);
+        }
+    }
+    if (m_reloadPending && !m_trackLoader.busy()
+            && timeGreaterThanOrEqual(m_eventRxTime, m_reloadTime))
+    {
+        m_reloadPending = false;
+        m_trackLoader.start();
+    }
+}
+
+/*! \brief Replace the track definitions by newly loaded ones.
+ *
+ * The current track and section are looked up by name in the new
+ * definitions. If the track is gone, the current setlist position is
+ * used instead. Notes that are still sounding are released, since the
+ * parts that would have released them are gone.
+ *
+ * \param[in,out] trackList    The new track list, returns empty.
+ * \param[in,out] setList      The new setlist, returns the old one.
+ * \param[in]     source       Stamp of the track definitions, taken by the loader before it parsed them.
+ */
+void Patcher::swapTracks(TrackList &trackList, SetList &setList, const SourceStamp &source)
+{
+    std::string trackName = currentTrack()->m_name;
+    std::string sectionName = currentSection()->m_name;
+    int trackIdx = -1;
+    int sectionIdx = -1;
+    for (size_t t=0; t<trackList.size() && trackIdx == -1; t++)
+    {
+        if (trackName == trackList[t]->m_name)
+            trackIdx = (int)t;
+    }
+    int trackIdxWithinSet = -1;
+    for (int i=0; i<setList.size() && trackIdx != -1 && trackIdxWithinSet == -1; i++)
+    {
+        if (setList[i] == trackIdx)
+            trackIdxWithinSet = i;
+    }
+    if (trackIdxWithinSet == -1)
+        trackIdxWithinSet = std::max(0, std::min(m_trackIdxWithinSet, setList.size()-1));
+    if (trackIdx == -1)
+    {
+        trackIdx = setList[trackIdxWithinSet];
+    }
+    else
+    {
+        const SectionList &sectionList = trackList[trackIdx]->m_sectionList;
+        for (size_t i=0; i<sectionList.size() && sectionIdx == -1; i++)
+        {
+            if (sectionName == sectionList[i]->m_name)
+                sectionIdx = (int)i;
+        }
+    }
+    if (sectionIdx == -1)
+        sectionIdx = trackList[trackIdx]->m_startSection;
+    releaseNotes();
+    bool reselect = trackIdx != m_trackIdx || m_fantomSync.foreign();
+    // nothing refers to the old definitions outside the event loop
+    m_trackList.swap(trackList);
+    std::swap(m_setList, setList);
+    trackList.release();
+    m_trackIdx = trackIdx;
+    m_sectionIdx = sectionIdx;
+    m_trackIdxWithinSet = trackIdxWithinSet;
+    m_persist.newTrack();
+    bool resized = resizePerformances();
+    for (size_t i=0; i<m_trackList.size(); i++)
+        m_trackList[i]->merge(m_performanceList[i]->m_loaded ? m_performanceList[i] : 0);
+    if (m_fpLog)
+        fprintf(m_fpLog, "reloaded " TRACK_DEF ", %d tracks, now at track %d section %d\n",
+            (int)m_trackList.size(), m_trackIdx, m_sectionIdx);
+    if (resized)
+    {
+        // performance indexes have changed, start over
+        startFantomSync();
+    }
+    if (reselect)
+    {
+        m_fantom->selectPerformance(m_trackIdx);
+        m_fantomSync.trackChanged(m_trackIdx);
     }
+    updateFantomDisplay();
+    updateBcfFaders();
+    publishVolumes();
+    m_persist.store(m_trackIdx, m_sectionIdx, m_trackIdxWithinSet);
+    m_sharedConfig.setTracks(m_trackList, m_setList);
+    publishConfig();
+    // after the generation, so a crash in between never resumes the old tracks
+    m_persist.storeSource(source);
+    sendTracksReloadedEvent();
+    sendReadyEvent();
+}
+
+/*! \brief Make the performance list as long as the track list.
+ *
+ * Performances are matched to tracks by index, so added tracks get
+ * pending performances, and the cache is rewritten with the new length.
+ *
+ * \return True if the length has changed.
+ */
+bool Patcher::resizePerformances()
+{
+    size_t n = m_trackList.size();
+    if (m_performanceList.size() == n)
+        return false;
+    std::vector<Fantom::Performance> store(n);
+    for (size_t i=0; i<n && i<m_performanceList.size(); i++)
+        store[i] = *m_performanceList[i];
+    m_performanceStore.swap(store);
+    m_fantomCache.release();
+    m_performanceList.clear();
+    for (size_t i=0; i<m_performanceStore.size(); i++)
+        m_performanceList.push_back(&m_performanceStore[i]);
+    m_cacheDirty = true;
+    m_cacheWriteDue = m_eventRxTime;
+    return true;
+}
+
+/*! \brief Send all notes off and sustain off on every channel of the current \a Track.
+ *
+ * Unlike \a allNotesOff(), this covers all sections, since toggled or
+ * sustained notes may have been left sounding by an earlier section.
+ */
+void Patcher::releaseNotes()
+{
+    bool channelsCleared[Midi::NofChannels];
+    for (int i=0; i<Midi::NofChannels; i++)
+        channelsCleared[i] = false;
+    const SectionList &sectionList = currentTrack()->m_sectionList;
+    for (size_t s=0; s<sectionList.size(); s++)
+    {
+        for (size_t i=0; i<sectionList[s]->m_partList.size(); i++)
+        {
+            int channel = sectionList[s]->m_partList[i]->m_channel;
+            if (channel < 0 || channel >= Midi::NofChannels || channelsCleared[channel])
+                continue;
+            channelsCleared[channel] = true;
+            sendMidi(Midi::Device::FantomOut, Midi::noData,
+                Midi::controller|channel, Midi::allNotesOff, 0);
+            sendMidi(Midi::Device::FantomOut, Midi::noData,
+                Midi::controller|channel, Midi::sustain, 0);
+        }
+    }
+}
+
+/*! \brief Serve the held live input once the live performance has been selected again.
+ */
+void Patcher::pollLiveHold()
+{
+    if (m_midi->holding() && timeGreaterThanOrEqual(m_eventRxTime, m_liveHoldEnd))
+        m_midi->release();
+}
+
+/*! \brief Time until the event loop must wake up, even without input.
+ *
+ * \return Timeout in usec for Midi::Driver::wait(), 0 to wait for input only.
+ */
+int Patcher::usecTimeout() const
+{
+    int timeout = m_fantomSync.usecTimeout(m_eventRxTime, m_liveState.current().quiet());
+    int reload = 0;
+    if (m_trackLoader.busy())
+    {
+        reload = reloadPollPeriod;
+    }
+    else if (m_reloadPending)
+    {
+        Real dt = timeDiffSeconds(m_eventRxTime, m_reloadTime);
+        reload = dt > (Real)0.001 ? (int)(dt*(Real)1e+6) : 1000;
+    }
+    if (reload && (!timeout || reload < timeout))
+        timeout = reload;
+    int probe = m_fantomProbe.usecTimeout(m_eventRxTime, m_fantomSync.active());
+    if (probe && (!timeout || probe < timeout))
+        timeout = probe;
+    int cache = 0;
+    if (m_cacheWriter != -1)
+    {
+        cache = cacheWriterPollPeriod;
+    }
+    else if (m_cacheDirty || m_xmlExportPending)
+    {
+        Real dt = timeDiffSeconds(m_eventRxTime, m_cacheWriteDue);
+        cache = dt > (Real)0.001 ? (int)(dt*(Real)1e+6) : 1000;
+    }
+    if (cache && (!timeout || cache < timeout))
+        timeout = cache;
+    if (m_configDirty && m_liveState.current().quiet())
+    {
+        Real dt = timeDiffSeconds(m_eventRxTime, m_configPublishDue);
+        int publish = dt > (Real)0.001 ? (int)(dt*(Real)1e+6) : 1000;
+        if (!timeout || publish < timeout)
+            timeout = publish;
+    }
+    if (m_midi->holding())
+    {
+        Real dt = timeDiffSeconds(m_eventRxTime, m_liveHoldEnd);
+        int hold = dt > (Real)0.001 ? (int)(dt*(Real)1e+6) : 1000;
+        if (!timeout || hold < timeout)
+            timeout = hold;
+    }
+    return timeout;
 }
 
 /*! \brief Restore state from a Persist object.
  *
- *  The state consists of the currenct track and current section.
+ *  The state consists of the currenct track and current section. After
+ *  a warm start, the Fantom still plays the current track, so it is not
+ *  selected again, and the filter state of its parts is restored. The
+ *  notes a previous core left sounding are released either way.
  */
 void Patcher::restoreState()
 {
     int t,s;
     m_persist.restore(&t, &s, &m_trackIdxWithinSet);
+    if (m_warmStart && t >= 0 && t < (int)nofTracks()
+        && s >= 0 && s < m_trackList[t]->nofSections())
+    {
+        m_trackIdx = t;
+        m_sectionIdx = s;
+        restoreParts();
+        releaseHangingNotes();
+        publishVolumes();
+        if (m_fpLog)
+            fprintf(m_fpLog, "warm start at track %d section %d\n", m_trackIdx, m_sectionIdx);
+        return;
+    }
     changeTrack(t);
     changeSection(s);
+    releaseHangingNotes();
+}
+
+/*! \brief Index of a part of the current \a Section among all parts of the current \a Track.
+ *
+ * \param[in] part  Index of the part within the section.
+ */
+int Patcher::partIndex(int part) const
+{
+    for (int s=0; s<m_sectionIdx; s++)
+        part += (int)currentTrack()->m_sectionList[s]->m_partList.size();
+    return part;
+}
+
+/*! \brief Store the filter state of parts of the current \a Section in the warm start snapshot.
+ *
+ * \param[in] parts  A bit per part to store, as returned by \a route(), all parts by default.
+ */
+void Patcher::storeParts(uint64_t parts)
+{
+    const SwPartList &partList = currentSection()->m_partList;
+    int index = partIndex(0);
+    for (size_t i=0; i<partList.size() && i<64; i++)
+    {
+        if (parts & ((uint64_t)1 << i))
+            m_persist.storePart(index + (int)i, *partList[i]);
+    }
 }
 
-/*! \brief Sends a 'ready' event to inform clients of a non MIDI status change.
+/*! \brief Restore the filter state of all parts of the current \a Track from the warm start snapshot.
+ *
+ * Parts without an intact record keep their initial state.
+ */
+void Patcher::restoreParts()
+{
+    const SectionList &sectionList = currentTrack()->m_sectionList;
+    int index = 0;
+    for (size_t s=0; s<sectionList.size(); s++)
+    {
+        for (size_t i=0; i<sectionList[s]->m_partList.size(); i++)
+            m_persist.restorePart(index++, *sectionList[s]->m_partList[i]);
+    }
+}
+
+/*! \brief Release the notes a previous core left sounding.
+ *
+ * No core listens to the keyboards during a restart, so every key and
+ * the sustain pedal count as released. Notes latched by a toggler of the
+ * current track keep sounding, the next press releases them as usual.
+ * On a channel without an intact owner record, all notes are released.
+ */
+void Patcher::releaseHangingNotes()
+{
+    std::vector<SwPart *> parts;
+    bool channelUsed[Midi::NofChannels];
+    for (int i=0; i<Midi::NofChannels; i++)
+        channelUsed[i] = false;
+    const SectionList &sectionList = currentTrack()->m_sectionList;
+    for (size_t s=0; s<sectionList.size(); s++)
+    {
+        for (size_t i=0; i<sectionList[s]->m_partList.size(); i++)
+        {
+            SwPart *part = sectionList[s]->m_partList[i];
+            parts.push_back(part);
+            if (part->m_channel < Midi::NofChannels)
+                channelUsed[part->m_channel] = true;
+        }
+    }
+    for (int channel=0; channel<Midi::NofChannels; channel++)
+    {
+        uint8_t owner[Midi::Note::max];
+        if (!m_persist.owners(channel, owner))
+        {
+            sendMidi(Midi::Device::FantomOut, Midi::noData,
+                Midi::controller|channel, Midi::allNotesOff, 0);
+            for (size_t i=0; i<parts.size(); i++)
+            {
+                if (parts[i]->m_channel == channel)
+                    parts[i]->m_toggler.reset();
+            }
+            continue;
+        }
+        for (int note=0; note<Midi::Note::max; note++)
+        {
+            if (owner[note] == Persist::NoOwner)
+                continue;
+            SwPart *part = owner[note] < parts.size() ? parts[owner[note]] : 0;
+            if (part && part->m_toggler.enabled() && part->m_toggler.latched(note))
+            {
+                // still sounding, as far as the clients know
+                m_liveState.beginUpdate().apply(Midi::noteOn|channel, note, 127);
+                m_liveState.endUpdate();
+                continue;
+            }
+            sendMidi(Midi::Device::FantomOut, Midi::noData, Midi::noteOff|channel, note, 0);
+            if (part)
+                part->m_toggler.release(note);
+        }
+    }
+    for (int channel=0; channel<Midi::NofChannels; channel++)
+    {
+        if (channelUsed[channel])
+            sendMidi(Midi::Device::FantomOut, Midi::noData,
+                Midi::controller|channel, Midi::sustain, 0);
+    }
+    for (size_t i=0; i<parts.size(); i++)
+    {
+        parts[i]->m_monoFilter.reset();
+        if (parts[i]->m_transposer)
+            parts[i]->m_transposer->setSustain(false);
+        m_persist.storePart((int)i, *parts[i]);
+    }
+}
+
+/*! \brief Publish the patcher status, and send a 'ready' event to inform clients of the change.
  */
 void Patcher::sendReadyEvent()
 {
     Event event;
-    event.m_metaMode = m_metaMode ? 1 : 0;
-    event.m_currentTrack = m_trackIdx;
-    event.m_currentSection = m_sectionIdx;
-    event.m_trackIdxWithinSet = m_trackIdxWithinSet;
+    LiveShm::State &state = m_liveState.beginUpdate();
+    state.m_metaMode = m_metaMode ? 1 : 0;
+    state.m_currentTrack = (uint16_t)m_trackIdx;
+    state.m_currentSection = (uint16_t)m_sectionIdx;
+    state.m_trackIdxWithinSet = (uint16_t)m_trackIdxWithinSet;
+    m_liveState.endUpdate();
     event.m_type = Event::Ready;
     event.m_deviceId = Event::Unspecified;
     event.m_part = Event::Unspecified;
@@ -200,6 +939,67 @@ void Patcher::sendReadyEvent()
     m_eventTxQueue.send(event);
 }
 
+/*! \brief Sends a 'tracks reloaded' event to make clients reload the track image.
+ */
+void Patcher::sendTracksReloadedEvent()
+{
+    Event event;
+    event.m_type = Event::TracksReloaded;
+    event.m_deviceId = Event::Unspecified;
+    event.m_part = Event::Unspecified;
+    event.m_midi[0] = Event::Unspecified;
+    event.m_midi[1] = Event::Unspecified;
+    event.m_midi[2] = Event::Unspecified;
+    m_eventTxQueue.send(event);
+}
+
+/*! \brief Sends a 'fantom sync' event to inform clients of downloaded performance data.
+ *
+ * \param[in]  performance     Index of the downloaded performance, \a Event::Unspecified if none.
+ */
+void Patcher::sendFantomSyncEvent(int performance)
+{
+    publishSyncState();
+    Event event;
+    event.m_type = Event::FantomSync;
+    event.m_deviceId = Midi::Device::FantomIn;
+    event.m_part = performance < Event::Unspecified ? performance : Event::Unspecified;
+    event.m_midi[0] = Event::Unspecified;
+    event.m_midi[1] = Event::Unspecified;
+    event.m_midi[2] = Event::Unspecified;
+    m_eventTxQueue.send(event);
+}
+
+//! \brief Publish the progress of the download of performance data.
+void Patcher::publishSyncState()
+{
+    LiveShm::State &state = m_liveState.beginUpdate();
+    state.m_nofSynced = (uint16_t)m_fantomSync.nofSynced();
+    state.m_nofToSync = (uint16_t)m_fantomSync.total();
+    state.m_nofSyncFailed = (uint16_t)m_fantomSync.nofFailed();
+    uint32_t errors = m_fantom->statistics().errors();
+    state.m_nofSyncErrors = (uint16_t)(errors < 0xffff ? errors : 0xfffe);
+    m_liveState.endUpdate();
+}
+
+/*! \brief Report a failed write to the recording, once.
+ *
+ * The recording stops growing after a failed write, e.g. on a full SD card,
+ * while the core keeps playing.
+ */
+void Patcher::pollRecording()
+{
+    int error = m_sequencer.writeError();
+    if (error == 0 || error == m_recordingError)
+        return;
+    m_recordingError = error;
+    std::cerr << "** recording " << m_sequencer.recordingName() << " stopped, write failed: "
+        << strerror(error) << ", " << m_sequencer.nofDropped() << " records dropped" << std::endl;
+    if (m_fpLog)
+        fprintf(m_fpLog, "recording %s stopped, write failed: %s, %u records dropped\n",
+            m_sequencer.recordingName().c_str(), strerror(error), m_sequencer.nofDropped());
+}
+
 /*! \brief Run the event loop.
  *
  *  This function processes incoming events. It never returns.
@@ -212,9 +1012,54 @@ void Patcher::eventLoop()
         g_timer.resetWatchdog(3);
         if (m_fpLog && j % 20 == 0)
             fprintf(m_fpLog, "eventloop %08d\n", j);
-        int deviceRx = m_midi->wait();
+        getTime(m_eventRxTime);
+        pollFantomSync();
+        pollConfigPublish();
+        pollFantomProbe();
+        pollReload();
+        pollCacheWriter();
+        pollRecording();
+        pollLiveHold();
+        int deviceRx = m_midi->wait(usecTimeout());
+        if (deviceRx == Midi::Device::none)
+            continue; // timeout, only background work to do
+        if (deviceRx == Midi::Device::config)
+        {
+            if (m_midi->configChanged())
+            {
+                // wait for the editor to finish, then read it in the background
+                getTime(m_reloadTime);
+                timeSum(m_reloadTime, m_reloadTime, TimeSpec(reloadDelay));
+                m_reloadPending = true;
+            }
+            continue;
+        }
         uint8_t byteRx = m_midi->getByte(deviceRx);
         getTime(m_eventRxTime);
+        m_midi->timestamp(deviceRx, m_eventRxTime);
+        if (deviceRx == Midi::Device::FantomIn && m_fantomSync.active())
+        {
+            m_fantomSync.receive(byteRx);
+            continue;
+        }
+        if (deviceRx == Midi::Device::FantomIn && m_fantomProbe.waiting())
+        {
+            if (m_fantomProbe.receive(byteRx, m_eventRxTime))
+                publishRoundTrip();
+            continue;
+        }
+        if (deviceRx != Midi::Device::FantomIn && byteRx < Midi::timingClock)
+        {
+            if (m_fantomSync.liveInput(m_eventRxTime, m_trackIdx))
+                timeSum(m_liveHoldEnd, m_eventRxTime, TimeSpec(Fantom::Synchroniser::selectDelay()));
+            if (!timeGreaterThanOrEqual(m_eventRxTime, m_liveHoldEnd))
+            {
+                // the live performance is still being selected, the input waits in the driver
+                m_midi->hold(deviceRx, byteRx);
+                continue;
+            }
+            m_fantomProbe.liveInput(m_eventRxTime);
+        }
         if (byteRx < 0x80)
         {
             // data without status - skip
@@ -235,6 +1080,7 @@ void Patcher::eventLoop()
                     // active sensing, single byte, dropped
                     break;
                 case Midi::realtimeStart:
+                    recordInput(deviceRx, byteRx);
                     if (m_fpLog)
                         fprintf(m_fpLog, "panic on\n");
                     for (int channel=0; channel<Midi::NofChannels; channel++)
@@ -246,6 +1092,7 @@ void Patcher::eventLoop()
                     }
                     break;
                 case Midi::realtimeStop:
+                    recordInput(deviceRx, byteRx);
                     if (m_fpLog)
                         fprintf(m_fpLog, "panic off\n");
                     break;
@@ -262,6 +1109,7 @@ void Patcher::eventLoop()
                         {
                             uint8_t note = m_midi->getByte(deviceRx);
                             uint8_t velo = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, note, velo);
 #ifdef LOG_NOTE
                             if (m_fpLog)
                                 fprintf(m_fpLog,
@@ -278,6 +1126,7 @@ void Patcher::eventLoop()
                         {
                             uint8_t note = m_midi->getByte(deviceRx);
                             uint8_t velo = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, note, velo);
 #ifdef LOG_NOTE
                             if (m_fpLog)
                                 fprintf(m_fpLog,
@@ -304,6 +1153,7 @@ void Patcher::eventLoop()
                         {
                             uint8_t note = m_midi->getByte(deviceRx);
                             uint8_t val = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, note, val);
                             if (m_fpLog)
                                 fprintf(m_fpLog,
                                     "aftertouch %s ch %02x val %02x\n",
@@ -315,6 +1165,7 @@ void Patcher::eventLoop()
                         {
                             uint8_t num = m_midi->getByte(deviceRx);
                             uint8_t val = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, num, val);
 #ifdef LOG_CONTROLLER
                             if (m_fpLog)
                                 fprintf(m_fpLog,
@@ -335,6 +1186,7 @@ void Patcher::eventLoop()
                                 m_metaMode = !!val;
                                 sendMidi(Midi::Device::BcfOut, Midi::noData, Midi::controller|0,
                                     Midi::BCFSwitchA, val ? 127 : 0);
+                                sendReadyEvent();
                             }
                             else if (deviceRx == Midi::Device::BcfIn && num == Midi::BCFSwitchA)
                             {
@@ -362,6 +1214,7 @@ void Patcher::eventLoop()
                         case Midi::programChange:
                         {
                             uint8_t num = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, num);
 #ifdef LOG_PROGRAM_CHANGE
                             if (m_fpLog)
                                 fprintf(m_fpLog,
@@ -404,6 +1257,7 @@ void Patcher::eventLoop()
                         case Midi::channelAftertouch:
                         {
                             uint8_t num = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, num);
                             if (m_fpLog)
                                 fprintf(m_fpLog,
                                     "channelRx pressure channelRx %02x num %02x\n",
@@ -415,6 +1269,7 @@ void Patcher::eventLoop()
                         {
                             uint8_t num1 = m_midi->getByte(deviceRx);
                             uint8_t num2 = m_midi->getByte(deviceRx);
+                            recordInput(deviceRx, byteRx, num1, num2);
 #ifdef LOG_PITCHBEND
                             if (m_fpLog)
                                 fprintf(m_fpLog,
@@ -453,86 +1308,15 @@ void Patcher::eventLoop()
 void Patcher::sendEventToFantom(uint8_t midiStatusByte,
                 uint8_t data1, uint8_t data2)
 {
-    uint8_t data1Out = data1;
-    uint8_t data2Out = data2;
-    uint8_t midiStatus = Midi::status(midiStatusByte);
-    bool isNoteData = Midi::isNote(midiStatus);
-    bool isNoteOn = Midi::isNoteOn(midiStatus, data1, data2);
-    bool isNoteOff = Midi::isNoteOff(midiStatus, data1, data2);
-    bool isController = Midi::isController(midiStatus);
-    for (size_t i=0; i<currentSection()->m_partList.size(); i++)
+    uint64_t changed = route(currentSection(), midiStatusByte, data1, data2, m_routed, m_fpLog);
+    for (size_t i=0; i<m_routed.size(); i++)
     {
-        bool drop = false;
-        SwPart *swPart = currentSection()->m_partList[i];
-        if (isNoteData)
-        {
-            if (!swPart->inRange(data1))
-            {
-                continue;
-            }
-            data1Out = data1 + swPart->m_transpose;
-            if (swPart->m_customTransposeEnabled)
-                data1Out += swPart->m_customTranspose[
-                    (data1 + 12 + swPart->m_customTransposeOffset) % 12];
-            if (data1Out > 127)
-                data1Out = 127;
-            if (swPart->m_mono)
-            {
-                if (isNoteOn && !swPart->m_monoFilter
-                        .passNoteOn(data1, data2))
-                {
-                    if (m_fpLog)
-                        fprintf(m_fpLog, "note on dropped\n");
-                    continue;
-                }
-                if (isNoteOff && !swPart->m_monoFilter
-                        .passNoteOff(data1, data2))
-                {
-                    if (m_fpLog)
-                        fprintf(m_fpLog, "note off dropped\n");
-                    continue;
-                }
-            }
-            if (swPart->m_transposer)
-            {
-                if (isNoteOn || isNoteOff)
-                {
-                    swPart->m_transposer->transpose(midiStatus, data1Out, data2Out);
-                }
-            }
-            if (!swPart->m_toggler.pass(midiStatus, data1Out, data2Out))
-            {
-                if (m_fpLog)
-                    fprintf(m_fpLog, "note on dropped\n");
-                continue;
-            }
-        }
-        if (isController)
-        {
-            if (data1 == Midi::sustain && swPart->m_mono)
-            {
-                swPart->m_monoFilter.sustain(data2 != 0);
-                if (m_fpLog)
-                    fprintf(m_fpLog, "mono sustain\n");
-            }
-            if (data1 == Midi::sustain && swPart->m_transposer)
-            {
-                swPart->m_transposer->setSustain(data2 != 0);
-                if (m_fpLog)
-                    fprintf(m_fpLog, "transposer sustain\n");
-                drop = true;
-            }
-            if (swPart->m_controllerRemap)
-            {
-                drop = drop || !swPart->m_controllerRemap->value(
-                    data1, data2, &data1Out, &data2Out);
-            }
-        }
-        if (!drop)
-        {
-            sendMidi(Midi::Device::FantomOut, i, midiStatus|swPart->m_channel, data1Out, data2Out);
-        }
-    } // FOREACH part in current section
+        const RoutedMessage &message = m_routed[i];
+        sendMidi(Midi::Device::FantomOut, message.m_part, message.m_status, message.m_data1, message.m_data2);
+    }
+    // plain parts have no filter state, most messages store nothing
+    if (changed)
+        storeParts(changed);
 }
 
 /*! \brief Change the volume of a Fantom part and send an event.
@@ -542,21 +1326,22 @@ void Patcher::sendEventToFantom(uint8_t midiStatusByte,
  */
 void Patcher::setVolume(uint8_t hwPart, uint8_t value)
 {
+    if (!currentTrack()->m_performance)
+        return;
     m_fantom->setVolume(hwPart, value);
     // Since the volume is set as a part parameter rather than through
     // a controller message, we need to fake the controller message
     // to inform clients about the volume change.
     Fantom::Part *part = currentTrack()->m_performance->m_partList+hwPart;
-    for (size_t swPart = 0; swPart<part->m_swPartList.size(); swPart++)
+    m_liveState.beginUpdate().m_volume[hwPart] = value;
+    m_liveState.endUpdate();
+    const ArenaList<const SwPart *> &swPartList = currentTrack()->m_swPartList[hwPart];
+    for (size_t swPart = 0; swPart<swPartList.size(); swPart++)
     {
         Event event;
-        event.m_metaMode = m_metaMode ? 1 : 0;
-        event.m_currentTrack = m_trackIdx;
-        event.m_currentSection = m_sectionIdx;
-        event.m_trackIdxWithinSet = m_trackIdxWithinSet;
         event.m_type = Event::MidiOut3Bytes;
         event.m_deviceId = Midi::Device::FantomOut;
-        event.m_part = part->m_swPartList[swPart]->m_number;
+        event.m_part = swPartList[swPart]->m_number;
         event.m_midi[0] = Midi::controller | part->m_channel;
         event.m_midi[1] = Midi::mainVolume;
         event.m_midi[2] = value;
@@ -581,11 +1366,8 @@ void Patcher::sendMidi(int deviceId, uint8_t part, uint8_t status, uint8_t data1
         m_midi->putBytes(deviceId, status, data1);
     else
         m_midi->putBytes(deviceId, status, data1, data2);
+    m_sequencer.record(deviceId | Recording::Output, m_trackIdx, m_sectionIdx, status, data1, data2);
     Event event;
-    event.m_metaMode = m_metaMode ? 1 : 0;
-    event.m_currentTrack = m_trackIdx;
-    event.m_currentSection = m_sectionIdx;
-    event.m_trackIdxWithinSet = m_trackIdxWithinSet;
     if (data2 == Midi::noData)
         event.m_type = Event::MidiOut2Bytes;
     else
@@ -595,9 +1377,26 @@ void Patcher::sendMidi(int deviceId, uint8_t part, uint8_t status, uint8_t data1
     event.m_midi[0] = status;
     event.m_midi[1] = data1;
     event.m_midi[2] = data2;
+    if (deviceId == Midi::Device::FantomOut)
+    {
+        m_liveState.beginUpdate().apply(status, data1, data2);
+        m_liveState.endUpdate();
+        m_persist.apply(status, data1, data2, part == Midi::noData ? -1 : partIndex(part));
+    }
     m_eventTxQueue.send(event);
 }
 
+/*! \brief Publish the volumes of the current performance, after a track change.
+ */
+void Patcher::publishVolumes()
+{
+    const Fantom::Performance *performance = currentTrack()->m_performance;
+    LiveShm::State &state = m_liveState.beginUpdate();
+    for (int i=0; i<Fantom::Performance::NofParts; i++)
+        state.m_volume[i] = performance ? performance->m_partList[i].m_volume : LiveShm::Unknown;
+    m_liveState.endUpdate();
+}
+
 /*! \brief Abuse the Fantom screen to show the current section.
  */
 void Patcher::updateFantomDisplay()
@@ -618,6 +1417,8 @@ void Patcher::updateFantomDisplay()
  */
 void Patcher::updateBcfFaders()
 {
+    if (!currentTrack()->m_performance)
+        return;
     for (int i=0; i<Fantom::Performance::NofParts;i++)
     {
         const Fantom::Part *hwPart = currentTrack()->m_performance->m_partList+i;
@@ -657,6 +1458,7 @@ void Patcher::allNotesOff()
             part->m_toggler.reset();
         }
     }
+    storeParts();
 }
 
 /*! \brief Change to a new \a Section.
@@ -665,9 +1467,9 @@ void Patcher::allNotesOff()
  *
  * \param [in] sectionIdx   The section number to switch to.
  */
-void Patcher::changeSection(uint8_t sectionIdx)
+void Patcher::changeSection(int sectionIdx)
 {
-    if (sectionIdx <
+    if (sectionIdx >= 0 && sectionIdx <
         m_trackList[m_trackIdx]->nofSections())
 
     {
@@ -745,13 +1547,16 @@ void Patcher::prevSection()
 
 /*! \brief Switch to a new \a Track.
  */
-void Patcher::changeTrack(uint8_t track)
+void Patcher::changeTrack(int track)
 {
+    m_persist.newTrack();
     m_trackIdx = track;
     m_sectionIdx = currentTrack()->m_startSection; // cannot use changeSection!
     m_fantom->selectPerformance(m_trackIdx);
+    m_fantomSync.trackChanged(m_trackIdx);
     updateFantomDisplay();
     updateBcfFaders();
+    publishVolumes();
     m_persist.store(m_trackIdx, m_sectionIdx, m_trackIdxWithinSet);
 }
 
@@ -784,7 +1589,7 @@ void Patcher::changeTrackByNote(uint8_t note)
     }
     if (valid)
     {
-        changeTrack((uint8_t)m_trackIdx);
+        changeTrack(m_trackIdx);
     }
     sendReadyEvent();
 }
@@ -825,7 +1630,7 @@ int main(int argc, char **argv)
     // if importing, then exporting alters any performance data.
     XML xml;
     Fantom::PerformanceList perfList;
-    xml.importPerformances("fantom_cache.xml", perfList);
+    xml.importPerformances(FANTOM_CACHE_XML, perfList);
     xml.exportPerformances("fantom_cache2.xml", perfList);
     // read tracklist and setlist
     TrackList trackList;
@@ -839,26 +1644,56 @@ int main(int argc, char **argv)
         (*track)->merge(*performance);
     }
     // cleanup
-    clear(trackList);
     for (std::vector<Fantom::Performance*>::iterator i = perfList.begin(); i != perfList.end(); i++)
         delete *i;
     return 0;
 #endif
     try
     {
+        bool standalone = false;
+        bool xmlExport = false;
+        bool record = false;
+        const char *fifoDir = 0;
+        Real probePeriod = 0;
+        bool coldStart = false;
+        int nofRestarts = 0, exitSignal = 0, exitCode = 0;
         for (;;)
         {
-            int opt = getopt(argc, argv, "shd:");
+            int opt = getopt(argc, argv, "shxrCd:f:i:p:R:");
             if (opt == -1)
                 break;
             switch (opt)
             {
                 case 's':
-                {
-                    Queue q;
-                    q.create();
+                    standalone = true;
+                    break;
+                case 'x':
+                    xmlExport = true;
+                    break;
+                case 'r':
+                    record = true;
+                    break;
+                case 'f':
+                    fifoDir = optarg;
+                    break;
+                case 'i':
+                    if (!*optarg || strchr(optarg, '/'))
+                        throw(Error("the instance name must not be empty or contain a slash, try -h"));
+                    Ipc::setInstance(optarg);
+                    break;
+                case 'C':
+                    coldStart = true;
+                    break;
+                case 'R':
+                    if (sscanf(optarg, "%d,%d,%d", &nofRestarts, &exitSignal, &exitCode) != 3
+                        || nofRestarts < 1)
+                        throw(Error("the restart info must be count,signal,exit code, try -h"));
+                    break;
+                case 'p':
+                    probePeriod = (Real)atof(optarg);
+                    if (probePeriod <= 0)
+                        throw(Error("the probe period must be positive, try -h"));
                     break;
-                }
                 case 'd':
                 {
                     const char *dir = optarg;
@@ -871,10 +1706,17 @@ int main(int argc, char **argv)
                     break;
                 }
                 default:
-                    std::cerr << "\npatcher [-h|?] [-d <dir>] [-s]\n\n"
+                    std::cerr << "\npatcher [-h|?] [-d <dir>] [-s] [-x] [-r] [-f <dir>] [-i <name>] [-p <seconds>] [-C] [-R <n,sig,exit>]\n\n"
                         "  -h|?     This message\n"
                         "  -s       Run standalone\n"
-                        "  -d dir   Change dir\n\n";
+                        "  -x       Export performance cache as XML after download\n"
+                        "  -r       Record all MIDI traffic to seq-<date>-<time>.seq\n"
+                        "  -d dir   Change dir\n"
+                        "  -f dir   Use the named pipes in dir instead of the devices in " DEVICE_CONF "\n"
+                        "  -i name  Use IPC objects of its own, named after the instance, instead of those of the live patcher\n"
+                        "  -p sec   Measure the round trip to the Fantom at most every sec seconds while idle\n"
+                        "  -C       Ignore the warm start snapshot of a previous core\n"
+                        "  -R n,sig,exit  Restart n by the administrator, after the previous core got a signal or exited\n\n";
                     return 1;
                     break;
             }
@@ -883,12 +1725,28 @@ int main(int argc, char **argv)
         {
             throw(Error("unrecognised trailing arguments, try -h"));
         }
+        if (standalone)
+        {
+            Queue q;
+            q.create();
+        }
         g_timer.setTimeout((Real)1.0, 2);
-        Midi::Driver midi(0);
+        Midi::Driver midi(0, fifoDir);
         Fantom::Driver fantom(&midi);
         Patcher patcher(&midi, &fantom);
+        if (nofRestarts > 0)
+            patcher.restarted(nofRestarts, exitSignal, exitCode);
+        if (coldStart)
+            patcher.forceColdStart();
+        if (xmlExport)
+            patcher.enableXmlExport();
+        if (record)
+            patcher.enableRecording();
         patcher.loadConfig();
         patcher.restoreState();
+        patcher.startFantomSync();
+        if (probePeriod > 0)
+            patcher.startFantomProbe(probePeriod);
         patcher.updateBcfFaders();
         patcher.eventLoop();
     }
@@ -91,6 +91,59 @@ Switching between tracks is done in meta mode.
 \section configuration Configuration
 
 Configuration is read from an XML file. A schema XSD is provided.
+patcher_compile validates the XML file against the schema once and compiles it into a binary image,
+which all processes read without parsing. An image that is older than the XML file
+is ignored, and rewritten by the core.
+When the XML file is saved while the patcher is running, the core reads it on a background thread
+and swaps the new definitions in between two MIDI events. The current track and section are kept
+by name, sounding notes are released, and the clients pick up the new definitions.
+If the new file cannot be read, the core keeps playing with the old definitions.
+
+The core publishes what it has loaded, tracks and performance data merged, in a POSIX shared memory
+segment, and publishes a new generation of it whenever the tracks are reloaded or a performance is downloaded.
+Clients check the generation on every event and use the segment in place, so they never parse
+anything themselves. The image and cache files are only read by clients if no core has published yet.
+
+The segment outlives the core. Next to the current track and section, the core keeps a warm start snapshot
+in shared memory: the generation it has published, the filter state of the parts of the current track and the
+part that owns every note sounding on the Fantom, each record with its own checksum. A core that is restarted
+after a crash resumes that generation, unless the XML file has changed since, and plays again within
+milliseconds without selecting the performance again. Keys and the sustain pedal count as released, so the
+notes they held are released, while notes latched by a toggle part keep sounding until they are pressed again.
+
+Fantom performance data is downloaded once and stored in a binary cache file, which is memory mapped on later runs.
+Missing performance data is downloaded in the background while the patcher is already playing: the live track first, other tracks only when no one has played for a few seconds and no note or sustain pedal is held.
+With the -x option the core also writes the cache as XML, for humans.
+
+\section devices MIDI devices
+
+The MIDI devices are read from "devices.conf", a line per device: its name, the transport and an address.
+The transport is "rawmidi" for an ALSA rawmidi device ("Anniv,0,1" or "hw:1,0,1"), "seq" for a port of the
+ALSA sequencer ("Anniv:1", as listed by aconnect -l), or "fifo" for a named pipe. Sequencer ports stamp the
+input in the kernel, so the latency of the core is measured from the arrival of the MIDI data.
+
+With the -p option the core measures the round trip to the Fantom: after a second without live input, and
+at most once per period, it requests the name of the current performance and times the reply. The latest
+round trip and the shortest, mean and longest of the last 32 are in the live state, and on the curses client,
+so a bad USB interface or hub shows up at the soundcheck. The requests and replies take about 13 ms on the links.
+
+\section recording Recording and replay
+
+With the -r option the core records every MIDI message it receives or sends, with the current track and section,
+in a seq-<date>-<time>.seq file. seq_dump prints a recording. A failed write, e.g. on a full card, ends the
+recording where it is and is reported on stderr, while the core keeps playing.
+
+patcher_replay runs the core on named pipes instead of the MIDI devices (the -f option of the core),
+feeds it a recording or a text stream at its original pace, and reports the throughput, the latency
+of the core and the first difference with a golden output. The replay_bench target replays every
+stream in the replay directory of the source tree, and fails on a difference or a missing golden output.
+After an intended change in the routing, the replay_bless target writes the golden outputs, review
+the difference and check them in.
+
+patcher_fantom stands in for the Fantom on the named pipes of the core. It answers parameter requests from
+the performance name, part parameters and patch names of the selected performance, applies parameter writes,
+and loads a performance from an XML performance cache on a program change, at the speed of a MIDI link and
+with a configurable load time. Run the core without a cache next to it to time the download.
 
 \section processes Processes
 The application consists of 3 processes.
@@ -98,6 +151,14 @@ The application consists of 3 processes.
 - The curses client, which produces terminal screen output from patcher events.
 - The patcher administrator, which creates and cleans up the two processes above, as well as the event queue.
 
+The administrator supervises the core and the client independently. A process that stops is started again
+right away, while the other one keeps running: a crashed core is back within milliseconds from its warm start
+snapshot, and the client stays attached to the event queue and picks up what the new core publishes.
+A process that keeps dying within a few seconds of its start is restarted with a backoff that doubles up to 8 seconds,
+and after 3 such deaths the core is started with -C, so a damaged snapshot cannot keep it in a crash loop.
+The administrator passes the number of restarts and the signal or exit code of the previous core with -R;
+the core puts them in the live state, and the curses client shows them.
+
 \htmlonly
 <div align='center'>
 <embed src="processes.svg" type="image/svg+xml"/>
@@ -118,5 +179,10 @@ typedef double Real;    //!< Double precision for PC, single precision for Pi.
 #error either SINGLE_PRECISION or DOUBLE_PRECISION must be defined
 #endif
 #define TRACK_DEF "tracks.xml"  //!< Config file name.
+#define TRACK_IMAGE "tracks.bin"    //!< Precompiled config file name.
+#define TRACK_SCHEMA "tracks.xsd"  //!< Config file schema, next to the config file.
+#define FANTOM_CACHE "fantom_cache.bin"     //!< Binary Fantom performance cache file name.
+#define FANTOM_CACHE_XML "fantom_cache.xml" //!< Human readable Fantom performance cache file name.
+#define DEVICE_CONF "devices.conf"  //!< MIDI device config file name.
 const unsigned char masterProgramChangeChannel = 0x0f; //!< MIDI channel to listen on for program changes that will be interpreted by this application.
 #endif
@@ -8,22 +8,54 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/unistd.h>
+#include "trackdef.h"
+#include "checksum.h"
 #include "error.h"
+#include "ipcname.h"
 
-//! \brief Memory map of persistent data: current \a Track and \a Section index.
+namespace
+{
+const char objectName[] = "/patcher-persistent";    //!< Name of the shared memory object of a live patcher.
+}
+
+//! \brief Filter state of a \a SwPart of the current \a Track.
+struct PartRecord
+{
+    uint32_t m_checksum;                    //!< Adler-32 checksum of the fields below.
+    uint32_t m_generation;                  //!< Generation of the snapshot it was written in.
+    Toggler::State m_toggler;               //!< Toggler state.
+    MonoFilter::State m_monoFilter;         //!< Mono filter state.
+    Transposer::State m_transposer;         //!< Sustain transposer state, zero if the part has none.
+};
+
+//! \brief The owners of the notes sounding on a MIDI channel.
+struct ChannelRecord
+{
+    uint32_t m_checksum;                    //!< Adler-32 checksum of \a m_owner.
+    uint8_t m_owner[Midi::Note::max];       //!< Part index within the track, or \a Persist::NoOwner or \a Persist::Foreign.
+};
+
+//! \brief Memory map of persistent data: current \a Track and \a Section index, and the warm start snapshot.
 class MemoryMap
 {
 public:
-    static const int expectMagic = 0xafbe821a;  //!<    Magic number, must be changed if layout changes.
+    static const int expectMagic = 0xafbe821c;  //!<    Magic number, must be changed if layout changes.
     int m_magic;                                //!<    Magic number.
-    bool m_valid;                               //!<    Validity flag.
+    uint32_t m_checksum;                        //!<    Adler-32 checksum of the fields up to \a m_channel.
+    uint32_t m_generation;                      //!<    Changes with the track, part records of other generations are stale.
     int m_track;                                //!<    Current \a Track number.
     int m_section;                              //!<    Current \a Section number.
     int m_trackWithinSet;                       //!<    Track index within setlist.
+    uint32_t m_configGeneration;                //!<    Generation of the published \a SharedConfig, 0 if none.
+    SourceStamp m_source;                       //!<    Stamp of the track definitions the configuration was read from.
+    ChannelRecord m_channel[Midi::NofChannels]; //!<    Note owners per MIDI channel.
+    PartRecord m_part[Persist::MaxParts];       //!<    Filter state per part of the current track.
 };
 
 /*! \brief Constructor.
@@ -32,7 +64,7 @@ public:
  */
 Persist::Persist(): m_memMap(0)
 {
-    int fd = shm_open("/patcher-persistent",
+    int fd = shm_open(Ipc::name(objectName).c_str(),
             O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
     if (fd == -1)
     {
@@ -54,28 +86,64 @@ Persist::Persist(): m_memMap(0)
     }
     m_memMap = (MemoryMap*)mmap(0, sizeof(MemoryMap),
                         PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (m_memMap == 0)
+    close(fd);
+    if (m_memMap == MAP_FAILED)
     {
         throw(Error("mmap", errno));
     }
     if (resized ||
         m_memMap->m_magic != MemoryMap::expectMagic ||
-        !m_memMap->m_valid)
+        !sealed())
     {
-        store(0, 0, 0); // clear
+        clear();
     }
 }
 
+//! \brief Remove the shared memory object, the next \a Persist starts an empty snapshot.
+void Persist::remove()
+{
+    shm_unlink(Ipc::name(objectName).c_str());
+}
+
+//! \brief Start an empty snapshot: track 0, no configuration and no sounding notes.
+void Persist::clear()
+{
+    memset(m_memMap, 0, sizeof(MemoryMap));
+    m_memMap->m_magic = MemoryMap::expectMagic;
+    m_memMap->m_generation = 1;
+    for (int i=0; i<Midi::NofChannels; i++)
+    {
+        ChannelRecord &record = m_memMap->m_channel[i];
+        memset(record.m_owner, NoOwner, sizeof(record.m_owner));
+        record.m_checksum = adler32(record.m_owner, sizeof(record.m_owner));
+    }
+    seal();
+}
+
+//! \brief Update the checksum of the header fields, after changing them.
+void Persist::seal()
+{
+    const char *begin = (const char *)&m_memMap->m_generation;
+    const char *end = (const char *)m_memMap->m_channel;
+    m_memMap->m_checksum = adler32(begin, end - begin);
+}
+
+//! \brief True if the header fields are intact.
+bool Persist::sealed() const
+{
+    const char *begin = (const char *)&m_memMap->m_generation;
+    const char *end = (const char *)m_memMap->m_channel;
+    return m_memMap->m_checksum == adler32(begin, end - begin);
+}
+
 /*! \brief  Store current \a Track, \a Section and set index in shared memory.
  */
 void Persist::store(int track, int section, int trackWithinSet)
 {
-    m_memMap->m_valid = false;
-    m_memMap->m_magic = MemoryMap::expectMagic;
     m_memMap->m_track = track;
     m_memMap->m_section = section;
     m_memMap->m_trackWithinSet = trackWithinSet;
-    m_memMap->m_valid = true;
+    seal();
 }
 
 /*! \brief  Restore current \a Track, \a Section and set index from shared memory.
@@ -87,3 +155,151 @@ void Persist::restore(int *track, int *section, int *trackWithinSet) const
     *trackWithinSet = m_memMap->m_trackWithinSet;
 }
 
+/*! \brief Store the stamp of the track definitions that were loaded.
+ *
+ * A snapshot of other track definitions is not resumed.
+ *
+ * \param[in]   source  Stamp of the track definitions, taken before they were parsed.
+ */
+void Persist::storeSource(const SourceStamp &source)
+{
+    m_memMap->m_source = source;
+    seal();
+}
+
+/*! \brief Store the generation of the configuration the core has just published.
+ *
+ * \param[in]   generation  \a SharedConfig::published(), 0 to forget the configuration.
+ */
+void Persist::storeConfig(uint32_t generation)
+{
+    m_memMap->m_configGeneration = generation;
+    seal();
+}
+
+/*! \brief Restore the generation of the published configuration.
+ *
+ * \param[out]  generation      Generation to pass to \a SharedConfig::resume().
+ * \param[out]  source          Stamp of the track definitions it was read from.
+ * \return      False if no configuration was published.
+ */
+bool Persist::restoreConfig(uint32_t *generation, SourceStamp *source) const
+{
+    *generation = m_memMap->m_configGeneration;
+    *source = m_memMap->m_source;
+    return *generation != 0;
+}
+
+/*! \brief Start the snapshot of a new track, or of new track definitions.
+ *
+ * The part records become stale, and the notes that are still sounding
+ * no longer belong to a part of the current track.
+ */
+void Persist::newTrack()
+{
+    m_memMap->m_generation++;
+    if (m_memMap->m_generation == 0)
+        m_memMap->m_generation = 1;
+    seal();
+    for (int i=0; i<Midi::NofChannels; i++)
+    {
+        ChannelRecord &record = m_memMap->m_channel[i];
+        for (int note=0; note<Midi::Note::max; note++)
+        {
+            if (record.m_owner[note] != NoOwner)
+                record.m_owner[note] = Foreign;
+        }
+        record.m_checksum = adler32(record.m_owner, sizeof(record.m_owner));
+    }
+}
+
+/*! \brief Store the filter state of a part of the current track.
+ *
+ * This must be called after every message that may have changed it.
+ *
+ * \param[in]   index   Index of the part among all parts of the track, in section order.
+ * \param[in]   part    The part.
+ */
+void Persist::storePart(int index, const SwPart &part)
+{
+    if (index < 0 || index >= MaxParts)
+        return;
+    PartRecord &record = m_memMap->m_part[index];
+    record.m_generation = m_memMap->m_generation;
+    part.m_toggler.getState(record.m_toggler);
+    part.m_monoFilter.getState(record.m_monoFilter);
+    if (part.m_transposer)
+        part.m_transposer->getState(record.m_transposer);
+    else
+        memset(&record.m_transposer, 0, sizeof(record.m_transposer));
+    const char *begin = (const char *)&record.m_generation;
+    record.m_checksum = adler32(begin, sizeof(record) - offsetof(PartRecord, m_generation));
+}
+
+/*! \brief Restore the filter state of a part of the current track.
+ *
+ * \param[in]   index   Index of the part among all parts of the track, in section order.
+ * \param[in]   part    The part.
+ * \return      False if the part has no intact record of this track, it is left alone then.
+ */
+bool Persist::restorePart(int index, SwPart &part) const
+{
+    if (index < 0 || index >= MaxParts)
+        return false;
+    const PartRecord &record = m_memMap->m_part[index];
+    const char *begin = (const char *)&record.m_generation;
+    if (record.m_generation != m_memMap->m_generation
+        || record.m_checksum != adler32(begin, sizeof(record) - offsetof(PartRecord, m_generation)))
+        return false;
+    part.m_toggler.setState(record.m_toggler);
+    part.m_monoFilter.setState(record.m_monoFilter);
+    if (part.m_transposer)
+        part.m_transposer->setState(record.m_transposer);
+    return true;
+}
+
+/*! \brief Apply a MIDI message sent to the Fantom to the note owners.
+ *
+ * \param[in]   status  MIDI status byte, with the channel.
+ * \param[in]   data1   MIDI data byte 1.
+ * \param[in]   data2   MIDI data byte 2.
+ * \param[in]   part    Index of the part that sent it among all parts of the track, -1 if none.
+ */
+void Persist::apply(uint8_t status, uint8_t data1, uint8_t data2, int part)
+{
+    ChannelRecord &record = m_memMap->m_channel[Midi::channel(status)];
+    if (Midi::isNote(status) && data1 < 128)
+    {
+        uint8_t owner;
+        if (!Midi::isNoteOn(status, data1, data2))
+            owner = NoOwner;
+        else if (part >= 0 && part < MaxParts)
+            owner = (uint8_t)part;
+        else
+            owner = Foreign;
+        // a note changes a single byte, so its checksum is updated in place
+        if (owner == record.m_owner[data1])
+            return;
+        record.m_checksum = adler32Replace(record.m_checksum, sizeof(record.m_owner), data1,
+            record.m_owner[data1], owner);
+        record.m_owner[data1] = owner;
+    }
+    else if (Midi::isController(status) && data1 == Midi::allNotesOff)
+    {
+        memset(record.m_owner, NoOwner, sizeof(record.m_owner));
+        record.m_checksum = adler32(record.m_owner, sizeof(record.m_owner));
+    }
+}
+
+/*! \brief The owners of the notes sounding on a MIDI channel.
+ *
+ * \param[in]   channel     MIDI channel.
+ * \param[out]  owner       Owner of every note, see \a apply().
+ * \return      False if the record is damaged, any note may be sounding then.
+ */
+bool Persist::owners(int channel, uint8_t owner[Midi::Note::max]) const
+{
+    const ChannelRecord &record = m_memMap->m_channel[channel];
+    memcpy(owner, record.m_owner, sizeof(record.m_owner));
+    return record.m_checksum == adler32(owner, sizeof(record.m_owner));
+}
@@ -5,17 +5,52 @@
  */
 #ifndef PERSISTENT_H
 #define PERSISTENT_H
+#include <stdint.h>
+#include "mididef.h"
+#include "trackimage.h"
 
 class MemoryMap;
+class SwPart;
 
-//! \brief Uses shared memory to store information persistently between patcher runs.
+/*! \brief Uses shared memory to store information persistently between patcher runs.
+ *
+ * This is the warm start snapshot of the core. Besides the current track
+ * and section, it holds the generation of the configuration the core has
+ * published with \a SharedConfig, the filter state of the parts of the
+ * current track and the owner of every note sounding on the Fantom. It
+ * outlives the core, so a core that is restarted after a crash resumes
+ * with the same tracks, performances and filter state without reading
+ * any file, and knows which notes were left sounding.
+ *
+ * Every record has its own Adler-32 checksum, so a core that dies halfway
+ * a write only loses that record. Part records also carry the generation
+ * of the snapshot, which changes with the track, so the filter state of
+ * a previous track is never applied to the current one.
+ */
 class Persist
 {
+public:
+    static const int MaxParts = 64;         //!< Parts of a track whose state is kept, the others start afresh.
+    static const uint8_t NoOwner = 0xff;    //!< Owner of a note that is not sounding.
+    static const uint8_t Foreign = 0xfe;    //!< Owner of a note that sounds, but not for a part of the current track.
+private:
     MemoryMap *m_memMap;    //!< The \a MemoryMap that should be made persistent.
+    void clear();
+    void seal();
+    bool sealed() const;
 public:
     Persist();
+    static void remove();
     void store(int track, int section, int trackWithinSet);
     void restore(int *track, int *section, int *trackWithinSet) const;
+    void storeSource(const SourceStamp &source);
+    void storeConfig(uint32_t generation);
+    bool restoreConfig(uint32_t *generation, SourceStamp *source) const;
+    void newTrack();
+    void storePart(int index, const SwPart &part);
+    bool restorePart(int index, SwPart &part) const;
+    void apply(uint8_t status, uint8_t data1, uint8_t data2, int part);
+    bool owners(int channel, uint8_t owner[Midi::Note::max]) const;
 };
 
 #endif // PERSISTENT_H
@@ -7,22 +7,30 @@
 #include <fcntl.h>
 #include <errno.h>
 #include "error.h"
+#include "ipcname.h"
 #include <sstream>
 
+namespace
+{
+const char queueName[] = "/patcher_queue";    //!< Name of the queue of a live patcher.
+}
+
 uint32_t Event::m_sequenceNumber = 0;
 
 void Queue::unlink()
 {
-    mq_unlink(m_name);
+    mq_unlink(Ipc::name(queueName).c_str());
 }
 
 void Queue::create()
 {
+    // a queue left by an older version may have another message size
+    mq_unlink(Ipc::name(queueName).c_str());
     struct mq_attr attr;
     attr.mq_flags = O_NONBLOCK;
     attr.mq_maxmsg = 10;
     attr.mq_msgsize = sizeof(Event);
-    m_descriptor = mq_open(m_name, O_WRONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR, &attr);
+    m_descriptor = mq_open(Ipc::name(queueName).c_str(), O_WRONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR, &attr);
     if (m_descriptor == -1)
     {
         throw(Error("mq_open O_WRONLY|O_NONBLOCK|O_CREAT", errno));
@@ -35,7 +43,7 @@ void Queue::openWrite()
     attr.mq_flags = O_NONBLOCK;
     attr.mq_maxmsg = 10;
     attr.mq_msgsize = sizeof(Event);
-    m_descriptor = mq_open(m_name, O_WRONLY|O_NONBLOCK, S_IRUSR|S_IWUSR, &attr);
+    m_descriptor = mq_open(Ipc::name(queueName).c_str(), O_WRONLY|O_NONBLOCK, S_IRUSR|S_IWUSR, &attr);
     if (m_descriptor == -1)
     {
         throw(Error("mq_open O_WRONLY|O_NONBLOCK|O_CREAT", errno));
@@ -44,7 +52,7 @@ void Queue::openWrite()
 
 void Queue::openRead()
 {
-    m_descriptor = mq_open(m_name, O_RDONLY, S_IRUSR, 0);
+    m_descriptor = mq_open(Ipc::name(queueName).c_str(), O_RDONLY, S_IRUSR, 0);
     if (m_descriptor == -1)
     {
         throw(Error("mq_open O_RDONLY", errno));
@@ -54,7 +62,6 @@ void Queue::openRead()
 //! \brief Construct a Queue, 'read' by default.
 Queue::Queue(): m_overruns(0)
 {
-    m_name = "/patcher_queue";
 }
 
 //! \brief Send an Event.
@@ -127,14 +134,6 @@ std::string Event::toString()
     //ss.setf(std::ios::showbase); // completely useless when combined with 'fill'
     ss << "0x"; ss.width(4); ss.fill('0');
     ss << (int)m_packetCounter << " ";
-    ss << "M0x"; ss.width(2); ss.fill('0');
-    ss << (int)m_metaMode << " ";
-    ss << "T0x"; ss.width(2); ss.fill('0');
-    ss << (int)m_currentTrack << " ";
-    ss << "S0x"; ss.width(2); ss.fill('0');
-    ss << (int)m_currentSection << " ";
-    ss << "L0x"; ss.width(2); ss.fill('0');
-    ss << (int)m_trackIdxWithinSet << " ";
     switch(m_type)
     {
         case Ready:
@@ -158,6 +157,12 @@ std::string Event::toString()
         case MidiIn3Bytes:
             ss << "MidiIn3Bytes";
             break;
+        case FantomSync:
+            ss << "FantomSync";
+            break;
+        case TracksReloaded:
+            ss << "TracksReloaded";
+            break;
         default:
             ss << "Unknown Type 0x";
             ss.width(2); ss.fill('0');
@@ -12,11 +12,12 @@
 
 /*! \brief A patcher event.
  *
- * It wraps MIDI messages generated by the patcher core,
- * and it contains some patcher status, so as to be
- * resistant against dropped events.
+ * It wraps MIDI messages generated by the patcher core.
  * It can also wrap MIDI messages received by the patcher,
  * but this is not used.
+ * The patcher status is not repeated here, clients read it
+ * from \a SharedLiveState, which is never out of date, not even
+ * after dropped events.
  */
 #ifdef NO_STRUCT_PACK
   class Event
@@ -28,21 +29,19 @@ public:
     //! \brief Event type.
     enum Type
     {
-        Ready = 0,
+        Ready = 0,      //!< The live state has changed, other than by a MIDI message.
         MidiOut1Byte,
         MidiOut2Bytes,
         MidiOut3Bytes,
         MidiIn1Byte,
         MidiIn2Bytes,
-        MidiIn3Bytes
+        MidiIn3Bytes,
+        FantomSync,     //!< A performance was downloaded, m_part = its index or Unspecified, the counts are in the live state.
+        TracksReloaded  //!< The track definitions were reloaded, the track image has been rewritten.
     };
     static const uint8_t Unspecified = 255; //!<    Placeholder value.
     static uint32_t m_sequenceNumber;   //!<    Global sequence number.
     uint16_t m_packetCounter;           //!<    Sequential counter.
-    uint8_t m_metaMode;                 //!<    Meta mode switch.
-    uint8_t m_currentTrack;             //!<    Current track.
-    uint8_t m_currentSection;           //!<    Current section.
-    uint8_t m_trackIdxWithinSet;        //!<    Setlist index.
     uint8_t m_type;                     //!<    Event type.
     uint8_t m_deviceId;                 //!<    \sa DeviceId.
     uint8_t m_part;                     //!<    Part number.
@@ -66,7 +65,6 @@ class Queue
     Event   m_posixQueue[2]; //!<    Event queue.
 #endif
     mqd_t   m_descriptor;   //!<    Queue descriptor.
-    const char *m_name;     //!<    Resource name.
     int m_overruns;         //!<    Overrun counter.
 public:
     void create();          //!<    Create queue.
@@ -77,6 +75,10 @@ public:
     void send(const Event &event);
     void receive(Event &event);
     bool receive(Event &event, const TimeSpec &absTime);
+    //! \brief Receive an event if one is pending, without waiting.
+    bool tryReceive(Event &event) { return receive(event, TimeSpec()); }
+    //! \brief The descriptor, on Linux it can be polled like a file descriptor.
+    int descriptor() const { return (int)m_descriptor; }
     std::string getAttr();
 };
 #endif // QUEUE_H
@@ -0,0 +1,520 @@
+/*! \file remote.cpp
+ *  \brief Contains the protocol to show the patcher state on another machine.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "remote.h"
+#include "mididriver.h"
+#include "error.h"
+
+using namespace Remote;
+
+namespace
+{
+const uint8_t magic[2] = { 'P', 'R' };  //!< Start of every frame.
+const uint8_t version = 2;              //!< Must be changed if any frame changes.
+const size_t headerSize = 8;            //!< Magic, type, version and sequence number.
+const size_t eventSize = 8;             //!< An \a Event in a delta.
+const size_t positionSize = 13;         //!< A \a Position.
+const size_t stateSize = positionSize + 2*Midi::NofChannels;   //!< A \a State in a snapshot.
+const size_t maxFrameSize = headerSize + stateSize;        //!< Largest frame.
+const Real resyncRetry = (Real)0.2;     //!< Seconds before a lost snapshot request is repeated.
+
+//! \brief Write a frame header.
+void putHeader(uint8_t *frame, FrameType type, uint32_t sequence)
+{
+    frame[0] = magic[0];
+    frame[1] = magic[1];
+    frame[2] = (uint8_t)type;
+    frame[3] = version;
+    uint32_t n = htonl(sequence);
+    memcpy(frame+4, &n, 4);
+}
+
+/*! \brief Check a frame header.
+ *
+ * \return  The frame type, 0 if it is not a valid frame.
+ */
+int getHeader(const uint8_t *frame, size_t size, uint32_t &sequence)
+{
+    if (size < headerSize || frame[0] != magic[0] || frame[1] != magic[1] || frame[3] != version)
+        return 0;
+    uint32_t n;
+    memcpy(&n, frame+4, 4);
+    sequence = ntohl(n);
+    return frame[2];
+}
+
+//! \brief Write a 16 bit value in network byte order.
+uint8_t *put16(uint8_t *s, uint16_t value)
+{
+    s[0] = (uint8_t)(value >> 8);
+    s[1] = (uint8_t)value;
+    return s+2;
+}
+
+//! \brief Read a 16 bit value written by \a put16().
+const uint8_t *get16(const uint8_t *s, uint16_t &value)
+{
+    value = (uint16_t)((s[0] << 8) | s[1]);
+    return s+2;
+}
+
+//! \brief Write an event in network byte order.
+void putEvent(uint8_t *s, const Event &event)
+{
+    s = put16(s, event.m_packetCounter);
+    s[0] = event.m_type;
+    s[1] = event.m_deviceId;
+    s[2] = event.m_part;
+    s[3] = event.m_midi[0];
+    s[4] = event.m_midi[1];
+    s[5] = event.m_midi[2];
+}
+
+//! \brief Read an event written by \a putEvent().
+void getEvent(const uint8_t *s, Event &event)
+{
+    uint16_t packetCounter;
+    s = get16(s, packetCounter);
+    event.m_packetCounter = packetCounter;
+    event.m_type = s[0];
+    event.m_deviceId = s[1];
+    event.m_part = s[2];
+    event.m_midi[0] = s[3];
+    event.m_midi[1] = s[4];
+    event.m_midi[2] = s[5];
+}
+
+//! \brief Write a position in network byte order, \a positionSize bytes.
+uint8_t *putPosition(uint8_t *s, const Position &position)
+{
+    s = put16(s, position.m_currentTrack);
+    s = put16(s, position.m_currentSection);
+    s = put16(s, position.m_trackIdxWithinSet);
+    *s++ = position.m_metaMode;
+    s = put16(s, position.m_nofSynced);
+    s = put16(s, position.m_nofToSync);
+    return put16(s, position.m_nofSyncErrors);
+}
+
+//! \brief Read a position written by \a putPosition().
+const uint8_t *getPosition(const uint8_t *s, Position &position)
+{
+    s = get16(s, position.m_currentTrack);
+    s = get16(s, position.m_currentSection);
+    s = get16(s, position.m_trackIdxWithinSet);
+    position.m_metaMode = *s++;
+    s = get16(s, position.m_nofSynced);
+    s = get16(s, position.m_nofToSync);
+    return get16(s, position.m_nofSyncErrors);
+}
+
+//! \brief Write a state, \a stateSize bytes.
+void putState(uint8_t *s, const State &state)
+{
+    s = putPosition(s, state.m_position);
+    memcpy(s, state.m_noteOn, Midi::NofChannels);
+    memcpy(s+Midi::NofChannels, state.m_volume, Midi::NofChannels);
+}
+
+//! \brief Read a state written by \a putState().
+void getState(const uint8_t *s, State &state)
+{
+    s = getPosition(s, state.m_position);
+    memcpy(state.m_noteOn, s, Midi::NofChannels);
+    memcpy(state.m_volume, s+Midi::NofChannels, Midi::NofChannels);
+}
+
+//! \brief True if a frame should be dropped, for testing.
+bool lose(int percentage)
+{
+    return percentage > 0 && rand() % 100 < percentage;
+}
+}
+
+//! \brief Take the position from the live state of the core.
+void Position::set(const LiveShm::State &live)
+{
+    m_currentTrack = live.m_currentTrack;
+    m_currentSection = live.m_currentSection;
+    m_trackIdxWithinSet = live.m_trackIdxWithinSet;
+    m_metaMode = live.m_metaMode;
+    m_nofSynced = live.m_nofSynced;
+    m_nofToSync = live.m_nofToSync;
+    m_nofSyncErrors = live.m_nofSyncErrors;
+}
+
+//! \brief Equality.
+bool Position::operator==(const Position &other) const
+{
+    return m_currentTrack == other.m_currentTrack
+        && m_currentSection == other.m_currentSection
+        && m_trackIdxWithinSet == other.m_trackIdxWithinSet
+        && m_metaMode == other.m_metaMode
+        && m_nofSynced == other.m_nofSynced
+        && m_nofToSync == other.m_nofToSync
+        && m_nofSyncErrors == other.m_nofSyncErrors;
+}
+
+//! \brief Set the state of a patcher that has not sent anything yet.
+void State::clear()
+{
+    memset(&m_position, 0, sizeof(m_position));
+    memset(m_noteOn, 0, sizeof(m_noteOn));
+    memset(m_volume, 255, sizeof(m_volume));
+}
+
+/*! \brief Apply a new position, the same way on both ends.
+ *
+ * Like the curses client, the sounding notes are forgotten when the
+ * track or section changes.
+ *
+ * \param[in]   position    The position.
+ */
+void State::apply(const Position &position)
+{
+    if (position.m_currentTrack != m_position.m_currentTrack
+        || position.m_currentSection != m_position.m_currentSection)
+        memset(m_noteOn, 0, sizeof(m_noteOn));
+    m_position = position;
+}
+
+/*! \brief Apply an event, the same way on both ends.
+ *
+ * \param[in]   event   The event.
+ */
+void State::apply(const Event &event)
+{
+    if (event.m_type == Event::MidiOut3Bytes && event.m_deviceId == Midi::Device::FantomOut)
+    {
+        uint8_t channel = Midi::channel(event.m_midi[0]);
+        if (Midi::isNote(event.m_midi[0]))
+        {
+            if (Midi::isNoteOn(event.m_midi[0], event.m_midi[1], event.m_midi[2]))
+            {
+                if (m_noteOn[channel] < 255)
+                    m_noteOn[channel]++;
+            }
+            else if (m_noteOn[channel] > 0)
+                m_noteOn[channel]--;
+        }
+        else if (Midi::isController(event.m_midi[0]))
+        {
+            if (event.m_midi[1] == Midi::allNotesOff)
+                m_noteOn[channel] = 0;
+            else if (event.m_midi[1] == Midi::mainVolume)
+                m_volume[channel] = event.m_midi[2];
+        }
+    }
+}
+
+//! \brief Equality.
+bool State::operator==(const State &other) const
+{
+    return m_position == other.m_position
+        && memcmp(m_noteOn, other.m_noteOn, sizeof(m_noteOn)) == 0
+        && memcmp(m_volume, other.m_volume, sizeof(m_volume)) == 0;
+}
+
+//! \brief Construct a closed server.
+Server::Server(): m_socket(-1), m_sequence(0), m_lossPercentage(0)
+{
+    m_state.clear();
+}
+
+//! \brief Destructor, closes the socket.
+Server::~Server()
+{
+    if (m_socket != -1)
+        close(m_socket);
+}
+
+/*! \brief Open the socket.
+ *
+ * \param[in]   port        UDP port, 0 for any.
+ * \param[in]   address     Local address in host byte order.
+ */
+void Server::open(uint16_t port, uint32_t address)
+{
+    m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_socket == -1)
+        throw(Error("socket", errno));
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(address);
+    if (bind(m_socket, (sockaddr *)&local, sizeof(local)) == -1)
+        throw(Error("bind", errno));
+    getTime(m_lastSent);
+}
+
+//! \brief The local port, useful if it was opened on any port.
+uint16_t Server::port() const
+{
+    sockaddr_in local;
+    socklen_t length = sizeof(local);
+    if (getsockname(m_socket, (sockaddr *)&local, &length) == -1)
+        throw(Error("getsockname", errno));
+    return ntohs(local.sin_port);
+}
+
+//! \brief Send a frame to a viewer, a viewer that is not there is no error.
+void Server::send(const sockaddr_in &address, const void *frame, size_t size)
+{
+    if (lose(m_lossPercentage))
+        return;
+    sendto(m_socket, frame, size, MSG_DONTWAIT, (const sockaddr *)&address, sizeof(address));
+}
+
+//! \brief Send a frame to all viewers.
+void Server::sendAll(const void *frame, size_t size)
+{
+    for (size_t i=0; i<m_peers.size(); i++)
+        send(m_peers[i].m_address, frame, size);
+    getTime(m_lastSent);
+}
+
+//! \brief Send the state to a viewer.
+void Server::sendSnapshot(const sockaddr_in &address)
+{
+    uint8_t frame[maxFrameSize];
+    putHeader(frame, Snapshot, m_sequence);
+    putState(frame+headerSize, m_state);
+    send(address, frame, headerSize + stateSize);
+}
+
+/*! \brief Apply an event to the state, and send it to the viewers.
+ *
+ * \param[in]   event   The event.
+ */
+void Server::publish(const Event &event)
+{
+    m_state.apply(event);
+    m_sequence++;
+    uint8_t frame[headerSize + eventSize];
+    putHeader(frame, Delta, m_sequence);
+    putEvent(frame+headerSize, event);
+    sendAll(frame, sizeof(frame));
+}
+
+/*! \brief Send the position of the live state of the core to the viewers, if it has changed.
+ *
+ * \param[in]   live    The live state.
+ */
+void Server::publish(const LiveShm::State &live)
+{
+    Position position;
+    position.set(live);
+    if (position == m_state.m_position)
+        return;
+    m_state.apply(position);
+    m_sequence++;
+    uint8_t frame[headerSize + positionSize];
+    putHeader(frame, PositionDelta, m_sequence);
+    putPosition(frame+headerSize, position);
+    sendAll(frame, sizeof(frame));
+}
+
+/*! \brief Handle the pending requests of the viewers, without waiting.
+ *
+ * A request from a new viewer adds it, and every request is answered
+ * with a snapshot.
+ */
+void Server::poll()
+{
+    TimeSpec now;
+    getTime(now);
+    for (;;)
+    {
+        uint8_t frame[maxFrameSize];
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        ssize_t size = recvfrom(m_socket, frame, sizeof(frame), MSG_DONTWAIT,
+                        (sockaddr *)&address, &length);
+        if (size == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        uint32_t sequence;
+        int type = getHeader(frame, size, sequence);
+        if (type != Hello && type != Resync)
+            continue;
+        size_t i = 0;
+        for (; i<m_peers.size(); i++)
+        {
+            if (m_peers[i].m_address.sin_addr.s_addr == address.sin_addr.s_addr
+                && m_peers[i].m_address.sin_port == address.sin_port)
+                break;
+        }
+        if (i == m_peers.size())
+        {
+            if (m_peers.size() == MaxPeers)
+                continue;
+            Peer peer;
+            peer.m_address = address;
+            m_peers.push_back(peer);
+        }
+        m_peers[i].m_lastHeard = now;
+        sendSnapshot(address);
+    }
+}
+
+/*! \brief Send a heartbeat if nothing has been sent for a second, and drop silent viewers.
+ *
+ * Call this at least once a second.
+ */
+void Server::heartbeat()
+{
+    TimeSpec now;
+    getTime(now);
+    for (size_t i=0; i<m_peers.size(); )
+    {
+        if (timeDiffSeconds(m_peers[i].m_lastHeard, now) > PeerTimeout)
+            m_peers.erase(m_peers.begin()+i);
+        else
+            i++;
+    }
+    if (timeDiffSeconds(m_lastSent, now) < 1)
+        return;
+    uint8_t frame[headerSize];
+    putHeader(frame, Heartbeat, m_sequence);
+    sendAll(frame, sizeof(frame));
+}
+
+//! \brief Construct a closed viewer.
+Viewer::Viewer(): m_socket(-1), m_sequence(0), m_synced(false), m_nofResyncs(0),
+    m_lossPercentage(0)
+{
+    m_state.clear();
+}
+
+//! \brief Destructor, closes the socket.
+Viewer::~Viewer()
+{
+    if (m_socket != -1)
+        close(m_socket);
+}
+
+/*! \brief Open the socket and ask the server for a snapshot.
+ *
+ * \param[in]   host    Name or address of the server.
+ * \param[in]   port    UDP port of the server.
+ */
+void Viewer::open(const char *host, uint16_t port)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *result;
+    int rv = getaddrinfo(host, 0, &hints, &result);
+    if (rv != 0)
+    {
+        Error e;
+        e.stream() << "cannot find " << host << ": " << gai_strerror(rv);
+        throw(e);
+    }
+    sockaddr_in server = *(sockaddr_in *)result->ai_addr;
+    freeaddrinfo(result);
+    server.sin_port = htons(port);
+    m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_socket == -1)
+        throw(Error("socket", errno));
+    if (connect(m_socket, (sockaddr *)&server, sizeof(server)) == -1)
+        throw(Error("connect", errno));
+    request(Hello);
+}
+
+//! \brief Send a request to the server.
+void Viewer::request(FrameType type)
+{
+    getTime(m_lastRequest);
+    if (lose(m_lossPercentage))
+        return;
+    uint8_t frame[headerSize];
+    putHeader(frame, type, m_sequence);
+    // the server may not be there yet, the request is repeated
+    ::send(m_socket, frame, sizeof(frame), MSG_DONTWAIT);
+}
+
+/*! \brief Wait for a frame and apply it.
+ *
+ * Requests are repeated here as well: a keepalive every few seconds,
+ * and a snapshot request while the state is not in sync.
+ *
+ * \param[in]   timeoutMs   Time to wait, 0 to only take a pending frame.
+ * \return      True if a frame was received.
+ */
+bool Viewer::receive(int timeoutMs)
+{
+    pollfd fd;
+    fd.fd = m_socket;
+    fd.events = POLLIN;
+    bool received = false;
+    if (::poll(&fd, 1, timeoutMs) > 0)
+    {
+        uint8_t frame[maxFrameSize];
+        ssize_t size = recv(m_socket, frame, sizeof(frame), MSG_DONTWAIT);
+        uint32_t sequence;
+        int type = size > 0 ? getHeader(frame, size, sequence) : 0;
+        received = type != 0;
+        if (type == Snapshot && size == (ssize_t)(headerSize + stateSize))
+        {
+            getState(frame+headerSize, m_state);
+            m_sequence = sequence;
+            m_synced = true;
+        }
+        else if (((type == Delta && size == (ssize_t)(headerSize + eventSize))
+            || (type == PositionDelta && size == (ssize_t)(headerSize + positionSize))) && m_synced)
+        {
+            int32_t ahead = (int32_t)(sequence - m_sequence);
+            if (ahead == 1 && type == Delta)
+            {
+                Event event;
+                getEvent(frame+headerSize, event);
+                m_state.apply(event);
+                m_sequence = sequence;
+            }
+            else if (ahead == 1)
+            {
+                Position position;
+                getPosition(frame+headerSize, position);
+                m_state.apply(position);
+                m_sequence = sequence;
+            }
+            else if (ahead > 1)
+            {
+                m_synced = false;
+                m_nofResyncs++;
+                request(Resync);
+            }
+        }
+        else if (type == Heartbeat && m_synced && (int32_t)(sequence - m_sequence) > 0)
+        {
+            // the last delta was lost
+            m_synced = false;
+            m_nofResyncs++;
+            request(Resync);
+        }
+    }
+    TimeSpec now;
+    getTime(now);
+    Real sinceRequest = timeDiffSeconds(m_lastRequest, now);
+    if (!m_synced && sinceRequest > resyncRetry)
+        request(Resync);
+    else if (sinceRequest > KeepaliveInterval)
+        request(Hello);
+    return received;
+}
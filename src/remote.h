@@ -0,0 +1,161 @@
+/*! \file remote.h
+ *  \brief Contains the protocol to show the patcher state on another machine.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef REMOTE_H
+#define REMOTE_H
+#include <stdint.h>
+#include <vector>
+#include <netinet/in.h>
+#include "queue.h"
+#include "mididef.h"
+#include "liveshm.h"
+
+#ifdef FAKE_STL // set in PREDEFINED in doxygen config
+namespace std { /*! \brief STL vector */ template <class T> class vector {
+        public T entry[2]; /*!< Entry. */ }; }
+#endif
+
+/*! \brief Namespace for the remote monitoring protocol.
+ *
+ * The patcher state is sent over UDP in small binary frames. A viewer
+ * asks for a \a State snapshot, after that every event and every change
+ * of the \a Position is sent as a delta with a sequence number. A viewer
+ * that misses a delta asks for a new snapshot. When there are no events the server sends a heartbeat
+ * with the current sequence number every second, so a lost last delta
+ * is noticed too.
+ */
+namespace Remote
+{
+
+static const uint16_t DefaultPort = 7400;  //!< UDP port of the server.
+
+//! \brief Frame types.
+enum FrameType
+{
+    Hello = 1,      //!< Viewer to server: send me snapshots and deltas, also a keepalive.
+    Resync,         //!< Viewer to server: I missed a delta, send a snapshot.
+    Snapshot,       //!< Server to viewer: the whole \a State.
+    Delta,          //!< Server to viewer: one event.
+    Heartbeat,      //!< Server to viewer: the current sequence number.
+    PositionDelta   //!< Server to viewer: the new \a Position.
+};
+
+//! \brief Where the patcher is, taken from its live state.
+struct Position
+{
+    uint16_t m_currentTrack;        //!< Current track.
+    uint16_t m_currentSection;      //!< Current section.
+    uint16_t m_trackIdxWithinSet;   //!< Setlist index.
+    uint8_t m_metaMode;             //!< Meta mode switch.
+    uint16_t m_nofSynced;           //!< Performances downloaded so far.
+    uint16_t m_nofToSync;           //!< Performances to download, 0 if none.
+    uint16_t m_nofSyncErrors;       //!< Failed Fantom requests during the download.
+    void set(const LiveShm::State &live);
+    bool operator==(const Position &other) const;
+    //! \brief Inequality.
+    bool operator!=(const Position &other) const { return !(*this == other); }
+};
+
+/*! \brief What a remote display shows.
+ *
+ * The notes and volumes are rebuilt from the events.
+ */
+struct State
+{
+    Position m_position;            //!< Where the patcher is.
+    uint8_t m_noteOn[Midi::NofChannels];    //!< Sounding notes per channel, at most 255.
+    uint8_t m_volume[Midi::NofChannels];    //!< Main volume per channel, 255 if not known.
+    void clear();
+    void apply(const Event &event);
+    void apply(const Position &position);
+    bool operator==(const State &other) const;
+    //! \brief Inequality.
+    bool operator!=(const State &other) const { return !(*this == other); }
+};
+
+/*! \brief Sends the state to the viewers, in the process that reads the events.
+ *
+ * It serves any number of viewers, up to \a MaxPeers. A viewer that has
+ * not been heard from in \a PeerTimeout seconds is dropped.
+ */
+class Server
+{
+    static const size_t MaxPeers = 8;   //!< Number of viewers served.
+    static const int PeerTimeout = 10;  //!< Seconds without a keepalive before a viewer is dropped.
+    //! \brief A viewer.
+    struct Peer
+    {
+        sockaddr_in m_address;          //!< Address of the viewer.
+        TimeSpec m_lastHeard;           //!< Time of the last request.
+    };
+    int m_socket;                       //!< UDP socket.
+    State m_state;                      //!< Current state.
+    uint32_t m_sequence;                //!< Sequence number of the last delta.
+    std::vector<Peer> m_peers;          //!< Viewers.
+    TimeSpec m_lastSent;                //!< Time of the last frame sent to the viewers.
+    int m_lossPercentage;               //!< Frames dropped on purpose, for testing.
+    Server(const Server &);             //!< Not copyable.
+    Server &operator=(const Server &);  //!< Not assignable.
+    void send(const sockaddr_in &address, const void *frame, size_t size);
+    void sendAll(const void *frame, size_t size);
+    void sendSnapshot(const sockaddr_in &address);
+public:
+    Server();
+    ~Server();
+    void open(uint16_t port, uint32_t address = INADDR_ANY);
+    uint16_t port() const;
+    //! \brief The socket, to wait for requests.
+    int descriptor() const { return m_socket; }
+    void publish(const Event &event);
+    void publish(const LiveShm::State &live);
+    void poll();
+    void heartbeat();
+    //! \brief Drop this percentage of the frames sent, to test the viewers.
+    void setLossPercentage(int percentage) { m_lossPercentage = percentage; }
+    //! \brief The state sent to the viewers.
+    const State &state() const { return m_state; }
+    //! \brief Sequence number of the last delta.
+    uint32_t sequence() const { return m_sequence; }
+    //! \brief Number of viewers.
+    size_t nofPeers() const { return m_peers.size(); }
+};
+
+/*! \brief Keeps a copy of the state of a \a Server, on the display machine.
+ */
+class Viewer
+{
+    static const int KeepaliveInterval = 2;     //!< Seconds between keepalives.
+    int m_socket;                       //!< UDP socket, connected to the server.
+    State m_state;                      //!< Copy of the server state.
+    uint32_t m_sequence;                //!< Sequence number of \a m_state.
+    bool m_synced;                      //!< \a m_state is valid and complete up to \a m_sequence.
+    TimeSpec m_lastRequest;             //!< Time of the last request to the server.
+    int m_nofResyncs;                   //!< Number of snapshots asked for after a lost delta.
+    int m_lossPercentage;               //!< Requests dropped on purpose, for testing.
+    Viewer(const Viewer &);             //!< Not copyable.
+    Viewer &operator=(const Viewer &);  //!< Not assignable.
+    void request(FrameType type);
+public:
+    Viewer();
+    ~Viewer();
+    void open(const char *host, uint16_t port);
+    //! \brief The socket, to wait for frames.
+    int descriptor() const { return m_socket; }
+    bool receive(int timeoutMs);
+    //! \brief Drop this percentage of the requests sent, to test the server.
+    void setLossPercentage(int percentage) { m_lossPercentage = percentage; }
+    //! \brief True if \a state() is complete up to \a sequence().
+    bool synced() const { return m_synced; }
+    //! \brief The copy of the server state.
+    const State &state() const { return m_state; }
+    //! \brief Sequence number of \a state().
+    uint32_t sequence() const { return m_sequence; }
+    //! \brief Number of snapshots asked for after a lost delta.
+    int nofResyncs() const { return m_nofResyncs; }
+};
+
+} // namespace Remote
+
+#endif // REMOTE_H
@@ -0,0 +1,385 @@
+/*! \file replay.cpp
+ *  \brief Replays a MIDI stream through patcher_core and checks its output.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "sequencer.h"
+#include "harness.h"
+#include "error.h"
+
+namespace
+{
+
+/*! \brief Read the input messages of a recording made by patcher_core -r.
+ *
+ * \param[in]  fileName     The recording.
+ * \param[out] messages     The messages.
+ */
+void loadRecording(const char *fileName, std::vector<Message> &messages)
+{
+    RecordingReader reader;
+    reader.open(fileName);
+    Recording::Record record;
+    while (reader.next(record))
+    {
+        if (record.output())
+            continue;
+        Message message;
+        message.m_time = record.m_time - reader.header().m_startTime;
+        message.m_device = record.device();
+        message.m_length = std::min((int)record.m_length, 3);
+        memcpy(message.m_bytes, record.m_midi, sizeof(message.m_bytes));
+        messages.push_back(message);
+    }
+}
+
+/*! \brief Read a stream in text form.
+ *
+ * A line holds the time in milliseconds, the name of the input pipe and
+ * up to 3 MIDI bytes in hex, for instance "1500 a30 90 3c 64". Empty
+ * lines and lines starting with '#' are skipped.
+ *
+ * \param[in]  fileName     The stream.
+ * \param[out] messages     The messages.
+ */
+void loadText(const char *fileName, std::vector<Message> &messages)
+{
+    std::ifstream in(fileName);
+    if (!in)
+    {
+        Error e;
+        e.stream() << "cannot open " << fileName;
+        throw(e);
+    }
+    std::string line;
+    for (int lineNo=1; std::getline(in, line); lineNo++)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream ss(line);
+        double ms;
+        std::string name;
+        Message message;
+        message.m_length = 0;
+        ss >> ms >> name;
+        unsigned int byte;
+        while (message.m_length < 3 && ss >> std::hex >> byte)
+            message.m_bytes[message.m_length++] = (uint8_t)byte;
+        message.m_device = deviceByName(name);
+        ss >> std::ws;
+        if (!ss.eof() || message.m_length == 0 || ms < 0
+            || message.m_device == Midi::Device::none || isOutput(message.m_device))
+        {
+            Error e;
+            e.stream() << fileName << ":" << lineNo << ": expected <ms> <input> <hex bytes>";
+            throw(e);
+        }
+        message.m_time = (uint64_t)(ms * 1e6);
+        messages.push_back(message);
+    }
+}
+
+/*! \brief Make up a stream of chords, played every 50 ms on the A30.
+ *
+ * \param[in]  n            Number of messages.
+ * \param[out] messages     The messages.
+ */
+void synthesise(int n, std::vector<Message> &messages)
+{
+    srand(1);
+    uint8_t chord[3] = { 0, 0, 0 };
+    for (int i=0; i<n; i++)
+    {
+        Message message;
+        message.m_time = (uint64_t)(i / 6) * 50000000u + (i % 6) * 1000000u;
+        message.m_device = Midi::Device::A30;
+        message.m_length = 3;
+        if (i % 6 < 3)
+        {
+            // release the previous chord
+            message.m_bytes[0] = Midi::noteOff;
+            message.m_bytes[1] = chord[i % 6];
+            message.m_bytes[2] = 0;
+        }
+        else
+        {
+            chord[i % 6 - 3] = 36 + rand() % 48;
+            message.m_bytes[0] = Midi::noteOn;
+            message.m_bytes[1] = chord[i % 6 - 3];
+            message.m_bytes[2] = 1 + rand() % 127;
+        }
+        messages.push_back(message);
+    }
+}
+
+/*! \brief Remove the RQ1 requests of the Fantom download from the output.
+ *
+ * Without a Fantom there are no replies, so the requests are retried on
+ * timeouts, which makes them depend on the timing of the run. All other
+ * output, including the DT1 writes, must be the same in every run.
+ *
+ * \param[in,out] bytes The output to the Fantom.
+ * \return        The number of requests removed.
+ */
+int dropRequests(std::vector<uint8_t> &bytes)
+{
+    std::vector<uint8_t> kept;
+    int n = 0;
+    for (size_t i=0; i<bytes.size(); )
+    {
+        if (bytes[i] == Midi::sysEx && i + 5 < bytes.size() && bytes[i + 5] == 0x11)
+        {
+            while (i < bytes.size() && bytes[i] != Midi::EOX)
+                i++;
+            i++;
+            n++;
+            continue;
+        }
+        kept.push_back(bytes[i++]);
+    }
+    bytes.swap(kept);
+    return n;
+}
+
+/*! \brief Write a golden output file.
+ *
+ * Every device is a line with its name and byte count, followed by the
+ * bytes in hex, 16 on a line.
+ */
+void saveGolden(const char *fileName, const Capture &capture)
+{
+    std::ofstream out(fileName);
+    if (!out)
+    {
+        Error e;
+        e.stream() << "cannot create " << fileName;
+        throw(e);
+    }
+    out << "# patcher_replay output\n";
+    char hex[4];
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        const std::vector<uint8_t> &bytes = capture.m_bytes[i];
+        if (!isOutput(i))
+            continue;
+        out << Midi::fifoName(i) << " " << bytes.size() << "\n";
+        for (size_t j=0; j<bytes.size(); j++)
+        {
+            sprintf(hex, "%02x", bytes[j]);
+            out << hex << ((j % 16 == 15 || j + 1 == bytes.size()) ? "\n" : " ");
+        }
+    }
+}
+
+//! \brief Read a golden output file.
+void loadGolden(const char *fileName, Capture &capture)
+{
+    std::ifstream in(fileName);
+    std::string line;
+    int device = Midi::Device::none;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream ss(line);
+        std::string name;
+        ss >> name;
+        if (name.size() > 2)
+        {
+            device = deviceByName(name);
+            if (device == Midi::Device::none)
+            {
+                Error e;
+                e.stream() << fileName << ": unknown device " << name;
+                throw(e);
+            }
+            continue;
+        }
+        ss.seekg(0);
+        unsigned int byte;
+        while (ss >> std::hex >> byte)
+            capture.m_bytes[device].push_back((uint8_t)byte);
+    }
+}
+
+/*! \brief Compare the output with the golden output.
+ *
+ * \return  An empty string if they are equal, the first difference otherwise.
+ */
+std::string compare(const Capture &golden, const Capture &capture)
+{
+    std::ostringstream ss;
+    for (int i=Midi::Device::none+1; i<Midi::Device::max; i++)
+    {
+        const std::vector<uint8_t> &expected = golden.m_bytes[i];
+        const std::vector<uint8_t> &actual = capture.m_bytes[i];
+        size_t n = std::min(expected.size(), actual.size());
+        size_t j = std::mismatch(expected.begin(), expected.begin() + n, actual.begin()).first
+            - expected.begin();
+        if (j < n)
+        {
+            ss << Midi::fifoName(i) << " byte " << j << ": expected " << std::hex
+                << (int)expected[j] << ", got " << (int)actual[j];
+            return ss.str();
+        }
+        if (expected.size() != actual.size())
+        {
+            ss << Midi::fifoName(i) << ": expected " << expected.size() << " bytes, got "
+                << actual.size();
+            return ss.str();
+        }
+    }
+    return ss.str();
+}
+
+}
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    const char *core = "./patcher_core";
+    const char *workDir = ".";
+    const char *goldenFile = 0;
+    bool bless = false;
+    double speed = 1;
+    int nofSynthetic = 0;
+    for (;;)
+    {
+        int opt = getopt(argc, argv, "c:d:g:bx:S:h");
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'c':
+                core = optarg;
+                break;
+            case 'd':
+                workDir = optarg;
+                break;
+            case 'g':
+                goldenFile = optarg;
+                break;
+            case 'b':
+                bless = true;
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 'S':
+                nofSynthetic = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "\npatcher_replay [-h|?] [-c <core>] [-d <dir>] [-g <golden> [-b]] [-x <speed>]\n"
+                    "               [-S <messages> | <stream>]\n\n"
+                    "  -h|?     This message\n"
+                    "  -c       The patcher_core executable, default ./patcher_core\n"
+                    "  -d       Directory with tracks.xml and the Fantom cache, default .\n"
+                    "  -g       Golden output to compare with, it must exist\n"
+                    "  -b       Write the output as the golden output, instead of comparing\n"
+                    "  -x       Replay speed, 2 is twice as fast, 0 as fast as possible\n"
+                    "  -S       Replay this many synthetic messages instead of a stream\n"
+                    "  stream   A recording of patcher_core -r, *.seq, or a text stream\n\n"
+                    "The core starts in the first track of the setlist, without a warm start\n"
+                    "snapshot. It has an event queue and shared memory of its own, so this can\n"
+                    "run next to a live core.\n\n");
+                return 1;
+                break;
+        }
+    }
+    if ((nofSynthetic > 0) == (argc > optind) || argc > optind + 1)
+    {
+        fprintf(stderr, "expected a stream or -S, try -h\n");
+        return 1;
+    }
+    if (bless && !goldenFile)
+    {
+        fprintf(stderr, "-b needs the golden output, try -h\n");
+        return 1;
+    }
+    try
+    {
+        std::vector<Message> messages;
+        std::string name;
+        if (nofSynthetic > 0)
+        {
+            synthesise(nofSynthetic, messages);
+            name = "synthetic";
+        }
+        else
+        {
+            name = argv[optind];
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seq") == 0)
+                loadRecording(argv[optind], messages);
+            else
+                loadText(argv[optind], messages);
+        }
+        if (messages.empty())
+            throw(Error("nothing to replay"));
+        if (goldenFile && !bless && access(goldenFile, F_OK) == -1)
+        {
+            Error e;
+            e.stream() << "no golden output " << goldenFile << ", write it with -b";
+            throw(e);
+        }
+        Harness harness;
+        harness.start(core, workDir);
+        size_t startupBytes = harness.capture().size();
+        uint64_t start = now();
+        uint64_t origin = messages[0].m_time;
+        for (size_t i=0; i<messages.size(); i++)
+        {
+            uint64_t due = start;
+            if (speed > 0)
+                due += (uint64_t)((messages[i].m_time - origin) / speed);
+            harness.pump(due);
+            harness.send(messages[i]);
+        }
+        uint64_t sent = now();
+        harness.settle();
+        uint64_t end = std::max(sent, harness.lastOutput());
+        int nofRequests = dropRequests(harness.capture().m_bytes[Midi::Device::FantomOut]);
+
+        std::vector<uint64_t> &latency = harness.latency();
+        std::sort(latency.begin(), latency.end());
+        double seconds = (end - start) * 1e-9;
+        printf("stream     %s, %lu messages over %.3f s\n", name.c_str(),
+            (unsigned long)messages.size(), (messages.back().m_time - origin) * 1e-9);
+        printf("replay     %.3f s, %.0f messages/s, %lu output bytes, %lu at startup, %d Fantom requests\n",
+            seconds, messages.size() / seconds,
+            (unsigned long)harness.capture().size(), (unsigned long)startupBytes, nofRequests);
+        if (speed > 0)
+            printf("latency    %lu answered, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+                (unsigned long)latency.size(), percentile(latency, 0.5) * 1e-3,
+                percentile(latency, 0.9) * 1e-3, percentile(latency, 0.99) * 1e-3,
+                (latency.empty() ? 0 : latency.back()) * 1e-3);
+        else
+            printf("latency    not measured at -x 0, the inputs overlap\n");
+        if (!goldenFile)
+            return 0;
+        if (bless)
+        {
+            saveGolden(goldenFile, harness.capture());
+            printf("golden     written to %s\n", goldenFile);
+            return 0;
+        }
+        Capture golden;
+        loadGolden(goldenFile, golden);
+        std::string difference = compare(golden, harness.capture());
+        printf("golden     %s\n", difference.empty() ? "match" : difference.c_str());
+        return difference.empty() ? 0 : 1;
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        return e.exitCode();
+    }
+}
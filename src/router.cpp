@@ -0,0 +1,121 @@
+/*! \file router.cpp
+ *  \brief Contains the routing of a MIDI message to the parts of a section.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include "router.h"
+#include "mididef.h"
+
+/*! \brief Apply the parts of a section to a MIDI message.
+ *
+ *  This does all the processing required by a \a Section: key ranges,
+ *  transposition, mono filter, toggler and controller remapping. The
+ *  filters of the parts keep their state, so every message must be
+ *  routed exactly once.
+ *
+ *  \param [in] section         The section.
+ *  \param [in] midiStatusByte  MIDI status byte
+ *  \param [in] data1           MIDI data byte 1
+ *  \param [in] data2           MIDI data byte 2, Midi::noData if absent
+ *  \param [out] out            The messages to send to the Fantom, one per part at most.
+ *  \param [in] fpLog           Log stream, 0 for none.
+ *  \return     A bit per part whose filter state the message may have changed,
+ *              bit 0 for the first part. The parts after the 64th have no bit.
+ */
+uint64_t route(Section *section, uint8_t midiStatusByte, uint8_t data1, uint8_t data2,
+    RoutedMessageList &out, FILE *fpLog)
+{
+    out.clear();
+    uint64_t changed = 0;
+    uint8_t data1Out = data1;
+    uint8_t data2Out = data2;
+    uint8_t midiStatus = Midi::status(midiStatusByte);
+    bool isNoteData = Midi::isNote(midiStatus);
+    bool isNoteOn = Midi::isNoteOn(midiStatus, data1, data2);
+    bool isNoteOff = Midi::isNoteOff(midiStatus, data1, data2);
+    bool isController = Midi::isController(midiStatus);
+    for (size_t i=0; i<section->m_partList.size(); i++)
+    {
+        bool drop = false;
+        SwPart *swPart = section->m_partList[i];
+        uint64_t bit = i < 64 ? (uint64_t)1 << i : 0;
+        if (isNoteData)
+        {
+            if (!swPart->inRange(data1))
+            {
+                continue;
+            }
+            if (swPart->m_mono || swPart->m_transposer || swPart->m_toggler.enabled())
+                changed |= bit;
+            data1Out = data1 + swPart->m_transpose;
+            if (swPart->m_customTransposeEnabled)
+                data1Out += swPart->m_customTranspose[
+                    (data1 + 12 + swPart->m_customTransposeOffset) % 12];
+            if (data1Out > 127)
+                data1Out = 127;
+            if (swPart->m_mono)
+            {
+                if (isNoteOn && !swPart->m_monoFilter
+                        .passNoteOn(data1, data2))
+                {
+                    if (fpLog)
+                        fprintf(fpLog, "note on dropped\n");
+                    continue;
+                }
+                if (isNoteOff && !swPart->m_monoFilter
+                        .passNoteOff(data1, data2))
+                {
+                    if (fpLog)
+                        fprintf(fpLog, "note off dropped\n");
+                    continue;
+                }
+            }
+            if (swPart->m_transposer)
+            {
+                if (isNoteOn || isNoteOff)
+                {
+                    swPart->m_transposer->transpose(midiStatus, data1Out, data2Out);
+                }
+            }
+            if (!swPart->m_toggler.pass(midiStatus, data1Out, data2Out))
+            {
+                if (fpLog)
+                    fprintf(fpLog, "note on dropped\n");
+                continue;
+            }
+        }
+        if (isController)
+        {
+            if (data1 == Midi::sustain && (swPart->m_mono || swPart->m_transposer))
+                changed |= bit;
+            if (data1 == Midi::sustain && swPart->m_mono)
+            {
+                swPart->m_monoFilter.sustain(data2 != 0);
+                if (fpLog)
+                    fprintf(fpLog, "mono sustain\n");
+            }
+            if (data1 == Midi::sustain && swPart->m_transposer)
+            {
+                swPart->m_transposer->setSustain(data2 != 0);
+                if (fpLog)
+                    fprintf(fpLog, "transposer sustain\n");
+                drop = true;
+            }
+            if (swPart->m_controllerRemap)
+            {
+                drop = drop || !swPart->m_controllerRemap->value(
+                    data1, data2, &data1Out, &data2Out);
+            }
+        }
+        if (!drop)
+        {
+            RoutedMessage message;
+            message.m_part = (uint8_t)i;
+            message.m_status = midiStatus|swPart->m_channel;
+            message.m_data1 = data1Out;
+            message.m_data2 = data2Out;
+            out.push_back(message);
+        }
+    } // FOREACH part in section
+    return changed;
+}
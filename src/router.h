@@ -0,0 +1,31 @@
+/*! \file router.h
+ *  \brief Contains the routing of a MIDI message to the parts of a section.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef ROUTER_H
+#define ROUTER_H
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "trackdef.h"
+
+//! \brief A MIDI message for a single part, produced by \a route().
+struct RoutedMessage
+{
+    uint8_t m_part;     //!< Index of the \a SwPart in its \a Section.
+    uint8_t m_status;   //!< MIDI status byte, with the channel of the part.
+    uint8_t m_data1;    //!< MIDI data byte 1.
+    uint8_t m_data2;    //!< MIDI data byte 2, Midi::noData if not sent.
+};
+
+/*! \brief A list of routed messages.
+ *
+ * Reuse it for every call, so its storage is only allocated once.
+ */
+typedef std::vector<RoutedMessage> RoutedMessageList;
+
+uint64_t route(Section *section, uint8_t midiStatusByte, uint8_t data1, uint8_t data2,
+    RoutedMessageList &out, FILE *fpLog = 0);
+
+#endif // ROUTER_H
@@ -0,0 +1,86 @@
+/*! \file seqdump.cpp
+ *  \brief Prints a recording made by patcher_core -r.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sequencer.h"
+#include "mididriver.h"
+#include "error.h"
+
+namespace
+{
+
+//! \brief Short names of the devices, by \a Midi::Device::DeviceId.
+const char *deviceName[Midi::Device::max] = { "none", "a30", "fcb", "fantom", "fantom", "bcf", "bcf" };
+
+//! \brief Print a record, the time relative to the start of the recording.
+void print(const Recording::Record &record, uint64_t startTime)
+{
+    int device = record.device();
+    printf("%12.6f %s %-6s track %3u section %2u ",
+        (double)(record.m_time - startTime) * 1e-9, record.output() ? "out" : "in ",
+        device < Midi::Device::max ? deviceName[device] : "?", record.m_track, record.m_section);
+    for (int i=0; i<record.m_length && i<3; i++)
+        printf(" %02x", record.m_midi[i]);
+    printf("\n");
+}
+
+}
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    double startSeconds = 0;
+    long maxRecords = -1;
+    for (;;)
+    {
+        int opt = getopt(argc, argv, "s:n:h");
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 's':
+                startSeconds = atof(optarg);
+                break;
+            case 'n':
+                maxRecords = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "\nseq_dump [-h|?] [-s <seconds>] [-n <records>] <recording>\n\n"
+                    "  -h|?     This message\n"
+                    "  -s       Start this many seconds into the recording\n"
+                    "  -n       Print no more than this many records\n\n");
+                return 1;
+                break;
+        }
+    }
+    if (argc != optind + 1)
+    {
+        fprintf(stderr, "expected one recording, try -h\n");
+        return 1;
+    }
+    try
+    {
+        RecordingReader reader;
+        reader.open(argv[optind]);
+        uint64_t startTime = reader.header().m_startTime;
+        time_t wallTime = (time_t)reader.header().m_wallTime;
+        printf("# %s# %s, %lu records dropped\n", ctime(&wallTime),
+            reader.indexed() ? "indexed" : "no index, stopped without a trailer",
+            (unsigned long)reader.nofDropped());
+        if (startSeconds > 0)
+            reader.seek(startTime + (uint64_t)(startSeconds * 1e9));
+        Recording::Record record;
+        for (long n=0; (maxRecords < 0 || n < maxRecords) && reader.next(record); n++)
+            print(record, startTime);
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        return e.exitCode();
+    }
+    return 0;
+}
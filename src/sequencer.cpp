@@ -1,45 +1,479 @@
-/*! \file sequencer.cpp
- *  \brief Contains an unused sequencer object.
- *
- *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
- */
-#include "sequencer.h"
-#include <ctime>
-//! \brief Unused.
-void Sequencer::enable()
-{
-    if (m_enabled)
-        disable();
-    m_fp = new std::ofstream(fileName().c_str());
-    m_enabled = true;
-}
-
-//! \brief Unused.
-void Sequencer::disable()
-{
-    if (m_enabled)
-    {
-        delete m_fp;
-        m_enabled = false;
-    }
-}
-
-//! \brief Unused.
-bool Sequencer::toggle()
-{
-    if (m_enabled)
-        disable();
-    else
-        enable();
-    return m_enabled;
-}
-
-//! \brief Unused.
-std::string Sequencer::fileName() const
-{
-    std::time_t result = std::time(0);
-    char buf[80];
-    std::strftime(buf, sizeof(buf), "seq-%Y%m%d-%H%M%S.txt", std::localtime(&result));
-    return std::string(buf);
-}
-
+/*! \file sequencer.cpp
+ *  \brief Contains the recorder of all MIDI traffic of the core.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ctime>
+#include <algorithm>
+#include "sequencer.h"
+#include "error.h"
+
+using namespace Recording;
+
+namespace
+{
+const char fileMagic[8] = { 'P', 'A', 'T', 'C', 'H', 'S', 'E', 'Q' };  //!< File magic.
+const char trailerMagic[8] = { 'S', 'E', 'Q', 'T', 'R', 'A', 'I', 'L' };   //!< Trailer magic.
+const char recordsMagic[4] = { 'R', 'E', 'C', 'S' };    //!< Magic of a frame of records.
+const char indexMagic[4] = { 'I', 'N', 'D', 'X' };      //!< Magic of an index frame.
+const long drainIntervalNs = 10000000;  //!< Time between two drains of the ring.
+
+//! \brief Read a clock in nanoseconds.
+uint64_t nanoseconds(clockid_t clock)
+{
+    timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+//! \brief Orders index entries by time.
+bool earlier(const IndexEntry &a, const IndexEntry &b)
+{
+    return a.m_firstTime < b.m_firstTime;
+}
+}
+
+//! \brief Constructor, the ring is allocated by the first \a enable().
+Sequencer::Sequencer():
+    m_ring(0),
+    m_head(0),
+    m_tail(0),
+    m_nofDropped(0),
+    m_stop(0),
+    m_writeError(0),
+    m_enabled(false),
+    m_fd(-1),
+    m_offset(0),
+    m_nofDroppedWritten(0),
+    m_lastIndex(0),
+    m_lastTime(0)
+{
+}
+
+//! \brief Destructor, finishes the recording.
+Sequencer::~Sequencer()
+{
+    disable();
+    delete[] m_ring;
+}
+
+/*! \brief Start a new recording, named after the current time.
+ *
+ * The ring and the frame buffer are allocated and touched here, so the
+ * event loop never takes a page fault on them.
+ */
+void Sequencer::enable()
+{
+    if (m_enabled)
+        disable();
+    if (!m_ring)
+    {
+        m_ring = new Record[RingSize];
+        memset(m_ring, 0, RingSize * sizeof(Record));
+        m_frame.resize(sizeof(FrameHeader) + MaxFrameRecords * sizeof(Record));
+        m_index.reserve(IndexInterval);
+    }
+    m_fileName = fileName();
+    m_fd = open(m_fileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (m_fd == -1)
+    {
+        Error e;
+        e.stream() << "cannot create " << m_fileName << ", " << strerror(errno);
+        throw(e);
+    }
+    m_head = 0;
+    m_tail = 0;
+    m_nofDropped = 0;
+    m_stop = 0;
+    m_offset = 0;
+    m_nofDroppedWritten = 0;
+    m_writeError = 0;
+    m_lastIndex = 0;
+    m_lastTime = 0;
+    m_index.clear();
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, fileMagic, sizeof(fileMagic));
+    header.m_version = FileHeader::Version;
+    header.m_recordSize = sizeof(Record);
+    header.m_startTime = nanoseconds(CLOCK_MONOTONIC);
+    header.m_wallTime = nanoseconds(CLOCK_REALTIME) / 1000000000u;
+    write(&header, sizeof(header));
+    // the thread must not take the watchdog alarm of the event loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rv = pthread_create(&m_thread, 0, run, this);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (rv != 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        throw(Error("pthread_create", rv));
+    }
+    m_enabled = true;
+}
+
+//! \brief Stop recording, the records still in the ring are written first.
+void Sequencer::disable()
+{
+    if (!m_enabled)
+        return;
+    m_enabled = false;
+    __sync_lock_test_and_set(&m_stop, 1);
+    pthread_join(m_thread, 0);
+    close(m_fd);
+    m_fd = -1;
+}
+
+/*! \brief Start or stop recording.
+ *
+ * \return  True if recording.
+ */
+bool Sequencer::toggle()
+{
+    if (m_enabled)
+        disable();
+    else
+        enable();
+    return m_enabled;
+}
+
+//! \brief The name of a new recording.
+std::string Sequencer::fileName() const
+{
+    std::time_t result = std::time(0);
+    char buf[80];
+    std::strftime(buf, sizeof(buf), "seq-%Y%m%d-%H%M%S.seq", std::localtime(&result));
+    return std::string(buf);
+}
+
+/*! \brief Record a MIDI message, in the event loop.
+ *
+ * \param[in] device    Device ID, or'ed with \a Recording::Output if sent.
+ * \param[in] track     Current track.
+ * \param[in] section   Current section.
+ * \param[in] status    MIDI status byte.
+ * \param[in] data1     MIDI data byte 1, Midi::noData if none.
+ * \param[in] data2     MIDI data byte 2, Midi::noData if none.
+ */
+void Sequencer::record(uint8_t device, int track, int section,
+    uint8_t status, uint8_t data1, uint8_t data2)
+{
+    if (!m_enabled)
+        return;
+    uint32_t head = m_head;
+    if (head - m_tail >= RingSize)
+    {
+        m_nofDropped = m_nofDropped + 1;
+        return;
+    }
+    Record &record = m_ring[head & (RingSize - 1)];
+    record.m_time = nanoseconds(CLOCK_MONOTONIC);
+    record.m_track = (uint16_t)track;
+    record.m_section = (uint8_t)section;
+    record.m_device = device;
+    record.m_midi[0] = status;
+    record.m_midi[1] = data1;
+    record.m_midi[2] = data2;
+    record.m_length = data1 == Midi::noData ? 1 : data2 == Midi::noData ? 2 : 3;
+    // the record must be complete before the writer thread sees it
+    __sync_synchronize();
+    m_head = head + 1;
+}
+
+//! \brief Writer thread entry point.
+void *Sequencer::run(void *arg)
+{
+    Sequencer *sequencer = (Sequencer *)arg;
+    timespec interval = { 0, drainIntervalNs };
+    while (!__sync_fetch_and_add(&sequencer->m_stop, 0))
+    {
+        sequencer->drain();
+        nanosleep(&interval, 0);
+    }
+    sequencer->drain();
+    sequencer->writeIndex();
+    if (sequencer->m_lastIndex)
+    {
+        Trailer trailer;
+        trailer.m_lastIndex = sequencer->m_lastIndex;
+        memcpy(trailer.m_magic, trailerMagic, sizeof(trailerMagic));
+        sequencer->write(&trailer, sizeof(trailer));
+    }
+    return 0;
+}
+
+//! \brief Append the records in the ring to the file, on the writer thread.
+void Sequencer::drain()
+{
+    uint32_t head = m_head;
+    __sync_synchronize();
+    uint32_t tail = m_tail;
+    while (tail != head)
+    {
+        uint32_t count = std::min(head - tail, (uint32_t)MaxFrameRecords);
+        FrameHeader *frame = (FrameHeader *)&m_frame[0];
+        Record *records = (Record *)(frame + 1);
+        for (uint32_t i=0; i<count; i++)
+            records[i] = m_ring[(tail + i) & (RingSize - 1)];
+        uint32_t nofDropped = m_nofDropped;
+        // the copies must be complete before the event loop reuses the slots
+        __sync_synchronize();
+        tail += count;
+        m_tail = tail;
+        memset(frame, 0, sizeof(*frame));
+        memcpy(frame->m_magic, recordsMagic, sizeof(recordsMagic));
+        frame->m_count = count;
+        frame->m_nofDropped = nofDropped - m_nofDroppedWritten;
+        frame->m_firstTime = records[0].m_time;
+        frame->m_lastTime = records[count - 1].m_time;
+        m_nofDroppedWritten = nofDropped;
+        m_lastTime = frame->m_lastTime;
+        IndexEntry entry;
+        entry.m_firstTime = frame->m_firstTime;
+        entry.m_offset = m_offset;
+        write(frame, sizeof(*frame) + count * sizeof(Record));
+        m_index.push_back(entry);
+        if ((int)m_index.size() >= IndexInterval)
+            writeIndex();
+    }
+}
+
+//! \brief Append an index of the frames since the previous index frame.
+void Sequencer::writeIndex()
+{
+    if (m_index.empty())
+        return;
+    FrameHeader frame;
+    memset(&frame, 0, sizeof(frame));
+    memcpy(frame.m_magic, indexMagic, sizeof(indexMagic));
+    frame.m_count = m_index.size();
+    frame.m_nofDropped = m_nofDroppedWritten;
+    frame.m_firstTime = m_index.front().m_firstTime;
+    frame.m_lastTime = m_lastTime;
+    frame.m_previousIndex = m_lastIndex;
+    uint64_t offset = m_offset;
+    write(&frame, sizeof(frame));
+    write(&m_index[0], m_index.size() * sizeof(IndexEntry));
+    m_lastIndex = offset;
+    m_index.clear();
+}
+
+/*! \brief Append to the file.
+ *
+ * After a failed write nothing is written anymore, so the file never
+ * holds a partial frame in the middle.
+ */
+void Sequencer::write(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0 && m_writeError == 0)
+    {
+        ssize_t n = ::write(m_fd, p, size);
+        if (n == -1)
+        {
+            if (errno != EINTR)
+                m_writeError = errno;
+            continue;
+        }
+        p += n;
+        size -= n;
+        m_offset += n;
+    }
+}
+
+//! \brief Construct a reader without a recording.
+RecordingReader::RecordingReader():
+    m_fd(-1),
+    m_frameIdx(0),
+    m_recordIdx(0),
+    m_nofDropped(0),
+    m_indexed(false)
+{
+    memset(&m_header, 0, sizeof(m_header));
+}
+
+//! \brief Destructor.
+RecordingReader::~RecordingReader()
+{
+    if (m_fd != -1)
+        close(m_fd);
+}
+
+/*! \brief Open a recording and find its frames.
+ *
+ * \param[in] fileName  The recording.
+ */
+void RecordingReader::open(const char *fileName)
+{
+    if (m_fd != -1)
+        close(m_fd);
+    m_frames.clear();
+    m_records.clear();
+    m_frameIdx = 0;
+    m_recordIdx = 0;
+    m_nofDropped = 0;
+    m_fd = ::open(fileName, O_RDONLY);
+    if (m_fd == -1)
+    {
+        Error e;
+        e.stream() << "cannot open " << fileName << ", " << strerror(errno);
+        throw(e);
+    }
+    if (!readAt(0, &m_header, sizeof(m_header))
+        || memcmp(m_header.m_magic, fileMagic, sizeof(fileMagic)) != 0
+        || m_header.m_version != FileHeader::Version
+        || m_header.m_recordSize != sizeof(Record))
+    {
+        Error e;
+        e.stream() << fileName << " is not a recording of this version";
+        throw(e);
+    }
+    m_indexed = readIndex();
+    if (!m_indexed)
+        walkFrames();
+}
+
+/*! \brief Read part of the recording.
+ *
+ * \return  False if the file is too short.
+ */
+bool RecordingReader::readAt(uint64_t offset, void *data, size_t size) const
+{
+    ssize_t n = pread(m_fd, data, size, (off_t)offset);
+    return n == (ssize_t)size;
+}
+
+/*! \brief Find the frames through the chain of index frames.
+ *
+ * \return  False if the recording has no valid trailer.
+ */
+bool RecordingReader::readIndex()
+{
+    struct stat statBuf;
+    if (fstat(m_fd, &statBuf) == -1
+        || statBuf.st_size < (off_t)(sizeof(FileHeader) + sizeof(Trailer)))
+        return false;
+    Trailer trailer;
+    if (!readAt(statBuf.st_size - sizeof(trailer), &trailer, sizeof(trailer))
+        || memcmp(trailer.m_magic, trailerMagic, sizeof(trailerMagic)) != 0)
+        return false;
+    std::vector<IndexEntry> frames;
+    uint64_t offset = trailer.m_lastIndex;
+    uint64_t end = statBuf.st_size;
+    bool last = true;
+    while (offset >= sizeof(FileHeader) && offset < end)
+    {
+        FrameHeader frame;
+        if (!readAt(offset, &frame, sizeof(frame))
+            || memcmp(frame.m_magic, indexMagic, sizeof(indexMagic)) != 0)
+            return false;
+        std::vector<IndexEntry> entries(frame.m_count);
+        if (frame.m_count > 0
+            && !readAt(offset + sizeof(frame), &entries[0], frame.m_count * sizeof(IndexEntry)))
+            return false;
+        if (last)
+            m_nofDropped = frame.m_nofDropped;
+        last = false;
+        frames.insert(frames.begin(), entries.begin(), entries.end());
+        if (frame.m_previousIndex == 0)
+        {
+            m_frames.swap(frames);
+            return true;
+        }
+        end = offset;
+        offset = frame.m_previousIndex;
+    }
+    return false;
+}
+
+//! \brief Find the frames by reading all frame headers, up to a partial frame at the end.
+void RecordingReader::walkFrames()
+{
+    uint64_t offset = sizeof(FileHeader);
+    FrameHeader frame;
+    while (readAt(offset, &frame, sizeof(frame)))
+    {
+        uint64_t size;
+        if (memcmp(frame.m_magic, recordsMagic, sizeof(recordsMagic)) == 0)
+            size = frame.m_count * sizeof(Record);
+        else if (memcmp(frame.m_magic, indexMagic, sizeof(indexMagic)) == 0)
+            size = frame.m_count * sizeof(IndexEntry);
+        else
+            break;
+        char last;
+        if (size > 0 && !readAt(offset + sizeof(frame) + size - 1, &last, 1))
+            break;
+        if (frame.m_magic[0] == recordsMagic[0])
+        {
+            IndexEntry entry;
+            entry.m_firstTime = frame.m_firstTime;
+            entry.m_offset = offset;
+            m_frames.push_back(entry);
+            m_nofDropped += frame.m_nofDropped;
+        }
+        offset += sizeof(frame) + size;
+    }
+}
+
+//! \brief Read the records of a frame into \a m_records.
+bool RecordingReader::loadFrame(size_t frameIdx)
+{
+    FrameHeader frame;
+    if (!readAt(m_frames[frameIdx].m_offset, &frame, sizeof(frame))
+        || memcmp(frame.m_magic, recordsMagic, sizeof(recordsMagic)) != 0)
+        return false;
+    m_records.resize(frame.m_count);
+    m_recordIdx = 0;
+    return frame.m_count == 0
+        || readAt(m_frames[frameIdx].m_offset + sizeof(frame), &m_records[0],
+            frame.m_count * sizeof(Record));
+}
+
+/*! \brief Continue reading at the first record at or after a time.
+ *
+ * \param[in] time  CLOCK_MONOTONIC in nanoseconds, as in the records.
+ */
+void RecordingReader::seek(uint64_t time)
+{
+    IndexEntry key;
+    key.m_firstTime = time;
+    key.m_offset = 0;
+    std::vector<IndexEntry>::const_iterator i =
+        std::upper_bound(m_frames.begin(), m_frames.end(), key, earlier);
+    m_records.clear();
+    m_recordIdx = 0;
+    m_frameIdx = i == m_frames.begin() ? 0 : i - m_frames.begin() - 1;
+    if (m_frameIdx >= m_frames.size())
+        return;
+    if (!loadFrame(m_frameIdx++))
+        throw(Error("cannot read recording frame"));
+    while (m_recordIdx < m_records.size() && m_records[m_recordIdx].m_time < time)
+        m_recordIdx++;
+}
+
+/*! \brief Read the next record.
+ *
+ * \param[out] record   The record.
+ * \return     False at the end of the recording.
+ */
+bool RecordingReader::next(Record &record)
+{
+    while (m_recordIdx >= m_records.size())
+    {
+        if (m_frameIdx >= m_frames.size())
+            return false;
+        if (!loadFrame(m_frameIdx++))
+            throw(Error("cannot read recording frame"));
+    }
+    record = m_records[m_recordIdx++];
+    return true;
+}
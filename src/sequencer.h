@@ -1,23 +1,182 @@
-/*! \file sequencer.h
- *  \brief Contains an unused sequencer object.
- *
- *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
- */
-#ifndef SEQUENCER_H
-#define SEQUENCER_H
-#include <iostream>
-#include <fstream>
-//! \brief This class is not used. \todo Implement a sequencer.
-class Sequencer
-{
-private:
-    std::ofstream *m_fp;            //!< File stream to write to.
-    std::string fileName() const;   //!< Return the current file name.
-    bool m_enabled;                 //!< Enable switch.
-public:
-    void enable();                  //!< Enable the \a Sequencer.
-    void disable();                 //!< Disable the \a Sequencer.
-    bool toggle();                  //!< Toggle the on/off switch of the \a Sequencer.
-    Sequencer(): m_fp(0), m_enabled(false) { } //!< Query enable switch.
-};
-#endif //SEQUENCER_H
+/*! \file sequencer.h
+ *  \brief Contains the recorder of all MIDI traffic of the core.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "mididef.h"
+
+/*! \brief Namespace for the records of a recording file.
+ *
+ * A recording starts with a \a FileHeader, followed by frames. Every
+ * frame starts with a \a FrameHeader. A "RECS" frame holds \a Record
+ * objects, an "INDX" frame holds an \a IndexEntry for every frame
+ * written since the previous index frame. A recording that was stopped
+ * cleanly ends with a \a Trailer, which points to the last index frame.
+ * A recording cut short by a crash has no trailer, but its frames can
+ * still be read front to back. All fields are little endian, the way
+ * both the Pi and the PC write them.
+ */
+namespace Recording
+{
+
+static const uint8_t Output = 0x80;     //!< Flag in \a Record::m_device of messages sent by the core.
+
+//! \brief The start of a recording file.
+struct FileHeader
+{
+    static const uint32_t Version = 1;  //!< Must be changed if the layout of the file changes.
+    char m_magic[8];                    //!< Magic string, "PATCHSEQ".
+    uint32_t m_version;                 //!< Layout version.
+    uint32_t m_recordSize;              //!< sizeof(Record).
+    uint64_t m_startTime;               //!< CLOCK_MONOTONIC at the start, in nanoseconds.
+    uint64_t m_wallTime;                //!< CLOCK_REALTIME at the start, in seconds.
+};
+
+//! \brief A MIDI message received or sent by the core.
+struct Record
+{
+    uint64_t m_time;                    //!< CLOCK_MONOTONIC in nanoseconds.
+    uint16_t m_track;                   //!< Current track.
+    uint8_t m_section;                  //!< Current section.
+    uint8_t m_device;                   //!< Device ID, or'ed with \a Output if sent.
+    uint8_t m_midi[3];                  //!< MIDI bytes, the unused ones Midi::noData.
+    uint8_t m_length;                   //!< Number of MIDI bytes.
+    //! \brief The device ID, without the direction.
+    int device() const { return m_device & ~Output; }
+    //! \brief True if the core sent the message.
+    bool output() const { return (m_device & Output) != 0; }
+};
+
+//! \brief The start of a frame.
+struct FrameHeader
+{
+    char m_magic[4];                    //!< "RECS" or "INDX".
+    uint32_t m_count;                   //!< Number of records or index entries that follow.
+    uint32_t m_nofDropped;              //!< Records lost to a full ring, RECS: just before the frame, INDX: since the start.
+    uint32_t m_reserved;                //!< Padding, 0.
+    uint64_t m_firstTime;               //!< Time of the first record covered.
+    uint64_t m_lastTime;                //!< Time of the last record covered.
+    uint64_t m_previousIndex;           //!< INDX: file offset of the previous index frame, 0 if none.
+};
+
+//! \brief Where to find a frame of records.
+struct IndexEntry
+{
+    uint64_t m_firstTime;               //!< Time of the first record in the frame.
+    uint64_t m_offset;                  //!< File offset of the frame header.
+};
+
+//! \brief The end of a recording that was stopped cleanly.
+struct Trailer
+{
+    uint64_t m_lastIndex;               //!< File offset of the last index frame.
+    char m_magic[8];                    //!< Magic string, "SEQTRAIL".
+};
+
+} // namespace Recording
+
+/*! \brief Records every MIDI message the core receives or sends.
+ *
+ * The event loop stores the records in a preallocated ring, which takes
+ * no more than a clock read and a few stores, and never waits: if the
+ * ring is full the record is dropped and counted. A writer thread drains
+ * the ring every few milliseconds and appends the records to the
+ * recording file, with an index frame every \a IndexInterval frames to
+ * find a moment in a long show quickly.
+ *
+ * \a record() and the switches must only be called from the event loop.
+ */
+class Sequencer
+{
+public:
+    static const uint32_t RingSize = 1 << 15;       //!< Records in the ring, a power of 2.
+    static const uint32_t MaxFrameRecords = 1024;   //!< Records per frame at most.
+    static const int IndexInterval = 64;            //!< Frames between index frames.
+private:
+    Recording::Record *m_ring;      //!< The ring.
+    volatile uint32_t m_head;       //!< Records stored, written by the event loop.
+    volatile uint32_t m_tail;       //!< Records taken, written by the writer thread.
+    volatile uint32_t m_nofDropped; //!< Records lost to a full ring, written by the event loop.
+    volatile int m_stop;            //!< Tells the writer thread to finish.
+    volatile int m_writeError;      //!< errno of the first failed write, 0 if none, written by the writer thread.
+    bool m_enabled;                 //!< Enable switch.
+    int m_fd;                       //!< Recording file.
+    std::string m_fileName;         //!< Name of the recording file.
+    pthread_t m_thread;             //!< Writer thread.
+    // writer thread only
+    uint64_t m_offset;              //!< Size of the file so far.
+    uint32_t m_nofDroppedWritten;   //!< \a m_nofDropped as far as written to the file.
+    uint64_t m_lastIndex;           //!< Offset of the last index frame.
+    uint64_t m_lastTime;            //!< Time of the last record written.
+    std::vector<Recording::IndexEntry> m_index;     //!< Frames since the last index frame.
+    std::vector<char> m_frame;      //!< Frame being written.
+    Sequencer(const Sequencer &);               //!< Not copyable.
+    Sequencer &operator=(const Sequencer &);    //!< Not assignable.
+    std::string fileName() const;   //!< Return the current file name.
+    static void *run(void *arg);
+    void drain();
+    void writeIndex();
+    void write(const void *data, size_t size);
+public:
+    void enable();                  //!< Enable the \a Sequencer.
+    void disable();                 //!< Disable the \a Sequencer.
+    bool toggle();                  //!< Toggle the on/off switch of the \a Sequencer.
+    //! \brief Query enable switch.
+    bool enabled() const { return m_enabled; }
+    //! \brief Name of the current or last recording.
+    const std::string &recordingName() const { return m_fileName; }
+    //! \brief Records lost to a full ring in the current recording.
+    uint32_t nofDropped() const { return m_nofDropped; }
+    /*! \brief errno of the first failed write to the current recording, 0 if none.
+     *
+     * Nothing is written to the recording after a failed write.
+     */
+    int writeError() const { return m_writeError; }
+    void record(uint8_t device, int track, int section,
+        uint8_t status, uint8_t data1 = Midi::noData, uint8_t data2 = Midi::noData);
+    Sequencer();
+    ~Sequencer();
+};
+
+/*! \brief Reads a recording.
+ *
+ * Uses the index to find a moment quickly if the recording has a
+ * trailer, and walks the frames otherwise.
+ */
+class RecordingReader
+{
+    int m_fd;                                   //!< Recording file.
+    Recording::FileHeader m_header;             //!< File header.
+    std::vector<Recording::IndexEntry> m_frames;    //!< All frames of records, in file order.
+    std::vector<Recording::Record> m_records;   //!< Records of the current frame.
+    size_t m_frameIdx;                          //!< Next frame to read.
+    size_t m_recordIdx;                         //!< Next record in \a m_records.
+    uint64_t m_nofDropped;                      //!< Records lost while recording.
+    bool m_indexed;                             //!< The frames were found through the index.
+    RecordingReader(const RecordingReader &);               //!< Not copyable.
+    RecordingReader &operator=(const RecordingReader &);    //!< Not assignable.
+    bool readAt(uint64_t offset, void *data, size_t size) const;
+    bool readIndex();
+    void walkFrames();
+    bool loadFrame(size_t frameIdx);
+public:
+    void open(const char *fileName);
+    //! \brief The file header.
+    const Recording::FileHeader &header() const { return m_header; }
+    //! \brief True if the frames were found through the index.
+    bool indexed() const { return m_indexed; }
+    //! \brief Records lost while recording.
+    uint64_t nofDropped() const { return m_nofDropped; }
+    void seek(uint64_t time);
+    bool next(Recording::Record &record);
+    RecordingReader();
+    ~RecordingReader();
+};
+
+#endif //SEQUENCER_H
@@ -3,57 +3,198 @@
  *
  *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
  */
-#define USE_XML_FAKES
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include "queue.h"
 #include "mididef.h"
 #include "mididriver.h"
 #include "error.h"
-#ifdef USE_XML_FAKES
-#include "xml.h"
-#endif
+#include "timestamp.h"
 
-void printEvent(const Event &event)
+/*! \brief Writes events to stdout as text, JSON or binary records.
+ *
+ * Output is collected in a buffer that is written when it reaches the
+ * flush threshold, or when no more events are pending. With a threshold
+ * of 0 every event is written at once, like the plain text output always
+ * was.
+ *
+ * If dropping is enabled, stdout is non-blocking and events that do not
+ * fit in the buffer while the reader is behind are dropped instead of
+ * stalling the event queue. The number of events dropped is reported
+ * once there is room again, before the next event or when the queue runs
+ * dry: as a "# gap" line in text, as a {"gap":n} line in JSON, and on
+ * stderr for binary records, which are the raw \a Event objects.
+ */
+class EventWriter
+{
+public:
+    //! \brief Output format.
+    enum Format { Text, Binary, Json };
+private:
+    static const size_t BufferSize = 65536;     //!< Capacity of the output buffer.
+    static const size_t MaxRecordSize = 256;    //!< Upper bound of a formatted event.
+    Format m_format;            //!< Output format.
+    size_t m_threshold;         //!< Write the buffer once it holds this many bytes.
+    bool m_drop;                //!< Drop events instead of blocking.
+    char m_buffer[BufferSize];  //!< Output buffer.
+    size_t m_size;              //!< Bytes in \a m_buffer.
+    uint32_t m_gap;             //!< Events dropped since the last one written.
+    int format(char *s, const Event &event, const TimeSpec &rxTime);
+    bool writeSome();
+    bool reportGap();
+public:
+    EventWriter(Format format, size_t threshold, bool drop);
+    //! \brief True if there is output that has not been written.
+    bool pending() const { return m_size != 0 || m_gap != 0; }
+    void write(const Event &event);
+    void flush();
+};
+
+//! \brief Construct a writer, and make stdout non-blocking if events may be dropped.
+EventWriter::EventWriter(Format format, size_t threshold, bool drop):
+    m_format(format), m_threshold(threshold < BufferSize ? threshold : BufferSize), m_drop(drop),
+    m_size(0), m_gap(0)
+{
+    if (m_drop)
+    {
+        int flags = fcntl(STDOUT_FILENO, F_GETFL);
+        if (flags == -1 || fcntl(STDOUT_FILENO, F_SETFL, flags|O_NONBLOCK) == -1)
+            throw(Error("fcntl", errno));
+    }
+}
+
+//! \brief Format an event into \a s, which has room for \a MaxRecordSize bytes.
+int EventWriter::format(char *s, const Event &event, const TimeSpec &rxTime)
+{
+    int n = 0;
+    switch (m_format)
+    {
+        case Binary:
+            memcpy(s, &event, sizeof(event));
+            return sizeof(event);
+        case Json:
+            n = snprintf(s, MaxRecordSize,
+                "{\"time\":%ld.%09ld,\"packet\":%u,\"type\":%u,"
+                "\"device\":%u,\"part\":%u,\"midi\":[%u,%u,%u]",
+                (long)rxTime.tv_sec, (long)rxTime.tv_nsec,
+                event.m_packetCounter, event.m_type,
+                event.m_deviceId, event.m_part,
+                event.m_midi[0], event.m_midi[1], event.m_midi[2]);
+            n += snprintf(s+n, MaxRecordSize-n, "}\n");
+            return n;
+        case Text:
+        default:
+            n = snprintf(s, MaxRecordSize,
+                "%04x %02x %02x %02x %02x %02x %02x\n",
+                event.m_packetCounter,
+                event.m_type,
+                event.m_deviceId,
+                event.m_part,
+                event.m_midi[0],
+                event.m_midi[1],
+                event.m_midi[2]);
+            return n;
+    }
+}
+
+/*! \brief Write as much of the buffer as stdout takes.
+ *
+ * \return  False if stdout would block.
+ */
+bool EventWriter::writeSome()
+{
+    size_t done = 0;
+    bool blocked = false;
+    while (done < m_size)
+    {
+        ssize_t rv = ::write(STDOUT_FILENO, m_buffer+done, m_size-done);
+        if (rv == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                blocked = true;
+                break;
+            }
+            throw(Error("write", errno));
+        }
+        done += rv;
+    }
+    memmove(m_buffer, m_buffer+done, m_size-done);
+    m_size -= done;
+    return !blocked;
+}
+
+//! \brief Add an event to the output, or drop it if the reader is too far behind.
+void EventWriter::write(const Event &event)
 {
-    printf("%04x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-        event.m_packetCounter,
-        event.m_metaMode,
-        event.m_currentTrack,
-        event.m_currentSection,
-        event.m_trackIdxWithinSet,
-        event.m_type,
-        event.m_deviceId,
-        event.m_part,
-        event.m_midi[0],
-        event.m_midi[1],
-        event.m_midi[2]);
-    fflush(stdout);
+    TimeSpec rxTime;
+    if (m_format == Json)
+        getTime(rxTime);
+    // leave room for a gap report and the event
+    if (m_size + 2*MaxRecordSize > BufferSize)
+    {
+        writeSome();
+        if (m_size + 2*MaxRecordSize > BufferSize)
+        {
+            // only when dropping, a blocking write empties the buffer
+            m_gap++;
+            return;
+        }
+    }
+    reportGap();
+    m_size += format(m_buffer+m_size, event, rxTime);
+    if (m_size >= m_threshold)
+        writeSome();
 }
 
-void fakeEvents()
+//! \brief Write the buffer, it is kept if stdout would block and events may be dropped.
+void EventWriter::flush()
 {
-#ifdef USE_XML_FAKES
-    XML xml;
-    TrackList trackList;
-    SetList setList;
-    xml.importTracks(TRACK_DEF, trackList, setList);
-#endif
+    writeSome();
+    if (reportGap())
+        writeSome();
+}
 
+/*! \brief Report the events dropped since the last report, if there is room.
+ *
+ * \return  True if a report was added to the buffer.
+ */
+bool EventWriter::reportGap()
+{
+    // wait until the reader has caught up, so a gap is reported once
+    if (m_gap == 0 || m_size + 2*MaxRecordSize > BufferSize)
+        return false;
+    switch (m_format)
+    {
+        case Binary:
+            // there is no room for it in the records
+            fprintf(stderr, "stdout_client: dropped %u events\n", (unsigned)m_gap);
+            m_gap = 0;
+            return false;
+        case Json:
+            m_size += snprintf(m_buffer+m_size, MaxRecordSize, "{\"gap\":%u}\n", (unsigned)m_gap);
+            break;
+        case Text:
+        default:
+            m_size += snprintf(m_buffer+m_size, MaxRecordSize, "# gap %u\n", (unsigned)m_gap);
+            break;
+    }
+    m_gap = 0;
+    return true;
+}
+
+void fakeEvents(EventWriter &writer)
+{
     Event event;
     for (int i=0;; i++)
     {
         event.m_packetCounter = i;
-        event.m_metaMode = i % 10 == 0;
-#ifdef USE_XML_FAKES
-        event.m_currentTrack = i % trackList.size();
-        event.m_currentSection = i % trackList[event.m_currentTrack]->m_sectionList.size();
-        event.m_trackIdxWithinSet = (i/4) % setList.size();
-#else
-        event.m_currentTrack = i % 10 < 4;
-        event.m_currentSection = i % 2;
-        event.m_trackIdxWithinSet = i / 15;
-#endif
         event.m_type = Event::MidiOut3Bytes;
         event.m_deviceId = Midi::Device::FantomOut;
         event.m_part = 0;
@@ -69,20 +210,38 @@ void fakeEvents()
             event.m_midi[1] = Midi::Note::C4;
             event.m_midi[2] = 0;
         }
-        printEvent(event);
+        writer.write(event);
+        writer.flush();
         sleep(1);
     }
 }
 
-void passEvents()
+void passEvents(EventWriter &writer)
 {
     Queue m_eventRxQueue;
     m_eventRxQueue.openRead();
     Event event;
     for (;;)
     {
-        m_eventRxQueue.receive(event);
-        printEvent(event);
+        // write the buffer when the queue runs dry
+        if (!m_eventRxQueue.tryReceive(event))
+        {
+            bool received = false;
+            writer.flush();
+            // a slow reader may not have taken all of it, retry while waiting
+            while (writer.pending() && !received)
+            {
+                TimeSpec retryTime;
+                getTime(retryTime);
+                timeSum(retryTime, retryTime, TimeSpec(0, 10000000));
+                received = m_eventRxQueue.receive(event, retryTime);
+                if (!received)
+                    writer.flush();
+            }
+            if (!received)
+                m_eventRxQueue.receive(event);
+        }
+        writer.write(event);
     }
 }
 
@@ -90,9 +249,12 @@ void passEvents()
 int main(int argc, char **argv)
 {
     bool enableFakeEvents = false;
+    EventWriter::Format format = EventWriter::Text;
+    int threshold = -1;
+    bool drop = false;
     for (;;)
     {
-        int opt = getopt(argc, argv, "fh");
+        int opt = getopt(argc, argv, "fbjt:dh");
         if (opt == -1)
             break;
         switch (opt)
@@ -100,10 +262,28 @@ int main(int argc, char **argv)
             case 'f':
                 enableFakeEvents = true;
                 break;
+            case 'b':
+                format = EventWriter::Binary;
+                break;
+            case 'j':
+                format = EventWriter::Json;
+                break;
+            case 't':
+                threshold = atoi(optarg);
+                break;
+            case 'd':
+                drop = true;
+                break;
             default:
-                fprintf(stderr, "\nstdout_client [-h|?] [-f]\n\n"
+                fprintf(stderr, "\nstdout_client [-h|?] [-f] [-b|-j] [-t <bytes>] [-d]\n\n"
                     "  -h|?     This message\n"
-                    "  -f       Enable fake events\n\n");
+                    "  -f       Enable fake events\n"
+                    "  -b       Write binary event records\n"
+                    "  -j       Write JSON lines with a receive time\n"
+                    "  -t       Buffer this many bytes before writing, 0 writes every event,\n"
+                    "           default 0 for text and 4096 otherwise.\n"
+                    "           The buffer is also written when no events are pending\n"
+                    "  -d       Drop events instead of waiting for a slow reader\n\n");
                 return 1;
                 break;
         }
@@ -112,8 +292,19 @@ int main(int argc, char **argv)
     {
         fprintf(stderr, "unrecognised trailing arguments, try -h\n");
     }
-    if (enableFakeEvents)
-        fakeEvents();
-    passEvents();
+    if (threshold < 0)
+        threshold = format == EventWriter::Text ? 0 : 4096;
+    try
+    {
+        EventWriter writer(format, threshold, drop);
+        if (enableFakeEvents)
+            fakeEvents(writer);
+        passEvents(writer);
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        return e.exitCode();
+    }
     return 0;
 }
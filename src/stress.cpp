@@ -0,0 +1,592 @@
+/*! \file stress.cpp
+ *  \brief Floods patcher_core with synthetic MIDI traffic over DIN speed links, and finds where it saturates.
+ *
+ *  The core runs on named pipes, with a generated track of a single
+ *  section that layers a number of parts. Every step of the test floods
+ *  it at a higher rate with a mix of note clusters, pitch bend, channel
+ *  aftertouch, controller sweeps and BCF fader moves, which the core
+ *  turns into SysEx writes to the Fantom. The output links are throttled
+ *  to 31250 baud. Probe notes, with velocity 1, measure the time from
+ *  an input to the moment its output has left the link.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "harness.h"
+#include "mididef.h"
+#include "patchercore.h"
+#include "error.h"
+
+namespace
+{
+
+const uint64_t probeIntervalNs = 50000000u;     //!< Time between probe notes.
+const uint64_t probeLengthNs = 20000000u;       //!< Time a probe note is held.
+const uint64_t answerTimeoutNs = (uint64_t)5 * 1000000000u;    //!< Time to wait for late probe answers after a step.
+const int nofProbeNotes = 64;                   //!< Probe notes cycle through this many notes.
+
+//! \brief Kinds of synthetic traffic.
+enum StreamType { Notes, Bend, Aftertouch, Controller, Faders, NofStreamTypes };
+
+//! \brief Names of the stream types, for the command line.
+const char *streamName[NofStreamTypes] = { "notes", "bend", "aftertouch", "cc", "faders" };
+
+//! \brief A flood of one kind of message, at a fixed rate.
+class Stream
+{
+    StreamType m_type;      //!< Kind of messages.
+    uint64_t m_interval;    //!< Time between messages.
+    uint64_t m_due;         //!< When the next message is due, relative to the start of the step.
+    uint32_t m_count;       //!< Messages made so far.
+    uint8_t m_cluster[4];   //!< Notes of the current cluster.
+public:
+    Stream(StreamType type, double rate);
+    //! \brief When the next message is due.
+    uint64_t due() const { return m_due; }
+    Message next();
+};
+
+/*! \brief Construct a stream.
+ *
+ * \param[in] type      Kind of messages.
+ * \param[in] rate      Messages per second.
+ */
+Stream::Stream(StreamType type, double rate):
+    m_type(type), m_interval((uint64_t)(1e9 / rate)), m_due(0), m_count(0)
+{
+    // spread the streams, so they do not all fire at once
+    m_due = m_interval * type / NofStreamTypes;
+    memset(m_cluster, 0, sizeof(m_cluster));
+}
+
+//! \brief Make the next message, and advance the due time.
+Message Stream::next()
+{
+    Message message;
+    message.m_time = m_due;
+    message.m_length = 3;
+    uint32_t i = m_count++;
+    int sweep = i % 254 < 127 ? i % 254 : 253 - i % 254;
+    switch (m_type)
+    {
+        case Notes:
+            // clusters of 4 notes, released together
+            message.m_device = Midi::Device::A30;
+            if (i % 8 < 4)
+            {
+                m_cluster[i % 8] = 36 + rand() % 48;
+                message.m_bytes[0] = Midi::noteOn;
+                message.m_bytes[1] = m_cluster[i % 8];
+                message.m_bytes[2] = 2 + rand() % 126;
+            }
+            else
+            {
+                message.m_bytes[0] = Midi::noteOff;
+                message.m_bytes[1] = m_cluster[i % 8 - 4];
+                message.m_bytes[2] = 64;
+            }
+            break;
+        case Bend:
+        {
+            int value = (int)(8192 + 8191 * sin(i * 0.05));
+            message.m_device = Midi::Device::A30;
+            message.m_bytes[0] = Midi::pitchBend;
+            message.m_bytes[1] = value & 0x7f;
+            message.m_bytes[2] = value >> 7;
+            break;
+        }
+        case Aftertouch:
+            message.m_device = Midi::Device::A30;
+            message.m_bytes[0] = Midi::channelAftertouch;
+            message.m_bytes[1] = sweep;
+            message.m_length = 2;
+            break;
+        case Controller:
+            // the expression pedal of the FCB1010
+            message.m_device = Midi::Device::Fcb1010;
+            message.m_bytes[0] = Midi::controller;
+            message.m_bytes[1] = Midi::continuousController16;
+            message.m_bytes[2] = sweep;
+            break;
+        case Faders:
+        default:
+            // every move becomes a SysEx write of a part volume
+            message.m_device = Midi::Device::BcfIn;
+            message.m_bytes[0] = Midi::controller;
+            message.m_bytes[1] = Midi::BCFFader1 + (i / 16) % 8;
+            message.m_bytes[2] = sweep;
+            break;
+    }
+    m_due += m_interval;
+    return message;
+}
+
+//! \brief A probe note and its answer.
+struct Probe
+{
+    uint8_t m_note;         //!< Note number.
+    uint64_t m_sent;        //!< When the note on was written.
+    uint64_t m_answered;    //!< When the first answer had left the link, 0 if none yet.
+    int m_nofAnswers;       //!< Answers seen, one per layer.
+};
+
+//! \brief The outcome of a step.
+struct Step
+{
+    double m_rate;              //!< Messages per second asked for, all streams together.
+    double m_sentRate;          //!< Messages per second written, without the probes, the input links may not keep up.
+    double m_outputRate;        //!< Bytes per second that left the Fantom link.
+    double m_queueMean;         //!< Mean number of bytes waiting for the Fantom link.
+    size_t m_queueMax;          //!< Maximum number of bytes waiting for the Fantom link.
+    size_t m_inputMax;          //!< Maximum number of bytes the core had not read yet.
+    int m_nofProbes;            //!< Probes sent.
+    std::vector<uint64_t> m_latency;    //!< Sorted probe latencies in nanoseconds.
+    std::string m_failure;      //!< Why the core stopped, empty if it did not.
+    bool saturated(double limitMs) const;
+};
+
+//! \brief True if the core died, lost probes, or answered a probe too late.
+bool Step::saturated(double limitMs) const
+{
+    return !m_failure.empty() || (int)m_latency.size() < m_nofProbes
+        || percentile(m_latency, 0.99) > limitMs * 1e6;
+}
+
+/*! \brief Write a file.
+ *
+ * \param[in] fileName  The file.
+ * \param[in] text      Its content.
+ */
+void writeFile(const std::string &fileName, const std::string &text)
+{
+    std::ofstream out(fileName.c_str());
+    if (!out || !(out << text))
+    {
+        Error e;
+        e.stream() << "cannot write " << fileName;
+        throw(e);
+    }
+}
+
+/*! \brief Write the track definitions and the performance cache for the core.
+ *
+ * There is a single track with a single section, which layers a part
+ * on each of the first \a layers channels over the whole keyboard. The
+ * performance is in the cache, so the core does not try to download it.
+ *
+ * \param[in] dir       Working directory of the core.
+ * \param[in] layers    Number of parts.
+ */
+void writeWorkDir(const std::string &dir, int layers)
+{
+    std::ostringstream tracks;
+    tracks << "<tracks version=\"1\">\n  <trackDefinitions>\n"
+        << "    <track name=\"Stress\">\n      <section name=\"Layers\">\n";
+    for (int i=1; i<=layers; i++)
+    {
+        tracks << "        <part channel=\"" << i << "\" name=\"Layer " << i << "\">\n"
+            << "          <range lower=\"C0\" upper=\"G10\" />\n"
+            << "          <transpose offset=\"0\" />\n"
+            << "        </part>\n";
+    }
+    tracks << "      </section>\n    </track>\n  </trackDefinitions>\n"
+        << "  <setList>\n    <track name=\"Stress\" />\n  </setList>\n</tracks>\n";
+    writeFile(dir + "/" + TRACK_DEF, tracks.str());
+    std::ostringstream performances;
+    performances << "<performances version=\"1\">\n  <performance name=\"Stress\">\n";
+    for (int i=1; i<=16; i++)
+    {
+        performances << "    <part channel=\"" << i << "\" bankSelectMsb=\"87\" bankSelectLsb=\"64\""
+            << " programChange=\"1\" volume=\"100\">\n"
+            << "      <patch name=\"Stress\" />\n    </part>\n";
+    }
+    performances << "  </performance>\n</performances>\n";
+    writeFile(dir + "/" + FANTOM_CACHE_XML, performances.str());
+}
+
+/*! \brief Match the note ons with velocity 1 in the output to the probes.
+ *
+ * Every layer answers a probe, the answers of a probe are matched to
+ * the oldest probe on that note that has not had all its answers.
+ *
+ * \param[in] capture       Output of the core.
+ * \param[in] from          Index of the first byte to the Fantom to look at.
+ * \param[in] layers        Answers per probe.
+ * \param[in,out] probes    The probes.
+ */
+void matchProbes(const Capture &capture, size_t from, int layers, std::vector<Probe> &probes)
+{
+    const std::vector<uint8_t> &bytes = capture.m_bytes[Midi::Device::FantomOut];
+    const std::vector<uint64_t> &times = capture.m_times[Midi::Device::FantomOut];
+    uint8_t status = 0;
+    uint8_t data[2];
+    int nofData = 0;
+    for (size_t i=from; i<bytes.size(); i++)
+    {
+        uint8_t b = bytes[i];
+        if (b >= Midi::timingClock)
+            continue;
+        if (b & 0x80)
+        {
+            status = b;
+            nofData = 0;
+            continue;
+        }
+        if (Midi::status(status) != Midi::noteOn || status == Midi::sysEx)
+            continue;
+        data[nofData++] = b;
+        if (nofData < 2)
+            continue;
+        nofData = 0;
+        if (data[1] != 1)
+            continue;
+        for (size_t p=0; p<probes.size(); p++)
+        {
+            if (probes[p].m_note == data[0] && probes[p].m_nofAnswers < layers && probes[p].m_sent < times[i])
+            {
+                if (probes[p].m_nofAnswers++ == 0)
+                    probes[p].m_answered = times[i];
+                break;
+            }
+        }
+    }
+}
+
+/*! \brief Run the core at one rate.
+ *
+ * Every step starts a fresh core, so a core that died of an overload
+ * does not end the test, and every step starts with empty links.
+ *
+ * \param[in] core          The patcher_core executable.
+ * \param[in] workDir       Working directory of the core.
+ * \param[in] types         Stream types in the mix.
+ * \param[in] rate          Messages per second, all streams together.
+ * \param[in] seconds       Duration of the flood.
+ * \param[in] layers        Parts in the section.
+ * \return    The outcome.
+ */
+Step runStep(const char *core, const std::string &workDir, const std::vector<StreamType> &types,
+    double rate, double seconds, int layers)
+{
+    Step step;
+    step.m_rate = rate;
+    step.m_sentRate = 0;
+    step.m_outputRate = 0;
+    step.m_queueMean = 0;
+    step.m_queueMax = 0;
+    step.m_inputMax = 0;
+    step.m_nofProbes = 0;
+    std::vector<Stream> streams;
+    for (size_t i=0; i<types.size(); i++)
+        streams.push_back(Stream(types[i], rate / types.size()));
+    std::vector<Probe> probes;
+    srand(1);
+    Harness harness(Harness::dinByteNs);
+    try
+    {
+        harness.start(core, workDir.c_str());
+        size_t from = harness.capture().m_bytes[Midi::Device::FantomOut].size();
+        uint64_t duration = (uint64_t)(seconds * 1e9);
+        uint64_t start = now();
+        uint64_t linkTime[Midi::Device::max];  // when each input link has sent its last byte
+        for (int i=0; i<Midi::Device::max; i++)
+            linkTime[i] = 0;
+        uint64_t nextProbe = 0;
+        uint64_t nofSent = 0;
+        double queueSum = 0;
+        uint64_t nofSamples = 0;
+        for (;;)
+        {
+            // the earliest of the streams and the probe
+            Message message;
+            uint64_t due = nextProbe;
+            size_t s = streams.size();
+            for (size_t i=0; i<streams.size(); i++)
+            {
+                if (streams[i].due() < due)
+                {
+                    due = streams[i].due();
+                    s = i;
+                }
+            }
+            if (due >= duration)
+                break;
+            if (s < streams.size())
+            {
+                message = streams[s].next();
+            }
+            else
+            {
+                // a probe, and its note off half way to the next one
+                Probe probe;
+                probe.m_note = 24 + step.m_nofProbes % nofProbeNotes;
+                probe.m_answered = 0;
+                probe.m_nofAnswers = 0;
+                message.m_time = due;
+                message.m_device = Midi::Device::A30;
+                message.m_length = 3;
+                message.m_bytes[0] = Midi::noteOn;
+                message.m_bytes[1] = probe.m_note;
+                message.m_bytes[2] = 1;
+                if (nextProbe % probeIntervalNs == 0)
+                {
+                    probes.push_back(probe);
+                    step.m_nofProbes++;
+                    nextProbe += probeLengthNs;
+                }
+                else
+                {
+                    message.m_bytes[0] = Midi::noteOff;
+                    message.m_bytes[1] = probes.back().m_note;
+                    message.m_bytes[2] = 0;
+                    nextProbe += probeIntervalNs - probeLengthNs;
+                }
+            }
+            // a message cannot start before the previous one on its link has been sent
+            uint64_t at = std::max(start + message.m_time, linkTime[message.m_device]);
+            linkTime[message.m_device] = at + message.m_length * Harness::dinByteNs;
+            harness.pump(at);
+            if (message.m_bytes[0] == Midi::noteOn && message.m_bytes[2] == 1)
+                probes.back().m_sent = now();
+            harness.send(message);
+            nofSent += s < streams.size();
+            size_t queued = harness.queued(Midi::Device::FantomOut);
+            queueSum += queued;
+            nofSamples++;
+            step.m_queueMax = std::max(step.m_queueMax, queued);
+            step.m_inputMax = std::max(step.m_inputMax, harness.queued(message.m_device));
+        }
+        uint64_t end = now();
+        step.m_sentRate = nofSent / ((end - start) * 1e-9);
+        step.m_queueMean = nofSamples ? queueSum / nofSamples : 0;
+        // wait for the answers, the links drain meanwhile
+        uint64_t deadline = end + answerTimeoutNs;
+        for (;;)
+        {
+            matchProbes(harness.capture(), from, layers, probes);
+            bool done = true;
+            for (size_t i=0; i<probes.size(); i++)
+                done = done && probes[i].m_nofAnswers > 0;
+            if (done || now() > deadline)
+                break;
+            harness.pump(now() + 10000000);
+        }
+        const std::vector<uint64_t> &times = harness.capture().m_times[Midi::Device::FantomOut];
+        size_t nofOutput = 0;
+        for (size_t i=from; i<times.size(); i++)
+            nofOutput += times[i] <= end;
+        step.m_outputRate = nofOutput / ((end - start) * 1e-9);
+    }
+    catch (Error &e)
+    {
+        step.m_failure = e.what();
+    }
+    for (size_t i=0; i<probes.size(); i++)
+    {
+        if (probes[i].m_nofAnswers > 0)
+            step.m_latency.push_back(probes[i].m_answered - probes[i].m_sent);
+    }
+    std::sort(step.m_latency.begin(), step.m_latency.end());
+    return step;
+}
+
+//! \brief Print the header of the table.
+void printHeader()
+{
+    printf("%9s %9s %8s %6s %15s %10s %8s %8s %8s %8s %8s\n", "rate/s", "sent/s", "out B/s", "link%",
+        "queue avg/max", "backlog B", "probes", "p50 ms", "p90 ms", "p99 ms", "max ms");
+}
+
+//! \brief Print a step.
+void printStep(const Step &step, double limitMs)
+{
+    char queue[32], probes[32];
+    snprintf(queue, sizeof(queue), "%.0f/%lu", step.m_queueMean, (unsigned long)step.m_queueMax);
+    snprintf(probes, sizeof(probes), "%lu/%d", (unsigned long)step.m_latency.size(), step.m_nofProbes);
+    printf("%9.0f %9.0f %8.0f %6.1f %15s %10lu %8s %8.2f %8.2f %8.2f %8.2f%s\n",
+        step.m_rate, step.m_sentRate, step.m_outputRate, step.m_outputRate * Harness::dinByteNs * 1e-7,
+        queue, (unsigned long)step.m_inputMax, probes,
+        percentile(step.m_latency, 0.5) * 1e-6, percentile(step.m_latency, 0.9) * 1e-6,
+        percentile(step.m_latency, 0.99) * 1e-6,
+        (step.m_latency.empty() ? 0 : step.m_latency.back()) * 1e-6,
+        step.saturated(limitMs) ? "  saturated" : "");
+    if (!step.m_failure.empty())
+        printf("          %s\n", step.m_failure.c_str());
+    fflush(stdout);
+}
+
+/*! \brief Remove the working directory and what the core wrote in it.
+ *
+ * \param[in] dir       The directory.
+ */
+void removeWorkDir(const std::string &dir)
+{
+    const char *files[] = { TRACK_DEF, TRACK_IMAGE, FANTOM_CACHE, FANTOM_CACHE_XML };
+    for (size_t i=0; i<sizeof(files)/sizeof(files[0]); i++)
+        unlink((dir + "/" + files[i]).c_str());
+    if (rmdir(dir.c_str()) == -1)
+        fprintf(stderr, "** left %s behind: %s\n", dir.c_str(), strerror(errno));
+}
+
+}
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    const char *core = "./patcher_core";
+    int layers = 3;
+    double rate = 50;
+    double growth = 1.5;
+    double seconds = 3;
+    double limitMs = 10;
+    int nofBisections = 4;
+    std::vector<StreamType> types;
+    for (;;)
+    {
+        int opt = getopt(argc, argv, "c:l:s:g:t:L:b:m:h");
+        if (opt == -1)
+            break;
+        switch (opt)
+        {
+            case 'c':
+                core = optarg;
+                break;
+            case 'l':
+                layers = atoi(optarg);
+                break;
+            case 's':
+                rate = atof(optarg);
+                break;
+            case 'g':
+                growth = atof(optarg);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'L':
+                limitMs = atof(optarg);
+                break;
+            case 'b':
+                nofBisections = atoi(optarg);
+                break;
+            case 'm':
+            {
+                std::istringstream ss(optarg);
+                std::string name;
+                while (std::getline(ss, name, ','))
+                {
+                    int t = 0;
+                    while (t < NofStreamTypes && name != streamName[t])
+                        t++;
+                    if (t == NofStreamTypes)
+                    {
+                        fprintf(stderr, "unknown stream %s, try -h\n", name.c_str());
+                        return 1;
+                    }
+                    types.push_back((StreamType)t);
+                }
+                break;
+            }
+            default:
+                fprintf(stderr, "\npatcher_stress [-h|?] [-c <core>] [-l <layers>] [-m <streams>] [-s <rate>]\n"
+                    "               [-g <growth>] [-t <seconds>] [-L <ms>] [-b <bisections>]\n\n"
+                    "  -h|?     This message\n"
+                    "  -c       The patcher_core executable, default ./patcher_core\n"
+                    "  -l       Parts layered in the section, default 3\n"
+                    "  -m       Streams in the mix, a comma separated list of\n"
+                    "           notes, bend, aftertouch, cc and faders, default all\n"
+                    "  -s       Messages per second of the first step, default 50\n"
+                    "  -g       Rate of a step relative to the previous one, default 1.5\n"
+                    "  -t       Seconds per step, default 3\n"
+                    "  -L       Probe latency in ms at the 99th percentile that counts as saturated, default 10\n"
+                    "  -b       Steps to narrow down the saturation point, default 4\n\n"
+                    "The core starts in a generated track, without a warm start snapshot.\n"
+                    "It has an event queue and shared memory of its own, so this can run next\n"
+                    "to a live core.\n\n");
+                return 1;
+                break;
+        }
+    }
+    if (argc > optind || layers < 1 || layers > 16 || rate <= 0 || growth <= 1 || seconds <= 0)
+    {
+        fprintf(stderr, "bad arguments, try -h\n");
+        return 1;
+    }
+    if (types.empty())
+    {
+        for (int t=0; t<NofStreamTypes; t++)
+            types.push_back((StreamType)t);
+    }
+    char dir[] = "/tmp/patcher_stress.XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    int rv = 0;
+    try
+    {
+        writeWorkDir(dir, layers);
+        printf("layers     %d\nstreams   ", layers);
+        for (size_t i=0; i<types.size(); i++)
+            printf(" %s", streamName[types[i]]);
+        printf("\nlinks      31250 baud, %d byte output buffer\nsaturated  p99 probe latency over %.1f ms, lost probes, or a dead core\n\n",
+            Harness::dinBufferSize, limitMs);
+        printHeader();
+        // ramp up until saturated
+        Step good, bad;
+        good.m_rate = 0;
+        bad.m_rate = 0;
+        for (;;)
+        {
+            Step step = runStep(core, dir, types, rate, seconds, layers);
+            printStep(step, limitMs);
+            if (step.saturated(limitMs))
+            {
+                bad = step;
+                break;
+            }
+            good = step;
+            if (step.m_sentRate < 0.9 * step.m_rate)
+            {
+                printf("\nthe input links are full before the output saturates\n");
+                break;
+            }
+            rate *= growth;
+        }
+        // narrow down
+        for (int i=0; i<nofBisections && good.m_rate > 0 && bad.m_rate > 0; i++)
+        {
+            Step step = runStep(core, dir, types, sqrt(good.m_rate * bad.m_rate), seconds, layers);
+            printStep(step, limitMs);
+            if (step.saturated(limitMs))
+                bad = step;
+            else
+                good = step;
+        }
+        printf("\n");
+        if (good.m_rate == 0)
+            printf("saturation below %.0f messages/s, lower -s\n", bad.m_rate);
+        else if (bad.m_rate > 0)
+            printf("saturation between %.0f and %.0f messages/s in, at %.0f bytes/s out (%.0f%% of the Fantom link), p99 %.2f ms\n",
+                good.m_rate, bad.m_rate, good.m_outputRate, good.m_outputRate * Harness::dinByteNs * 1e-7,
+                percentile(good.m_latency, 0.99) * 1e-6);
+    }
+    catch (Error &e)
+    {
+        fprintf(stderr, "** %s\n", e.what());
+        rv = e.exitCode();
+    }
+    removeWorkDir(dir);
+    return rv;
+}
@@ -1,10 +1,16 @@
 #include <tcl.h>
 #include <string.h>
 #include <sstream>
+#include <vector>
 #include "queue.h"
 #include "trackdef.h"
 #include "fantomdef.h"
 #include "xml.h"
+#include "fantomcache.h"
+#include "trackimage.h"
+#include "configshm.h"
+#include "liveshm.h"
+#include "error.h"
 
 class EvalException
 {
@@ -43,88 +49,285 @@ public:
     }
 };
 
-class Banner
+/*! \brief A canvas item that is created once and then changed in place.
+ *
+ * Changes are only recorded here. When Tk is idle, \a flushCanvasItems()
+ * sends each changed item a single itemconfigure with just the options
+ * that differ from what is shown, and a coords if it has moved. The
+ * commands are built as Tcl_Obj vectors, so nothing is parsed.
+ */
+class CanvasItem
 {
+    Tcl_Obj *m_canvas;          //!< Canvas path.
+    Tcl_Obj *m_id;              //!< Item id.
+    std::string m_text;         //!< Text to show.
+    std::string m_shownText;    //!< Text shown.
+    int m_coords[4];            //!< Rectangle to show.
+    int m_shownCoords[4];       //!< Rectangle shown.
+    bool m_hidden;              //!< Hide the item.
+    bool m_shownHidden;         //!< The item is hidden.
+    bool m_pending;             //!< The item is in the pending list.
+    void create(Tcl_Interp *interp, const char *canvas, TclEval &eval);
+    void schedule(Tcl_Interp *interp);
 public:
-    const char *m_canvas;
-    int m_row;
-    int m_col;
-    struct {
-        int m_value;
-        int m_fraction;
-    } m_id;
-    Banner(Tcl_Interp *interp, const char *canvas, const char *field, int row, int col): 
-        m_canvas(canvas), m_row(row), m_col(col)
+    static void init();
+    void createText(Tcl_Interp *interp, const char *canvas, int x, int y,
+        const std::string &text, const char *options);
+    void createRectangle(Tcl_Interp *interp, const char *canvas,
+        int x1, int y1, int x2, int y2, const char *options);
+    void setText(Tcl_Interp *interp, const std::string &text);
+    void setCoords(Tcl_Interp *interp, int x1, int y1, int x2, int y2);
+    void setHidden(Tcl_Interp *interp, bool hidden);
+    void flush(Tcl_Interp *interp);
+    CanvasItem(): m_canvas(0), m_id(0), m_hidden(false), m_shownHidden(false), m_pending(false)
     {
-        TclEval eval;
-        eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" 
-            << field << "} -anchor w";
-        eval.flush(interp);
-        update(interp, "banner", 0, 1);
+        for (int i=0; i<4; i++)
+            m_coords[i] = m_shownCoords[i] = 0;
     }
-    void clear(Tcl_Interp *interp)
+};
+
+namespace
+{
+//! \brief The words of the update commands, shared by all items.
+struct Words
+{
+    Tcl_Obj *m_itemconfigure;
+    Tcl_Obj *m_coords;
+    Tcl_Obj *m_text;
+    Tcl_Obj *m_state;
+    Tcl_Obj *m_hidden;
+    Tcl_Obj *m_normal;
+} words;
+
+std::vector<CanvasItem *> pendingItems;     //!< Items with changes that are not shown yet.
+bool flushScheduled = false;                //!< An idle flush is scheduled.
+
+//! \brief Create an object that is never freed.
+Tcl_Obj *newWord(const char *s)
+{
+    Tcl_Obj *obj = Tcl_NewStringObj(s, -1);
+    Tcl_IncrRefCount(obj);
+    return obj;
+}
+
+//! \brief Evaluate a command vector.
+void evalObjv(Tcl_Interp *interp, int objc, Tcl_Obj **objv)
+{
+    for (int i=0; i<objc; i++)
+        Tcl_IncrRefCount(objv[i]);
+    int rv = Tcl_EvalObjv(interp, objc, objv, TCL_EVAL_GLOBAL);
+    for (int i=0; i<objc; i++)
+        Tcl_DecrRefCount(objv[i]);
+    if (rv != TCL_OK)
+        throw EvalException(rv, interp);
+}
+
+//! \brief Idle callback, show all pending changes.
+void flushCanvasItems(ClientData cdata)
+{
+    Tcl_Interp *interp = (Tcl_Interp *)cdata;
+    flushScheduled = false;
+    try
     {
-        TclEval eval;
-        eval.stream() << m_canvas << " delete " << m_id.m_value;
-        eval.flush(interp);
-        eval.stream() << m_canvas << " delete " << m_id.m_fraction;
-        eval.flush(interp);
+        for (size_t i=0; i<pendingItems.size(); i++)
+            pendingItems[i]->flush(interp);
     }
-    void update(Tcl_Interp *interp, const char *value, int numerator, int denominator)
+    catch (EvalException &e)
+    {
+        Tcl_BackgroundError(interp);
+    }
+    pendingItems.clear();
+}
+}
+
+//! \brief Create the shared command words, once.
+void CanvasItem::init()
+{
+    words.m_itemconfigure = newWord("itemconfigure");
+    words.m_coords = newWord("coords");
+    words.m_text = newWord("-text");
+    words.m_state = newWord("-state");
+    words.m_hidden = newWord("hidden");
+    words.m_normal = newWord("normal");
+}
+
+//! \brief Run a create command and keep the id of the new item.
+void CanvasItem::create(Tcl_Interp *interp, const char *canvas, TclEval &eval)
+{
+    int id;
+    eval.flush(interp, id);
+    m_canvas = newWord(canvas);
+    m_id = Tcl_NewIntObj(id);
+    Tcl_IncrRefCount(m_id);
+}
+
+//! \brief Create a text item.
+void CanvasItem::createText(Tcl_Interp *interp, const char *canvas, int x, int y,
+    const std::string &text, const char *options)
+{
+    TclEval eval;
+    eval.stream() << canvas << " create text " << x << "p " << y << "p -text {"
+        << text << "} " << options;
+    create(interp, canvas, eval);
+    m_text = m_shownText = text;
+}
+
+//! \brief Create a rectangle item.
+void CanvasItem::createRectangle(Tcl_Interp *interp, const char *canvas,
+    int x1, int y1, int x2, int y2, const char *options)
+{
+    TclEval eval;
+    eval.stream() << canvas << " create rectangle " << x1 << "p " << y1 <<
+            "p " << x2 << "p " << y2 << "p " << options;
+    create(interp, canvas, eval);
+    m_coords[0] = m_shownCoords[0] = x1;
+    m_coords[1] = m_shownCoords[1] = y1;
+    m_coords[2] = m_shownCoords[2] = x2;
+    m_coords[3] = m_shownCoords[3] = y2;
+}
+
+//! \brief Add the item to the pending list, and make sure it is flushed when Tk is idle.
+void CanvasItem::schedule(Tcl_Interp *interp)
+{
+    if (m_pending)
+        return;
+    m_pending = true;
+    pendingItems.push_back(this);
+    if (!flushScheduled)
+    {
+        Tcl_DoWhenIdle(flushCanvasItems, interp);
+        flushScheduled = true;
+    }
+}
+
+//! \brief Change the text.
+void CanvasItem::setText(Tcl_Interp *interp, const std::string &text)
+{
+    if (text == m_text)
+        return;
+    m_text = text;
+    schedule(interp);
+}
+
+//! \brief Move the rectangle.
+void CanvasItem::setCoords(Tcl_Interp *interp, int x1, int y1, int x2, int y2)
+{
+    if (x1 == m_coords[0] && y1 == m_coords[1] && x2 == m_coords[2] && y2 == m_coords[3])
+        return;
+    m_coords[0] = x1;
+    m_coords[1] = y1;
+    m_coords[2] = x2;
+    m_coords[3] = y2;
+    schedule(interp);
+}
+
+//! \brief Hide or show the item.
+void CanvasItem::setHidden(Tcl_Interp *interp, bool hidden)
+{
+    if (hidden == m_hidden)
+        return;
+    m_hidden = hidden;
+    schedule(interp);
+}
+
+//! \brief Send the changes to Tk, if they differ from what is shown.
+void CanvasItem::flush(Tcl_Interp *interp)
+{
+    m_pending = false;
+    Tcl_Obj *objv[7];
+    int objc = 0;
+    objv[objc++] = m_canvas;
+    objv[objc++] = words.m_itemconfigure;
+    objv[objc++] = m_id;
+    if (m_text != m_shownText)
+    {
+        objv[objc++] = words.m_text;
+        objv[objc++] = Tcl_NewStringObj(m_text.c_str(), -1);
+        m_shownText = m_text;
+    }
+    if (m_hidden != m_shownHidden)
+    {
+        objv[objc++] = words.m_state;
+        objv[objc++] = m_hidden ? words.m_hidden : words.m_normal;
+        m_shownHidden = m_hidden;
+    }
+    if (objc > 3)
+        evalObjv(interp, objc, objv);
+    if (memcmp(m_coords, m_shownCoords, sizeof(m_coords)) != 0)
+    {
+        objc = 0;
+        objv[objc++] = m_canvas;
+        objv[objc++] = words.m_coords;
+        objv[objc++] = m_id;
+        for (int i=0; i<4; i++)
+        {
+            objv[objc++] = Tcl_ObjPrintf("%dp", m_coords[i]);
+            m_shownCoords[i] = m_coords[i];
+        }
+        evalObjv(interp, objc, objv);
+    }
+}
+
+class Banner
+{
+public:
+    CanvasItem m_fraction;
+    CanvasItem m_value;
+    Banner(Tcl_Interp *interp, const char *canvas, const char *field, int row, int col)
     {
-        int row = m_row;
-        int col = m_col;
-        clear(interp);
         TclEval eval;
+        eval.stream() << canvas << " create text " << col << "p " << row << "p -text {" 
+            << field << "} -anchor w";
+        eval.flush(interp);
         col += 60;
-        eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" 
-            << numerator << "/" << denominator << "}";
-        eval.flush(interp, m_id.m_fraction);
+        m_fraction.createText(interp, canvas, col, row, "0/1", "");
         col += 80;
-        eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" 
-            << value << "} -anchor w -font TkTextFont";
-        eval.flush(interp, m_id.m_value);
+        m_value.createText(interp, canvas, col, row, "banner", "-anchor w -font TkTextFont");
+    }
+    void update(Tcl_Interp *interp, const char *value, int numerator, int denominator)
+    {
+        std::stringstream fraction;
+        fraction << numerator << "/" << denominator;
+        m_fraction.setText(interp, fraction.str());
+        m_value.setText(interp, value);
     }
 };
 
 class Range
 {
 public:
-    const char *m_canvas;
     int m_x1;
     int m_y1;
     int m_x2;
     int m_y2;
-    int m_value1;
-    int m_value2;
     static const int m_min = Midi::Note::E2;
     static const int m_max = Midi::Note::G8;
-    struct {
-        int m_bg;
-        int m_fg;
-        int m_text1;
-        int m_text2;
-    } m_id;
+    CanvasItem m_bg;
+    CanvasItem m_fg;
+    CanvasItem m_text1;
+    CanvasItem m_text2;
     static int clamp(int x, int xa, int xb)
     {
         return std::max(xa, std::min(x, xb));
     }
     Range(Tcl_Interp *interp, const char *canvas, int x1, int y1, int x2, int y2,
             int value1, int value2):
-        m_canvas(canvas), m_x1(x1), m_y1(y1), m_x2(x2), m_y2(y2),
-        m_value1(value1), m_value2(value2)
+        m_x1(x1), m_y1(y1), m_x2(x2), m_y2(y2)
+    {
+        m_bg.createRectangle(interp, canvas, m_x1, m_y1, m_x2, m_y2, "-fill black");
+        m_fg.createRectangle(interp, canvas, m_x1, m_y1, m_x1, m_y2, "-fill blue");
+        int y3 = (m_y1 + m_y2)/2;
+        m_text1.createText(interp, canvas, m_x1, y3, "", "-fill white -anchor w");
+        m_text2.createText(interp, canvas, m_x2, y3, "", "-fill white -anchor e");
+        update(interp, value1, value2);
+    }
+    void update(Tcl_Interp *interp, int value1, int value2)
     {
-        m_value1 = clamp(m_value1, m_min, m_max);
-        m_value2 = clamp(m_value2, m_min, m_max);
-        m_value1 -= m_min;
-        m_value2 -= m_min;
+        value1 = clamp(value1, m_min, m_max) - m_min;
+        value2 = clamp(value2, m_min, m_max) - m_min;
         double range = m_max - m_min;
-        TclEval eval;
-        eval.stream() << m_canvas << " create rectangle " << m_x1 << "p " << m_y1 <<
-                "p " << m_x2 << "p " << m_y2 << "p -fill black";
-        eval.flush(interp, m_id.m_bg);
-        double f1 = (double)m_value1/range;
-        double f2 = (double)m_value2/range;
+        double f1 = (double)value1/range;
+        double f2 = (double)value2/range;
         int x3 = m_x1 + f1 * (m_x2-m_x1);
         int x4 = m_x1 + f2 * (m_x2-m_x1);
         if (std::abs(x3-x4) < 2)
@@ -134,113 +337,75 @@ public:
             else
                 x4 += 2;
         }
-        eval.stream() << m_canvas << " create rectangle " << x3 << "p " << m_y1 <<
-                "p " << x4 << "p " << m_y2 << "p -fill blue";
-        eval.flush(interp, m_id.m_fg);
-        int y3 = (m_y1 + m_y2)/2;
-        eval.stream() << m_canvas << " create text " << m_x1 << "p " << y3 << "p -text {" << Midi::noteName(m_value1+m_min) << "} -fill white -anchor w";
-        eval.flush(interp, m_id.m_text1);
-        eval.stream() << m_canvas << " create text " << m_x2 << "p " << y3 << "p -text {" << Midi::noteName(m_value2+m_min) << "} -fill white -anchor e";
-        eval.flush(interp, m_id.m_text2);
+        m_fg.setCoords(interp, x3, m_y1, x4, m_y2);
+        m_text1.setText(interp, Midi::noteName(value1+m_min));
+        m_text2.setText(interp, Midi::noteName(value2+m_min));
     }
-    void clear(Tcl_Interp *interp)
+    void setHidden(Tcl_Interp *interp, bool hidden)
     {
-        TclEval eval;
-        eval.stream() << m_canvas << " delete " << m_id.m_fg;
-        eval.flush(interp);
-        eval.stream() << m_canvas << " delete " << m_id.m_bg;
-        eval.flush(interp);
-        eval.stream() << m_canvas << " delete " << m_id.m_text1;
-        eval.flush(interp);
-        eval.stream() << m_canvas << " delete " << m_id.m_text2;
-        eval.flush(interp);
+        m_bg.setHidden(interp, hidden);
+        m_fg.setHidden(interp, hidden);
+        m_text1.setHidden(interp, hidden);
+        m_text2.setHidden(interp, hidden);
     }
 };
 
 class Bar
 {
 public:
-    const char *m_canvas;
     int m_x1;
     int m_y1;
     int m_x2;
     int m_y2;
-    int m_value;
     int m_max;
-    struct {
-        int m_bg;
-        int m_fg;
-        int m_text;
-    } m_id;
+    CanvasItem m_bg;
+    CanvasItem m_fg;
+    CanvasItem m_text;
     Bar(Tcl_Interp *interp, const char *canvas, int x1, int y1, int x2, int y2, int value, int max):
-        m_canvas(canvas), m_x1(x1), m_y1(y1), m_x2(x2), m_y2(y2), m_value(value), m_max(max)
+        m_x1(x1), m_y1(y1), m_x2(x2), m_y2(y2), m_max(max)
     {
-        TclEval eval;
-        eval.stream() << m_canvas << " create rectangle " << m_x1 << "p " << m_y1 <<
-                "p " << m_x2 << "p " << m_y2 << "p -fill black";
-        eval.flush(interp, m_id.m_bg);
-        double f = (double)m_value/(double)m_max;
-        int x3 = m_x1 + f * (m_x2-m_x1);
-        eval.stream() << m_canvas << " create rectangle " << m_x1 << "p " << m_y1 <<
-                "p " << x3 << "p " << m_y2 << "p -fill green";
-        eval.flush(interp, m_id.m_fg);
-        x3 = (m_x1 + m_x2)/2;
-        int y3 = (m_y1 + m_y2)/2;
-        eval.stream() << m_canvas << " create text " << x3 << "p " << y3 << "p -text " << m_value << " -fill white";
-        eval.flush(interp, m_id.m_text);
+        m_bg.createRectangle(interp, canvas, m_x1, m_y1, m_x2, m_y2, "-fill black");
+        m_fg.createRectangle(interp, canvas, m_x1, m_y1, m_x1, m_y2, "-fill green");
+        m_text.createText(interp, canvas, (m_x1 + m_x2)/2, (m_y1 + m_y2)/2, "", "-fill white");
+        update(interp, value);
     }
     void update(Tcl_Interp *interp, int value)
     {
-        m_value = value;
-        TclEval eval;
-        eval.stream() << m_canvas << " delete " << m_id.m_fg;
-        eval.flush(interp);
-        double f = (double)m_value/(double)m_max;
+        double f = (double)value/(double)m_max;
         int x3 = m_x1 + f * (m_x2-m_x1);
-        eval.stream() << m_canvas << " create rectangle " << m_x1 << "p " << m_y1 <<
-                "p " << x3 << "p " << m_y2 << "p -fill green";
-        eval.flush(interp, m_id.m_fg);
-        eval.stream() << m_canvas << " dchars " << m_id.m_text << " 0 end";
-        eval.flush(interp);
-        x3 = (m_x1 + m_x2)/2;
-        int y3 = (m_y1 + m_y2)/2;
-        eval.stream() << m_canvas << " create text " << x3 << "p " << y3 << "p -text " << m_value << " -fill white";
-        eval.flush(interp, m_id.m_text);
+        m_fg.setCoords(interp, m_x1, m_y1, x3, m_y2);
+        std::stringstream text;
+        text << value;
+        m_text.setText(interp, text.str());
     }
 };
 
 class SwPartState
 {
-    const char *m_canvas;
     Range *m_range;
     int m_num;
     int m_num1;
     int m_num2;
-    struct {
-        int m_num;
-        int m_channel;
-        int m_preset;
-        int m_name;
-    } m_id;
+    CanvasItem m_numText;
+    CanvasItem m_channel;
+    CanvasItem m_preset;
+    CanvasItem m_name;
     SwPart *swPart() const;
     Fantom::Part *hwPart() const;
 public:
     SwPartState(Tcl_Interp *interp, const char *canvas, int num, int num1, int num2);
-    void update(Tcl_Interp *interp);
+    void update(Tcl_Interp *interp, int num1, int num2);
     void clear(Tcl_Interp *interp);
 };
 
 class HwPartState
 {
-    const char *m_canvas;
     Bar *m_volumeBar;
     int m_num;
-    struct {
-        int m_num;
-        int m_channel;
-        int m_preset;
-        int m_name;
-    } m_id;
+    CanvasItem m_numText;
+    CanvasItem m_channel;
+    CanvasItem m_preset;
+    CanvasItem m_name;
     Fantom::Part *hwPart() const;
 public:
     HwPartState(Tcl_Interp *interp, const char *canvas, int num);
@@ -265,6 +430,11 @@ class TkClientState
 public:
     TrackList m_trackList;
     SetList m_setList;
+    Fantom::Cache m_fantomCache;
+    SharedConfig m_sharedConfig;
+    Fantom::PerformanceList m_performanceList;
+    SharedLiveState m_liveState;
+    LiveShm::State m_live;
     Event m_event;
     int m_currentTrack;
     int m_currentSection;
@@ -279,6 +449,7 @@ public:
     }
     void init()
     {
+        m_live.clear();
         m_currentTrack = -1;
         m_currentSection = -1;
         m_bannerState = 0;
@@ -301,6 +472,13 @@ void BannerState::update(Tcl_Interp *interp)
 
 Fantom::Part *HwPartState::hwPart() const
 {
+    // stand-in while the core is still downloading this performance
+    static Fantom::Part pendingPart;
+    if (!tkClientState.currentTrack()->m_performance)
+    {
+        strcpy(pendingPart.m_preset, "pending");
+        return &pendingPart;
+    }
     return &tkClientState.currentTrack()->m_performance->m_partList[m_num];
 }
 
@@ -315,99 +493,80 @@ Fantom::Part *SwPartState::hwPart() const
 }
 
 SwPartState::SwPartState(Tcl_Interp *interp, const char *canvas, int num, int num1, int num2):
-            m_canvas(canvas), m_range(0), m_num(num), m_num1(num1), m_num2(num2)
+            m_range(0), m_num(num), m_num1(num1), m_num2(num2)
 {
     int row = (m_num % 4) * 30 + 30;
     int col = (m_num / 4) * 380 + 30;
-    TclEval eval;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text " << (1+m_num);
-    eval.flush(interp, m_id.m_num);
+    std::stringstream text;
+    text << (1+m_num);
+    m_numText.createText(interp, canvas, col, row, text.str(), "");
     col += 30;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text " << (1+swPart()->m_channel);
-    eval.flush(interp, m_id.m_channel);
+    text.str(std::string());
+    text << (1+swPart()->m_channel);
+    m_channel.createText(interp, canvas, col, row, text.str(), "");
     col += 40;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" << hwPart()->m_preset << "}";
-    eval.flush(interp, m_id.m_preset);
+    m_preset.createText(interp, canvas, col, row, hwPart()->m_preset, "");
     col += 60;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" << hwPart()->m_patch.m_name << "} -anchor w";
-    eval.flush(interp, m_id.m_name);
+    m_name.createText(interp, canvas, col, row, hwPart()->m_patch.m_name, "-anchor w");
     col += 90;
     m_range = new Range(interp, canvas, col, row-5, col+100, row+5, swPart()->m_rangeLower, swPart()->m_rangeUpper);
 }
 
-HwPartState::HwPartState(Tcl_Interp *interp, const char *canvas, int num): m_canvas(canvas), m_volumeBar(0),
+HwPartState::HwPartState(Tcl_Interp *interp, const char *canvas, int num): m_volumeBar(0),
     m_num(num)
 {
     int row = (m_num % 8) * 30 + 15;
     int col = (m_num / 8) * 380 + 30;
-    TclEval eval;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text " << (1+m_num);
-    eval.flush(interp, m_id.m_num);
+    std::stringstream text;
+    text << (1+m_num);
+    m_numText.createText(interp, canvas, col, row, text.str(), "");
     col += 30;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text " << (1+hwPart()->m_channel);
-    eval.flush(interp, m_id.m_channel);
+    text.str(std::string());
+    text << (1+hwPart()->m_channel);
+    m_channel.createText(interp, canvas, col, row, text.str(), "");
     col += 40;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" << hwPart()->m_preset << "}";
-    eval.flush(interp, m_id.m_preset);
+    m_preset.createText(interp, canvas, col, row, hwPart()->m_preset, "");
     col += 60;
-    eval.stream() << m_canvas << " create text " << col << "p " << row << "p -text {" << hwPart()->m_patch.m_name << "} -anchor w";
-    eval.flush(interp, m_id.m_name);
+    m_name.createText(interp, canvas, col, row, hwPart()->m_patch.m_name, "-anchor w");
     col += 90;
     m_volumeBar = new Bar(interp,  canvas, col, row-5, col+100, row+5, hwPart()->m_volume, 127);
 }
 
-void SwPartState::update(Tcl_Interp *interp)
+//! \brief Show \a SwPart num1 of the current section, on its Fantom part num2.
+void SwPartState::update(Tcl_Interp *interp, int num1, int num2)
 {
-    TclEval eval;
-    eval.stream() << m_canvas << " insert " << m_id.m_num << " end " << (1+m_num);
-    eval.flush(interp);
-    eval.stream() << m_canvas << " insert " << m_id.m_channel << " end {" << (int)(1+hwPart()->m_channel) << "}";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " insert " << m_id.m_preset << " end {" << hwPart()->m_preset << "}";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " insert " << m_id.m_name << " end {" << hwPart()->m_patch.m_name << "}";
-    eval.flush(interp);
-    int row = (m_num % 8) * 30 + 30;
-    int col = (m_num / 8) * 380 + 30 + 30 +40 +60 +90;
-    m_range = new Range(interp, m_canvas, col, row-5, col+100, row+5, swPart()->m_rangeLower, swPart()->m_rangeUpper);
+    m_num1 = num1;
+    m_num2 = num2;
+    std::stringstream text;
+    text << (int)(1+hwPart()->m_channel);
+    m_channel.setText(interp, text.str());
+    m_preset.setText(interp, hwPart()->m_preset);
+    m_name.setText(interp, hwPart()->m_patch.m_name);
+    m_range->update(interp, swPart()->m_rangeLower, swPart()->m_rangeUpper);
+    m_numText.setHidden(interp, false);
+    m_channel.setHidden(interp, false);
+    m_preset.setHidden(interp, false);
+    m_name.setHidden(interp, false);
+    m_range->setHidden(interp, false);
 }
 
+//! \brief Hide the part, it is not used in the current section.
 void SwPartState::clear(Tcl_Interp *interp)
 {
-    TclEval eval;
-    eval.stream() << m_canvas << " dchars " << m_id.m_channel << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " dchars " << m_id.m_num << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " dchars " << m_id.m_channel << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " dchars " << m_id.m_preset << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " dchars " << m_id.m_name << " 0 end";
-    eval.flush(interp);
-    if (m_range)
-    {
-        m_range->clear(interp);
-        delete m_range;
-    }
-    m_range = 0;
+    m_numText.setHidden(interp, true);
+    m_channel.setHidden(interp, true);
+    m_preset.setHidden(interp, true);
+    m_name.setHidden(interp, true);
+    m_range->setHidden(interp, true);
 }
 
 void HwPartState::update(Tcl_Interp *interp)
 {
-    TclEval eval;
-    eval.stream() << m_canvas << " dchars " << m_id.m_channel << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " insert " << m_id.m_channel << " end " << (int)(1+hwPart()->m_channel) << "";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " dchars " << m_id.m_preset << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " insert " << m_id.m_preset << " end {" << hwPart()->m_preset << "}";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " dchars " << m_id.m_name << " 0 end";
-    eval.flush(interp);
-    eval.stream() << m_canvas << " insert " << m_id.m_name << " end {" << hwPart()->m_patch.m_name << "}";
-    eval.flush(interp);
+    std::stringstream text;
+    text << (int)(1+hwPart()->m_channel);
+    m_channel.setText(interp, text.str());
+    m_preset.setText(interp, hwPart()->m_preset);
+    m_name.setText(interp, hwPart()->m_patch.m_name);
     m_volumeBar->update(interp, hwPart()->m_volume);
 }
 
@@ -422,7 +581,56 @@ int getSet(Tcl_Interp *interp)
     return TCL_OK;
 }
 
-int processSectionChange(Tcl_Interp *interp, uint8_t newSection)
+void loadTracks()
+{
+    tkClientState.m_trackList.release();
+    tkClientState.m_setList = SetList();
+    if (!TrackImage::load(TRACK_IMAGE, TRACK_DEF, tkClientState.m_trackList,
+                        tkClientState.m_setList))
+    {
+        XML xml;
+        xml.importTracks(TRACK_DEF, tkClientState.m_trackList,
+                            tkClientState.m_setList);
+    }
+}
+
+void loadPerformances()
+{
+    Fantom::PerformanceList performanceList;
+    if (!tkClientState.m_fantomCache.load(FANTOM_CACHE, performanceList))
+    {
+        XML xml;
+        xml.importPerformances(FANTOM_CACHE_XML, performanceList);
+    }
+    TrackList::iterator track = tkClientState.m_trackList.begin();
+    Fantom::PerformanceList::iterator performance =
+                performanceList.begin();
+    for (; performance != performanceList.end() && track != tkClientState.m_trackList.end();
+            ++performance, ++track)
+    {
+        (*track)->merge((*performance)->m_loaded ? *performance : 0);
+    }
+}
+
+/*! \brief Load the configuration published by the core.
+ *
+ * The image and cache files are only read if no core has published yet.
+ */
+void loadConfig()
+{
+    if (tkClientState.m_sharedConfig.load(tkClientState.m_trackList, tkClientState.m_setList,
+                        tkClientState.m_performanceList))
+    {
+        tkClientState.m_fantomCache.release();
+    }
+    else
+    {
+        loadTracks();
+        loadPerformances();
+    }
+}
+
+int processSectionChange(Tcl_Interp *interp, int newSection)
 {
     tkClientState.m_currentSection = newSection;
     int num = 0;
@@ -444,14 +652,14 @@ int processSectionChange(Tcl_Interp *interp, uint8_t newSection)
                 tkClientState.m_swPartState[num] = new SwPartState(interp, ".c", num, num1, num2);
             else
             {
-                tkClientState.m_swPartState[num]->update(interp);
+                tkClientState.m_swPartState[num]->update(interp, num1, num2);
             }
         }
     }
     return TCL_OK;
 }
 
-int processTrackChange(Tcl_Interp *interp, uint8_t newTrack)
+int processTrackChange(Tcl_Interp *interp, int newTrack)
 {
     tkClientState.m_currentTrack = newTrack;
     for (int i=0; i<16; i++)
@@ -466,46 +674,53 @@ int processTrackChange(Tcl_Interp *interp, uint8_t newTrack)
     return TCL_OK;
 }
 
-int processEvent(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+/*! \brief Apply \a tkClientState.m_event and the live state of the core to the canvases.
+ *
+ * \param[in]  interp  The interpreter.
+ * \return     TCL_OK or TCL_ERROR.
+ */
+int handleEvent(Tcl_Interp *interp)
 {
-    (void)cdata;
-    (void)objc;
-    unsigned int scans[11];
-    int rv = sscanf(Tcl_GetStringFromObj(objv[1], 0),
-                    "%x %x %x %x %x %x %x %x %x %x %x",
-                    scans+0, scans+1, scans+2, scans+3,
-                    scans+4, scans+5, scans+6, scans+7,
-                    scans+8, scans+9, scans+10);
-    if (rv != 11)
-    {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("processEvent: cannot parse event", -1));
-        return TCL_ERROR;
-    }
-    tkClientState.m_event.m_packetCounter = scans[0];
-    tkClientState.m_event.m_metaMode = scans[1];
-    tkClientState.m_event.m_currentTrack = scans[2];
-    tkClientState.m_event.m_currentSection = scans[3];
-    tkClientState.m_event.m_trackIdxWithinSet = scans[4];
-    tkClientState.m_event.m_type = scans[5];
-    tkClientState.m_event.m_deviceId = scans[6];
-    tkClientState.m_event.m_part = scans[7];
-    tkClientState.m_event.m_midi[0] = scans[8];
-    tkClientState.m_event.m_midi[1] = scans[9];
-    tkClientState.m_event.m_midi[2] = scans[10];
+    int rv;
     try
     {
         bool forceSectionChange = false;
-        if (tkClientState.m_event.m_currentTrack != tkClientState.m_currentTrack)
+        // the core publishes before it sends the event that refers to it
+        bool forceTrackChange = tkClientState.m_sharedConfig.changed();
+        if (forceTrackChange)
+        {
+            loadConfig();
+        }
+        else if (tkClientState.m_event.m_type == Event::TracksReloaded ||
+                 tkClientState.m_event.m_type == Event::FantomSync)
+        {
+            // nothing published, the core has rewritten the files
+            loadConfig();
+            forceTrackChange = true;
+        }
+        // the position is not in the events, it is read in one go
+        const LiveShm::State &live = tkClientState.m_live;
+        if (!tkClientState.m_liveState.read(tkClientState.m_live))
+            return TCL_OK;
+        if (live.m_currentTrack >= tkClientState.m_trackList.size() ||
+            live.m_currentSection >= tkClientState.m_trackList[
+                live.m_currentTrack]->m_sectionList.size())
+        {
+            // does not fit the loaded tracks
+            return TCL_OK;
+        }
+        if (forceTrackChange ||
+            live.m_currentTrack != tkClientState.m_currentTrack)
         {
-            rv = processTrackChange(interp, tkClientState.m_event.m_currentTrack);
+            rv = processTrackChange(interp, live.m_currentTrack);
             if (rv != TCL_OK)
                 return rv;
             forceSectionChange = true;
         }
         if (forceSectionChange || 
-            tkClientState.m_event.m_currentSection != tkClientState.m_currentSection)
+            live.m_currentSection != tkClientState.m_currentSection)
         {
-            rv = processSectionChange(interp, tkClientState.m_event.m_currentSection);
+            rv = processSectionChange(interp, live.m_currentSection);
             if (rv != TCL_OK)
                 return rv;
         }
@@ -517,25 +732,139 @@ int processEvent(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const
     return TCL_OK;
 }
 
+int processEvent(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    (void)cdata;
+    (void)objc;
+    unsigned int scans[7];
+    int rv = sscanf(Tcl_GetStringFromObj(objv[1], 0),
+                    "%x %x %x %x %x %x %x",
+                    scans+0, scans+1, scans+2, scans+3,
+                    scans+4, scans+5, scans+6);
+    if (rv != 7)
+    {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("processEvent: cannot parse event", -1));
+        return TCL_ERROR;
+    }
+    tkClientState.m_event.m_packetCounter = scans[0];
+    tkClientState.m_event.m_type = scans[1];
+    tkClientState.m_event.m_deviceId = scans[2];
+    tkClientState.m_event.m_part = scans[3];
+    tkClientState.m_event.m_midi[0] = scans[4];
+    tkClientState.m_event.m_midi[1] = scans[5];
+    tkClientState.m_event.m_midi[2] = scans[6];
+    return handleEvent(interp);
+}
+
+namespace
+{
+/*! \brief Reads the core events straight from the event queue.
+ *
+ * The queue descriptor is registered as a Tcl file handler. When it is
+ * readable, all pending events are received as binary records, their
+ * fields and the position of the core are stored in the variables of
+ * the State namespace, the canvases are updated, and the callback script
+ * is run once per event.
+ */
+struct EventSource
+{
+    Queue m_queue;                  //!< Event queue of the core.
+    bool m_open;                    //!< The queue is open and watched.
+    Tcl_Obj *m_callback;            //!< Script run after each event, 0 if none.
+    Tcl_Obj *m_fieldName[11];       //!< Variable names of the event fields.
+} eventSource;
+
+//! \brief Store the fields of \a tkClientState.m_event and the live state in the State variables.
+void setEventVariables(Tcl_Interp *interp)
+{
+    const Event &event = tkClientState.m_event;
+    const LiveShm::State &live = tkClientState.m_live;
+    int field[11] = {
+        event.m_packetCounter, live.m_metaMode,
+        live.m_currentTrack, live.m_currentSection,
+        live.m_trackIdxWithinSet, event.m_type,
+        event.m_deviceId, event.m_part,
+        event.m_midi[0], event.m_midi[1], event.m_midi[2] };
+    for (int i=0; i<11; i++)
+        Tcl_ObjSetVar2(interp, eventSource.m_fieldName[i], 0,
+            Tcl_NewIntObj(field[i]), TCL_GLOBAL_ONLY);
+}
+
+//! \brief File handler, the event queue is readable.
+void readEvents(ClientData cdata, int mask)
+{
+    (void)mask;
+    Tcl_Interp *interp = (Tcl_Interp *)cdata;
+    while (eventSource.m_queue.tryReceive(tkClientState.m_event))
+    {
+        int rv = handleEvent(interp);
+        setEventVariables(interp);
+        if (rv == TCL_OK && eventSource.m_callback)
+            rv = Tcl_EvalObjEx(interp, eventSource.m_callback, TCL_EVAL_GLOBAL);
+        if (rv != TCL_OK)
+            Tcl_BackgroundError(interp);
+    }
+}
+}
+
+/*! \brief Tcl command "patcherEvents ?script?", receive the core events.
+ *
+ * Opens the event queue and watches it. After each event the State
+ * variables packetCount, type, deviceId, part, midi1, midi2 and midi3
+ * hold its fields, metaMode, currentTrack, currentSection and
+ * trackIdxWithinSet hold the live state of the core, and the optional
+ * script is run.
+ */
+int patcherEvents(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    (void)cdata;
+    if (objc > 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, objv, "?script?");
+        return TCL_ERROR;
+    }
+    if (eventSource.m_callback)
+        Tcl_DecrRefCount(eventSource.m_callback);
+    eventSource.m_callback = 0;
+    if (objc == 2)
+    {
+        eventSource.m_callback = objv[1];
+        Tcl_IncrRefCount(eventSource.m_callback);
+    }
+    if (eventSource.m_open)
+        return TCL_OK;
+    static const char *names[11] = {
+        "::State::packetCount", "::State::metaMode",
+        "::State::currentTrack", "::State::currentSection",
+        "::State::trackIdxWithinSet", "::State::type",
+        "::State::deviceId", "::State::part",
+        "::State::midi1", "::State::midi2", "::State::midi3" };
+    try
+    {
+        eventSource.m_queue.openRead();
+    }
+    catch (Error &e)
+    {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(e.what(), -1));
+        return TCL_ERROR;
+    }
+    for (int i=0; i<11; i++)
+    {
+        eventSource.m_fieldName[i] = Tcl_NewStringObj(names[i], -1);
+        Tcl_IncrRefCount(eventSource.m_fieldName[i]);
+    }
+    Tcl_CreateFileHandler(eventSource.m_queue.descriptor(), TCL_READABLE, readEvents, interp);
+    eventSource.m_open = true;
+    return TCL_OK;
+}
+
 int loadXml(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
     (void)cdata;
     (void)interp;
     (void)objc;
     (void)objv;
-    XML xml;
-    xml.importTracks(TRACK_DEF, tkClientState.m_trackList,
-                        tkClientState.m_setList);
-    Fantom::PerformanceList performanceList;
-    xml.importPerformances("fantom_cache.xml", performanceList);
-    TrackList::iterator track = tkClientState.m_trackList.begin();
-    Fantom::PerformanceList::iterator performance =
-                performanceList.begin();
-    for (; performance != performanceList.end();
-            ++performance, ++track)
-    {
-        (*track)->merge(*performance);
-    }
+    loadConfig();
     return TCL_OK;
 }
 
@@ -551,8 +880,10 @@ int Patcher_Init(Tcl_Interp *interp)
         return TCL_ERROR;
     }
     tkClientState.init();
+    CanvasItem::init();
     Tcl_CreateObjCommand(interp, "loadxml", loadXml, NULL, NULL);
     Tcl_CreateObjCommand(interp, "processEvent", processEvent, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "patcherEvents", patcherEvents, NULL, NULL);
     return TCL_OK;
 }
 } // extern "C"
@@ -65,3 +65,17 @@ void Toggler::reset()
     for (int i=0; i<128; i++)
         m_noteStatus[i] = Off;
 }
+
+//! \brief Copy the note status.
+void Toggler::getState(State &state) const
+{
+    for (int i=0; i<Midi::Note::max; i++)
+        state.m_noteStatus[i] = (uint8_t)m_noteStatus[i];
+}
+
+//! \brief Restore the note status, unknown values count as off.
+void Toggler::setState(const State &state)
+{
+    for (int i=0; i<Midi::Note::max; i++)
+        m_noteStatus[i] = state.m_noteStatus[i] < Off ? (NoteStatus)state.m_noteStatus[i] : Off;
+}
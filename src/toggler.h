@@ -16,6 +16,11 @@ class Toggler
     bool m_enabled;     //!< Enabled flag.
     NoteStatus m_noteStatus[Midi::Note::max];   //!< Status of every single note.
 public:
+    //! \brief A copy of the note status, to survive a restart of the core.
+    struct State
+    {
+        uint8_t m_noteStatus[Midi::Note::max];  //!< Status of every single note.
+    };
     //! \brief Return true if enabled.
     bool enabled() const { return m_enabled; }
     Toggler();
@@ -25,5 +30,11 @@ public:
     bool pass(uint8_t midiStatus, uint8_t data1, uint8_t data2);
     //! \brief Reset the Toggler.
     void reset();
+    void getState(State &state) const;
+    void setState(const State &state);
+    //! \brief True if a note sounds after its key was released.
+    bool latched(uint8_t note) const { return m_noteStatus[note & 127] == Hanging; }
+    //! \brief Forget a note, after it has been released by other means.
+    void release(uint8_t note) { m_noteStatus[note & 127] = Off; }
 };
 #endif
@@ -10,9 +10,14 @@
 #include "fantomdriver.h"
 #include "error.h"
 
-//! \brief Construct a default Section with a given name.
-Section::Section(const char *name):
-        m_name(name), m_noteOffEnter(true), m_noteOffLeave(true),
+/*! \brief Construct a default Section with a given name.
+ *
+ * \param[in] arena     Arena the section is created in.
+ * \param[in] name      Name, it is interned in \a arena.
+ */
+Section::Section(Arena &arena, const char *name):
+        m_name(arena.intern(name)), m_noteOffEnter(true), m_noteOffLeave(true),
+        m_partList(arena),
         m_nextTrack(TrackDef::Unspecified),
         m_nextSection(TrackDef::Unspecified),
         m_previousTrack(TrackDef::Unspecified),
@@ -20,28 +25,18 @@ Section::Section(const char *name):
 {
 }
 
-//! \brief Destructor.
-Section::~Section()
-{
-    clear();
-}
-
-//! \brief Clean up memory used by this \a Section.
-void Section::clear()
-{
-    for (SwPartList::iterator i = m_partList.begin(); i != m_partList.end(); ++i)
-        delete *i;
-    m_partList.clear();
-    free((void*)m_name);
-    m_name = 0;
-}
-
-//! \brief Contruct a default SwPart with a given name.
-SwPart::SwPart(int number, const char *name):
+/*! \brief Contruct a default SwPart with a given name.
+ *
+ * \param[in] arena     Arena the part is created in.
+ * \param[in] number    Sequence number within the section.
+ * \param[in] name      Name, it is interned in \a arena.
+ */
+SwPart::SwPart(Arena &arena, int number, const char *name):
         m_number(number),
-        m_name(name), m_channel(255), m_transpose(0),
+        m_name(arena.intern(name)), m_channel(255), m_transpose(0),
         m_customTransposeEnabled(false),
         m_rangeLower(0), m_rangeUpper(127),
+        m_hwPartList(arena),
         m_controllerRemap(0),
         m_mono(false),
         m_transposer(0)
@@ -49,40 +44,54 @@ SwPart::SwPart(int number, const char *name):
     memset(&m_customTranspose, 0, sizeof m_customTranspose);
 }
 
-//! \brief Destructor.
-SwPart::~SwPart()
-{
-    clear();
-}
-
-//! \brief Clean up memory used by this \a SwPart..
-void SwPart::clear()
-{
-    if (m_controllerRemap)
-        delete m_controllerRemap;
-    m_controllerRemap = 0;
-    delete m_transposer;
-    m_transposer = 0;
-    free((void*)m_name);
-    m_name = 0;
-}
-
-//! \brief Construct a default Track with a given name.
-Track::Track(const char *name): m_name(name), m_chain(false), m_startSection(0), m_performance(0)
-{
-}
-
-//! \brief Destructor.
-Track::~Track()
+/*! \brief Construct a default Track with a given name.
+ *
+ * \param[in] arena     Arena the track is created in.
+ * \param[in] name      Name, it is interned in \a arena.
+ */
+Track::Track(Arena &arena, const char *name):
+    m_name(arena.intern(name)), m_sectionList(arena), m_chain(false), m_startSection(0), m_performance(0)
 {
-    clear();
+    for (int hp = 0; hp < Fantom::Performance::NofParts; hp++)
+        m_swPartList[hp].setArena(arena);
 }
 
 /*! \brief Merge performance data.
+ *
+ * Links from a previous merge are dropped first, so this can be called
+ * again when fresh performance data arrives. The link lists are sized
+ * exactly before they are filled, and reused by later merges, so the
+ * \a Arena only grows if the channels have changed.
+ *
+ * \param[in] performance   Performance data, or 0 if it is still pending.
  */
 void Track::merge(Fantom::Performance *performance)
 {
     m_performance = performance;
+    size_t nofLinks[Fantom::Performance::NofParts];
+    for (int hp = 0; hp < Fantom::Performance::NofParts; hp++)
+    {
+        m_swPartList[hp].clear();
+        nofLinks[hp] = 0;
+    }
+    if (m_performance)
+    {
+        for (SectionList::const_iterator section = m_sectionList.begin();
+                section != m_sectionList.end(); ++section)
+        {
+            for (SwPartList::const_iterator sp = (*section)->m_partList.begin();
+                    sp != (*section)->m_partList.end(); ++sp)
+            {
+                for (int hp = 0; hp < Fantom::Performance::NofParts; hp++)
+                {
+                    if ((*sp)->m_channel == m_performance->m_partList[hp].m_channel)
+                        nofLinks[hp]++;
+                }
+            }
+        }
+        for (int hp = 0; hp < Fantom::Performance::NofParts; hp++)
+            m_swPartList[hp].reserve(nofLinks[hp]);
+    }
     // FOREACH section
     for (SectionList::const_iterator section = m_sectionList.begin();
             section != m_sectionList.end(); ++section)
@@ -92,6 +101,16 @@ void Track::merge(Fantom::Performance *performance)
                 sp != (*section)->m_partList.end(); ++sp)
         {
             SwPart *swPart = (*sp);
+            swPart->m_hwPartList.clear();
+            if (!m_performance)
+                continue;
+            size_t nofHwParts = 0;
+            for (int hp = 0; hp < Fantom::Performance::NofParts; hp++)
+            {
+                if (swPart->m_channel == m_performance->m_partList[hp].m_channel)
+                    nofHwParts++;
+            }
+            swPart->m_hwPartList.reserve(nofHwParts);
             // FOREACH hardware part
             for (int hp = 0; hp < Fantom::Performance::NofParts; hp++)
             {
@@ -100,23 +119,13 @@ void Track::merge(Fantom::Performance *performance)
                 if (swPart->m_channel == hwPart->m_channel)
                 {
                     swPart->m_hwPartList.push_back(hwPart);
-                    hwPart->m_swPartList.push_back(swPart);
+                    m_swPartList[hp].push_back(swPart);
                 }
             }
         }
     }
 }
 
-//! \brief Clean up memory used by this \a Track.
-void Track::clear()
-{
-    for (SectionList::iterator i = m_sectionList.begin(); i != m_sectionList.end(); ++i)
-        delete *i;
-    m_sectionList.clear();
-    free((void*)m_name);
-    m_name = 0;
-}
-
 void SetList::add(TrackList &trackList, const char *trackName)
 {
     int addIdx = TrackDef::Unspecified;
@@ -227,13 +236,3 @@ void fixChain(TrackList &trackList)
         } // FOREACH section
     } // FOREACH track
 }
-
-/*! \brief Clean up a track list.
- *
- * Not really needed, only for memory leak checks.
- */
-void clear(TrackList &trackList)
-{
-    for (TrackList::iterator i = trackList.begin(); i != trackList.end(); ++i)
-        delete *i;
-}
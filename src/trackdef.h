@@ -6,6 +6,7 @@
 #ifndef TRACKDEF_H
 #define TRACKDEF_H
 #include <vector>
+#include <algorithm>
 #include <stdint.h>
 #include "patchercore.h"
 #include "monofilter.h"
@@ -13,16 +14,14 @@
 #include "controller.h"
 #include "toggler.h"
 #include "screen.h"
+#include "fantomdef.h"
+#include "arena.h"
 
 #ifdef FAKE_STL // set in PREDEFINED in doxygen config
 namespace std { /*! \brief STL vector */ template <class T> class vector {
         public T entry[2]; /*!< Entry. */ }; }
 #endif
 
-namespace Fantom {
-    class Part;
-    class Performance;
-}
 //! \brief Contains some placeholder chaining constants, which are replaced by actual indexes after the TrackList is complete.
 namespace TrackDef {
     //! \brief Placeholder constants.
@@ -38,11 +37,12 @@ namespace TrackDef {
 /*! \brief Contains all the parameters needed to manipulate events on a single MIDI channel.
  *
  * This is the counterpart of \a Fantom::Part, although a single SwPart may trigger more than one \a Fantom::Part. By convention there should be a single Fantom::Part on each channel.
+ * It lives in the \a Arena of its \a TrackList, like its transposer and controller remap.
  */
 class SwPart {
 public:
     int m_number;                       //!< Sequence number within Section.
-    const char *m_name;                 //!< The name of the part. Ownership of the string is assumed.
+    const char *m_name;                 //!< The name of the part, interned in the \a Arena.
     uint8_t m_channel;                  //!< MIDI channel to listen and send on.
     int m_transpose;                    //!< Tranposition in semitones.
     bool m_customTransposeEnabled;      //!< Enable switch for custom (per-note) transposition.
@@ -50,7 +50,7 @@ public:
     int m_customTransposeOffset;        //!< Additional transposition for custom transposes.
     uint8_t m_rangeLower;               //!< Lower range.
     uint8_t m_rangeUpper;               //!< Upper range.
-    std::vector <Fantom::Part *> m_hwPartList;   //!< List of \a Fantom::Part pointers this will trigger.
+    ArenaList<Fantom::Part *> m_hwPartList;     //!< List of \a Fantom::Part pointers this will trigger.
     ControllerRemap::Default *m_controllerRemap; //!< Remap object. \todo allow more than one.
     MonoFilter m_monoFilter;            //!< Mono filter object.
     Toggler m_toggler;                  //!< Toggler object.
@@ -59,13 +59,17 @@ public:
     //! \brief Return true if a note number is in range of this \a SwPart.
     bool inRange(uint8_t noteNum) const
         { return noteNum >= m_rangeLower && noteNum <= m_rangeUpper; }
-    SwPart(int number, const char *name);
-    ~SwPart();
-    void clear();
+    SwPart(Arena &arena, int number, const char *name);
 };
 
-//! \brief A list of \a Section object pointers.
-typedef std::vector<SwPart *> SwPartList;
+/*! \brief A list of \a SwPart object pointers.
+ *
+ * The list and its parts are in the \a Arena, and \a TrackImage::read()
+ * lays them out next to their \a Section. An index into the arena would
+ * need the same two loads per part on the note path, so the links stay
+ * pointers, which keeps the m_partList[i]-> interface of the clients.
+ */
+typedef ArenaList<SwPart *> SwPartList;
 
 /*! \brief A single keyboard layout.
  *
@@ -74,7 +78,7 @@ typedef std::vector<SwPart *> SwPartList;
  */
 class Section {
 public:
-    const char *m_name;             //!< The name of the section. Ownership of the string is assumed.
+    const char *m_name;             //!< The name of the section, interned in the \a Arena.
     bool m_noteOffEnter;            //!< Force 'note off' events when switching to this section.
     bool m_noteOffLeave;            //!< Force 'note off' events when switching away from this section.
     SwPartList m_partList;          //!< List of \a SwPart objects.
@@ -82,26 +86,23 @@ public:
     int m_nextSection;              //!< Chaining info: next \a Section.
     int m_previousTrack;            //!< Chaining info: previous \a Track.
     int m_previousSection;          //!< Chaining info: previous \a Section.
-    Section(const char *name);
-    ~Section();
-    void clear();
+    Section(Arena &arena, const char *name);
 };
 
-//! \brief A list of \a Section object pointers.
-typedef std::vector<Section *> SectionList;
+//! \brief A list of \a Section object pointers into the \a Arena, like \a SwPartList.
+typedef ArenaList<Section *> SectionList;
 
 /*! \brief The equivalent of a \a FantomPerformance.
  */
 class Track {
 public:
-    const char *m_name;             //!< Name of this track. Ownership of the string is assumed.
+    const char *m_name;             //!< Name of this track, interned in the \a Arena.
     SectionList m_sectionList;      //!< Section list.
     bool m_chain;                   //!< Chain mode switch. If enabled, FCB1010 program changes are interpreted as 'next' and 'previous' events.
     int m_startSection;             //!< Section index to switch to when this track starts.
-    Fantom::Performance *m_performance; //!< Fantom performance for this Track.
-    Track(const char *name);
-    ~Track();
-    void clear();
+    Fantom::Performance *m_performance; //!< Fantom performance for this Track, 0 while pending.
+    ArenaList<const SwPart *> m_swPartList[Fantom::Performance::NofParts]; //!< For each Fantom part, the list of \a SwPart pointers which point there.
+    Track(Arena &arena, const char *name);
     //! \brief Add \a Section.
     void addSection(Section *s) { m_sectionList.push_back(s); }
     //! \brief The number of sections in this Track.
@@ -109,7 +110,34 @@ public:
     void merge(Fantom::Performance *performance);
 };
 
-typedef std::vector<Track*> TrackList;  //!< A list of \a Track object pointers.
+/*! \brief A list of \a Track object pointers, and the \a Arena they live in.
+ *
+ * All tracks, sections, parts and their names are created in \a arena(),
+ * in the order they are read, so the parts of a section are next to each
+ * other in memory. The section and part lists hold pointers into the
+ * arena. Only the chaining links of a section, to the next and previous
+ * track and section, are indexes.
+ * The whole lot is released at once by \a release().
+ */
+class TrackList: public std::vector<Track*>
+{
+    Arena *m_arena;                         //!< Arena that holds the tracks, the part lists point to it.
+    TrackList(const TrackList &);           //!< Not copyable.
+    TrackList &operator=(const TrackList &);    //!< Not assignable.
+public:
+    //! \brief Construct an empty list.
+    TrackList(): m_arena(new Arena) { }
+    //! \brief Destructor, releases all tracks.
+    ~TrackList() { delete m_arena; }
+    //! \brief The \a Arena to create tracks, sections, parts and names in.
+    Arena &arena() { return *m_arena; }
+    //! \brief Exchange two lists, the arenas go with their tracks.
+    void swap(TrackList &other) { std::vector<Track*>::swap(other); std::swap(m_arena, other.m_arena); }
+    //! \brief Remove all tracks, and release them at once.
+    void release() { std::vector<Track*>::clear(); m_arena->release(); }
+private:
+    using std::vector<Track*>::clear;      //!< Would keep the tracks in the arena, use \a release().
+};
 
 /*! \brief This object contains a list of integers that indicate indexes in
  * a \a TrackList.
@@ -120,7 +148,7 @@ public:
     //! \brief Return the size ofthe \a SetList.
     int size() const { return (int)m_trackIndexList.size(); }
     //! \brief Return the track index of the i'th item in the \a SetList.
-    int operator[](int i) { return i>=0 && i<size() ? m_trackIndexList[i] : 0; }
+    int operator[](int i) const { return i>=0 && i<size() ? m_trackIndexList[i] : 0; }
     //! \brief Append a track index to the \a SetList.
     void add(int i) { m_trackIndexList.push_back(i); }
     //! \brief Append a track by name.
@@ -128,6 +156,5 @@ public:
 };
 
 void fixChain(TrackList &trackList);
-void clear(TrackList &trackList);
 
 #endif // TRACKDEF_H
@@ -0,0 +1,405 @@
+/*! \file trackimage.cpp
+ *  \brief Contains a precompiled binary image of the track definitions.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include "trackimage.h"
+#include "checksum.h"
+#include "error.h"
+
+using namespace TrackImageDef;
+
+namespace
+{
+const char magic[8] = { 'P', 'A', 'T', 'C', 'H', 'T', 'R', 'K' }; //!< Image file magic.
+
+//! \brief Collects the strings of an image, without duplicates.
+class StringTable
+{
+    std::string m_data;     //!< Concatenated zero-terminated strings.
+public:
+    //! \brief Add a string, and return its offset.
+    uint32_t add(const char *s)
+    {
+        if (!s)
+            s = "";
+        size_t len = strlen(s);
+        for (size_t pos = m_data.find(s, 0, len+1); pos != std::string::npos; pos = m_data.find(s, pos+1, len+1))
+        {
+            if (pos == 0 || m_data[pos-1] == 0)
+                return (uint32_t)pos;
+        }
+        uint32_t offset = (uint32_t)m_data.size();
+        m_data.append(s, len+1);
+        return offset;
+    }
+    //! \brief The table contents.
+    const std::string &data() const { return m_data; }
+};
+
+//! \brief Controller remap ID of a \a SwPart.
+uint8_t remapId(const ControllerRemap::Default *remap)
+{
+    if (!remap)
+        return NoRemap;
+    if (strcmp(remap->name(), "volQuadratic") == 0)
+        return VolQuadratic;
+    if (strcmp(remap->name(), "volReverse") == 0)
+        return VolReverse;
+    if (strcmp(remap->name(), "drop16") == 0)
+        return Drop16;
+    Error e;
+    e.stream() << "TrackImage: unknown controllerRemap " << remap->name();
+    throw(e);
+}
+
+//! \brief Create the controller remap object for an ID in an \a Arena.
+ControllerRemap::Default *createRemap(Arena &arena, uint8_t id)
+{
+    switch (id)
+    {
+        case VolQuadratic:
+            return new (arena) ControllerRemap::VolQuadratic;
+        case VolReverse:
+            return new (arena) ControllerRemap::VolReverse;
+        case Drop16:
+            return new (arena) ControllerRemap::Drop16;
+        default:
+            return 0;
+    }
+}
+
+//! \brief Append the bytes of a record array to an image.
+template <class T> void append(std::string &image, const std::vector<T> &records)
+{
+    if (!records.empty())
+        image.append((const char *)&records[0], records.size()*sizeof(T));
+}
+}
+
+//! \brief Clear the stamp, it matches no file then.
+void SourceStamp::clear()
+{
+    m_size = 0;
+    m_mtime = 0;
+    m_mtimeNsec = 0;
+}
+
+/*! \brief Take the stamp of a file.
+ *
+ * \param[in] fileName  The file.
+ * \return    False if the file cannot be found.
+ */
+bool SourceStamp::read(const char *fileName)
+{
+    struct stat statBuf;
+    if (stat(fileName, &statBuf) == -1)
+        return false;
+    m_size = (uint32_t)statBuf.st_size;
+    m_mtime = (uint32_t)statBuf.st_mtim.tv_sec;
+    m_mtimeNsec = (uint32_t)statBuf.st_mtim.tv_nsec;
+    return true;
+}
+
+/*! \brief Build a track image in memory.
+ *
+ * The chain placeholders must already be resolved by \a fixChain().
+ *
+ * \param[out]  image       The image, header included.
+ * \param[in]   source      Stamp of the XML file the tracks were read from, cleared if none.
+ * \param[in]   trackList   Tracks to store.
+ * \param[in]   setList     Setlist to store.
+ */
+void TrackImage::build(std::string &image, const SourceStamp &source,
+    const TrackList &trackList, const SetList &setList)
+{
+    StringTable strings;
+    std::vector<TrackImageDef::Track> tracks;
+    std::vector<TrackImageDef::Section> sections;
+    std::vector<TrackImageDef::Part> parts;
+    std::vector<int32_t> setListRecords;
+    for (TrackList::const_iterator t = trackList.begin(); t != trackList.end(); ++t)
+    {
+        TrackImageDef::Track track;
+        memset(&track, 0, sizeof(track));
+        track.m_name = strings.add((*t)->m_name);
+        track.m_startSection = (*t)->m_startSection;
+        track.m_chain = (*t)->m_chain ? 1 : 0;
+        track.m_firstSection = (uint32_t)sections.size();
+        track.m_nofSections = (uint32_t)(*t)->m_sectionList.size();
+        tracks.push_back(track);
+        for (SectionList::const_iterator s = (*t)->m_sectionList.begin(); s != (*t)->m_sectionList.end(); ++s)
+        {
+            TrackImageDef::Section section;
+            memset(&section, 0, sizeof(section));
+            section.m_name = strings.add((*s)->m_name);
+            section.m_noteOffEnter = (*s)->m_noteOffEnter ? 1 : 0;
+            section.m_noteOffLeave = (*s)->m_noteOffLeave ? 1 : 0;
+            section.m_nextTrack = (*s)->m_nextTrack;
+            section.m_nextSection = (*s)->m_nextSection;
+            section.m_previousTrack = (*s)->m_previousTrack;
+            section.m_previousSection = (*s)->m_previousSection;
+            section.m_firstPart = (uint32_t)parts.size();
+            section.m_nofParts = (uint32_t)(*s)->m_partList.size();
+            sections.push_back(section);
+            for (SwPartList::const_iterator p = (*s)->m_partList.begin(); p != (*s)->m_partList.end(); ++p)
+            {
+                const SwPart *swPart = *p;
+                TrackImageDef::Part part;
+                memset(&part, 0, sizeof(part));
+                part.m_name = strings.add(swPart->m_name);
+                part.m_channel = swPart->m_channel;
+                part.m_rangeLower = swPart->m_rangeLower;
+                part.m_rangeUpper = swPart->m_rangeUpper;
+                part.m_transpose = swPart->m_transpose;
+                if (swPart->m_toggler.enabled())
+                    part.m_flags |= Toggle;
+                if (swPart->m_mono)
+                    part.m_flags |= Mono;
+                if (swPart->m_customTransposeEnabled)
+                {
+                    part.m_flags |= CustomTranspose;
+                    part.m_customTransposeOffset = swPart->m_customTransposeOffset;
+                    for (int i=0; i<12; i++)
+                        part.m_customTranspose[i] = (int8_t)swPart->m_customTranspose[i];
+                }
+                if (swPart->m_transposer)
+                {
+                    part.m_flags |= SustainTranspose;
+                    part.m_sustainTranspose = swPart->m_transposer->m_transpose;
+                }
+                part.m_controllerRemap = remapId(swPart->m_controllerRemap);
+                parts.push_back(part);
+            }
+        }
+    }
+    for (int i=0; i<setList.size(); i++)
+        setListRecords.push_back(setList[i]);
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, magic, sizeof(magic));
+    header.m_version = Header::Version;
+    header.m_source = source;
+    std::string body;
+    header.m_nofTracks = (uint32_t)tracks.size();
+    header.m_trackOffset = (uint32_t)(sizeof(header) + body.size());
+    append(body, tracks);
+    header.m_nofSections = (uint32_t)sections.size();
+    header.m_sectionOffset = (uint32_t)(sizeof(header) + body.size());
+    append(body, sections);
+    header.m_nofParts = (uint32_t)parts.size();
+    header.m_partOffset = (uint32_t)(sizeof(header) + body.size());
+    append(body, parts);
+    header.m_setListLength = (uint32_t)setListRecords.size();
+    header.m_setListOffset = (uint32_t)(sizeof(header) + body.size());
+    append(body, setListRecords);
+    header.m_stringSize = (uint32_t)strings.data().size();
+    header.m_stringOffset = (uint32_t)(sizeof(header) + body.size());
+    body.append(strings.data());
+    header.m_size = (uint32_t)(sizeof(header) + body.size());
+    header.m_checksum = adler32(body.data(), body.size());
+    image.assign((const char *)&header, sizeof(header));
+    image.append(body);
+}
+
+/*! \brief Write a track image file.
+ *
+ * The file is written under a temporary name first and then renamed,
+ * so a reader never sees a half written image.
+ * The stamp must be taken before the XML file is parsed. If the file has
+ * changed since, the tracks may be those of the old content, and no image
+ * is written.
+ *
+ * \param[in]   imageFile   Image file name.
+ * \param[in]   sourceFile  XML file the tracks were read from.
+ * \param[in]   source      Stamp of \a sourceFile, taken before it was parsed.
+ * \param[in]   trackList   Tracks to store.
+ * \param[in]   setList     Setlist to store.
+ * \return      False if \a sourceFile has changed since \a source was taken.
+ */
+bool TrackImage::save(const char *imageFile, const char *sourceFile, const SourceStamp &source,
+    const TrackList &trackList, const SetList &setList)
+{
+    SourceStamp current;
+    if (!current.read(sourceFile) || current != source)
+        return false;
+    std::string image;
+    build(image, source, trackList, setList);
+    std::string tmpName = std::string(imageFile) + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if (!fp)
+    {
+        Error e;
+        e.stream() << "cannot create " << tmpName << ": " << strerror(errno);
+        throw(e);
+    }
+    bool ok = fwrite(image.data(), 1, image.size(), fp) == image.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmpName.c_str(), imageFile) == -1)
+    {
+        unlink(tmpName.c_str());
+        Error e;
+        e.stream() << "cannot write " << imageFile;
+        throw(e);
+    }
+    return true;
+}
+
+/*! \brief Read the tracks and setlist from a track image file.
+ *
+ * \param[in]   imageFile   Image file name.
+ * \param[in]   sourceFile  XML file the image should be compiled from.
+ * \param[out]  trackList   Tracks.
+ * \param[out]  setList     Setlist.
+ * \return      True if the image exists, is valid and is not older than \a sourceFile.
+ */
+bool TrackImage::load(const char *imageFile, const char *sourceFile,
+    TrackList &trackList, SetList &setList)
+{
+    SourceStamp source;
+    if (!source.read(sourceFile))
+        return false;
+    int fd = open(imageFile, O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) == -1 || statBuf.st_size < (off_t)sizeof(Header))
+    {
+        close(fd);
+        return false;
+    }
+    size_t mapSize = (size_t)statBuf.st_size;
+    void *map = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const Header *header = (const Header *)map;
+    bool valid = header->m_source == source
+        && read(map, mapSize, trackList, setList);
+    munmap(map, mapSize);
+    return valid;
+}
+
+/*! \brief Read the tracks and setlist from a track image in memory.
+ *
+ * \param[in]   image       Start of the image, aligned for its records.
+ * \param[in]   size        Size of the image.
+ * \param[out]  trackList   Tracks.
+ * \param[out]  setList     Setlist.
+ * \return      True if the image is valid.
+ */
+bool TrackImage::read(const void *image, size_t size,
+    TrackList &trackList, SetList &setList)
+{
+    if (size < sizeof(Header))
+        return false;
+    const size_t mapSize = size;
+    const char *base = (const char *)image;
+    const Header *header = (const Header *)image;
+    bool valid = memcmp(header->m_magic, magic, sizeof(magic)) == 0
+        && header->m_version == Header::Version
+        && header->m_size == mapSize
+        && header->m_checksum == adler32(base + sizeof(Header), mapSize - sizeof(Header))
+        && header->m_trackOffset + (uint64_t)header->m_nofTracks*sizeof(TrackImageDef::Track) <= mapSize
+        && header->m_sectionOffset + (uint64_t)header->m_nofSections*sizeof(TrackImageDef::Section) <= mapSize
+        && header->m_partOffset + (uint64_t)header->m_nofParts*sizeof(TrackImageDef::Part) <= mapSize
+        && header->m_setListOffset + (uint64_t)header->m_setListLength*sizeof(int32_t) <= mapSize
+        && header->m_stringOffset + (uint64_t)header->m_stringSize <= mapSize
+        && header->m_stringSize > 0
+        && base[header->m_stringOffset + header->m_stringSize - 1] == 0;
+    if (!valid)
+        return false;
+    const TrackImageDef::Track *tracks = (const TrackImageDef::Track *)(base + header->m_trackOffset);
+    const TrackImageDef::Section *sections = (const TrackImageDef::Section *)(base + header->m_sectionOffset);
+    const TrackImageDef::Part *parts = (const TrackImageDef::Part *)(base + header->m_partOffset);
+    const int32_t *setListRecords = (const int32_t *)(base + header->m_setListOffset);
+    const char *strings = base + header->m_stringOffset;
+    for (uint32_t t=0; valid && t<header->m_nofTracks; t++)
+    {
+        const TrackImageDef::Track &trackRecord = tracks[t];
+        valid = trackRecord.m_name < header->m_stringSize
+            && trackRecord.m_firstSection + (uint64_t)trackRecord.m_nofSections <= header->m_nofSections;
+        for (uint32_t s=0; valid && s<trackRecord.m_nofSections; s++)
+        {
+            const TrackImageDef::Section &sectionRecord = sections[trackRecord.m_firstSection + s];
+            valid = sectionRecord.m_name < header->m_stringSize
+                && sectionRecord.m_firstPart + (uint64_t)sectionRecord.m_nofParts <= header->m_nofParts;
+            for (uint32_t p=0; valid && p<sectionRecord.m_nofParts; p++)
+                valid = parts[sectionRecord.m_firstPart + p].m_name < header->m_stringSize;
+        }
+    }
+    for (uint32_t i=0; valid && i<header->m_setListLength; i++)
+        valid = setListRecords[i] >= 0 && (uint32_t)setListRecords[i] < header->m_nofTracks;
+    if (!valid)
+        return false;
+
+    // everything in one block, in the order the event loop walks it:
+    // a section, its part list and then its parts
+    Arena &arena = trackList.arena();
+    const size_t slack = 8;
+    arena.reserve(header->m_nofTracks * (sizeof(::Track) + slack)
+        + header->m_nofSections * (sizeof(::Section) + sizeof(::Section *) + 2*slack)
+        + header->m_nofParts * (sizeof(SwPart) + sizeof(SwPart *) + sizeof(Transposer)
+            + sizeof(ControllerRemap::VolReverse) + 4*slack)
+        + header->m_stringSize + header->m_nofTracks * slack);
+    trackList.reserve(trackList.size() + header->m_nofTracks);
+    for (uint32_t t=0; t<header->m_nofTracks; t++)
+    {
+        const TrackImageDef::Track &trackRecord = tracks[t];
+        ::Track *track = new (arena) ::Track(arena, strings + trackRecord.m_name);
+        track->m_sectionList.reserve(trackRecord.m_nofSections);
+        track->m_startSection = trackRecord.m_startSection;
+        track->m_chain = trackRecord.m_chain != 0;
+        for (uint32_t s=0; s<trackRecord.m_nofSections; s++)
+        {
+            const TrackImageDef::Section &sectionRecord = sections[trackRecord.m_firstSection + s];
+            ::Section *section = new (arena) ::Section(arena, strings + sectionRecord.m_name);
+            section->m_partList.reserve(sectionRecord.m_nofParts);
+            section->m_noteOffEnter = sectionRecord.m_noteOffEnter != 0;
+            section->m_noteOffLeave = sectionRecord.m_noteOffLeave != 0;
+            section->m_nextTrack = sectionRecord.m_nextTrack;
+            section->m_nextSection = sectionRecord.m_nextSection;
+            section->m_previousTrack = sectionRecord.m_previousTrack;
+            section->m_previousSection = sectionRecord.m_previousSection;
+            for (uint32_t p=0; p<sectionRecord.m_nofParts; p++)
+            {
+                const TrackImageDef::Part &partRecord = parts[sectionRecord.m_firstPart + p];
+                SwPart *part = new (arena) SwPart(arena, (int)p, strings + partRecord.m_name);
+                part->m_channel = partRecord.m_channel;
+                part->m_rangeLower = partRecord.m_rangeLower;
+                part->m_rangeUpper = partRecord.m_rangeUpper;
+                part->m_transpose = partRecord.m_transpose;
+                if (partRecord.m_flags & Toggle)
+                    part->m_toggler.enable();
+                part->m_mono = (partRecord.m_flags & Mono) != 0;
+                if (partRecord.m_flags & CustomTranspose)
+                {
+                    part->m_customTransposeEnabled = true;
+                    part->m_customTransposeOffset = partRecord.m_customTransposeOffset;
+                    for (int i=0; i<12; i++)
+                        part->m_customTranspose[i] = partRecord.m_customTranspose[i];
+                }
+                if (partRecord.m_flags & SustainTranspose)
+                    part->m_transposer = new (arena) Transposer(partRecord.m_sustainTranspose);
+                part->m_controllerRemap = createRemap(arena, partRecord.m_controllerRemap);
+                section->m_partList.push_back(part);
+            }
+            track->addSection(section);
+        }
+        trackList.push_back(track);
+    }
+    for (uint32_t i=0; i<header->m_setListLength; i++)
+        setList.add(setListRecords[i]);
+    return true;
+}
@@ -0,0 +1,141 @@
+/*! \file trackimage.h
+ *  \brief Contains a precompiled binary image of the track definitions.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef TRACK_IMAGE_H
+#define TRACK_IMAGE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "trackdef.h"
+
+/*! \brief Identifies a version of the XML file a track image is compiled from.
+ *
+ * The modification time is kept to the nanosecond, so an edit that keeps
+ * the size is noticed even if it is made within the same second.
+ */
+struct SourceStamp
+{
+    uint32_t m_size;            //!< File size.
+    uint32_t m_mtime;           //!< Modification time, seconds.
+    uint32_t m_mtimeNsec;       //!< Modification time, nanoseconds within the second.
+    void clear();
+    bool read(const char *fileName);
+    //! \brief Equality.
+    bool operator==(const SourceStamp &other) const {
+        return m_size == other.m_size && m_mtime == other.m_mtime && m_mtimeNsec == other.m_mtimeNsec; }
+    //! \brief Inequality.
+    bool operator!=(const SourceStamp &other) const { return !(*this == other); }
+};
+
+//! \brief Namespace for the records of a track image file.
+namespace TrackImageDef
+{
+
+/*! \brief Header of a track image file.
+ *
+ * All references within the image are byte offsets from the start of the
+ * image, or indexes into the record arrays, so the image does not depend
+ * on the address it is mapped at. Names are offsets into the string table.
+ * Fields are stored in host byte order, a byte-swapped image fails the
+ * version check and is ignored.
+ */
+struct Header
+{
+    static const uint32_t Version = 2;  //!< Must be changed if the layout of any record changes.
+    char m_magic[8];            //!< Magic string, "PATCHTRK".
+    uint32_t m_version;         //!< File format version.
+    uint32_t m_size;            //!< Size of the whole image in bytes.
+    uint32_t m_checksum;        //!< Adler-32 checksum of everything after the header.
+    SourceStamp m_source;       //!< The XML file the image was compiled from.
+    uint32_t m_nofTracks;       //!< Number of \a Track records.
+    uint32_t m_trackOffset;     //!< Offset of the \a Track records.
+    uint32_t m_nofSections;     //!< Number of \a Section records.
+    uint32_t m_sectionOffset;   //!< Offset of the \a Section records.
+    uint32_t m_nofParts;        //!< Number of \a Part records.
+    uint32_t m_partOffset;      //!< Offset of the \a Part records.
+    uint32_t m_setListLength;   //!< Number of setlist entries.
+    uint32_t m_setListOffset;   //!< Offset of the setlist, an array of int32_t track indexes.
+    uint32_t m_stringSize;      //!< Size of the string table.
+    uint32_t m_stringOffset;    //!< Offset of the string table.
+};
+
+//! \brief Image record of a \a ::Track.
+struct Track
+{
+    uint32_t m_name;            //!< Name, offset in the string table.
+    int32_t m_startSection;     //!< Start section index.
+    uint32_t m_chain;           //!< Chain mode switch.
+    uint32_t m_firstSection;    //!< Index of the first \a Section record.
+    uint32_t m_nofSections;     //!< Number of \a Section records.
+};
+
+//! \brief Image record of a \a ::Section, with the chain placeholders already resolved.
+struct Section
+{
+    uint32_t m_name;            //!< Name, offset in the string table.
+    uint8_t m_noteOffEnter;     //!< Note off on enter switch.
+    uint8_t m_noteOffLeave;     //!< Note off on leave switch.
+    uint8_t m_reserved[2];      //!< Padding, zero.
+    int32_t m_nextTrack;        //!< Chaining info: next track.
+    int32_t m_nextSection;      //!< Chaining info: next section.
+    int32_t m_previousTrack;    //!< Chaining info: previous track.
+    int32_t m_previousSection;  //!< Chaining info: previous section.
+    uint32_t m_firstPart;       //!< Index of the first \a Part record.
+    uint32_t m_nofParts;        //!< Number of \a Part records.
+};
+
+//! \brief Controller remap IDs.
+enum RemapId { NoRemap = 0, VolQuadratic, VolReverse, Drop16 };
+
+//! \brief Flags of a \a Part record.
+enum PartFlags
+{
+    Toggle = 1,                 //!< Toggler enabled.
+    Mono = 2,                   //!< Mono filter enabled.
+    CustomTranspose = 4,        //!< Custom transposition enabled.
+    SustainTranspose = 8        //!< Sustain transposer enabled.
+};
+
+//! \brief Image record of a \a ::SwPart.
+struct Part
+{
+    uint32_t m_name;                //!< Name, offset in the string table.
+    uint8_t m_channel;              //!< MIDI channel.
+    uint8_t m_rangeLower;           //!< Lower range.
+    uint8_t m_rangeUpper;           //!< Upper range.
+    uint8_t m_flags;                //!< \a PartFlags.
+    int32_t m_transpose;            //!< Transposition in semitones.
+    int32_t m_customTransposeOffset;    //!< Additional transposition for custom transposes.
+    int8_t m_customTranspose[12];   //!< Per-note transposition.
+    uint8_t m_sustainTranspose;     //!< Sustain transposer offset.
+    uint8_t m_controllerRemap;      //!< \a RemapId.
+    uint8_t m_reserved[2];          //!< Padding, zero.
+};
+
+} // namespace TrackImageDef
+
+/*! \brief A precompiled binary image of the track definitions.
+ *
+ * Parsing and validating the XML track definitions takes seconds on the
+ * Pi, in every process. \a patcher_compile does that once and writes this
+ * image, which every process maps and turns into its \a TrackList without
+ * any parsing.
+ * The image remembers the \a SourceStamp of the XML file it was compiled
+ * from, taken before the file was parsed, and a stale image is ignored.
+ */
+class TrackImage
+{
+public:
+    static void build(std::string &image, const SourceStamp &source,
+        const TrackList &trackList, const SetList &setList);
+    static bool read(const void *image, size_t size,
+        TrackList &trackList, SetList &setList);
+    static bool save(const char *imageFile, const char *sourceFile, const SourceStamp &source,
+        const TrackList &trackList, const SetList &setList);
+    static bool load(const char *imageFile, const char *sourceFile,
+        TrackList &trackList, SetList &setList);
+};
+
+#endif // TRACK_IMAGE_H
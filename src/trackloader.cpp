@@ -0,0 +1,122 @@
+/*! \file trackloader.cpp
+ *  \brief Contains an object that reads the track definitions on a background thread.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <signal.h>
+#include <algorithm>
+#include "trackloader.h"
+#include "xml.h"
+#include "error.h"
+
+/*! \brief Constructor.
+ *
+ * \param[in] sourceFile    Track definition file.
+ * \param[in] imageFile     Track image file, rewritten after every successful load.
+ */
+TrackLoader::TrackLoader(const char *sourceFile, const char *imageFile):
+    m_sourceFile(sourceFile),
+    m_imageFile(imageFile),
+    m_state(Idle)
+{
+    m_source.clear();
+}
+
+//! \brief Destructor, waits for a running thread.
+TrackLoader::~TrackLoader()
+{
+    if (state() != Idle)
+        pthread_join(m_thread, 0);
+}
+
+//! \brief Thread entry point.
+void *TrackLoader::run(void *arg)
+{
+    TrackLoader *loader = (TrackLoader *)arg;
+    loader->load();
+    return 0;
+}
+
+//! \brief Parse the track definitions, this runs on the loader thread.
+void TrackLoader::load()
+{
+    int result = Done;
+    try
+    {
+        // a parser of our own, the one of the event loop is not thread safe,
+        // xerces-c was initialised by that one, on the main thread
+        XML xml(false);
+        if (!m_source.read(m_sourceFile))
+        {
+            Error e;
+            e.stream() << "cannot stat " << m_sourceFile;
+            throw(e);
+        }
+        xml.importTracks(m_sourceFile, m_trackList, m_setList);
+        // if the file changed meanwhile, the next reload writes the image
+        TrackImage::save(m_imageFile, m_sourceFile, m_source, m_trackList, m_setList);
+    }
+    catch (Error &e)
+    {
+        m_error = e.what();
+        result = Failed;
+    }
+    catch (...)
+    {
+        m_error = "unexpected exception";
+        result = Failed;
+    }
+    if (result == Failed)
+    {
+        m_trackList.release();
+        m_setList = SetList();
+    }
+    __sync_lock_test_and_set(&m_state, result);
+}
+
+/*! \brief Start loading on a new thread.
+ *
+ * Does nothing if a load is already underway or its result has not been taken.
+ */
+void TrackLoader::start()
+{
+    if (state() != Idle)
+        return;
+    m_error.clear();
+    m_state = Busy;
+    // the thread must not take the watchdog alarm of the event loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rv = pthread_create(&m_thread, 0, run, this);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (rv != 0)
+    {
+        m_state = Idle;
+        throw(Error("pthread_create", rv));
+    }
+}
+
+/*! \brief Take the result of a finished load.
+ *
+ * \param[out] trackList    New track list, the caller takes ownership.
+ * \param[out] setList      New setlist.
+ * \param[out] source       Stamp of the track definition file, taken before it was parsed.
+ * \param[out] error        Error message if the load failed.
+ * \return     True if a new track list was loaded.
+ */
+bool TrackLoader::take(TrackList &trackList, SetList &setList, SourceStamp &source, std::string &error)
+{
+    if (!done())
+        return false;
+    pthread_join(m_thread, 0);
+    bool ok = m_state == Done;
+    trackList.swap(m_trackList);
+    std::swap(setList, m_setList);
+    source = m_source;
+    error = m_error;
+    m_trackList.release();
+    m_setList = SetList();
+    m_state = Idle;
+    return ok;
+}
@@ -0,0 +1,54 @@
+/*! \file trackloader.h
+ *  \brief Contains an object that reads the track definitions on a background thread.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#ifndef TRACK_LOADER_H
+#define TRACK_LOADER_H
+#include <pthread.h>
+#include <string>
+#include "trackdef.h"
+#include "trackimage.h"
+
+/*! \brief Reads the track definitions on a background thread.
+ *
+ * Parsing tracks.xml takes seconds on the Pi, which is far too long
+ * to stall the event loop. The loader thread builds a complete new
+ * \a TrackList and \a SetList, and recompiles the track image for the
+ * clients, unless the file changed again while it was parsed. The event loop polls \a done() between events, and takes
+ * the result with \a take(). The thread never touches the live lists,
+ * so the swap is a matter of exchanging a few pointers.
+ *
+ * The thread does not initialise xerces-c, the owner must keep an \a XML
+ * that did, created on the main thread.
+ */
+class TrackLoader
+{
+public:
+    //! \brief Loader state.
+    enum State { Idle, Busy, Done, Failed };
+private:
+    const char *m_sourceFile;   //!< Track definition file.
+    const char *m_imageFile;    //!< Track image file to rewrite.
+    pthread_t m_thread;         //!< Loader thread.
+    mutable volatile int m_state;   //!< \a State, written by the thread once it is finished.
+    TrackList m_trackList;      //!< New track list.
+    SetList m_setList;          //!< New setlist.
+    SourceStamp m_source;       //!< Stamp of the track definition file, taken before it was parsed.
+    std::string m_error;        //!< Error message if the load failed.
+    static void *run(void *arg);
+    void load();
+    //! \brief Read \a m_state with a full barrier, so the results of the thread are visible.
+    int state() const { return __sync_fetch_and_add(&m_state, 0); }
+public:
+    TrackLoader(const char *sourceFile, const char *imageFile);
+    ~TrackLoader();
+    void start();
+    //! \brief True while the thread is running.
+    bool busy() const { return state() == Busy; }
+    //! \brief True if the thread has finished, successfully or not.
+    bool done() const { int s = state(); return s == Done || s == Failed; }
+    bool take(TrackList &trackList, SetList &setList, SourceStamp &source, std::string &error);
+};
+
+#endif // TRACK_LOADER_H
@@ -35,3 +35,19 @@ void Transposer::transpose(uint8_t midiStatus, uint8_t &data1, uint8_t &data2)
         }
     }
 }
+
+//! \brief Copy the transposer state.
+void Transposer::getState(State &state) const
+{
+    for (int i=0; i<Midi::Note::max; i++)
+        state.m_noteState[i] = m_noteState[i] ? 1 : 0;
+    state.m_sustain = m_sustain ? 1 : 0;
+}
+
+//! \brief Restore the transposer state.
+void Transposer::setState(const State &state)
+{
+    for (int i=0; i<Midi::Note::max; i++)
+        m_noteState[i] = state.m_noteState[i] != 0;
+    m_sustain = state.m_sustain != 0;
+}
@@ -15,11 +15,19 @@ class Transposer
     bool m_noteState[Midi::Note::max];  //!<    Sustain status for each MIDI note.
     bool m_sustain;                     //!<    Latest sustain pedal status.
 public:
+    //! \brief A copy of the transposer state, to survive a restart of the core.
+    struct State
+    {
+        uint8_t m_noteState[Midi::Note::max];   //!< Sustain status for each MIDI note.
+        uint8_t m_sustain;                      //!< Latest sustain pedal status.
+    };
     uint8_t m_transpose;                //!<    Transpose value in semitones.
     //! \brief Construct a transposer that by default transposes one octave.
     Transposer(uint8_t offset = 12);
     //! \brief Set the sustain pedal status.
     void setSustain(bool b) { m_sustain = b; };
     void transpose(uint8_t midiStatus, uint8_t &data1, uint8_t &data2);
+    void getState(State &state) const;
+    void setState(const State &state);
 };
 #endif
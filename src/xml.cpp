@@ -12,10 +12,17 @@
 #include <xercesc/framework/LocalFileFormatTarget.hpp>
 #include <xercesc/util/XMLStringTokenizer.hpp>
 #include <xercesc/util/XMLChar.hpp>
+#include <xercesc/util/XMLUni.hpp>
+#include <xercesc/sax2/SAX2XMLReader.hpp>
+#include <xercesc/sax2/XMLReaderFactory.hpp>
+#include <xercesc/sax2/DefaultHandler.hpp>
+#include <xercesc/sax2/Attributes.hpp>
+#include <xercesc/sax/SAXParseException.hpp>
 #include <iostream>
 #include <sstream>
 #include <list>
 #include <map>
+#include <algorithm>
 #include "error.h"
 
 #ifdef FAKE_STL // set in PREDEFINED in doxygen config
@@ -105,6 +112,7 @@ class XMLParser
     std::stringstream m_stringStream;  //!< Temporary stringstream.
     XMLStringCache m_xmlStr;           //!< Instance of \a XMLStringCache.
     XPathCache m_xPath;                //!< Instance of \a XPathCache.
+    bool m_platform;                   //!< This parser has initialised xerces-c.
     DOMNode *findNode(DOMDocument *doc, const DOMElement *node, const char *path);
     DOMXPathResult *findNodes(DOMDocument *doc, const DOMElement *node, const char *path);
     std::stringstream &xmlStream(const XMLCh *c);
@@ -116,20 +124,25 @@ class XMLParser
     void parseTracks(DOMDocument *doc, TrackList &trackList, SetList &setList);
     void parsePerformances(DOMDocument *doc, Fantom::PerformanceList &performanceList);
 public:
-    int importTracks (const char *inFile, TrackList &tracks, SetList &setList);
+    int importTracks (const char *inFile, TrackList &tracks, SetList &setList, const char *schemaFile);
+    int importTracksDom (const char *inFile, TrackList &tracks, SetList &setList);
     int exportPerformances(const char *outFile, const Fantom::PerformanceList &performanceList);
     int importPerformances(const char *inFile, Fantom::PerformanceList &performanceList);
-    XMLParser();
+    explicit XMLParser(bool platform);
     ~XMLParser();
 };
 
 /*! \brief XML Parser constructor.
  *
- * There should be only one instance per process. It could be made static,
+ * There should be only one instance per thread. It could be made static,
  * but destroying it when no longer needed frees up a little memory.
+ *
+ * \param[in] platform  Initialise xerces-c, and terminate it in the destructor.
  */
-XMLParser::XMLParser(): m_xPath(&m_xmlStr)
+XMLParser::XMLParser(bool platform): m_xPath(&m_xmlStr), m_platform(platform)
 {
+    if (!m_platform)
+        return;
     try {
         XMLPlatformUtils::Initialize();
     }
@@ -147,7 +160,8 @@ XMLParser::~XMLParser()
 {
     m_xmlStr.clear();
     m_xPath.clear();
-    XMLPlatformUtils::Terminate();
+    if (m_platform)
+        XMLPlatformUtils::Terminate();
 }
 
 //! \brief Find the first node that matches an XPath expression.
@@ -198,11 +212,12 @@ void XMLParser::parseTracks(DOMDocument *doc, TrackList &trackList, SetList &set
     DOMElement *root = doc->getDocumentElement();
     DOMNode *trackDefNode = findNode(doc, root, "/tracks/trackDefinitions");
     DOMXPathResult *trackNodes = findNodes(doc, (DOMElement*)trackDefNode, "./track");
+    Arena &arena = trackList.arena();
     for (size_t trackIdx = 0; trackNodes->snapshotItem(trackIdx); trackIdx++)
     {
         DOMNode *trackNode = trackNodes->getNodeValue();
         char *name = XMLString::transcode(((DOMElement*)trackNode)->getAttribute(m_xmlStr("name")));
-        Track *track = new Track(strdup(name));
+        Track *track = new (arena) Track(arena, name);
         XMLString::release(&name);
         xmlStream(((DOMElement*)trackNode)->getAttribute(m_xmlStr("startSection")))
                 >> track->m_startSection;
@@ -215,7 +230,7 @@ void XMLParser::parseTracks(DOMDocument *doc, TrackList &trackList, SetList &set
         {
             DOMNode *sectionNode = sectionNodes->getNodeValue();
             name = XMLString::transcode(((DOMElement*)sectionNode)->getAttribute(m_xmlStr("name")));
-            Section *section = new Section(strdup(name));
+            Section *section = new (arena) Section(arena, name);
             XMLString::release(&name);
             DOMNode *noteOffNode = findNode(doc, (DOMElement*)sectionNode, "./noteOff");
             if (noteOffNode)
@@ -288,7 +303,7 @@ void XMLParser::parseTracks(DOMDocument *doc, TrackList &trackList, SetList &set
                 SwPart *part;
                 {
                     name = XMLString::transcode(((DOMElement*)partNode)->getAttribute(m_xmlStr("name")));
-                    part = new SwPart((int)partIdx, strdup(name));
+                    part = new (arena) SwPart(arena, (int)partIdx, name);
                     XMLString::release(&name);
                 }
                 section->m_partList.push_back(part);
@@ -309,18 +324,18 @@ void XMLParser::parseTracks(DOMDocument *doc, TrackList &trackList, SetList &set
                 {
                     int tp = 0;
                     xmlStream(((DOMElement*)partNode)->getAttribute(m_xmlStr("sustainTranspose"))) >> tp;
-                    part->m_transposer = new Transposer(tp);
+                    part->m_transposer = new (arena) Transposer(tp);
                 }
                 DOMNode *controllerRemapNode = findNode(doc, (DOMElement*)partNode, "./controllerRemap");
                 if (controllerRemapNode)
                 {
                     std::string id = xmlStdString(((DOMElement*)controllerRemapNode)->getAttribute(m_xmlStr("id")));
                     if (id == "volQuadratic")
-                        part->m_controllerRemap = new ControllerRemap::VolQuadratic;
+                        part->m_controllerRemap = new (arena) ControllerRemap::VolQuadratic;
                     else if (id == "volReverse")
-                        part->m_controllerRemap = new ControllerRemap::VolReverse;
+                        part->m_controllerRemap = new (arena) ControllerRemap::VolReverse;
                     else if (id == "drop16")
-                        part->m_controllerRemap = new ControllerRemap::Drop16;
+                        part->m_controllerRemap = new (arena) ControllerRemap::Drop16;
                     else
                         throw(Error("unknown controllerRemap id"));
                 }
@@ -383,8 +398,452 @@ void XMLParser::parseTracks(DOMDocument *doc, TrackList &trackList, SetList &set
     trackNodes->release();
 }
 
-//! \brief Parse an XML file into a track list and a \a SetList.
-int XMLParser::importTracks (const char *inFile, TrackList &tracks, SetList &setList)
+/*! \brief SAX2 handler that builds a track list and a \a SetList in a single pass.
+ *
+ * It has the same semantics as \a XMLParser::parseTracks(): only direct
+ * children are considered, and of the single-valued children like
+ * noteOff, chain, range, transpose, custom and controllerRemap only
+ * the first one counts.
+ */
+class TrackHandler: public DefaultHandler
+{
+    //! \brief Element types, by position in the document.
+    enum Element { OtherElement, TracksElement, TrackDefinitionsElement, TrackElement,
+        SectionElement, NoteOffElement, ChainElement, PartElement, ControllerRemapElement,
+        RangeElement, TransposeElement, CustomElement, MapElement, SetListElement,
+        SetListTrackElement };
+    XMLStringCache &m_xmlStr;           //!< String cache.
+    TrackList &m_trackList;             //!< Track list to fill.
+    SetList &m_setList;                 //!< Setlist to fill.
+    std::vector<std::string> m_setListNames;    //!< Setlist track names, resolved at the end.
+    std::vector<Element> m_stack;       //!< Open elements.
+    Track *m_track;                     //!< Track being built.
+    Section *m_section;                 //!< Section being built.
+    SwPart *m_part;                     //!< Part being built.
+    int m_partIdx;                      //!< Index of \a m_part within \a m_section.
+    bool m_seenTrackDefinitions;        //!< First trackDefinitions seen.
+    bool m_seenSetList;                 //!< First setList seen.
+    bool m_seenNoteOff;                 //!< First noteOff of the section seen.
+    bool m_seenChain;                   //!< First chain of the section seen.
+    bool m_seenRemap;                   //!< First controllerRemap of the part seen.
+    bool m_seenRange;                   //!< First range of the part seen.
+    bool m_seenTranspose;               //!< First transpose of the part seen.
+    bool m_seenCustom;                  //!< First custom of the transpose seen.
+    Element classify(const XMLCh *name);
+    bool attribute(const Attributes &attrs, const char *name, std::string &value);
+    static bool toInt(const std::string &value, int &i);
+    void noteAttribute(const Attributes &attrs, const char *name, uint8_t &note);
+public:
+    virtual void startElement(const XMLCh *const uri, const XMLCh *const localname,
+        const XMLCh *const qname, const Attributes &attrs);
+    virtual void endElement(const XMLCh *const uri, const XMLCh *const localname,
+        const XMLCh *const qname);
+    virtual void endDocument();
+    virtual void error(const SAXParseException &exc);
+    virtual void fatalError(const SAXParseException &exc);
+    /*! \brief Constructor.
+     *
+     * \param[in] xmlStr        A string cache.
+     * \param[out] trackList    Track list to fill.
+     * \param[out] setList      Setlist to fill.
+     */
+    TrackHandler(XMLStringCache &xmlStr, TrackList &trackList, SetList &setList):
+        m_xmlStr(xmlStr), m_trackList(trackList), m_setList(setList),
+        m_track(0), m_section(0), m_part(0), m_partIdx(0),
+        m_seenTrackDefinitions(false), m_seenSetList(false),
+        m_seenNoteOff(false), m_seenChain(false), m_seenRemap(false),
+        m_seenRange(false), m_seenTranspose(false), m_seenCustom(false) { }
+    // a partial track after an error is released with the arena of the track list
+};
+
+/*! \brief Determine the type of a new element from its name and its parent.
+ *
+ * Repeated single-valued elements are classified as \a OtherElement, so they
+ * and their children are ignored.
+ */
+TrackHandler::Element TrackHandler::classify(const XMLCh *name)
+{
+    if (m_stack.empty())
+        return XMLString::equals(name, m_xmlStr("tracks")) ? TracksElement : OtherElement;
+    switch (m_stack.back())
+    {
+        case TracksElement:
+            if (XMLString::equals(name, m_xmlStr("trackDefinitions")) && !m_seenTrackDefinitions)
+            {
+                m_seenTrackDefinitions = true;
+                return TrackDefinitionsElement;
+            }
+            if (XMLString::equals(name, m_xmlStr("setList")) && !m_seenSetList)
+            {
+                m_seenSetList = true;
+                return SetListElement;
+            }
+            break;
+        case TrackDefinitionsElement:
+            if (XMLString::equals(name, m_xmlStr("track")))
+                return TrackElement;
+            break;
+        case SetListElement:
+            if (XMLString::equals(name, m_xmlStr("track")))
+                return SetListTrackElement;
+            break;
+        case TrackElement:
+            if (XMLString::equals(name, m_xmlStr("section")))
+                return SectionElement;
+            break;
+        case SectionElement:
+            if (XMLString::equals(name, m_xmlStr("part")))
+                return PartElement;
+            if (XMLString::equals(name, m_xmlStr("noteOff")) && !m_seenNoteOff)
+            {
+                m_seenNoteOff = true;
+                return NoteOffElement;
+            }
+            if (XMLString::equals(name, m_xmlStr("chain")) && !m_seenChain)
+            {
+                m_seenChain = true;
+                return ChainElement;
+            }
+            break;
+        case PartElement:
+            if (XMLString::equals(name, m_xmlStr("controllerRemap")) && !m_seenRemap)
+            {
+                m_seenRemap = true;
+                return ControllerRemapElement;
+            }
+            if (XMLString::equals(name, m_xmlStr("range")) && !m_seenRange)
+            {
+                m_seenRange = true;
+                return RangeElement;
+            }
+            if (XMLString::equals(name, m_xmlStr("transpose")) && !m_seenTranspose)
+            {
+                m_seenTranspose = true;
+                return TransposeElement;
+            }
+            break;
+        case TransposeElement:
+            if (XMLString::equals(name, m_xmlStr("custom")) && !m_seenCustom)
+            {
+                m_seenCustom = true;
+                return CustomElement;
+            }
+            break;
+        case CustomElement:
+            if (XMLString::equals(name, m_xmlStr("map")))
+                return MapElement;
+            break;
+        default:
+            break;
+    }
+    return OtherElement;
+}
+
+/*! \brief Retrieve an attribute value.
+ *
+ * \return True if the attribute is present.
+ */
+bool TrackHandler::attribute(const Attributes &attrs, const char *name, std::string &value)
+{
+    const XMLCh *c = attrs.getValue(m_xmlStr(name));
+    if (!c)
+    {
+        value.clear();
+        return false;
+    }
+    char *s = XMLString::transcode(c);
+    value = s;
+    XMLString::release(&s);
+    return true;
+}
+
+/*! \brief Convert a string to an integer, like a stream extraction.
+ *
+ * \return True if successful, \a i is unchanged otherwise.
+ */
+bool TrackHandler::toInt(const std::string &value, int &i)
+{
+    std::istringstream ss(value);
+    int tmp;
+    if (!(ss >> tmp))
+        return false;
+    i = tmp;
+    return true;
+}
+
+//! \brief Retrieve a note-value attribute, \a note is unchanged if it is absent or empty.
+void TrackHandler::noteAttribute(const Attributes &attrs, const char *name, uint8_t &note)
+{
+    std::string value;
+    if (attribute(attrs, name, value) && !value.empty())
+        note = Midi::noteValue(value.c_str());
+}
+
+//! \brief Handle the start of an element.
+void TrackHandler::startElement(const XMLCh *const uri, const XMLCh *const localname,
+    const XMLCh *const qname, const Attributes &attrs)
+{
+    (void)uri;
+    (void)localname;
+    Element element = classify(qname);
+    m_stack.push_back(element);
+    std::string value;
+    switch (element)
+    {
+        case TrackElement:
+            attribute(attrs, "name", value);
+            m_track = new (m_trackList.arena()) Track(m_trackList.arena(), value.c_str());
+            attribute(attrs, "startSection", value);
+            toInt(value, m_track->m_startSection);
+            attribute(attrs, "chain", value);
+            if (value == "true")
+                m_track->m_chain = true;
+            break;
+        case SectionElement:
+            attribute(attrs, "name", value);
+            m_section = new (m_trackList.arena()) Section(m_trackList.arena(), value.c_str());
+            m_partIdx = 0;
+            m_seenNoteOff = false;
+            m_seenChain = false;
+            break;
+        case NoteOffElement:
+            if (attribute(attrs, "enter", value))
+                m_section->m_noteOffEnter = value == "true";
+            if (attribute(attrs, "leave", value))
+                m_section->m_noteOffLeave = value == "true";
+            break;
+        case ChainElement:
+        {
+            const char *ss[] = {"nextSection", "previousSection"};
+            for (size_t i=0; i<2; i++)
+            {
+                if (attribute(attrs, ss[i], value))
+                {
+                    int sectionIdx = 0;
+                    if (value == "last")
+                        sectionIdx = TrackDef::LastSection;
+                    else
+                        toInt(value, sectionIdx);
+                    if (i == 0)
+                        m_section->m_nextSection = sectionIdx;
+                    else
+                        m_section->m_previousSection = sectionIdx;
+                }
+            }
+            const char *ts[] = {"nextTrack", "previousTrack"};
+            for (size_t i=0; i<2; i++)
+            {
+                if (attribute(attrs, ts[i], value))
+                {
+                    int trackIdx = 0;
+                    if (value == "next")
+                        trackIdx = TrackDef::NextTrack;
+                    else if (value == "current")
+                        trackIdx = TrackDef::CurrentTrack;
+                    else if (value == "previous")
+                        trackIdx = TrackDef::PreviousTrack;
+                    else
+                        toInt(value, trackIdx);
+                    if (i == 0)
+                        m_section->m_nextTrack = trackIdx;
+                    else
+                        m_section->m_previousTrack = trackIdx;
+                }
+            }
+            break;
+        }
+        case PartElement:
+        {
+            attribute(attrs, "name", value);
+            m_part = new (m_trackList.arena()) SwPart(m_trackList.arena(), m_partIdx++, value.c_str());
+            m_section->m_partList.push_back(m_part);
+            m_seenRemap = false;
+            m_seenRange = false;
+            m_seenTranspose = false;
+            int channel = 0;
+            attribute(attrs, "channel", value);
+            toInt(value, channel);
+            m_part->m_channel = channel-1;
+            attribute(attrs, "toggle", value);
+            if (value == "true")
+                m_part->m_toggler.enable();
+            attribute(attrs, "mono", value);
+            if (value == "true")
+                m_part->m_mono = true;
+            if (attribute(attrs, "sustainTranspose", value))
+            {
+                int tp = 0;
+                toInt(value, tp);
+                m_part->m_transposer = new (m_trackList.arena()) Transposer(tp);
+            }
+            break;
+        }
+        case ControllerRemapElement:
+            attribute(attrs, "id", value);
+            if (value == "volQuadratic")
+                m_part->m_controllerRemap = new (m_trackList.arena()) ControllerRemap::VolQuadratic;
+            else if (value == "volReverse")
+                m_part->m_controllerRemap = new (m_trackList.arena()) ControllerRemap::VolReverse;
+            else if (value == "drop16")
+                m_part->m_controllerRemap = new (m_trackList.arena()) ControllerRemap::Drop16;
+            else
+                throw(Error("unknown controllerRemap id"));
+            break;
+        case RangeElement:
+            noteAttribute(attrs, "lower", m_part->m_rangeLower);
+            noteAttribute(attrs, "upper", m_part->m_rangeUpper);
+            break;
+        case TransposeElement:
+            m_seenCustom = false;
+            if (attribute(attrs, "offset", value))
+                toInt(value, m_part->m_transpose);
+            break;
+        case CustomElement:
+            m_part->m_customTransposeEnabled = true;
+            memset(m_part->m_customTranspose, 0, sizeof(m_part->m_customTranspose));
+            if (attribute(attrs, "offset", value))
+                toInt(value, m_part->m_customTransposeOffset);
+            break;
+        case MapElement:
+        {
+            int from = 0;
+            attribute(attrs, "from", value);
+            toInt(value, from);
+            from = (from + 120) % 12;
+            int to = 0;
+            attribute(attrs, "to", value);
+            toInt(value, to);
+            m_part->m_customTranspose[from] = to;
+            break;
+        }
+        case SetListTrackElement:
+            attribute(attrs, "name", value);
+            m_setListNames.push_back(value);
+            break;
+        default:
+            break;
+    }
+}
+
+//! \brief Handle the end of an element.
+void TrackHandler::endElement(const XMLCh *const uri, const XMLCh *const localname,
+    const XMLCh *const qname)
+{
+    (void)uri;
+    (void)localname;
+    (void)qname;
+    Element element = m_stack.back();
+    m_stack.pop_back();
+    switch (element)
+    {
+        case TrackElement:
+            m_trackList.push_back(m_track);
+            m_track = 0;
+            break;
+        case SectionElement:
+            m_track->addSection(m_section);
+            m_section = 0;
+            break;
+        case PartElement:
+            m_part = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+//! \brief Resolve the setlist, now that all tracks are known.
+void TrackHandler::endDocument()
+{
+    for (size_t i=0; i<m_setListNames.size(); i++)
+        m_setList.add(m_trackList, m_setListNames[i].c_str());
+}
+
+/*! \brief Stop at a validation error.
+ *
+ * The default handler ignores them, so a file that does not match the
+ * schema would be accepted.
+ */
+void TrackHandler::error(const SAXParseException &exc)
+{
+    Error e;
+    char *file = XMLString::transcode(exc.getSystemId());
+    char *message = XMLString::transcode(exc.getMessage());
+    e.stream() << file << ":" << exc.getLineNumber() << ":"
+        << exc.getColumnNumber() << ": " << message;
+    XMLString::release(&file);
+    XMLString::release(&message);
+    throw(e);
+}
+
+//! \brief Stop at a syntax error.
+void TrackHandler::fatalError(const SAXParseException &exc)
+{
+    error(exc);
+}
+
+/*! \brief Parse an XML file into a track list and a \a SetList.
+ *
+ * This is a single pass over the file with a SAX2 reader, no DOM is built.
+ * With a schema, the file is validated against it on the way, and the
+ * first validation error is thrown. The schema file has no target
+ * namespace, a relative path is relative to the directory of \a inFile.
+ *
+ * \param[in]  inFile      The XML file.
+ * \param[out] tracks      The tracks.
+ * \param[out] setList     The setlist.
+ * \param[in]  schemaFile  XSD to validate against, 0 to skip validation.
+ */
+int XMLParser::importTracks (const char *inFile, TrackList &tracks, SetList &setList, const char *schemaFile)
+{
+    SAX2XMLReader *reader = XMLReaderFactory::createXMLReader();
+    bool validate = schemaFile != 0;
+    reader->setFeature(XMLUni::fgSAX2CoreNameSpaces, validate);
+    reader->setFeature(XMLUni::fgSAX2CoreValidation, validate);
+    reader->setFeature(XMLUni::fgXercesDynamic, false);
+    reader->setFeature(XMLUni::fgXercesSchema, validate);
+    if (validate)
+    {
+        // the reader keeps a copy
+        XMLCh *schema = XMLString::transcode(schemaFile);
+        reader->setProperty(XMLUni::fgXercesSchemaExternalNoNameSpaceSchemaLocation, schema);
+        XMLString::release(&schema);
+    }
+    TrackHandler handler(m_xmlStr, tracks, setList);
+    reader->setContentHandler(&handler);
+    reader->setErrorHandler(&handler);
+
+    try {
+        reader->parse(inFile);
+    }
+    catch (Error &) {
+        delete reader;
+        throw;
+    }
+    catch (const XMLException& toCatch) {
+        delete reader;
+        Error e("XMLException: ");
+        char* message = XMLString::transcode(toCatch.getMessage());
+        e.stream() << message;
+        XMLString::release(&message);
+        throw(e);
+    }
+    catch (...) {
+        delete reader;
+        throw(Error("xerces-c: unexpected exception"));
+    }
+
+    delete reader;
+    fixChain(tracks);
+    return 0;
+}
+
+/*! \brief Parse an XML file into a track list and a \a SetList, through a DOM.
+ *
+ * This was the only path before \a importTracks() went single pass.
+ * It is kept for comparison by xml_bench.
+ */
+int XMLParser::importTracksDom (const char *inFile, TrackList &tracks, SetList &setList)
 {
     XercesDOMParser* parser = new XercesDOMParser();
     parser->setValidationScheme(XercesDOMParser::Val_Always);
@@ -563,7 +1022,7 @@ void XMLParser::parsePerformances(DOMDocument *doc, Fantom::PerformanceList &per
             XMLString::release(&name);
         }
         partNodes->release();
-
+        performance->m_loaded = 1;
         performanceList.push_back(performance);
     }
     performanceNodes->release();
@@ -683,10 +1142,17 @@ int XMLParser::exportPerformances(const char *outFile, const Fantom::Performance
     return 0;
 }
 
-//! \brief Default constructor.
-XML::XML()
+/*! \brief Constructor.
+ *
+ * Initialising xerces-c is not thread safe. A program that parses on more
+ * than one thread keeps an XML that initialises it on the main thread, for
+ * as long as the other threads run, and creates theirs without.
+ *
+ * \param[in] platform  Initialise xerces-c for the lifetime of this object.
+ */
+XML::XML(bool platform)
 {
-    m_xmlParser = new XMLParser;
+    m_xmlParser = new XMLParser(platform);
 }
 
 //! \brief Destructor.
@@ -695,10 +1161,16 @@ XML::~XML()
     delete m_xmlParser;
 }
 
-//! \brief Parse an XML file into a track list and a \a SetList.
-int XML::importTracks (const char *inFile, TrackList &tracks, SetList &setList)
+//! \brief Parse an XML file into a track list and a \a SetList, optionally validated against a schema.
+int XML::importTracks (const char *inFile, TrackList &tracks, SetList &setList, const char *schemaFile)
+{
+    return m_xmlParser->importTracks(inFile, tracks, setList, schemaFile);
+}
+
+//! \brief Parse an XML file into a track list and a \a SetList, through a DOM.
+int XML::importTracksDom (const char *inFile, TrackList &tracks, SetList &setList)
 {
-    return m_xmlParser->importTracks(inFile, tracks, setList);
+    return m_xmlParser->importTracksDom(inFile, tracks, setList);
 }
 
 //! \brief Export a \a PerformanceList to XML.
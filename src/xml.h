@@ -13,7 +13,8 @@ class XMLParser;
 /*! \brief XML parser wrapper, hides \a XMLParser.
  *
  * It provides an API to
- * - read the \a TrackList and \a SetList,
+ * - read the \a TrackList and \a SetList, in a single SAX pass or through a DOM,
+ *   optionally validated against the schema,
  * - read the \a Fantom::PerformanceList from a cache file, and
  * - write the \a Fantom::PerformanceList to a cache file.
  */
@@ -21,10 +22,11 @@ class XML
 {
     XMLParser *m_xmlParser; //!<    XML parser.
 public:
-    int importTracks (const char *inFile, TrackList &tracks, SetList &setList);
+    int importTracks (const char *inFile, TrackList &tracks, SetList &setList, const char *schemaFile = 0);
+    int importTracksDom (const char *inFile, TrackList &tracks, SetList &setList);
     int exportPerformances(const char *outFile, const Fantom::PerformanceList &performanceList);
     int importPerformances(const char *inFile, Fantom::PerformanceList &performanceList);
-    XML();
+    explicit XML(bool platform = true);
     ~XML();
 };
 
@@ -0,0 +1,287 @@
+/*! \file xmlbench.cpp
+ *  \brief Compares the time and memory used by the SAX and DOM track importers.
+ *
+ *  Both importers must produce the same track definitions. The results are
+ *  compared through their compiled track image, which holds every track,
+ *  section, part and setlist entry, and a difference is an error.
+ *
+ *  Copyright 2013 Raymond Zandbergen (ray.zandbergen@gmail.com)
+ */
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "trackdef.h"
+#include "trackimage.h"
+#include "checksum.h"
+#include "timestamp.h"
+#include "xml.h"
+#include "error.h"
+
+namespace
+{
+
+//! \brief Importers that can be measured.
+enum Importer { NoImporter, SaxImporter, DomImporter };
+
+//! \brief Names of the importers, for the report.
+const char *importerName[] = {"none", "sax", "dom"};
+
+//! \brief Result of one measurement.
+struct Result
+{
+    double m_seconds;   //!< Time taken by the import.
+    int m_nofTracks;    //!< Number of tracks imported.
+    uint32_t m_imageSize;       //!< Size of the track image of the import.
+    uint32_t m_imageChecksum;   //!< Adler-32 checksum of the track image of the import.
+};
+
+//! \brief Read a whole file into a string.
+std::string readFile(const char *fileName)
+{
+    std::ifstream in(fileName);
+    if (!in)
+    {
+        Error e;
+        e.stream() << "cannot open " << fileName;
+        throw(e);
+    }
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+/*! \brief Replace the content of an element by \a factor copies of it.
+ *
+ * \param[in,out] doc   The document text.
+ * \param[in] tag       Name of the element, which must occur once.
+ * \param[in] factor    Number of copies.
+ */
+void replicate(std::string &doc, const char *tag, int factor)
+{
+    std::string open = std::string("<") + tag + ">";
+    std::string close = std::string("</") + tag + ">";
+    size_t begin = doc.find(open);
+    size_t end = doc.find(close);
+    if (begin == std::string::npos || end == std::string::npos || end < begin)
+    {
+        Error e;
+        e.stream() << "no " << tag << " element found";
+        throw(e);
+    }
+    begin += open.size();
+    std::string content = doc.substr(begin, end-begin);
+    std::string copies;
+    copies.reserve(content.size()*factor);
+    for (int i=0; i<factor; i++)
+        copies += content;
+    doc.replace(begin, end-begin, copies);
+}
+
+/*! \brief Write a copy of a track definition file with all tracks and setlist entries repeated.
+ *
+ * \param[in] inFile    The original file.
+ * \param[in] factor    Number of copies of every track.
+ * \return    Name of the new file.
+ */
+std::string scaleFile(const char *inFile, int factor)
+{
+    std::string doc = readFile(inFile);
+    replicate(doc, "trackDefinitions", factor);
+    replicate(doc, "setList", factor);
+    char name[] = "/tmp/xml_benchXXXXXX";
+    int fd = mkstemp(name);
+    if (fd == -1)
+        throw(Error("mkstemp", errno));
+    size_t done = 0;
+    while (done < doc.size())
+    {
+        ssize_t rv = write(fd, doc.data()+done, doc.size()-done);
+        if (rv <= 0)
+        {
+            close(fd);
+            unlink(name);
+            throw(Error("write", errno));
+        }
+        done += rv;
+    }
+    close(fd);
+    return name;
+}
+
+/*! \brief Import a file in a child process.
+ *
+ * Each import runs in a fresh process, so its peak RSS can be measured
+ * on its own and the importers cannot influence each other's heap.
+ *
+ * \param[in] inFile    File to import.
+ * \param[in] importer  Importer to use, \a NoImporter measures the baseline.
+ * \param[out] result   Time, track count and track image of the import.
+ * \return    Peak RSS of the child in kB.
+ */
+long measure(const char *inFile, Importer importer, Result &result)
+{
+    int fd[2];
+    if (-1 == pipe(fd))
+        throw(Error("pipe", errno));
+    pid_t pid = fork();
+    if (pid == -1)
+        throw(Error("fork", errno));
+    if (pid == 0)
+    {
+        close(fd[0]);
+        Result r;
+        r.m_seconds = 0;
+        r.m_nofTracks = 0;
+        r.m_imageSize = 0;
+        r.m_imageChecksum = 0;
+        try
+        {
+            TrackList trackList;
+            SetList setList;
+            TimeSpec start, stop;
+            getTime(start);
+            if (importer != NoImporter)
+            {
+                XML xml;
+                if (importer == SaxImporter)
+                    xml.importTracks(inFile, trackList, setList);
+                else
+                    xml.importTracksDom(inFile, trackList, setList);
+            }
+            getTime(stop);
+            r.m_seconds = timeDiffSeconds(start, stop);
+            r.m_nofTracks = (int)trackList.size();
+            if (importer != NoImporter)
+            {
+                std::string image;
+                SourceStamp none;
+                none.clear();
+                TrackImage::build(image, none, trackList, setList);
+                r.m_imageSize = (uint32_t)image.size();
+                r.m_imageChecksum = adler32(image.data(), image.size());
+            }
+        }
+        catch (Error &e)
+        {
+            std::cerr << "** " << importerName[importer] << ": " << e.what() << std::endl;
+            _exit(1);
+        }
+        ssize_t rv = write(fd[1], &r, sizeof(r));
+        _exit(rv == sizeof(r) ? 0 : 1);
+    }
+    close(fd[1]);
+    ssize_t rv = read(fd[0], &result, sizeof(result));
+    close(fd[0]);
+    int status;
+    struct rusage usage;
+    if (-1 == wait4(pid, &status, 0, &usage))
+        throw(Error("wait4", errno));
+    if (rv != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        Error e;
+        e.stream() << importerName[importer] << " import of " << inFile << " failed";
+        throw(e);
+    }
+    return usage.ru_maxrss;
+}
+
+} // anonymous namespace
+
+//! \brief Main entry point.
+int main(int argc, char **argv)
+{
+    const char *inFile = TRACK_DEF;
+    int factor = 10;
+    std::string scaledFile;
+    try
+    {
+        for (;;)
+        {
+            int opt = getopt(argc, argv, "hn:d:");
+            if (opt == -1)
+                break;
+            switch (opt)
+            {
+                case 'n':
+                    factor = atoi(optarg);
+                    if (factor < 1)
+                        throw(Error("scale factor must be at least 1"));
+                    break;
+                case 'd':
+                {
+                    const char *dir = optarg;
+                    if (-1 == chdir(dir))
+                    {
+                        Error e;
+                        e.stream() << "cannot change dir to " << dir;
+                        throw(e);
+                    }
+                    break;
+                }
+                default:
+                    std::cerr << "\nxml_bench [-h|?] [-d <dir>] [-n <factor>] [<tracks.xml>]\n\n"
+                        "  -h|?      This message\n"
+                        "  -d dir    Change dir\n"
+                        "  -n factor Size of the scaled file relative to the original, default 10\n\n";
+                    return 1;
+                    break;
+            }
+        }
+        if (argc > optind)
+            inFile = argv[optind++];
+        if (argc > optind)
+            throw(Error("unrecognised trailing arguments, try -h"));
+        scaledFile = scaleFile(inFile, factor);
+        const char *files[] = {inFile, scaledFile.c_str()};
+        std::cout << std::setw(8) << "file" << std::setw(8) << "parser"
+            << std::setw(10) << "tracks" << std::setw(12) << "time [s]"
+            << std::setw(14) << "peak RSS [kB]" << std::setw(14) << "import [kB]" << "\n";
+        for (size_t f=0; f<2; f++)
+        {
+            Result result[DomImporter+1];
+            long baseline = measure(files[f], NoImporter, result[NoImporter]);
+            for (int importer = SaxImporter; importer <= DomImporter; importer++)
+            {
+                long rss = measure(files[f], (Importer)importer, result[importer]);
+                std::ostringstream label;
+                label << "x" << (f == 0 ? 1 : factor);
+                std::cout << std::setw(8) << label.str()
+                    << std::setw(8) << importerName[importer]
+                    << std::setw(10) << result[importer].m_nofTracks
+                    << std::setw(12) << std::fixed << std::setprecision(3) << result[importer].m_seconds
+                    << std::setw(14) << rss
+                    << std::setw(14) << rss-baseline << "\n";
+            }
+            if (result[SaxImporter].m_imageSize != result[DomImporter].m_imageSize
+                || result[SaxImporter].m_imageChecksum != result[DomImporter].m_imageChecksum)
+            {
+                Error e;
+                e.stream() << "sax and dom imports of " << files[f] << " differ, track image "
+                    << result[SaxImporter].m_imageSize << " bytes, checksum " << std::hex
+                    << result[SaxImporter].m_imageChecksum << " against " << std::dec
+                    << result[DomImporter].m_imageSize << " bytes, checksum " << std::hex
+                    << result[DomImporter].m_imageChecksum;
+                throw(e);
+            }
+        }
+        std::cout << "sax and dom imports are identical\n";
+        unlink(scaledFile.c_str());
+    }
+    catch (Error &e)
+    {
+        if (!scaledFile.empty())
+            unlink(scaledFile.c_str());
+        std::cerr << "** " << e.what() << std::endl;
+        return e.exitCode();
+    }
+    return 0;
+}
@@ -19,33 +19,16 @@ proc LogEvent line {
     }
 }
 
-proc ProcessPatcherEvent { line } {
-    global eventMembers
-    eval "scan \"$line\" \"%x %x %x %x %x %x %x %x %x %x %x\" $eventMembers"
-    processEvent $line
-    LogEvent $line
-    if { $currentTrack != $::State::currentTrack } {
-        set ::State::currentTrack $currentTrack
-    }
-    if { $currentSection != $::State::currentSection } {
-        set ::State::currentSection $currentSection
-    }
-}
-
-# wait for first event
-set channel [ open "|./stdout_client -f" ]
-#set channel [ open "|./stdout_client" ]
-set firstLine [ gets $channel ]
-foreach i $eventMembers { lappend globals State::$i }
-eval "scan \"$firstLine\" \"%x %x %x %x %x %x %x %x %x %x %x\" $globals"
-loadxml
-
-# get patcher event
-proc GetPatcherEvent {channel} {
-    if { ! [ eof $channel ] } {
-        global eventMembers
-        set line [ gets $channel ]
-        ProcessPatcherEvent $line
+# called by the library after each event, the State variables hold its fields
+# and the position of the core
+proc PatcherEvent {} {
+    global showEventLog
+    if { [ info exists showEventLog ] && $showEventLog == true } {
+        LogEvent [ format "%04x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x" \
+            $::State::packetCount $::State::metaMode $::State::currentTrack \
+            $::State::currentSection $::State::trackIdxWithinSet $::State::type \
+            $::State::deviceId $::State::part \
+            $::State::midi1 $::State::midi2 $::State::midi3 ]
     }
 }
 
@@ -83,5 +66,7 @@ proc onClick {} {
 
 wm title . "z"
 
-fileevent $channel readable [list GetPatcherEvent $channel]
+# read the core events straight from its queue
+loadxml
+patcherEvents PatcherEvent
 